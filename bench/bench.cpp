@@ -0,0 +1,416 @@
+// 微基准测试：在进程内单独驱动请求解析、时间轮、线程池队列、响应生成和响应缓存，不经过网络。
+// 每个测试的操作次数从 1 开始倍增，直到运行时间超过 -t 指定的秒数，结果是每次操作的平均耗时。
+// 结果以 JSON 输出，字段与 Google Benchmark 的 --benchmark_format=json 一致，可以逐个提交比较。
+//
+// 用法：bench.out [-t min_seconds] [-f filter] [-o output.json]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <deque>
+#include "http_conn.h"
+#include "threadpool.h"
+#include "timer_wheel.h"
+#include "router.h"
+#include "resp_cache.h"
+
+// 一个测试的结果
+struct bench_result {
+    std::string name;
+    long iterations;
+    double ns_per_op;
+};
+
+static double min_time = 0.2;                   // 每个测试至少运行的秒数
+static const char *filter = nullptr;            // 只运行名字包含该子串的测试
+static std::vector<bench_result> results;
+static volatile long sink;                      // 防止编译器优化掉被测代码
+
+static long now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// 运行一个测试。fn(n) 执行 n 次操作，操作次数倍增直到运行时间足够长
+template<typename F>
+static void run(const std::string &name, F fn) {
+    if (filter && name.find(filter) == std::string::npos)
+        return;
+
+    long n = 1;
+    long elapsed;
+    while (true) {
+        long start = now_ns();
+        fn(n);
+        elapsed = now_ns() - start;
+        if (elapsed >= min_time * 1e9 || n >= (1L << 40))
+            break;
+        // 按已经测得的速度估计需要的次数，最多扩大 10 倍
+        long next = elapsed > 0 ? (long)(n * min_time * 1.2e9 / elapsed) : n * 10;
+        n = next > n * 10 ? n * 10 : (next <= n ? n + 1 : next);
+    }
+    results.push_back(bench_result{name, n, (double)elapsed / n});
+    fprintf(stderr, "%-32s %12ld %14.1f ns/op\n", name.c_str(), n, (double)elapsed / n);
+}
+
+/////////////////////////////////////请求解析/////////////////////////////////////
+
+// 浏览器和命令行工具发出的真实请求，目标是进程内处理器，解析过程不访问文件系统
+struct sample {
+    const char *name;
+    const char *request;
+};
+
+static const sample samples[] = {
+    {"curl",
+     "GET /healthz HTTP/1.1\r\n"
+     "Host: 127.0.0.1:10000\r\n"
+     "User-Agent: curl/7.88.1\r\n"
+     "Accept: */*\r\n"
+     "\r\n"},
+    {"chrome",
+     "GET /healthz HTTP/1.1\r\n"
+     "Host: 192.168.110.129:10000\r\n"
+     "Connection: keep-alive\r\n"
+     "Cache-Control: max-age=0\r\n"
+     "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+     "sec-ch-ua-mobile: ?0\r\n"
+     "sec-ch-ua-platform: \"Linux\"\r\n"
+     "Upgrade-Insecure-Requests: 1\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+     "application/signed-exchange;v=b3;q=0.7\r\n"
+     "Sec-Fetch-Site: none\r\n"
+     "Sec-Fetch-Mode: navigate\r\n"
+     "Sec-Fetch-User: ?1\r\n"
+     "Sec-Fetch-Dest: document\r\n"
+     "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+     "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+     "\r\n"},
+    {"firefox",
+     "GET /healthz HTTP/1.1\r\n"
+     "Host: 192.168.110.129:10000\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+     "Accept-Language: zh-CN,zh;q=0.8,zh-TW;q=0.7,zh-HK;q=0.5,en-US;q=0.3,en;q=0.2\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "Connection: keep-alive\r\n"
+     "Upgrade-Insecure-Requests: 1\r\n"
+     "Sec-Fetch-Dest: document\r\n"
+     "Sec-Fetch-Mode: navigate\r\n"
+     "Sec-Fetch-Site: none\r\n"
+     "Sec-Fetch-User: ?1\r\n"
+     "Priority: u=1\r\n"
+     "\r\n"},
+};
+
+static void health_handler(const route_match &match, response *resp) {
+    resp->append("ok\n");
+}
+
+// http_conn 的友元，直接调用解析和应答函数
+struct http_bench {
+    // 解析一个完整的请求
+    static long parse(http_conn *conn, const char *req, int len) {
+        conn->init();
+        memcpy(conn->m_read_buf, req, len);
+        conn->m_read_idx = len;
+        return conn->process_read();
+    }
+
+    // 请求分两次到达：先到 split 字节，解析后再到剩余部分
+    static long parse_split(http_conn *conn, const char *req, int len, int split) {
+        conn->init();
+        memcpy(conn->m_read_buf, req, split);
+        conn->m_read_idx = split;
+        long ret = conn->process_read();
+        memcpy(conn->m_read_buf + split, req + split, len - split);
+        conn->m_read_idx = len;
+        return ret * 100 + conn->process_read();
+    }
+
+    static long respond_error(http_conn *conn) {
+        conn->m_write_idx = 0;
+        conn->m_linger = true;
+        conn->process_write(http_conn::NO_RESOURCE);
+        return conn->m_write_idx;
+    }
+
+    static long respond_file(http_conn *conn) {
+        conn->m_write_idx = 0;
+        conn->m_linger = true;
+        conn->m_file_address = nullptr;
+        conn->m_file_stat.st_size = 123456;
+        conn->process_write(http_conn::FILE_REQUEST);
+        return conn->m_write_idx;
+    }
+
+    static long respond_handler(http_conn *conn) {
+        conn->m_write_idx = 0;
+        conn->m_linger = true;
+        conn->m_response.init(conn->m_write_buf + http_conn::HANDLER_HEADROOM,
+                              http_conn::WRITE_BUFFER_SIZE - http_conn::HANDLER_HEADROOM);
+        conn->m_response.append("ok\n");
+        conn->process_write(http_conn::HANDLER_REQUEST);
+        return conn->m_write_idx;
+    }
+};
+
+static void bench_parser() {
+    http_conn *conn = new http_conn;
+    for (const sample &s : samples) {
+        int len = strlen(s.request);
+        if (http_bench::parse(conn, s.request, len) != http_conn::HANDLER_REQUEST) {
+            fprintf(stderr, "sample %s is not parsed as a handler request\n", s.name);
+            exit(1);
+        }
+
+        run(std::string("parse/") + s.name, [&](long n) {
+            long sum = 0;
+            for (long i = 0; i < n; ++i)
+                sum += http_bench::parse(conn, s.request, len);
+            sink = sum;
+        });
+
+        // 每次操作依次在每个字节处切开请求，结果是所有切分位置的平均耗时
+        run(std::string("parse_split/") + s.name, [&](long n) {
+            long sum = 0;
+            for (long i = 0; i < n; ++i)
+                sum += http_bench::parse_split(conn, s.request, len, 1 + i % (len - 1));
+            sink = sum;
+        });
+    }
+    delete conn;
+}
+
+static void bench_response() {
+    http_conn *conn = new http_conn;
+    run("response/404", [&](long n) {
+        long sum = 0;
+        for (long i = 0; i < n; ++i)
+            sum += http_bench::respond_error(conn);
+        sink = sum;
+    });
+    run("response/file_headers", [&](long n) {
+        long sum = 0;
+        for (long i = 0; i < n; ++i)
+            sum += http_bench::respond_file(conn);
+        sink = sum;
+    });
+    run("response/handler", [&](long n) {
+        long sum = 0;
+        for (long i = 0; i < n; ++i)
+            sum += http_bench::respond_handler(conn);
+        sink = sum;
+    });
+    delete conn;
+}
+
+/////////////////////////////////////时间轮/////////////////////////////////////
+
+static void bench_timer() {
+    static const int counts[] = {10000, 100000, 1000000};
+    for (int count : counts) {
+        // count 个连接的期限分布在一圈之内，时间轮停在 0 秒
+        long base = 0;
+        timer_wheel *wheel = new timer_wheel;
+        wheel->advance(base, [](wheel_node *) {});
+        std::vector<wheel_node> nodes(count);
+        for (int i = 0; i < count; ++i)
+            wheel->add(&nodes[i], base + 1 + i % timer_wheel::SLOTS);
+
+        // 连接上有活动：随机选一个连接推迟它的期限
+        unsigned seed = 1;
+        long expire = base + 1;
+        run("timer/adjust/" + std::to_string(count), [&](long n) {
+            for (long i = 0; i < n; ++i) {
+                wheel_node *t = &nodes[rand_r(&seed) % count];
+                wheel->remove(t);
+                wheel->add(t, base + 1 + expire++ % timer_wheel::SLOTS);
+            }
+        });
+
+        // 连接的建立和关闭：删除最早加入的连接，以新的期限再加入
+        std::deque<wheel_node *> live;
+        for (wheel_node &t : nodes)
+            live.push_back(&t);
+        run("timer/add_del/" + std::to_string(count), [&](long n) {
+            for (long i = 0; i < n; ++i) {
+                wheel_node *t = live.front();
+                live.pop_front();
+                wheel->remove(t);
+                wheel->add(t, base + 1 + expire++ % timer_wheel::SLOTS);
+                live.push_back(t);
+            }
+        });
+        delete wheel;
+    }
+}
+
+/////////////////////////////////////线程池队列/////////////////////////////////////
+
+// 空任务，只记录被处理的次数
+struct noop_task {
+    std::atomic<long> done;
+    void process() { done.fetch_add(1, std::memory_order_relaxed); }
+};
+
+struct producer_arg {
+    threadpool<noop_task> *pool;
+    noop_task *task;
+    long count;
+};
+
+static void *producer(void *arg) {
+    producer_arg *p = (producer_arg *)arg;
+    for (long i = 0; i < p->count; ++i) {
+        while (!p->pool->append(p->task))       // 队列满时让出 CPU 后重试
+            sched_yield();
+    }
+    return nullptr;
+}
+
+static void bench_queue() {
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus < 4 ? cpus : 4;
+    static const int producer_counts[] = {1, 2, 4, 8};
+
+    // 线程数固定，避免测量过程中创建线程
+    threadpool<noop_task> pool(workers, workers, 10000, 1000000, 30);
+    noop_task task;
+    for (int producers : producer_counts) {
+        // 多个生产者同时 append，工作线程取出并执行，每次操作是一个任务从入队到执行完毕
+        run("queue/producers/" + std::to_string(producers), [&](long n) {
+            task.done = 0;
+            long per = (n + producers - 1) / producers;
+            pthread_t tids[8];
+            producer_arg args[8];
+            for (int i = 0; i < producers; ++i) {
+                args[i] = producer_arg{&pool, &task, per};
+                pthread_create(&tids[i], nullptr, producer, &args[i]);
+            }
+            for (int i = 0; i < producers; ++i)
+                pthread_join(tids[i], nullptr);
+            while (task.done.load(std::memory_order_relaxed) < per * producers)
+                sched_yield();
+        });
+    }
+}
+
+/////////////////////////////////////响应缓存/////////////////////////////////////
+
+// 命中：查找、检查文件状态（每秒一次）、释放引用；未命中：查找一个不存在的键。
+// 开启缓存会影响响应生成的测试，因此放在最后运行
+static void bench_cache() {
+    char path[] = "/tmp/pawcook-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+        return;
+    static char body[4096];
+    memset(body, 'x', sizeof(body));
+    ::write(fd, body, sizeof(body));
+    fchmod(fd, 0644);
+    struct stat st;
+    fstat(fd, &st);
+    close(fd);
+
+    resp_cache::parse("64");
+    uint64_t key = resp_cache::key(path, 1);
+    const char head[] = "HTTP/1.1 200 OK\r\nContent-Length: 4096\r\nContent-Type:text/html\r\nConnection: keep-alive\r\n\r\n";
+    resp_cache::lookup(key, path);          // 访问过两次的响应才会被放入缓存
+    resp_cache::lookup(key, path);
+    resp_cache::insert(key, path, st, head, strlen(head), body, sizeof(body));
+
+    run("cache/hit", [&](long n) {
+        for (long i = 0; i < n; ++i) {
+            resp_cache::entry *e = resp_cache::lookup(key, path);
+            if (e) {
+                sink = e->len;
+                resp_cache::release(e);
+            }
+        }
+    });
+    uint64_t missing = resp_cache::key(path, 0);
+    run("cache/miss", [&](long n) {
+        for (long i = 0; i < n; ++i)
+            sink = (long)resp_cache::lookup(missing, path);
+    });
+    unlink(path);
+}
+
+/////////////////////////////////////结果输出/////////////////////////////////////
+
+static void write_json(FILE *out) {
+    char date[64];
+    time_t t = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&t));
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+
+    fprintf(out, "{\n  \"context\": {\n");
+    fprintf(out, "    \"date\": \"%s\",\n", date);
+    fprintf(out, "    \"host_name\": \"%s\",\n", host);
+    fprintf(out, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(out, "    \"min_time\": %g\n", min_time);
+    fprintf(out, "  },\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const bench_result &r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"run_type\": \"iteration\", \"iterations\": %ld, "
+                     "\"real_time\": %.2f, \"time_unit\": \"ns\", \"items_per_second\": %.1f}%s\n",
+                r.name.c_str(), r.iterations, r.ns_per_op, 1e9 / r.ns_per_op, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f:o:")) != -1) {
+        switch (opt) {
+            case 't':
+                min_time = atof(optarg);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t min_seconds] [-f filter] [-o output.json]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (min_time <= 0)
+        min_time = 0.2;
+
+    // 被测代码的日志写到 /dev/null，JSON 写到原来的标准输出或者 -o 指定的文件
+    FILE *out = output ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out) {
+        perror("open output");
+        return 1;
+    }
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+
+    router::add_func("/healthz", true, health_handler);
+
+    bench_parser();
+    bench_response();
+    bench_timer();
+    bench_queue();
+    bench_cache();
+
+    write_json(out);
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef BODY_HANDLER_H
+#define BODY_HANDLER_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+// 请求体处理器：请求体被切成数据块依次交给处理器，处理器不缓存整个请求体，
+// 因此无论请求体多大，每个连接占用的内存都是固定的
+class body_handler {
+public:
+    virtual ~body_handler() {}
+
+    virtual bool on_data(const char *data, long len) = 0;  // 收到一块请求体数据
+    virtual bool on_complete() = 0;                         // 请求体接收完毕
+    virtual void on_abort() = 0;                            // 请求体接收中断（出错或连接关闭）
+
+    // 如果处理器的目标是一个普通文件，返回它的文件描述符，连接可以用 splice 把数据从 socket 零拷贝写入文件
+    // 返回 -1 表示只能通过 on_data 交付数据
+    virtual int splice_fd() { return -1; }
+};
+
+// 丢弃请求体，用于没有注册上传路由的请求，保证长连接上的下一个请求能被正确解析
+class discard_sink : public body_handler {
+public:
+    bool on_data(const char *data, long len) { return true; }
+    bool on_complete() { return true; }
+    void on_abort() {}
+};
+
+// 把请求体写入上传目录中的文件。数据先写入同目录下的临时文件，接收完毕后再原子地重命名为目标文件，
+// 这样中断的上传不会留下半个文件
+class file_sink : public body_handler {
+public:
+    static const int PATH_LEN = 256;
+
+    file_sink() : m_fd(-1) { m_path[0] = m_tmp_path[0] = '\0'; }
+    ~file_sink() { on_abort(); }
+
+    bool open(const char *dir, const char *name);   // 在目录 dir 下创建临时文件，最终文件名为 name
+
+    bool on_data(const char *data, long len);
+    bool on_complete();
+    void on_abort();
+    int splice_fd() { return m_fd; }
+
+private:
+    int m_fd;                       // 临时文件的文件描述符
+    char m_path[PATH_LEN];          // 目标文件路径
+    char m_tmp_path[PATH_LEN];      // 临时文件路径
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+#include <sys/epoll.h>
+#include <atomic>
+
+// 低延迟的忙等模式：用 CPU 换取唤醒延迟。
+// - 主线程：epoll_wait 没有就绪事件时，先以 0 超时反复调用 epoll_wait 自旋 poll_us 微秒，期间有事件到达就不必睡眠再被唤醒；
+//   超时后才阻塞等待。只有上一次等待等到了事件（有持续的流量）时才自旋，空闲的服务器不消耗 CPU。
+//   两次轮询之间 sched_yield，同一个核上有工作线程要运行时让给它，有空闲的核时这个调用立即返回
+// - 内核：对 epoll 实例设置 EPIOCSPARAMS（Linux 6.9+），对连接设置 SO_BUSY_POLL 和 SO_PREFER_BUSY_POLL，
+//   支持 NAPI 的网卡上由内核直接轮询网卡队列。不支持或权限不足时忽略，只用用户态的自旋
+// - 工作线程：没有任务时先自旋 worker_us 微秒再在信号量上睡眠，见 threadpool::set_spin
+//
+// 自旋的线程占满一个核，核数少于 2 时工作线程不自旋，否则它会和主线程争抢同一个核
+class busy_poll {
+public:
+    // 解析 "poll_us[:worker_us]"，worker_us 默认与 poll_us 相同，0 表示工作线程不自旋
+    static bool parse(const char *spec);
+    static bool enabled() { return m_poll_us > 0; }
+    static long poll_us() { return m_poll_us; }
+    static long worker_us() { return m_worker_us; }
+
+    // 对 epoll 实例开启内核的忙等，不支持时返回 false
+    static bool setup(int epfd);
+
+    // 与 epoll_wait 相同，阻塞之前先自旋
+    static int wait(int epfd, epoll_event *events, int max, int timeout);
+
+    static std::atomic<long> m_spins;           // 自旋的次数
+    static std::atomic<long> m_hits;            // 自旋期间等到了事件的次数
+    static std::atomic<long> m_blocks;          // 自旋超时、阻塞等待的次数
+
+private:
+    static long now_ns();
+
+    static long m_poll_us;
+    static long m_worker_us;
+    static bool m_hot;                          // 上一次等待是否等到了事件，只有主线程访问
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <atomic>
+
+// 流量录制：把客户端发来的原始字节（TLS 连接记录解密后的明文）连同相对时间和连接号写入二进制日志，
+// 由 tools/replay.cpp 对本地实例按原来的连接和时间结构重放。
+//
+// 日志以 8 字节的 CAPTURE_MAGIC 开头，之后是一条条记录：16 字节的 capture_record，后面紧跟 len 字节的数据。
+// 同一个连接的记录按时间先后写入，不同线程写入的记录可能交错，重放时按时间排序。
+//
+// 记录写入当前线程的环形缓冲区，只有本线程写，不加锁；缓冲区写满时丢弃记录并计数，从不阻塞请求处理。
+// 丢失了数据的连接不再录制，写入一条 LOST 记录，重放时跳过。
+// 后台线程定期把所有缓冲区中的记录写入文件，文件达到上限后停止录制
+#define CAPTURE_MAGIC "PWCAP1\0\0"
+
+struct capture_record {
+    uint64_t ts_ns;         // 相对于开始录制的时间，纳秒
+    uint32_t conn;          // 连接号，从 1 开始
+    uint16_t type;          // capture::TYPE
+    uint16_t len;           // 记录后面的数据的长度
+};
+
+class capture {
+public:
+    static const int RING_SIZE = 4 << 20;       // 每个线程的缓冲区字节数
+    static const int RESERVE = 4096;            // 缓冲区中留给 LOST 记录的空间
+    static const int MAX_RINGS = 256;
+
+    // 记录的类型
+    // - OPEN：连接建立
+    // - DATA：收到的请求数据，超过 65535 字节时拆成多条记录
+    // - RESP：一个响应发送完毕，数据为 8 字节的响应字节数，重放时用来判断响应是否收完
+    // - CLOSE：连接关闭
+    // - LOST：缓冲区已满，连接丢失了记录，之后不再录制这个连接
+    enum TYPE {OPEN = 0, DATA, RESP, CLOSE, LOST};
+
+    // 解析 "file[:max_mb]"，max_mb 为日志文件大小的上限（默认 1024MB）
+    static bool parse(const char *spec);
+    static bool enabled() { return m_enabled; }
+    static bool start();                        // 打开日志文件，启动后台写入线程
+    static void stop();                         // 写出剩余的记录，关闭日志文件
+
+    static uint32_t open();                     // 新连接，返回连接号，没有开启录制时返回 0
+    // 下面这一组函数记录连接上的事件。丢弃了记录时把 conn 置为 0，之后不再录制这个连接
+    static void data(uint32_t &conn, const char *buf, size_t len);
+    static void response(uint32_t &conn, uint64_t bytes);
+    static void close(uint32_t &conn);
+
+    static std::atomic<long> m_records;         // 录制的记录数
+    static std::atomic<long> m_dropped;         // 缓冲区已满而丢弃的记录数
+
+private:
+    struct ring {
+        std::atomic<uint64_t> head;     // 写入的总字节数，只由所属线程修改
+        std::atomic<uint64_t> tail;     // 后台线程取走的总字节数
+        std::atomic<bool> in_use;
+        char buf[RING_SIZE];
+    };
+
+    struct ring_holder {
+        ring *r = nullptr;
+        ~ring_holder() { if (r) r->in_use.store(false, std::memory_order_release); }
+    };
+
+    static ring *local_ring();
+    static bool put(uint32_t conn, TYPE type, const char *buf, size_t len, size_t reserve = RESERVE);
+    static void lost(uint32_t &conn);
+    static bool drain();                        // 把所有缓冲区中的记录写入文件，达到大小上限时返回 false
+    static void *flusher(void *arg);
+
+    static bool m_enabled;
+    static const char *m_path;
+    static long m_max_bytes;
+    static FILE *m_file;
+    static long m_written;
+    static uint64_t m_start_ns;
+    static std::atomic<bool> m_running;
+    static pthread_t m_thread;
+    static std::atomic<uint32_t> m_counter;
+    static std::atomic<ring *> m_rings[MAX_RINGS];
+    static thread_local ring_holder m_local;
+};
+
+#endif
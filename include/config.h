@@ -0,0 +1,70 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include "sockopt.h"
+#include "listener.h"
+
+// 服务器的运行参数，由命令行解析得到
+// 用法：a.out [选项] listen [listen...]
+//   listen 为监听地址：port、host:port 或 unix:/path[:mode]，TCP 地址后面可以跟 @sock_options 单独指定参数，见 listener.h
+//   -r doc_root                      网站根目录
+//   -b max_body                      默认的请求体大小上限（字节）
+//   -U prefix=dir[:max_body]         上传路由：前缀为 prefix 的 POST/PUT 请求体流式写入目录 dir，可单独指定大小上限
+//   -P prefix=upstream[,upstream...] 代理路由：前缀为 prefix 的请求转发给一组上游，上游为 host:port 或 unix:/path
+//   -S prefix=dir                    静态文件路由：前缀为 prefix 的请求访问目录 dir 下去掉前缀的路径
+//   -L req=r[:b],net=r[:b],conn=r[:b]  按客户端限流：每个 IP 的请求速率、每个网段的请求速率、每个 IP 的新建连接速率（每秒），b 为突发量
+//   -T listen=cert,key               HTTPS 监听地址，以及 PEM 格式的证书链和私钥文件
+//   -u upgrade_socket                平滑升级使用的 Unix 域 socket 路径，启动时从该 socket 上的旧进程继承监听 socket
+//   -O sock_options                  TCP 监听 socket 的默认参数，地址中没有 @sock_options 时使用，见 sockopt.h
+//   -t min[:max]                     工作线程数的上下限，默认为 CPU 核数和 4 倍的 CPU 核数
+//   -w target_wait_us                任务排队时间的目标值（微秒），超过时增加工作线程
+//   -i idle_timeout                  工作线程空闲多少秒后退出
+//   -Q w0,w1,w2,w3[:age_us]          线程池按预估开销分的四类任务的权重和老化单位，默认 1,4,16,64:1000
+//   -m thread|coro                   执行模型：线程池（默认），或者由主线程上的协程处理每个连接
+//   -D drain_timeout                 退出（升级或收到 SIGQUIT）时等待正在处理的请求完成的最长秒数
+//   -X every[:file]                  每 every 个请求跟踪一个，收到 SIGUSR1 时导出到 file（默认 /tmp/pawcook-trace.json）
+//   -E header=s,body=s,idle=s,write=s[:rate]  各阶段的期限（秒）：接收首部、请求体两次数据之间、长连接空闲、发送响应，
+//                                    rate 为发送响应的最低速率（字节/秒），0 表示不限时，默认 header=20,body=30,idle=60,write=30:1024
+//   -C file[:max_mb]                 录制客户端发来的原始字节到 file，用 tools/replay.cpp 重放，文件最大 max_mb（默认 1024MB）
+//   -F ttl_ms[:negative_ttl_ms]      合并同时对同一个文件的 stat/open/mmap，结果（包括文件不存在）共享 ttl_ms 毫秒，见 file_table.h
+//   -K requests[:capacity]           每个长连接的请求数上限（0 表示不限，默认 1000），以及长连接策略计算负载时的连接数容量，见 http_conn.h
+//   -I bytes_kb[:calls[:accepts]]    每个连接每轮最多收发的字节数和调用次数，以及每轮最多 accept 的连接数，0 表示不限，
+//                                    没有给出的保持默认值 256:32:64，见 http_conn.h
+//   -B poll_us[:worker_us]           忙等模式：主线程和工作线程睡眠之前先自旋的微秒数，见 busypoll.h
+//   -W workers                       预派生模式：主进程派生并看管 workers 个工作进程，各自用 SO_REUSEPORT 监听，见 prefork.h
+//   -H budget_mb[:max_entry_kb]      所有工作进程共用的共享内存响应缓存，单个响应最大 max_entry_kb（默认 64KB），见 shm_cache.h
+//   -R budget_mb[:max_entry_kb]      开启完整响应缓存，内存预算为 budget_mb，单个响应最大 max_entry_kb（默认 1024KB），见 resp_cache.h
+class config {
+public:
+    config();
+    ~config() {}
+
+    bool parse_arg(int argc, char *argv[]);     // 解析命令行参数，失败返回 false
+    void usage(const char *prog);               // 打印用法
+
+private:
+    bool parse_tls(char *arg);
+    bool add_listener(const char *spec, bool tls);
+    bool parse_schedule(const char *arg);
+
+public:
+    listener m_listeners[listener::MAX];    // 监听地址，包括 -T 指定的 HTTPS 地址
+    int m_listener_count;
+    const char *m_doc_root;         // 网站根目录
+    long m_max_body;                // 默认的请求体大小上限
+    const char *m_upgrade_path;     // 升级 socket 的路径，为空表示不启用平滑升级
+    int m_drain_timeout;            // 退出时等待请求完成的最长秒数
+    sock_options m_sockopt;         // TCP 监听 socket 的默认参数，解析后复制到各个监听地址
+    int m_min_threads;              // 工作线程数的下限，0 表示按 CPU 核数
+    int m_max_threads;              // 工作线程数的上限，0 表示按 CPU 核数
+    long m_target_wait;             // 任务排队时间的目标值，微秒
+    int m_idle_timeout;             // 工作线程空闲多少秒后退出
+    long m_class_weights[4];        // 线程池中各类任务的权重，见 threadpool.h
+    long m_age_us;                  // 任务老化的时间单位，微秒
+};
+
+#endif
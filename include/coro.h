@@ -0,0 +1,108 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <coroutine>
+#include <exception>
+#include <new>
+#include <stddef.h>
+
+// 协程执行模型的基础设施：协程帧分配器、连接协程和可等待的子任务
+
+// 协程帧的线程内内存池。帧按 FRAME_ALIGN 字节分级，释放的帧挂在本线程对应级别的空闲链表上，
+// 稳定运行后创建协程不再访问全局堆。超过最大级别的帧直接使用 operator new
+class frame_pool {
+public:
+    static const size_t FRAME_ALIGN = 64;
+    static const int CLASSES = 32;              // 最大可缓存 64 * 31 字节的帧
+
+    static void *alloc(size_t size) {
+        size_t cls = (size + FRAME_ALIGN - 1) / FRAME_ALIGN;
+        if (cls >= CLASSES)
+            return ::operator new(size);
+        if (node *p = m_free[cls]) {
+            m_free[cls] = p->next;
+            return p;
+        }
+        return ::operator new(cls * FRAME_ALIGN);
+    }
+
+    static void free(void *ptr, size_t size) {
+        size_t cls = (size + FRAME_ALIGN - 1) / FRAME_ALIGN;
+        if (cls >= CLASSES) {
+            ::operator delete(ptr);
+            return;
+        }
+        node *p = (node *)ptr;
+        p->next = m_free[cls];
+        m_free[cls] = p;
+    }
+
+private:
+    struct node {
+        node *next;
+    };
+    static thread_local node *m_free[CLASSES];
+};
+
+// 所有 promise 的基类，让协程帧从 frame_pool 中分配
+struct pooled_promise {
+    static void *operator new(size_t size) { return frame_pool::alloc(size); }
+    static void operator delete(void *ptr, size_t size) { frame_pool::free(ptr, size); }
+};
+
+// 连接协程：每个连接一个，创建后立即运行到第一次挂起，运行结束时自动销毁协程帧
+struct conn_task {
+    struct promise_type : pooled_promise {
+        conn_task get_return_object() { return conn_task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// 可等待的子任务，由连接协程 co_await。子任务创建时不运行，被等待时才开始，
+// 结束时直接切换回等待它的协程（对称转移），不经过事件循环
+template<typename T>
+class task {
+public:
+    struct promise_type : pooled_promise {
+        T m_value;
+        std::coroutine_handle<> m_continuation;
+
+        task get_return_object() { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct final_awaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                return h.promise().m_continuation;
+            }
+            void await_resume() noexcept {}
+        };
+        final_awaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T value) { m_value = value; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit task(std::coroutine_handle<promise_type> h) : m_handle(h) {}
+    task(task &&other) : m_handle(other.m_handle) { other.m_handle = nullptr; }
+    task(const task &) = delete;
+    ~task() {
+        if (m_handle)
+            m_handle.destroy();
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+        m_handle.promise().m_continuation = caller;
+        return m_handle;
+    }
+    T await_resume() { return m_handle.promise().m_value; }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+#endif
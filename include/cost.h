@@ -0,0 +1,24 @@
+#ifndef COST_H
+#define COST_H
+
+#include <stdint.h>
+#include <atomic>
+
+// 请求的预估开销，用来把线程池中的任务分类（见 threadpool.h），0 类最小。
+// 按请求行中 URL 的哈希记住最近一次处理的开销：响应的大小和工作线程的处理时间分别折算成类别，取较大的一个。
+// 表是直接映射的，每项一个原子变量，冲突时后写入的覆盖先写入的，不加锁
+class cost_table {
+public:
+    static const int SIZE = 4096;               // 表的项数，必须是 2 的幂
+    static const int UNKNOWN_CLASS = 1;         // 没有记录的请求的类别
+
+    static uint32_t key(const char *buf, int len);      // 从读缓冲区开头的请求行取出 URL 计算键，请求行不完整时返回 0
+    static int lookup(uint32_t key);                    // 键对应的类别
+    static void learn(uint32_t key, long bytes, long service_ns);  // 记录一次请求的开销
+    static int classify(long bytes, long service_ns);
+
+private:
+    static std::atomic<uint32_t> m_table[SIZE];        // 高 30 位是键，低 2 位是类别
+};
+
+#endif
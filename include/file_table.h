@@ -0,0 +1,94 @@
+#ifndef FILE_TABLE_H
+#define FILE_TABLE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <atomic>
+#include "locker.h"
+
+// 打开的静态文件表：同一个路径的 stat、open 和 mmap 同时只有一个请求在做（single-flight），
+// 结果由所有请求按引用计数共享，包括文件不存在这样的否定结果。
+//
+// 热门文件变冷（发布新版本、缓存失效）之后，大量请求会同时访问同一个文件。第一个请求负责查找，
+// 之后到达的请求挂在查找中的条目上，不占用工作线程；查找完成时逐个唤醒它们，它们直接使用同一个映射区。
+//
+// 结果只在一段很短的时间内有效（默认 1 秒，否定结果可以单独设置），过期之后下一个请求重新查找，
+// 因此文件被修改或新建后，最多在这段时间内返回旧的结果。正在使用旧条目的连接持有引用，发送完毕后才释放映射区。
+// 每个分片最多 MAX_ENTRIES 个条目，超过时淘汰最早加入的条目
+class file_table {
+public:
+    static const int SHARDS = 16;
+    static const int BUCKETS = 1 << 10;         // 每个分片的哈希桶数，必须是 2 的幂
+    static const int MAX_ENTRIES = 64;          // 每个分片的条目数上限
+
+    struct waiter;
+
+    struct list_node {
+        list_node *prev;
+        list_node *next;
+    };
+
+    // 一个查找结果，与路径分配在一块内存中。在分片中按加入的顺序排成链表
+    struct entry : list_node {
+        entry *next_hash;                       // 哈希桶中的下一个条目
+        std::atomic<int> refs;                  // 表本身持有一个引用，每个使用结果的连接持有一个
+        bool loading;                           // 是否还在查找
+        long expire_ms;
+        waiter *waiters;                        // 等待查找结果的连接
+        uint64_t hash;
+
+        // 查找的结果，由负责查找的请求填写
+        int code;                               // 调用者定义的结果代码
+        struct stat st;
+        char *addr;                             // 文件的只读映射，空文件或者否定结果时为空
+        int fd;                                 // 保留的文件描述符（协程模式用 sendfile 发送），-1 表示没有保留
+        char path[];
+    };
+
+    // 等待查找结果的连接，嵌在连接对象中
+    struct waiter {
+        waiter *next;
+        void *owner;                            // 等待的连接
+        entry *result;                          // 唤醒时已经填好的结果，持有引用
+    };
+
+    enum STATUS {FOUND = 0, LOAD, WAIT};
+
+    // 解析 "ttl_ms[:negative_ttl_ms]"，否定结果的有效期默认与 ttl_ms 相同
+    static bool parse(const char *spec);
+    static bool enabled() { return m_shards != nullptr; }
+
+    // 查找 path：
+    // - FOUND：返回持有引用的条目
+    // - LOAD：返回新的条目，调用者负责查找，填写结果后调用 publish，条目同样持有引用
+    // - WAIT：另一个请求正在查找，w 已经挂在条目上，结果发布时填入 w->result 并由 m_wake 唤醒，返回空
+    static entry *acquire(const char *path, waiter *w, STATUS *status);
+    // 发布查找结果并唤醒等待的连接，negative 表示否定结果，按否定结果的有效期过期
+    static void publish(entry *e, bool negative);
+    static void release(entry *e);
+
+    static void (*m_wake)(waiter *w);           // 唤醒等待的连接，在发布结果的线程中调用
+
+    static std::atomic<long> m_hits;            // 直接使用了已有结果的请求数
+    static std::atomic<long> m_loads;           // 实际执行查找的次数
+    static std::atomic<long> m_coalesced;       // 等待了其他请求的查找结果的请求数
+    static std::atomic<long> m_entries;
+
+private:
+    struct shard {
+        locker lock;
+        entry *buckets[BUCKETS];
+        list_node list;                         // 按加入顺序的链表头，头部最早
+        int count;
+    };
+
+    static shard &shard_of(uint64_t hash) { return m_shards[(hash >> 40) % SHARDS]; }
+    static void unlink(shard &s, entry *e);     // 调用者持有分片的锁，返回后还要释放表的引用
+    static void destroy(entry *e);
+
+    static shard *m_shards;
+    static long m_ttl_ms;
+    static long m_negative_ttl_ms;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <string.h>
+
+// HTTP/2 的首部压缩（RFC 7541）。
+// 解码器维护对方编码器的动态表，必须按顺序解码连接上的每一个首部块，否则两端的动态表就不一致了。
+// 编码器只用静态表和不加索引的字面量，不需要动态表，也不做 Huffman 编码：响应首部只有几个字段，压缩收益很小
+class hpack_decoder {
+public:
+    static const int TABLE_SIZE = 4096;         // 动态表的大小上限，等于 SETTINGS_HEADER_TABLE_SIZE 的默认值
+    static const int MAX_ENTRIES = TABLE_SIZE / 32;     // 每个条目至少占 32 字节
+    static const int STRING_LEN = 8192;         // 单个首部字段名或值解码后的最大长度
+
+    // 每解码出一个首部字段调用一次，返回 false 时停止解码。字符串不以 \0 结尾，只在回调期间有效
+    typedef bool (*header_cb)(void *arg, const char *name, int name_len, const char *value, int value_len);
+
+    hpack_decoder() : m_first(0), m_count(0), m_size(0), m_max_size(TABLE_SIZE) {}
+    ~hpack_decoder();
+
+    // 解码一个完整的首部块。返回 false 表示首部块有错误（COMPRESSION_ERROR），连接必须关闭
+    bool decode(const uint8_t *data, int len, header_cb cb, void *arg);
+
+    // 下面这一组函数编码响应首部，返回写入的字节数，out 需要足够大
+    static int encode_int(uint8_t *out, uint32_t value, int prefix_bits, uint8_t first);
+    static int encode_status(uint8_t *out, int status);             // :status
+    static int encode_header(uint8_t *out, int name_index, const char *value, int len);    // 名字在静态表中的字面量
+
+    // 常用首部在静态表中的下标
+    enum STATIC_INDEX {STATUS_200 = 8, CONTENT_LENGTH = 28, CONTENT_TYPE = 31, RETRY_AFTER = 53};
+
+private:
+    struct entry {
+        char *data;             // 名字和值连在一起存放
+        int name_len;
+        int value_len;
+    };
+
+    bool lookup(uint32_t index, const char **name, int *name_len, const char **value, int *value_len);
+    bool insert(const char *name, int name_len, const char *value, int value_len);
+    void evict(int max_size);
+    static bool decode_int(const uint8_t **p, const uint8_t *end, int prefix_bits, uint32_t *value);
+    static bool decode_string(const uint8_t **p, const uint8_t *end, char *out, int *len);
+    static bool huffman_decode(const uint8_t *data, int len, char *out, int *out_len);
+
+    entry m_entries[MAX_ENTRIES];   // 环形数组，m_first 是最新的条目
+    int m_first;
+    int m_count;
+    int m_size;                     // 按 RFC 7541 计算的动态表大小
+    int m_max_size;                 // 对方通过动态表大小更新指令设置的上限
+};
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <atomic>
+#include "hpack.h"
+#include "http_conn.h"
+
+// 一个 HTTP/2 连接（RFC 9113）。连接上的多个流共用一个 socket，每个流是一个请求：
+// 读到的字节交给 on_input 按帧解析，请求按路由处理，静态文件的内容通过 mmap 映射，不复制；
+// 要发送的数据按“轮”组织，每一轮把控制帧、HEADERS 帧和多个流的 DATA 帧拼成一个 iovec 数组，
+// 由连接用一次 writev（或者 SSL_write）写出，写完之后再组织下一轮。
+//
+// 这个类不做 IO，不关心连接运行在线程池还是协程中：连接负责读写 socket，在同一时刻只有一个线程访问会话。
+// 反向代理路由直接在 socket 上 splice，HTTP/2 连接上访问代理路由返回 502，
+// 因此配置了代理路由时 TLS 不通过 ALPN 提供 h2
+class h2_session {
+public:
+    static const int FRAME_HEADER = 9;
+    static const int MAX_FRAME_SIZE = 16384;            // 接受的最大帧，等于协议的默认值
+    static const int INPUT_SIZE = 2 * MAX_FRAME_SIZE;   // 读缓冲区，至少能放下一个完整的帧
+    static const int MAX_STREAMS = 64;                  // 同时打开的流的上限（SETTINGS_MAX_CONCURRENT_STREAMS）
+    static const int RECV_WINDOW = 1 << 20;             // 连接和每个流的接收窗口
+    static const int HEADER_BLOCK_SIZE = 16384;         // 分成多个帧（CONTINUATION）的首部块的最大长度
+    static const int CTRL_SIZE = 4096;                  // 等待发送的控制帧的最大字节数，对方刷 PING、SETTINGS 时用完即断开
+    static const int OUTPUT_SIZE = 16384;               // 一轮写出中帧首部、HEADERS 帧和控制帧所用的缓冲区
+    static const int ROUND_IOVS = 64;                   // 一轮写出最多的缓冲区个数
+    static const int ROUND_BYTES = 256 * 1024;          // 一轮写出的 DATA 最多的字节数
+    static const int PREFACE_LEN = 24;                  // 客户端的连接序言 "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+    // 帧的类型。PRIORITY_UPDATE 来自 RFC 9218
+    enum FRAME_TYPE {DATA_FRAME = 0, HEADERS_FRAME, PRIORITY_FRAME, RST_STREAM_FRAME, SETTINGS_FRAME, PUSH_PROMISE_FRAME,
+                     PING_FRAME, GOAWAY_FRAME, WINDOW_UPDATE_FRAME, CONTINUATION_FRAME, PRIORITY_UPDATE_FRAME = 0x10};
+
+    // 错误码
+    enum ERROR_CODE {NO_ERROR = 0, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR, SETTINGS_TIMEOUT, STREAM_CLOSED,
+                     FRAME_SIZE_ERROR, REFUSED_STREAM, CANCEL, COMPRESSION_ERROR, CONNECT_ERROR, ENHANCE_YOUR_CALM};
+
+    h2_session(const sockaddr_storage &addr);
+    ~h2_session();
+
+    // data 是否以连接序言开头：1 是，0 数据不够、目前是序言的前缀，-1 不是
+    static int match_preface(const char *data, int len);
+
+    void start();                   // 发送服务器的 SETTINGS，之后等待客户端的连接序言
+    // h2c 升级：先发送 101 响应，应用 HTTP2-Settings 首部中的参数，升级前的请求成为流 1
+    void upgrade(const char *settings, http_conn::METHOD method, const char *path);
+
+    char *input() { return m_in + m_in_len; }           // 读取 socket 的位置
+    int input_space() const { return INPUT_SIZE - m_in_len; }
+    void on_input(int len);                             // 解析新读到的 len 字节，处理其中完整的帧
+
+    // 本轮还没有写出的数据，本轮已经写完时组织下一轮。返回 0 表示没有可以发送的数据
+    int pending(struct iovec **iv);
+    void sent(size_t len);                              // 本轮写出了 len 字节
+
+    void shutdown();                // 进程退出：发送 GOAWAY，不再接受新的流，已有的流处理完毕后连接结束
+    bool finished() const;          // 连接可以关闭了
+    bool idle() const { return m_stream_count == 0 && m_ctrl_len == 0 && m_iov_idx == m_iov_count; }
+
+public:
+    // 监控数据
+    static std::atomic<long> m_connections;     // 建立的 HTTP/2 连接数
+    static std::atomic<long> m_total_streams;   // 处理的流的个数
+
+private:
+    // 一个流。请求首部中用到的字段解码到这里，响应是一段内存：映射的文件或者生成的响应体
+    struct stream {
+        uint32_t id;
+        http_conn::METHOD method;
+        bool has_method;
+        bool bad_request;               // 不支持的请求方法或者无效的路径，回复 400
+        bool has_path;
+        bool malformed;                 // 首部不符合协议，用 RST_STREAM 拒绝
+        bool regular_seen;              // 已经出现过普通首部，之后不能再有伪首部
+        char path[http_conn::FILENAME_LEN];
+        long content_length;            // -1 表示没有 content-length
+        int urgency;                    // RFC 9218 的优先级：0 最高，7 最低，默认 3
+        bool incremental;               // 是否与同优先级的其他流交替发送
+
+        bool remote_closed;             // 收到了 END_STREAM
+        bool ready;                     // 响应已经生成
+        bool headers_sent;              // HEADERS 帧已经放入某一轮
+        bool closed;                    // 响应发送完毕或者流被重置，当前一轮写完后释放
+        long send_window;
+        long recv_window;
+        int recv_pending;               // 已经收下但还没有用 WINDOW_UPDATE 归还的字节数
+
+        file_sink *sink;                // 上传路由的请求体处理器
+        long body_limit;
+        long body_received;
+
+        int status;
+        const char *content_type;
+        const char *body;
+        long body_len;
+        long body_sent;
+        char *buf;                      // 进程内处理器生成的响应体
+        char *map;                      // 映射的文件
+        long map_len;
+    };
+
+    // 帧的处理
+    void on_frame(int type, int flags, uint32_t id, const uint8_t *payload, int len);
+    void on_data(int flags, uint32_t id, const uint8_t *payload, int len);
+    void on_headers(int flags, uint32_t id, const uint8_t *payload, int len);
+    void on_continuation(int flags, uint32_t id, const uint8_t *payload, int len);
+    void on_header_block(const uint8_t *block, int len);
+    bool on_settings(const uint8_t *payload, int len);
+    void on_window_update(uint32_t id, const uint8_t *payload, int len);
+    static bool on_header(void *arg, const char *name, int name_len, const char *value, int value_len);
+    static void parse_priority(stream *s, const char *value, int len);
+
+    // 请求的处理
+    void on_request(stream *s);
+    void on_body_end(stream *s);
+    void serve_file(stream *s, const route_match &m);
+    void begin_upload(stream *s, const route_match &m);
+    void respond(stream *s, int status, const char *body, long len, const char *content_type = "text/html");
+
+    // 流的管理
+    stream *find_stream(uint32_t id);
+    stream *open_stream(uint32_t id);
+    void release_streams();
+    void reset_stream(stream *s, ERROR_CODE code);
+    void finish_stream(stream *s);
+
+    // 发送
+    bool queue_frame(int type, int flags, uint32_t id, const void *payload, int len);
+    void queue_window_update(uint32_t id, uint32_t increment);
+    void fail(ERROR_CODE code);                 // 连接错误：发送 GOAWAY，之后不再处理输入
+    void build_round();
+    bool round_full() const;
+    void add_output(const void *data, int len);         // 复制到本轮的缓冲区
+    void add_iov(const void *data, long len);           // 引用外部的数据
+    void add_headers(stream *s);
+    bool add_data(stream *s);
+    static void put_frame_header(uint8_t *out, int len, int type, int flags, uint32_t id);
+
+private:
+    sockaddr_storage m_address;     // 客户端地址，用于限流
+    hpack_decoder m_decoder;
+
+    char m_in[INPUT_SIZE];
+    int m_in_len;
+    bool m_preface_ok;              // 已经收到了客户端的连接序言
+
+    stream *m_streams[MAX_STREAMS];
+    int m_stream_count;
+    uint32_t m_last_id;             // 客户端打开的最大的流 ID
+
+    // 分成多个帧的首部块
+    uint8_t *m_hblock;
+    int m_hblock_len;
+    uint32_t m_hblock_stream;       // 正在接收首部块的流，不为 0 时下一帧必须是它的 CONTINUATION
+    int m_hblock_flags;             // HEADERS 帧的标志
+
+    // 流量控制
+    long m_send_window;             // 连接的发送窗口
+    long m_recv_window;             // 连接的接收窗口
+    int m_recv_pending;
+    long m_peer_window;             // 对方的 SETTINGS_INITIAL_WINDOW_SIZE
+    int m_peer_max_frame;           // 对方的 SETTINGS_MAX_FRAME_SIZE
+
+    bool m_goaway_sent;
+    bool m_peer_goaway;
+    bool m_failed;                  // 发生了连接错误
+
+    // 等待发送的控制帧，组织下一轮时放在最前面
+    uint8_t m_ctrl[CTRL_SIZE];
+    int m_ctrl_len;
+
+    // 正在写出的一轮
+    uint8_t m_out[OUTPUT_SIZE];
+    int m_out_len;
+    struct iovec m_iov[ROUND_IOVS];
+    int m_iov_count;
+    int m_iov_idx;                  // 第一个还没有写完的缓冲区
+    long m_round_bytes;
+};
+
+#endif
@@ -19,7 +19,25 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "body_handler.h"
+#include "sockopt.h"
+#include "coro.h"
+#include "router.h"
+#include "ratelimit.h"
+#include "tls.h"
+#include "trace.h"
+#include "timer_wheel.h"
+#include "capture.h"
+#include "cost.h"
+#include "resp_cache.h"
+#include "shm_cache.h"
+#include "file_table.h"
 #include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <atomic>
+
+class h2_session;
+template<typename T> class threadpool;
 
 class http_conn {
 public:
@@ -27,7 +45,12 @@ public:
     static const int READ_BUFFER_SIZE = 2048;       // 读缓冲区大小
     static const int WRITE_BUFFER_SIZE = 2048;      // 写缓冲区大小
 
-    // HTTP 请求方法，但我们只支持 GET
+    static const int HANDLER_HEADROOM = 256;        // 进程内处理器的响应体写在写缓冲区的这个位置之后，前面留给首部
+    static const int SPLICE_CHUNK = 65536;          // 每次 splice 的最大字节数
+    static const int COLD_WINDOW = 1 << 20;         // 每次发送文件之前检查是否在页缓存中的范围，一次最多发送这么多
+    static const int FETCH_SIZE = 4 << 20;          // 文件不在页缓存中时，I/O 线程池每次预读的大小
+
+    // HTTP 请求方法，我们支持 GET，以及上传、代理和进程内处理器路由上的 POST 和 PUT
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
 
     // 解析客户端请求时，主状态机的状态
@@ -45,7 +68,18 @@ public:
     // - FILE_REQUEST：文件请求，获取文件成功
     // - INTERNAL_ERROR：表示服务器内部错误
     // - CLOSED_CONNECTION：表示客户端已经关闭连接了
-    enum HTTP_CODE {NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION};
+    // - BODY_TOO_LARGE：请求体超过了路由允许的大小
+    // - UPLOAD_REQUEST：上传请求的请求体已经完整写入文件
+    // - PROXY_REQUEST：请求匹配代理路由，需要转发给上游
+    // - BAD_GATEWAY：没有可用的上游，或者上游没有返回有效的响应
+    // - LENGTH_REQUIRED：代理路由不接受分块传输编码的请求体
+    // - HANDLER_REQUEST：进程内处理器已经生成了响应
+    // - TOO_MANY_REQUESTS：客户端超过了请求速率限制
+    // - H2_PREFACE：连接以 HTTP/2 的连接序言开头（h2c prior knowledge）
+    // - H2_UPGRADE：请求要求升级到 h2c
+    enum HTTP_CODE {NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION,
+                    BODY_TOO_LARGE, UPLOAD_REQUEST, PROXY_REQUEST, BAD_GATEWAY, LENGTH_REQUIRED, HANDLER_REQUEST, TOO_MANY_REQUESTS,
+                    H2_PREFACE, H2_UPGRADE, CACHED_REQUEST, FILE_PENDING};
 
     // 从状态机的三种可能状态，代表行的读取状态
     // - LINE_OK  ：读取到一个完整的行
@@ -53,27 +87,146 @@ public:
     // - LINE_OPEN：行数据不完整
     enum LINE_STATUS {LINE_OK = 0, LINE_BAD, LINE_OPEN};
 
+    // 线程池模式下连接的状态字（m_state）。连接始终以边缘触发注册读写事件，由主线程或者一个工作线程持有：
+    // - EV_OWNED：连接在线程池队列中或者正被工作线程处理，主线程收到的事件只记在状态字中
+    // - EV_IN/EV_OUT/EV_HUP：记录下来还没有处理的可读、可写、挂断事件
+    // - EV_CLOSE：工作线程要求关闭连接
+    enum EVENT_BITS {EV_OWNED = 1, EV_IN = 2, EV_OUT = 4, EV_HUP = 8, EV_CLOSE = 16};
+
+    // 分块传输编码（Transfer-Encoding: chunked）请求体的解析状态
+    // - CHUNK_SIZE：正在读取块大小行
+    // - CHUNK_DATA：正在读取块数据
+    // - CHUNK_DATA_END：块数据之后的 \r\n
+    // - CHUNK_TRAILER：最后一个块之后的尾部字段
+    enum CHUNK_STATE {CHUNK_SIZE = 0, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER};
+
+    // 连接所处的阶段，每个阶段有各自的期限，超过期限的连接由主线程直接关闭，不经过线程池
+    // - PHASE_HEADER：从连接建立（包括 TLS 握手）或者收到新请求的第一个字节开始，到首部接收完毕
+    // - PHASE_BODY：接收请求体，每收到一块数据重新计时
+    // - PHASE_IDLE：长连接等待下一个请求。HTTP/2 连接每次读写之后重新计时
+    // - PHASE_WRITE：发送响应，期限为额外给的时间加上按最低发送速率发完响应所需的时间
+    // - PHASE_NONE：不限时
+    enum PHASE {PHASE_HEADER = 0, PHASE_BODY, PHASE_IDLE, PHASE_WRITE, PHASE_NONE, PHASE_COUNT = PHASE_NONE};
+
+    // 冷文件的预读任务，由 I/O 线程池执行：把即将发送的部分读入页缓存，完成后经过完成队列交还连接
+    struct fetch_job {
+        http_conn *conn;
+        char *addr;                 // 映射区中需要预读的起始位置，按页对齐
+        size_t len;
+        fetch_job *next;            // 重试链表中的下一个任务
+        void process();
+    };
+
 public:
-    http_conn() {}
+    http_conn() : m_sockfd(-1), m_h2(nullptr), m_trace_id(0), m_capture_id(0), m_cost_key(0), m_cache_key(0), m_cache_entry(nullptr), m_shm_slot(nullptr), m_file_entry(nullptr), m_file_waiting(false), m_turn_used_bytes(0), m_turn_used_calls(0), m_budget_out(false), m_ready(false), m_yielded(false), m_ready_next(nullptr), m_state(0), m_want_write(false), m_done_next(nullptr), m_deadline(PHASE_NONE), m_fetching(false), m_body_handler(nullptr), m_file_address(0), m_file_fd(-1), m_coro_active(false)
+        { m_pipefd[0] = m_pipefd[1] = -1; m_file_waiter.owner = this; m_file_waiter.result = nullptr; }
     ~http_conn() {}
 
 public:
-    void init(int socked, const sockaddr_in &addr);         // 初始化新接受的连接
+    void init(int socked, const sockaddr_storage &addr, const sock_options *opts, bool tls);    // 初始化新接受的连接，tls 表示来自 HTTPS 监听 socket
     void close_conn();              // 关闭连接
     void process();                 // 任务的处理逻辑。这里是处理客户端请求，解析 http 请求报文
     bool read();                    // 非阻塞读
     bool write();                   // 非阻塞写
+    bool is_idle() const { return m_sockfd != -1 && m_idle && !(m_state.load() & EV_OWNED); }   // 是否是等待下一个请求的空闲长连接
+    bool io_in_worker() const { return m_tls.handshaking() || m_h2; }   // 连接的读写是否由工作线程完成：TLS 握手和 HTTP/2
+    void close_idle();              // 关闭空闲的长连接
+
+    // 下面这一组函数实现线程池模式下连接在主线程和工作线程之间的交接，连接注册一次之后不再调用 epoll_ctl
+    void on_events(uint32_t events);        // 主线程收到连接上的事件
+    static void drain_completions();        // 主线程取出工作线程交还的连接，处理期间到达的事件
+    void trace(tracer::POINT point) { if (m_trace_id) tracer::record(m_trace_id, point); }    // 被采样的请求记录一个时间点
+    static bool parse_deadlines(const char *spec);  // 解析各阶段的期限 "header=s,body=s,idle=s,write=s[:rate]"
+    static bool parse_keepalive(const char *spec);  // 解析长连接策略 "requests[:capacity]"
+    static int keepalive_level();           // 按当前的连接数选择长连接策略的等级，见 m_keepalive_requests
+    static bool parse_budget(const char *spec);     // 解析每轮的预算 "bytes_kb[:calls[:accepts]]"
+    static void run_ready();                // 主线程处理就绪链表中用完了预算的连接
+    static bool has_ready() { return m_ready_head != nullptr; }
+    static void retry_fetches();            // 主线程把 I/O 线程池队列满时留下的预读任务重新交给它
+    static bool has_fetch_retry() { return m_fetch_retry_head != nullptr; }
+    static void check_deadlines();          // 主线程定期调用，关闭超过期限的连接
+    void resume(uint32_t events);   // 协程模式：连接上发生了事件，恢复等待该事件的协程
+
+    // 下面这一组函数由 HTTP/1.1 和 HTTP/2 共用
+    static bool build_path(const route_match &route, const char *url, char *path);    // 生成静态文件的完整路径
+    static bool upload_name(const route_match &route, const char *url, char *name);  // 取出上传的目标文件名
+    static HTTP_CODE open_file(const char *path, struct stat *st, int *fd);          // 检查并打开静态文件
+    static void file_ready(file_table::waiter *w);  // file_table 发布了连接等待的查找结果
 
 private:
-    void init();            // 初始化连接其余的信息
+    void init(int pipelined = 0);   // 初始化连接其余的信息，读缓冲区开头的 pipelined 个字节是下一个请求的数据，保留下来
+    void next_request();    // 长连接上的请求处理完毕，保留流水线发来的后续请求，准备处理下一个请求
+    int keepalive_timeout() const;  // 当前等级下空闲期限的秒数
+    void run_events();      // 主线程持有连接时处理状态字中记录的事件
+    void hand_off();        // 主线程把连接交给线程池
+    int cost_class();       // 预估工作线程处理这个连接的开销，见 cost_table
+    void release();         // 工作线程交还连接，期间到达了需要处理的事件时经过完成队列交给主线程
+    void close_from_worker();   // 工作线程要求主线程关闭连接
+    void post_completion();     // 把连接放入完成队列
+    void set_phase(PHASE phase, long extra = 0);    // 进入一个阶段，期限从现在开始计算，extra 为额外增加的秒数
+    void begin_turn() { m_turn_used_bytes = 0; m_turn_used_calls = 0; }    // 开始新的一轮，预算重新计算
+    void charge(long bytes) { ++m_turn_used_calls; if (bytes > 0) m_turn_used_bytes += bytes; }  // 记录一次收发
+    bool over_budget() const;   // 这一轮的预算是否已经用完
+    void make_ready(uint32_t bits);     // 主线程：用完预算的连接放入就绪链表，bits 是需要继续处理的事件
+    void arm_timer(long now);   // 按照当前的期限把连接放入时间轮
+    void on_deadline(long now); // 时间轮转到了连接所在的位置
+    bool file_resident(off_t offset, size_t len);  // 文件中即将发送的部分是否都在页缓存中，不在时记下需要预读的范围
+    void start_fetch();         // 把连接交给 I/O 线程池预读文件，预读完成之前连接不处理任何事件
+    void cache_response();      // 把刚生成的静态文件响应放入 resp_cache
+    HTTP_CODE open_shared();    // 经过 file_table 打开静态文件，与同时访问这个文件的其他连接共享查找结果
     HTTP_CODE process_read();           // 解析 http 请求
     bool process_write(HTTP_CODE ret);  // 填充 HTTP 应答
     
     // 下面这一组函数被 process_read 调用以分析 HTTP 请求报文
     HTTP_CODE parse_request_line(char *text);     // 解析 http 请求首行
     HTTP_CODE parse_headers(char *text);          // 解析 http 请求头
-    HTTP_CODE parse_content(char *text);          // 解析 http 请求体
+    HTTP_CODE parse_content();                    // 解析 http 请求体，以流的方式交给请求体处理器
     HTTP_CODE do_request();
+    HTTP_CODE dispatch();                   // 首部解析完毕，按路由选择处理器
+
+    // 下面这一组函数用于流式地接收请求体
+    HTTP_CODE begin_body();                 // 首部解析完毕，选择请求体处理器并检查大小限制
+    HTTP_CODE parse_fixed_body();           // 按 Content-Length 接收请求体
+    HTTP_CODE parse_chunked_body();         // 按分块传输编码接收请求体
+    HTTP_CODE splice_body();                // 把 socket 中剩余的请求体用 splice 零拷贝写入文件
+    HTTP_CODE finish_body();                // 请求体接收完毕
+    bool deliver_body(const char *data, long len);     // 把一块请求体交给处理器
+    void compact_read_buf();                // 丢弃读缓冲区中已经处理过的数据
+    void send_continue();                   // 回复 100 Continue
+    void abort_body();                      // 中断请求体的接收
+
+    // 下面这一组函数用于反向代理
+    HTTP_CODE forward_request();            // 把请求转发给上游，响应直接写给客户端
+    int build_proxy_head(char *buf, int size);     // 重新组装发给上游的请求首部
+
+    // 下面这一组函数切换到 HTTP/2，会话由 h2_session 处理，连接只负责读写 socket
+    void start_h2(HTTP_CODE how);           // 创建会话，把读缓冲区中已经读到的数据交给它
+    void process_h2();                      // 线程池模式：读取并处理帧，写出响应，直到 socket 暂时不可读写
+    int flush_h2();                         // 写出会话中待发送的数据：1 写完，0 socket 写满，-1 出错
+
+    // 下面这一组函数实现协程执行模型（定义在 coro_conn.cpp）。每个连接由一个协程按顺序处理，
+    // IO 操作遇到 EAGAIN 时挂起协程，由主线程在 socket 就绪时恢复
+    struct event_awaiter {
+        http_conn *conn;
+        uint32_t events;
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> h) { conn->m_waiter = h; conn->m_wait_events = events; }
+        void await_resume() { conn->m_waiter = nullptr; }
+    };
+    event_awaiter wait_event(uint32_t events) { return event_awaiter{this, events}; }
+    conn_task serve();                                      // 连接协程
+    task<ssize_t> read_some();                              // 读取一些数据到读缓冲区
+    task<bool> write_all(struct iovec *iv, int count, int flags = 0);      // 集中写出所有数据
+    task<bool> send_file(int fd, off_t offset, size_t len); // 用 sendfile 发送文件
+    task<bool> serve_h2();                                  // HTTP/2 连接的协程主循环
+    // 协程用完了一轮的预算，进入就绪链表，主线程处理完这一批事件之后再恢复它
+    struct turn_awaiter {
+        http_conn *conn;
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> h) { conn->m_waiter = h; conn->m_wait_events = 0; conn->m_yielded = true; conn->make_ready(0); }
+        void await_resume() { conn->m_waiter = nullptr; conn->m_yielded = false; }
+    };
+    turn_awaiter next_turn() { return turn_awaiter{this}; }
     char *get_line() {  return m_read_buf + m_start_line;   }
     LINE_STATUS parse_line();           // 解析具体的一行
 
@@ -91,10 +244,79 @@ private:
 public:
     static int m_epollfd;           // epoll 实例。所有的 http_conn 共用一个 epoll 实例
     static int m_user_count;        // 统计 TCP 连接数量
+    static long m_max_body;         // 没有匹配上传路由时，请求体的默认上限
+    static std::atomic<bool> m_draining;    // 进程正在退出，之后的响应都不再保持连接
+    static bool m_coro_mode;        // 是否使用协程执行模型，由主线程处理所有连接，不经过线程池
+    static threadpool<http_conn> *m_pool;   // 线程池模式下处理请求的线程池
+    static int m_done_fd;           // 完成队列的 eventfd，工作线程向空队列放入连接时唤醒主线程
+    static std::atomic<long> m_epoll_ctls;  // 对连接 socket 调用 epoll_ctl 的次数
+    static int m_phase_timeout[PHASE_COUNT];    // 各阶段的期限（秒），0 表示不限时
+    static long m_min_send_rate;            // 发送响应的最低速率（字节/秒），0 表示不按响应大小延长期限
+    static int m_recheck;                   // 时间轮复查连接的最长间隔（秒），0 表示所有阶段都不限时
+    static std::atomic<long> m_timeouts[PHASE_COUNT];  // 各阶段因超过期限而被关闭的连接数
+    static threadpool<fetch_job> *m_io_pool;       // 预读冷文件的 I/O 线程池
+    static std::atomic<long> m_cold_fetches;        // 因文件不在页缓存中而预读的次数
+
+    // 长连接策略。HTTP/1.1 默认保持连接，HTTP/1.0 需要 Connection: keep-alive，任一方要求 Connection: close 时关闭。
+    // 每个连接最多处理 m_keepalive_requests 个请求，连接数接近容量 m_capacity 时逐级收紧，把连接让给新的客户端：
+    //   0 级，连接数低于容量的 50%：空闲期限和请求数上限不变
+    //   1 级，低于 75%：两者减半；2 级，低于 90%：两者减为 1/4；3 级：响应之后不再保持连接
+    // 响应带有 Keep-Alive: timeout=空闲期限, max=请求数上限，两者是当前等级的值而不是剩余的值，
+    // 这样同一个等级下的响应相同，可以放入 resp_cache
+    static const int KEEPALIVE_LEVELS = 4;
+    static int m_keepalive_requests;        // 每个连接的请求数上限，0 表示不限
+    static int m_capacity;                  // 连接数的容量，默认为文件描述符的上限
+    static std::atomic<long> m_keepalive_reuses;    // 在复用的连接上处理的请求数
+    static std::atomic<long> m_requests_total;      // 处理过的 HTTP/1.x 请求数
+    static std::atomic<long> m_keepalive_declined;  // 客户端要求保持连接，但因为请求数上限或负载而关闭的次数
+
+    // 每轮的 I/O 预算。主线程每次处理一个连接（线程池模式下工作线程每次处理一个连接）算作一轮，
+    // 一轮中一个连接最多收发 m_turn_bytes 字节、调用 m_turn_calls 次收发函数，用完时停下，
+    // 连接进入就绪链表，主线程在处理完这一批 epoll 事件之后按顺序轮流继续处理它们。
+    // socket 仍然可读写，边缘触发的事件不会再来，因此就绪链表中的连接由主线程主动继续，epoll_wait 不阻塞。
+    // 每轮 epoll_wait 之后最多 accept m_accept_budget 个新连接，剩下的留到下一轮。0 表示不限
+    static long m_turn_bytes;
+    static int m_turn_calls;
+    static int m_accept_budget;
+    static std::atomic<long> m_budget_yields;       // 连接用完一轮的预算的次数
+    static std::atomic<long> m_accept_deferred;     // 因为达到 accept 上限而把新连接留到下一轮的次数
+    static http_conn *m_ready_head;         // 就绪链表，只由主线程访问
+    static http_conn *m_ready_tail;
+    static fetch_job *m_fetch_retry_head;   // 等待重试的预读任务，只由主线程访问
+    static fetch_job *m_fetch_retry_tail;
 
 private:
+    friend struct http_bench;   // 微基准测试（bench/bench.cpp）不经过 socket，直接驱动解析和应答函数
+
     int m_sockfd;               // 连接的客户端 socket 句柄
-    sockaddr_in m_address;      // 连接的客户端 socket 地址
+    sockaddr_storage m_address; // 连接的客户端 socket 地址，可能是 IPv4、IPv6 或 Unix 域 socket
+    const sock_options *m_sockopt;      // 所属监听 socket 的 TCP 参数
+    tls_conn m_tls;             // HTTPS 连接的 TLS 会话
+    h2_session *m_h2;           // HTTP/2 会话，为空表示 HTTP/1.1
+    uint32_t m_trace_id;        // 当前请求的跟踪号，0 表示没有被采样
+    uint32_t m_capture_id;      // 流量录制中的连接号，0 表示没有录制
+    uint32_t m_cost_key;        // 当前请求在 cost_table 中的键，0 表示还不知道
+    uint64_t m_cache_key;       // 当前请求在 resp_cache 中的键
+    resp_cache::entry *m_cache_entry;   // 正在发送的缓存中的响应，持有它的引用
+    shm_cache::slot *m_shm_slot;        // 正在发送的共享内存缓存中的响应，持有它的引用
+    file_table::entry *m_file_entry;    // 正在发送的共享文件，持有它的引用，映射区和文件描述符都属于它
+    file_table::waiter m_file_waiter;   // 在 file_table 中等待其他连接的查找结果
+    bool m_file_waiting;                // 正在等待查找结果，唤醒后 process 从 do_request 继续
+    long m_turn_used_bytes;             // 这一轮已经收发的字节数
+    int m_turn_used_calls;              // 这一轮已经调用收发函数的次数
+    bool m_budget_out;                  // 响应因为预算用完而停止发送，socket 仍然可写
+    bool m_ready;                       // 是否在就绪链表中，只由主线程访问
+    bool m_yielded;                     // 协程模式：协程因为预算用完而挂起在就绪链表中
+    http_conn *m_ready_next;            // 就绪链表中的下一个连接
+    std::atomic<uint32_t> m_state;      // 线程池模式下连接由谁持有，以及记录下来的事件，见 EVENT_BITS
+    bool m_want_write;          // 响应没有写完（或者 TLS 握手、HTTP/2 要写数据），等待可写事件
+    bool m_read_drained;        // 上一次读取是否读到了 EAGAIN。读缓冲区满时停止读取，不会再有新的可读事件
+    http_conn *m_done_next;     // 完成队列中的下一个连接
+    std::atomic<uint64_t> m_deadline;   // 当前阶段的期限：高位是到期时间（秒），低 3 位是 PHASE。持有连接的线程写，主线程读
+    wheel_node m_timer;         // 连接在时间轮中的结点，只由主线程访问
+    bool m_fetching;            // 正在等待 I/O 线程池预读文件
+    fetch_job m_fetch;          // 预读任务
+    off_t m_resident_end;       // 文件中已经确认在页缓存中的部分的结尾
 
     char m_read_buf[READ_BUFFER_SIZE];      // 读缓冲
     int m_read_idx;             // 游标，指明读缓冲的第一个空闲下标
@@ -109,18 +331,47 @@ private:
     char* m_url;                            // 客户请求的目标文件的文件名
     char* m_version;                        // HTTP协议版本号，我们仅支持HTTP1.1
     char* m_host;                           // 主机名
-    int m_content_length;                   // HTTP 请求报文的报文主体的长度
-    bool m_linger;                          // HTTP 请求是否要求保持连接
+    int m_headers_idx;                      // 首部字段在读缓冲区中的起始位置
+    route_match m_route;                    // 当前请求匹配的路由
+    response m_response;                    // 进程内处理器生成的响应
+    long m_content_length;                  // HTTP 请求报文的报文主体的长度
+    bool m_linger;                          // 响应之后是否保持连接
+    bool m_pipelined;                       // 读缓冲区中有客户端不等响应就发来的下一个请求
+    int m_requests;                         // 连接上已经开始处理的请求数
+    int m_status;                           // 当前响应的状态码，0 表示还没有生成响应
+    int m_keepalive_level;                  // 决定保持连接时的策略等级
+    bool m_idle;                            // 连接上没有正在处理的请求。只由主线程读写
+    bool m_chunked;                         // 请求体是否使用分块传输编码
+    bool m_expect_continue;                 // 客户端是否在等待 100 Continue
+    bool m_upgrade_h2;                      // 请求带有 Upgrade: h2c
+    char* m_h2_settings;                    // HTTP2-Settings 首部的值
+
+    body_handler *m_body_handler;           // 当前请求的请求体处理器，为空表示没有请求体
+    const route_target *m_upload;           // 当前请求匹配的上传路由
+    long m_body_limit;                      // 当前请求允许的最大请求体
+    long m_body_received;                   // 已经接收的请求体字节数
+    long m_body_remaining;                  // Content-Length 请求体中还未接收的字节数
+    CHUNK_STATE m_chunk_state;              // 分块传输编码的解析状态
+    long m_chunk_left;                      // 当前块中还未接收的字节数
+    bool m_body_splice;                     // 是否正在用 splice 把 socket 中的请求体直接写入文件
+    int m_pipefd[2];                        // splice 使用的管道
+    file_sink m_file_sink;                  // 上传路由使用的处理器
+    discard_sink m_discard_sink;            // 其他请求使用的处理器
 
     char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
     int m_write_idx;                        // 写缓冲区中待发送的字节数
     char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
+    int m_file_fd;                          // 协程模式下用 sendfile 发送文件，不做内存映射
     struct stat m_file_stat;                // 保存请求的文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
     struct iovec m_iv[2];                   // 将多个缓冲区的数据集中写到写缓冲区中 
     int m_iv_count;                         // 表示集中写中的缓冲区的个数
 
     int bytes_to_send;              // 写缓冲区中还需要发送的字节数
     int bytes_have_send;            // 写缓冲区中已经发送的字节数
+
+    bool m_coro_active;                     // 连接协程是否在运行
+    std::coroutine_handle<> m_waiter;       // 正在等待事件的协程
+    uint32_t m_wait_events;                 // 协程等待的事件
 };
 
 
@@ -0,0 +1,47 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include "sockopt.h"
+
+// 一个监听地址。服务器可以同时监听多个地址，每个地址由一个字符串描述：
+//   port                  TCP，所有 IPv4 地址上的 port 端口
+//   host:port             TCP，指定的 IPv4 地址，IPv6 地址写作 [addr]:port
+//   unix:/path[:mode]     Unix 域 stream socket，mode 为 socket 文件的八进制权限，默认 0660
+//
+// TCP 地址后面可以跟 @sock_options，例如 "443@nodelay,fastopen=256"，这个监听 socket 及其连接使用这组参数（见 sockopt.h），
+// 不再使用 -O 给出的默认参数。
+//
+// 同一台机器上的调用方（如 sidecar）通过 Unix 域 socket 连接，不经过 TCP/IP 协议栈。
+// 这样的连接与 TCP 连接走相同的解析、路由和 sendfile/splice 零拷贝发送路径，只是不设置 TCP 参数，也不限流，
+// 访问权限由 socket 文件的权限控制
+struct listener {
+    static const int MAX = 16;          // 监听地址的最大数量，与 upgrader::MAX_FDS 一致
+
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    mode_t mode;                        // Unix 域 socket 文件的权限
+    bool tls;                           // 是否是 HTTPS 监听地址
+    int fd;                             // 监听 socket，-1 表示还没有打开
+    sock_options opts;                  // 监听 socket 及其连接的 TCP 参数，Unix 域 socket 不设置
+    bool own_opts;                      // 地址中是否给出了参数，否则由 config 填入 -O 的默认参数
+
+    listener() : addr_len(0), mode(0660), tls(false), fd(-1), own_opts(false) {}
+
+    bool parse(const char *spec, bool is_tls);      // 解析监听地址，格式错误返回 false
+    bool is_unix() const { return addr.ss_family == AF_UNIX; }
+
+    // fd 是否是绑定在这个地址上的监听 socket。平滑升级时用它认领从旧进程继承的 socket，与交接时的顺序无关
+    bool matches(int sock) const;
+
+    // 创建、绑定并监听，失败返回 -1。Unix 域 socket 的路径上残留的 socket 文件会被删除，
+    // 但如果还有进程在这个路径上监听，则不抢占它
+    int open();
+
+    const char *describe(char *buf, size_t size) const;     // 可读的地址，用于日志
+};
+
+#endif
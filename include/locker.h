@@ -4,6 +4,8 @@
 #include <pthread.h>
 #include <exception>
 #include <semaphore.h>
+#include <errno.h>
+#include <time.h>
 
 
 // 该头文件保存了各种线程同步机制的封装类，实现 RAII 机制
@@ -93,6 +95,23 @@ public:
         return sem_wait(&m_sem) == 0;
     }
 
+    // 最多等待 seconds 秒，超时返回 false
+    bool timedwait(int seconds) {
+        timespec t;
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec += seconds;
+        while (sem_timedwait(&m_sem, &t) != 0) {
+            if (errno != EINTR)
+                return false;
+        }
+        return true;
+    }
+
+    // 不等待，信号量为 0 时返回 false。不进入内核
+    bool trywait() {
+        return sem_trywait(&m_sem) == 0;
+    }
+
     bool post() {
         return sem_post(&m_sem) == 0;
     }
@@ -102,6 +121,16 @@ private:
 };
 
 
+// 4. 自旋等待的一次循环：提示 CPU 这是忙等，降低功耗，并让出流水线给同一个核上的另一个超线程
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+
 
 
 
@@ -0,0 +1,57 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <sys/types.h>
+#include <signal.h>
+#include <atomic>
+
+// 预派生（prefork）模式：主进程派生 N 个工作进程，每个工作进程是一个完整的服务器（主循环、线程池、连接数组），
+// 互不共享连接，一个进程崩溃只断开它自己的连接。
+//
+// - 监听：每个工作进程用 SO_REUSEPORT 打开自己的 TCP 监听 socket，由内核把新连接分散到各个进程，
+//   没有惊群，也不争抢同一个 accept 队列。Unix 域 socket 没有这样的负载均衡，由主进程打开，工作进程继承
+// - 看管：工作进程退出（崩溃）后主进程重新派生它，同一个位置上一秒之内最多派生一次，避免启动即崩溃时空转
+// - 信号：主进程收到 SIGQUIT、SIGTERM 或 SIGINT 时向工作进程发送 SIGQUIT，等它们处理完已有的请求后退出；
+//   SIGUSR1 转发给所有工作进程。主进程退出时工作进程收到 SIGQUIT。工作进程在装好信号处理函数之前阻塞这些信号，
+//   期间收到的信号保留到 unblock_signals 之后处理
+// - 统计：每个工作进程的统计写在派生之前映射的共享内存中，任何一个工作进程的 /metrics 都能输出所有进程的数据。
+//   响应缓存用 -H 开启的 shm_cache 所有进程共用一份
+//
+// 预派生模式与平滑升级（-u）和流量录制（-C）不能同时使用
+class prefork {
+public:
+    static const int MAX_WORKERS = 64;
+
+    // 一个工作进程位置的统计，独占一个缓存行
+    struct alignas(64) worker_stats {
+        std::atomic<pid_t> pid;                 // 0 表示没有在运行
+        std::atomic<long> connections;
+        std::atomic<long> requests;             // 处理过的请求数，进程重新派生后从 0 开始
+        std::atomic<long> restarts;             // 这个位置上的进程被重新派生的次数
+    };
+
+    // 解析工作进程数
+    static bool parse(const char *spec);
+    static bool enabled() { return m_workers > 0; }
+    static int workers() { return m_workers; }
+
+    // 主进程：映射统计区，派生并看管工作进程，所有工作进程退出后结束主进程，不返回。
+    // 工作进程中返回自己的位置编号，失败返回 -1
+    static int run();
+
+    // 工作进程装好信号处理函数之后调用，恢复派生之前的信号掩码。不是工作进程时什么也不做
+    static void unblock_signals();
+
+    // 工作进程更新自己的统计
+    static void publish(long connections, long requests);
+    static const worker_stats &stats(int i) { return m_stats[i]; }
+
+private:
+    static int m_workers;
+    static int m_index;                         // 当前工作进程的位置
+    static pid_t m_master;
+    static worker_stats *m_stats;
+    static sigset_t m_old_mask;                 // 主进程阻塞信号之前的信号掩码
+};
+
+#endif
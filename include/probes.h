@@ -0,0 +1,39 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT 静态探针，provider 为 pawcook。bpftrace、perf 等工具可以在运行中的进程上挂载它们，
+// 探针的名字和参数不随编译器的内联而变化，例子见 tools/bpftrace：
+//   bpftrace -e 'usdt:./a.out:pawcook:response_done { @bytes = hist(arg2); }'
+//
+// 探针由 <sys/sdt.h>（systemtap-sdt-dev）展开为一条 nop 指令，位置和参数的取法记在 ELF 的 .note.stapsdt 中，
+// 没有挂载时只执行这条 nop。参数只用已经算好的值，不要在探针处额外计算。
+// 没有 <sys/sdt.h> 或者编译时定义了 PAWCOOK_NO_PROBES 时，探针展开为空
+//
+// 探针及其参数：
+//   accept(fd, tls)                        新连接
+//   read(fd, bytes)                        读到数据
+//   enqueue(fd, class)                     连接放入线程池队列，class 为预估开销的类别
+//   dequeue(fd)                            工作线程取出连接
+//   parse_done(fd, code, url)              请求解析完毕，code 为 HTTP_CODE，url 为请求的路径（字符串）
+//   response_start(fd, status, bytes)      生成了响应，bytes 为响应的总字节数
+//   response_done(fd, status, bytes)       响应发送完毕
+//   close(fd, requests)                    关闭连接，requests 为连接上处理过的请求数
+//   timeout(fd, phase)                     连接超过期限，phase 为 http_conn::PHASE
+#if defined(__has_include) && !defined(PAWCOOK_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PAWCOOK_PROBES 1
+#endif
+#endif
+
+#ifdef PAWCOOK_PROBES
+#define PROBE1(name, a)             DTRACE_PROBE1(pawcook, name, a)
+#define PROBE2(name, a, b)          DTRACE_PROBE2(pawcook, name, a, b)
+#define PROBE3(name, a, b, c)       DTRACE_PROBE3(pawcook, name, a, b, c)
+#else
+#define PROBE1(name, a)             do {} while (0)
+#define PROBE2(name, a, b)          do {} while (0)
+#define PROBE3(name, a, b, c)       do {} while (0)
+#endif
+
+#endif
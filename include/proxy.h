@@ -0,0 +1,99 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <atomic>
+#include "locker.h"
+
+// 上游服务器：TCP 地址 host:port 或 Unix 域 socket unix:/path。
+// 维护一个保持连接的空闲连接池，请求结束后连接放回池中供后续请求复用
+class upstream {
+public:
+    static const int MAX_IDLE = 64;             // 连接池中空闲连接的最大数量
+    static const int NAME_LEN = 128;
+
+    upstream() : m_outstanding(0), m_healthy(true), m_idle_count(0) { m_name[0] = '\0'; }
+    ~upstream();
+
+    bool init(const char *addr);                // 解析地址
+    int acquire();                              // 取一个连接：优先复用空闲连接，否则新建，失败返回 -1
+    void release(int fd, bool reusable);        // 归还连接，不可复用的连接直接关闭
+    bool check();                               // 健康检查：能否建立连接
+
+    const char *name() const { return m_name; }
+    bool is_unix() const { return m_addr.ss_family == AF_UNIX; }
+
+public:
+    std::atomic<int> m_outstanding;             // 正在处理的请求数，用于最少请求数负载均衡
+    std::atomic<bool> m_healthy;                // 最近一次健康检查是否通过
+
+private:
+    int connect_upstream(int timeout_ms);       // 新建一个到上游的连接
+
+private:
+    char m_name[NAME_LEN];
+    sockaddr_storage m_addr;
+    socklen_t m_addrlen;
+
+    locker m_lock;                              // 保护连接池
+    int m_idle[MAX_IDLE];
+    int m_idle_count;
+};
+
+// 反向代理：把请求转发到一组上游服务器，由路由表决定哪些请求交给哪一组上游
+class proxy {
+public:
+    static const int MAX_ROUTES = 16;
+    static const int MAX_UPSTREAMS = 8;         // 每个路由的上游服务器的最大数量
+    static const int HEAD_BUFFER_SIZE = 8192;   // 上游响应首部的最大长度
+    static const int IO_TIMEOUT = 30000;        // 转发过程中单次等待的超时时间（毫秒）
+    static const int HEALTH_INTERVAL = 2;       // 健康检查的间隔（秒）
+
+    struct route {
+        upstream *upstreams[MAX_UPSTREAMS];
+        int count;
+        mutable std::atomic<unsigned> next;          // 轮转起点，请求数相同时依次选择
+    };
+
+    // 转发的结果
+    // - PROXY_OK：响应已经完整地转发给客户端
+    // - PROXY_BAD_GATEWAY：没有可用的上游或者上游出错，客户端还没有收到任何数据，可以回复 502
+    // - PROXY_ABORT：转发中途出错，客户端已经收到部分响应，只能关闭连接
+    enum RESULT {PROXY_OK = 0, PROXY_BAD_GATEWAY, PROXY_ABORT};
+
+    // 创建一组上游，upstreams 为逗号分隔的上游地址列表，失败返回 nullptr
+    static const route *add_route(const char *upstreams);
+    static bool enabled() { return m_route_count > 0; }
+
+    // 启动和停止健康检查线程。停止时唤醒正在等待的线程并 join
+    static void start_health_check();
+    static void stop_health_check();
+
+    static std::atomic<long> m_bad_gateway;     // 没有上游应答、回复 502 的请求数
+
+    // 转发一个请求。head 为重新组装的请求首部，body 为已经读到的请求体，
+    // 剩余的 body_remaining 字节请求体从客户端 socket 中直接 splice 到上游。
+    // 响应首部去掉逐跳首部后按 keep_alive 加上 Connection 首部；http10 的客户端不能接收分块编码，由我们解码。
+    // keep_alive 传入客户端连接能否继续复用，返回实际的结果
+    static RESULT forward(const route *r, int client_fd, bool head_only, bool http10, const char *head, int head_len,
+                          const char *body, long body_len, long body_remaining, bool *keep_alive);
+
+private:
+    static upstream *pick(const route *r);      // 选择请求数最少的健康上游
+    static void *health_check(void *arg);
+
+    static route m_routes[MAX_ROUTES];
+    static int m_route_count;
+
+    static pthread_t m_health_tid;
+    static bool m_health_running;
+    static bool m_health_stop;                  // 受 m_health_lock 保护
+    static locker m_health_lock;
+    static cond m_health_cond;
+};
+
+#endif
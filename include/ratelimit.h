@@ -0,0 +1,61 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <atomic>
+
+// 按客户端地址限流。每个客户端 IP、每个网段（IPv4 /24，IPv6 /64）各有一个令牌桶：
+// - conn：每秒新建连接数，在 accept 时检查
+// - req：每个 IP 每秒的请求数，在每个请求的首部解析完毕时检查
+// - net：每个网段每秒的请求数
+// Unix 域 socket 上的连接来自本机，访问权限已由 socket 文件的权限控制，不限流。
+//
+// 令牌桶放在固定大小的开放寻址哈希表中，每个槽是两个原子变量，用 CAS 更新，不加锁。
+// 一个键只在哈希位置之后的 PROBE 个槽中查找，都被占用时淘汰其中最久没有访问的一个（近似 LRU）
+class rate_limiter {
+public:
+    static const int TABLE_SIZE = 1 << 16;      // 哈希表的槽数，必须是 2 的幂
+    static const int PROBE = 8;                 // 每个键最多探测的槽数
+
+    // 速率（每秒）和桶容量，rate 为 0 表示不限制
+    struct limit {
+        int rate;
+        int burst;
+    };
+
+    // 解析 "req=rate[:burst],net=rate[:burst],conn=rate[:burst]"，burst 默认等于 rate
+    static bool parse(const char *spec);
+    static bool enabled() { return m_conn.rate > 0 || m_req.rate > 0 || m_net.rate > 0; }
+
+    static bool allow_conn(const sockaddr *addr);       // 是否允许这个地址新建连接
+    static bool allow_request(const sockaddr *addr);    // 是否允许这个地址的一个请求
+
+    static const char m_response[];                     // 预先生成的 429 响应
+    static const int m_response_len;
+    static std::atomic<long> m_rejected;                // 被拒绝的连接和请求数
+
+private:
+    // 键的高 8 位区分桶的种类，0 表示空槽
+    enum KEY_KIND {CONN_KEY = 1, REQ_KEY, NET_KEY};
+
+    // 一个槽：键，以及打包在一个 64 位整数中的令牌桶状态，高 32 位为上次更新的时间（毫秒），
+    // 低 32 位为剩余的令牌数（千分之一个令牌为单位）。状态为 0 表示满的桶
+    struct slot {
+        std::atomic<uint64_t> key;
+        std::atomic<uint64_t> state;
+    };
+
+    static uint64_t make_key(KEY_KIND kind, const sockaddr *addr, bool network);
+    static bool take(uint64_t key, const limit &l);
+    static slot *find(uint64_t key, uint32_t now);
+
+    static limit m_conn;
+    static limit m_req;
+    static limit m_net;
+    static slot m_table[TABLE_SIZE];
+};
+
+#endif
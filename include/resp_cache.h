@@ -0,0 +1,138 @@
+#ifndef RESP_CACHE_H
+#define RESP_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <atomic>
+#include "locker.h"
+
+// 完整响应缓存：小的静态文件的响应（状态行、首部和文件内容）序列化在一块连续的内存中，
+// 命中时直接用一次 send 发送这块内存，不再 stat、open、mmap 文件，也不再生成首部。
+//
+// 键为文件的完整路径（路由已经把 URL 规范化为路径）加上响应的变体。这里的响应没有内容编码，
+// 同一个文件的响应只有 Connection 和 Keep-Alive 首部会不同，变体由调用者编号，最多 VARIANTS 种。
+//
+// 缓存按键分成 SHARDS 个分片，每个分片有固定的内存预算（所有条目连同路径和结构体的字节数），
+// 预算之内的淘汰和准入使用 W-TinyLFU：
+// - 新条目先进入占预算 1% 的窗口，窗口满时最旧的条目成为候选，进入主区之前与主区的淘汰对象比较访问频率，
+//   频率更高的留下。一次性的扫描只会经过窗口，不会冲掉主区中的热点条目
+// - 主区分为试用区和保护区（占主区的 80%），条目被命中过就在淘汰时获得第二次机会，移入保护区
+// - 访问频率由 4 行的 Count-Min Sketch 估计，每个计数器 4 位饱和，采样数达到上限时所有计数器减半，
+//   使频率随时间衰减。频率至少为 2（之前访问过）的文件才会被复制进缓存
+//
+// 读不加锁：查找在一个很短的纪元（epoch）临界区中遍历哈希链，找到后增加条目的引用计数，
+// 发送完毕时释放。写者持有分片的锁，从哈希链中摘下的条目等所有读者都离开了摘下之前开始的临界区、
+// 并且没有连接还在发送它时才释放内存。
+//
+// 文件在缓存期间被修改时，每个条目每秒最多检查一次文件的状态，不一致时删除条目，最多返回 1 秒的旧内容
+class resp_cache {
+public:
+    static const int SHARDS = 16;
+    static const int BUCKETS = 1 << 13;         // 每个分片的哈希桶数，必须是 2 的幂
+    static const int MAX_READERS = 256;         // 读者纪元槽的数量，每个访问缓存的线程占一个
+    static const int VARIANTS = 4;              // 同一个路径的响应变体数，必须是 2 的幂
+
+    struct lru_node {
+        lru_node *prev;
+        lru_node *next;
+    };
+
+    // 一个缓存条目，与路径和响应分配在一块内存中
+    struct entry : lru_node {
+        std::atomic<entry *> next_hash;         // 哈希桶中的下一个条目
+        uint64_t key;
+        long len;                               // 响应的字节数
+        long charge;                            // 计入预算的字节数
+        int segment;                            // 所在的分段，见 SEGMENT
+        std::atomic<bool> referenced;           // 进入当前分段之后是否被命中过
+        std::atomic<int> refs;                  // 正在发送这个响应的连接数
+        std::atomic<long> checked;              // 上一次检查文件状态的时间（秒）
+        uint64_t retire_epoch;                  // 从哈希链中摘下时的纪元
+        dev_t dev;                              // 缓存时文件的状态，用于判断文件是否被修改
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        char *path;
+        char *data;                             // 响应
+    };
+
+    // 解析 "budget_mb[:max_entry_kb]"：内存预算和单个响应的大小上限（默认 1024KB），并分配分片
+    static bool parse(const char *spec);
+    static bool enabled() { return m_shards != nullptr; }
+
+    static uint64_t key(const char *path, int variant);
+    // 查找响应。命中时返回持有引用的条目，发送完毕后必须调用 release；文件已经被修改时按未命中处理
+    static entry *lookup(uint64_t key, const char *path);
+    static void release(entry *e);
+
+    // 长度为 len 的响应是否值得放入缓存：大小不超过上限，并且之前被访问过。调用者据此决定是否准备数据
+    static bool wants(uint64_t key, long len);
+    // 把状态行和首部 head 与文件内容 body 复制为一个条目，经过 W-TinyLFU 决定是否留下
+    static void insert(uint64_t key, const char *path, const struct stat &st,
+                       const char *head, long head_len, const char *body, long body_len);
+
+    static std::atomic<long> m_hits;
+    static std::atomic<long> m_misses;
+    static std::atomic<long> m_entries;         // 缓存中的条目数
+    static std::atomic<long> m_bytes;           // 已分配的字节数，包括等待释放的条目
+    static std::atomic<long> m_evictions;       // 为了腾出空间淘汰的条目数
+    static std::atomic<long> m_rejected;        // 没有通过准入的候选条目数
+
+private:
+    enum SEGMENT {WINDOW = 0, PROBATION, PROTECTED, RETIRED};
+
+    struct shard {
+        locker lock;                            // 写者的锁，读者不加锁
+        std::atomic<entry *> buckets[BUCKETS];
+        lru_node lists[3];                      // 各分段的链表，头部最新，尾部最旧
+        long bytes[3];                          // 各分段的字节数
+        lru_node retired;                       // 等待释放的条目
+        long used;                              // 已分配的字节数，不超过 m_budget
+    };
+
+    // 每个读者线程一个纪元槽，占满一个缓存行。0 表示不在临界区中
+    struct alignas(64) reader_slot {
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> in_use;
+    };
+
+    struct slot_holder {
+        reader_slot *s = nullptr;
+        ~slot_holder() { if (s) s->in_use.store(false, std::memory_order_release); }
+    };
+
+    static reader_slot *local_slot();
+    static uint64_t min_active_epoch();
+    static void synchronize(uint64_t epoch);    // 等待纪元小于 epoch 的读者都离开临界区
+
+    static void touch(uint64_t key);            // 记录一次访问
+    static int frequency(uint64_t key);         // 估计的访问频率
+
+    static shard &shard_of(uint64_t key) { return m_shards[(key >> 40) % SHARDS]; }
+    static entry *find(shard &s, uint64_t key, const char *path);
+    static void push(shard &s, int segment, entry *e);
+    static void unlink(shard &s, entry *e);
+    static void retire(shard &s, entry *e);
+    static void reclaim(shard &s);
+    static void admit(shard &s, entry *cand);
+    static bool fresh(entry *e);
+    static void remove(entry *e);
+
+    static shard *m_shards;
+    static long m_budget;                       // 每个分片的预算
+    static long m_window_cap;
+    static long m_main_cap;
+    static long m_protected_cap;
+    static long m_max_entry;
+
+    static std::atomic<uint8_t> *m_sketch;      // 4 行，每行 m_sketch_width 个计数器
+    static long m_sketch_width;
+    static std::atomic<long> m_samples;
+    static long m_reset_at;
+
+    static std::atomic<uint64_t> m_epoch;
+    static std::atomic<reader_slot *> m_readers[MAX_READERS];
+    static thread_local slot_holder m_local;
+};
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include "proxy.h"
+
+// 进程内处理器的响应。响应体直接写在连接的写缓冲区中，首部由连接在发送前补上
+struct response {
+    int m_status;
+    const char *m_title;
+    const char *m_content_type;
+    char *m_body;               // 响应体在写缓冲区中的起始位置
+    int m_size;                 // 响应体可用的空间
+    int m_len;                  // 已经写入的字节数
+
+    void init(char *body, int size) {
+        m_status = 200;
+        m_title = "OK";
+        m_content_type = "text/plain";
+        m_body = body;
+        m_size = size;
+        m_len = 0;
+    }
+
+    void set_status(int status, const char *title) {
+        m_status = status;
+        m_title = title;
+    }
+
+    // 追加格式化的响应体，空间不足时返回 false，已经写入的内容保持不变
+    bool append(const char *format, ...) {
+        va_list arg_list;
+        va_start(arg_list, format);
+        int len = vsnprintf(m_body + m_len, m_size - m_len, format, arg_list);
+        va_end(arg_list);
+        if (len < 0 || len >= m_size - m_len) {
+            m_body[m_len] = '\0';
+            return false;
+        }
+        m_len += len;
+        return true;
+    }
+};
+
+// 路由处理器的类型：静态文件是其中一种，上传、反向代理和进程内处理器是另外几种
+enum HANDLER_TYPE {STATIC_HANDLER = 0, UPLOAD_HANDLER, PROXY_HANDLER, FUNC_HANDLER};
+
+struct route_match;
+typedef void (*route_fn)(const route_match &match, response *resp);
+
+// 路由的处理器，启动时创建，之后只读
+struct route_target {
+    HANDLER_TYPE type;
+    char dir[200];                  // STATIC_HANDLER 的根目录，UPLOAD_HANDLER 的存放目录
+    long max_body;                  // UPLOAD_HANDLER 允许的最大请求体，<= 0 表示使用默认上限
+    const proxy::route *upstreams;  // PROXY_HANDLER 的上游
+    route_fn fn;                    // FUNC_HANDLER 的处理函数
+};
+
+// 路径参数 :name 匹配到的值，指向 URL 内部，不以 \0 结尾
+struct route_param {
+    const char *name;
+    const char *value;
+    int len;
+};
+
+// 匹配结果，所有指针都指向路由表或 URL，匹配过程不分配内存
+struct route_match {
+    static const int MAX_PARAMS = 4;
+
+    const route_target *target;
+    const char *url;
+    int prefix_len;                 // 前缀路由匹配的长度，精确路由为整个路径的长度
+    int param_count;
+    route_param params[MAX_PARAMS];
+
+    // 按名字取路径参数，没有时返回 nullptr
+    const char *param(const char *name, int *len) const {
+        for (int i = 0; i < param_count; ++i) {
+            if (strcmp(params[i].name, name) == 0) {
+                *len = params[i].len;
+                return params[i].value;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// 路由表。启动时把精确路由、前缀路由和带参数的路由编译成一棵压缩前缀树（radix trie），
+// 请求到来时沿着 URL 走一遍树即可找到处理器：精确匹配优先，其次是最长的前缀匹配。
+// 路径中的 :name 匹配一个不含 / 的段，静态的边优先于参数
+class router {
+public:
+    static const int PATTERN_LEN = 200;
+
+    // 注册路由。exact 为 true 时只匹配整个路径（忽略查询串），否则匹配以 pattern 开头、且在路径段的边界上结束的路径
+    static bool add(const char *pattern, bool exact, const route_target &target);
+
+    // 下面这一组函数注册各种类型的路由
+    static bool add_static(const char *prefix, const char *dir);
+    static bool add_upload(const char *prefix, const char *dir, long max_body);
+    static bool add_proxy(const char *prefix, const char *upstreams);
+    static bool add_func(const char *pattern, bool exact, route_fn fn);
+
+    // 查找 URL 对应的处理器，找不到时返回 false
+    static bool match(const char *url, route_match *m);
+
+private:
+    struct node;
+    static node *insert_static(node *parent, const char *s, int len);
+    static bool walk(const node *n, const char *url, int pos, route_param *params, int param_count, route_match *m);
+
+    static node *m_root;
+};
+
+#endif
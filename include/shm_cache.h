@@ -0,0 +1,86 @@
+#ifndef SHM_CACHE_H
+#define SHM_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <atomic>
+
+// 共享内存中的完整响应缓存，供预派生模式（见 prefork.h）的所有工作进程共用，进程数增加时缓存的内存不变。
+// 缓存的内容与 resp_cache 相同：小的静态文件的状态行、首部和文件内容，命中时一次 send 发出。
+//
+// 共享内存在 fork 之前用 MAP_SHARED | MAP_ANONYMOUS 映射，之后派生的进程继承同一块内存。
+// 其中不能有指针和进程内的锁，因此结构与 resp_cache 不同：
+// - 内存分成固定大小的槽，每个槽放一个不超过 max_entry 的响应，键按槽数取模，只在之后的 PROBE 个槽中查找
+// - 不加锁：槽的状态字记录正在发送它的读者数和写者标志。读者在没有写者时增加读者数，再确认键没有变化；
+//   写者只能在没有读者时取得槽（替换时选最近最少命中的槽），写完之后才发布键。取不到槽时放弃插入
+// - 文件在缓存期间被修改时，每个槽每秒最多检查一次文件的状态，与 resp_cache 相同
+//
+// 每个槽的大小相同，比 max_entry 小得多的响应会浪费槽中剩余的空间，max_entry 应按要缓存的文件大小设置。
+// 工作进程在发送缓存中的响应时崩溃，它持有的读者数不会减少，这个槽之后不再被替换，只损失这一个槽
+class shm_cache {
+public:
+    static const int PROBE = 4;                 // 每个键查找的槽数
+    static const int MAX_PATH = 256;            // 路径的最大长度，更长的路径不缓存
+
+    // 共享内存中的一个槽，响应之后紧跟着路径
+    struct slot {
+        std::atomic<uint32_t> state;            // WRITING 位和读者数
+        std::atomic<uint64_t> key;              // 0 表示空槽
+        std::atomic<long> used;                 // 最近一次命中的时间（秒）
+        std::atomic<long> checked;              // 上一次检查文件状态的时间（秒）
+        long len;                               // 响应的字节数
+        dev_t dev;                              // 缓存时文件的状态，用于判断文件是否被修改
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        char data[];
+    };
+
+    // 解析 "budget_mb[:max_entry_kb]"：共享内存的大小和单个响应的大小上限（默认 64KB），并映射共享内存。
+    // 必须在派生工作进程之前调用
+    static bool parse(const char *spec);
+    static bool enabled() { return m_header != nullptr; }
+
+    // 查找响应，键由 resp_cache::key 生成。命中时返回持有引用的槽，发送完毕后必须调用 release
+    static slot *lookup(uint64_t key, const char *path);
+    static void release(slot *s);
+
+    static bool wants(long len) { return len <= m_header->max_entry; }
+    // 把状态行和首部 head 与文件内容 body 复制进一个槽，已经有同一个键或者取不到槽时放弃
+    static void insert(uint64_t key, const char *path, const struct stat &st,
+                       const char *head, long head_len, const char *body, long body_len);
+
+    // 统计在共享内存中，是所有工作进程的合计
+    struct stats {
+        long hits;
+        long misses;
+        long entries;
+        long bytes;
+        long evictions;
+        long slots;
+    };
+    static stats get_stats();
+
+private:
+    static const uint32_t WRITING = 1u << 31;
+
+    struct alignas(64) header {
+        long slots;
+        long stride;                            // 每个槽占用的字节数
+        long max_entry;
+        std::atomic<long> hits;
+        std::atomic<long> misses;
+        std::atomic<long> entries;
+        std::atomic<long> bytes;
+        std::atomic<long> evictions;
+    };
+
+    static slot *at(long i) { return (slot *)((char *)(m_header + 1) + i * m_header->stride); }
+    static bool claim(slot *s);                 // 没有读者和写者时取得槽
+    static void vacate(slot *s);                // 写者清空取得的槽
+    static bool fresh(slot *s, const char *path);
+
+    static header *m_header;
+};
+
+#endif
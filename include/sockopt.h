@@ -0,0 +1,49 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <stdlib.h>
+
+// 监听 socket 及其接受的连接的 TCP 参数。每一项都可以单独开启，便于逐项测试效果
+// 以逗号分隔的字符串配置，例如 "nodelay,cork,fastopen=256,sndbuf=262144"
+//   nodelay           TCP_NODELAY，关闭 Nagle 算法
+//   cork              发送响应时用 TCP_CORK 包住首部和文件，使它们合并成尽量少的报文段
+//   msgmore           首部用 MSG_MORE 发送，告诉内核后面紧跟着文件内容
+//   fastopen=N        监听 socket 开启 TCP_FASTOPEN，N 为队列长度
+//   sndbuf=N          SO_SNDBUF
+//   rcvbuf=N          SO_RCVBUF，设置在监听 socket 上，以便在握手时确定窗口扩大因子
+//   lowat=N           TCP_NOTSENT_LOWAT，限制内核中尚未发送的数据量
+//   usertimeout=N     TCP_USER_TIMEOUT（毫秒），已发送数据超过该时间未被确认则断开连接
+//   busypoll=N        连接的 SO_BUSY_POLL（微秒）和 SO_PREFER_BUSY_POLL，阻塞读时由内核轮询网卡队列，
+//                     超过 net.core.busy_read 需要 CAP_NET_ADMIN。-B 开启忙等模式时默认设置
+//   reuseport         监听 socket 的 SO_REUSEPORT，多个进程各自监听同一个地址，由内核分配连接。-W 预派生模式时默认设置
+struct sock_options {
+    bool nodelay;
+    bool cork;
+    bool msg_more;
+    bool reuseport;
+    int fastopen;           // 0 表示不开启
+    int sndbuf;             // 0 表示使用系统默认值，下同
+    int rcvbuf;
+    int notsent_lowat;
+    int user_timeout;
+    int busy_poll;
+
+    sock_options() { memset(this, 0, sizeof(*this)); }
+
+    bool parse(const char *spec);           // 解析配置字符串，格式错误返回 false
+    void apply_listener(int fd) const;      // 设置监听 socket，在 listen 之前调用
+    void apply_conn(int fd) const;          // 设置新接受的连接
+};
+
+// 开启或关闭 TCP_CORK。关闭时内核立即发出积攒的数据
+inline void set_cork(int fd, bool on) {
+    int val = on ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+}
+
+#endif
@@ -2,132 +2,415 @@
 #define THREADPOOL_H
 
 #include <exception>
-#include <list>
+#include <deque>
+#include <atomic>
 #include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 #include "locker.h"
 #include <iostream>
 
 
 // 线程池类，定义成模板是为了代码的复用，T 代表任务
+//
+// 线程数量是弹性的：初始为 CPU 核数，当任务在队列中的等待时间超过目标值时增加线程，
+// 线程空闲超过冷却时间后退出，线程数始终在 [min_threads, max_threads] 之间
+//
+// 任务按预估的开销分为 CLASSES 类，每类一个队列，各自加锁。工作线程优先取预估开销小的任务（最短预期作业优先），
+// 每类有一个权重：类 c 的队首任务的得分为 权重[c] * 老化单位 - 已等待的时间，取得分最小的一类。
+// 等待越久得分越低，开销大的任务等待超过 (权重[c] - 权重[0]) 个老化单位后会排在新到的小任务之前，不会饿死
 template<typename T>
 class threadpool
 {
+public:
+    static const int CLASSES = 4;
+
+
+    // 监控数据
+    struct stats {
+        int threads;                // 当前的线程数
+        int idle_threads;           // 空闲（正在等待任务）的线程数
+        int queued;                 // 队列中的任务数
+        long avg_wait_us;           // 任务在队列中的平均等待时间（指数加权平均），微秒
+        long max_wait_us;           // 最近一次统计以来的最长等待时间，微秒
+        int class_queued[CLASSES];          // 每类队列中的任务数
+        long class_wait_us[CLASSES];        // 每类任务的平均等待时间（指数加权平均），微秒
+        long spin_hits;             // 忙等期间等到了任务的次数
+        long parks;                 // 忙等超时、进入内核等待的次数
+    };
+
 private:
-    // 线程的数量
+    // 线程槽。退出的线程由后续创建线程或析构函数 join，因此所有线程都是可 join 的
+    enum SLOT_STATE {SLOT_EMPTY = 0, SLOT_RUNNING, SLOT_EXITED};
+    struct slot {
+        pthread_t tid;
+        SLOT_STATE state;
+        threadpool *pool;
+    };
+
+    // 队列中的任务，记录入队时间以统计等待时间
+    struct item {
+        T *request;
+        long enqueue_ns;
+    };
+
+    // 线程数的上下限
+    int m_min_threads;
+    int m_max_threads;
+
+    // 当前线程数，受 m_queuelocker 保护
     int m_thread_number;
 
-    // 线程池中的线程 id 数组，大小为 m_thread_number
-    pthread_t *m_threads;
+    // 空闲（正在等待任务）的线程数
+    std::atomic<int> m_idle_number;
+
+    // 线程槽数组，大小为 m_max_threads
+    slot *m_threads;
 
     // 任务队列中请求的最大数量
     int m_max_requests;
 
-    // 任务队列，存放任务
-    std::list<T*> m_workqueue;
+    // 每类任务一个队列，各自加锁。m_head_ns 是队首任务的入队时间，0 表示队列为空，
+    // 工作线程不加锁地比较各个队首，选中一类之后再对这一类加锁
+    struct queue {
+        std::deque<item> items;
+        locker lock;
+        std::atomic<long> head_ns;
+        std::atomic<long> avg_wait_ns;
+    };
+    queue m_queues[CLASSES];
+
+    // 所有队列中的任务总数
+    std::atomic<int> m_queued;
 
-    // 互斥锁，使得多个线程能够互斥地对任务队列进行访问
+    // 各类的权重和老化单位
+    long m_weights[CLASSES];
+    long m_age_ns;
+
+    // 互斥锁，保护线程数和线程槽
     locker m_queuelocker;
 
-    // 信号量，同步线程对任务队列的访问（比如，什么时候可以访问队列，什么时候该等待）
+    // 信号量，值为队列中的任务数，没有任务时工作线程在这里等待
     sem m_queuesem;
 
+    // 队列等待时间的目标值，超过该值时增加线程
+    long m_target_wait_ns;
+
+    // 线程空闲多久后退出
+    int m_idle_timeout;
+
+    // 队列等待时间的统计
+    std::atomic<long> m_avg_wait_ns;
+    std::atomic<long> m_max_wait_ns;
+
+    // 忙等：空闲的线程先自旋 m_spin_ns 纳秒再在信号量上睡眠，同时自旋的线程不超过 m_spin_limit 个。0 表示不忙等
+    long m_spin_ns;
+    int m_spin_limit;
+    std::atomic<int> m_spinners;
+    std::atomic<long> m_spin_hits;
+    std::atomic<long> m_parks;
+
     // 是否结束线程
-    bool m_stop;
+    std::atomic<bool> m_stop;
 
 private:
     // 线程的主函数
     static void *worker(void *arg);     // 之所以要定义为 static，是因为 c++ 的要求
-    void run();                         // 线程工作的逻辑单元
+    void run(slot *self);               // 线程工作的逻辑单元
+    bool spawn();                       // 创建一个线程，调用者需持有 m_queuelocker
+    bool take(item *task, int *cls);    // 按得分取出一个任务，所有队列为空时返回 false
+    bool spin_wait();                   // 忙等信号量，等到时返回 true
+    void record_wait(long wait_ns, int cls);    // 记录一个任务的等待时间
+
+    static long now_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+    }
 
 public:
-    threadpool(int thread_number=8, int max_requests=10000);
-    
+    // min_threads/max_threads 为 0 时分别取 CPU 核数和 4 倍的 CPU 核数
+    threadpool(int min_threads=0, int max_threads=0, int max_requests=10000,
+               long target_wait_us=1000, int idle_timeout=30);
+
     ~threadpool();
 
-    // 添加任务到任务队列中
-    bool append(T *request);
+    // 添加任务到任务队列中，cls 为预估开销的类别，0 最小
+    bool append(T *request, int cls = 0);
+
+    // 设置各类的权重和老化单位（微秒）
+    void set_schedule(const long *weights, long age_us);
+
+    // 空闲的线程先忙等 spin_us 微秒再睡眠，任务在这期间到达时不需要内核唤醒线程。
+    // 自旋的线程最多为 CPU 核数减 1 个，给主线程留出一个核，单核时不自旋
+    void set_spin(long spin_us);
+
+    // 获取监控数据，同时重置最长等待时间
+    stats get_stats();
 };
 
 // 构造函数
 template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests):
-    m_thread_number(thread_number), m_max_requests(max_requests), m_stop(false), m_threads(nullptr) {
+threadpool<T>::threadpool(int min_threads, int max_threads, int max_requests, long target_wait_us, int idle_timeout):
+    m_min_threads(min_threads), m_max_threads(max_threads), m_thread_number(0), m_idle_number(0), m_threads(nullptr),
+    m_max_requests(max_requests), m_queued(0), m_age_ns(1000000), m_target_wait_ns(target_wait_us * 1000),
+    m_idle_timeout(idle_timeout), m_avg_wait_ns(0), m_max_wait_ns(0),
+    m_spin_ns(0), m_spin_limit(1), m_spinners(0), m_spin_hits(0), m_parks(0), m_stop(false) {
 
-        if (thread_number <=0 || max_requests <=0) 
-            throw std::exception();
-        
-        // 申请创建线程 id 数组
-        m_threads = new pthread_t[m_thread_number];
-        if(!m_threads){
+        for (int c = 0; c < CLASSES; ++c) {
+            m_queues[c].head_ns = 0;
+            m_queues[c].avg_wait_ns = 0;
+            m_weights[c] = 1L << (2 * c);       // 1, 4, 16, 64
+        }
+
+        int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus <= 0)
+            cpus = 1;
+        if (m_min_threads <= 0)
+            m_min_threads = cpus;
+        if (m_max_threads <= 0)
+            m_max_threads = cpus * 4;
+        if (m_max_threads < m_min_threads)
+            m_max_threads = m_min_threads;
+
+        if (max_requests <= 0 || idle_timeout <= 0)
             throw std::exception();
+
+        // 申请线程槽数组
+        m_threads = new slot[m_max_threads];
+        for (int i = 0; i < m_max_threads; ++i) {
+            m_threads[i].state = SLOT_EMPTY;
+            m_threads[i].pool = this;
         }
-        
-        // 创建 thread_number 个线程，并设置为脱离状态
-        for (int i=0; i<thread_number; ++i) {
-            std::cout << "create the " << i << "th thread" << std::endl;
-            if (pthread_create(m_threads+i, nullptr, worker, this) != 0) {
-                delete []m_threads;
-                throw std::exception();
-            }
 
-            if (pthread_detach(m_threads[i])) {
+        // 初始时创建 min_threads 个线程
+        m_queuelocker.lock();
+        for (int i = 0; i < m_min_threads; ++i) {
+            if (!spawn()) {
+                m_queuelocker.unlock();
                 delete []m_threads;
                 throw std::exception();
             }
         }
+        m_queuelocker.unlock();
 }
 
 
+// 通知所有线程退出，并等待它们结束
 template<typename T>
 threadpool<T>::~threadpool(){
-    delete []m_threads;
     m_stop = true;
+    for (int i = 0; i < m_max_threads; ++i)
+        m_queuesem.post();
+
+    for (int i = 0; i < m_max_threads; ++i) {
+        if (m_threads[i].state != SLOT_EMPTY)
+            pthread_join(m_threads[i].tid, nullptr);
+    }
+    delete []m_threads;
 }
 
+// 创建一个线程。先回收已经退出的线程，再占用一个空槽
 template<typename T>
-bool threadpool<T>::append(T *request) {
-    // 需要对队列上锁，因为该队列被所有线程共享
-    m_queuelocker.lock();
-    if (m_workqueue.size() >= m_max_requests) {     // 如果请求队列已满
-        m_queuelocker.unlock();
+bool threadpool<T>::spawn() {
+    if (m_thread_number >= m_max_threads)
         return false;
+
+    for (int i = 0; i < m_max_threads; ++i) {
+        if (m_threads[i].state == SLOT_EXITED) {
+            pthread_join(m_threads[i].tid, nullptr);
+            m_threads[i].state = SLOT_EMPTY;
+        }
     }
 
-    m_workqueue.push_back(request);             // 添加请求到请求队列中
-    m_queuelocker.unlock();
+    for (int i = 0; i < m_max_threads; ++i) {
+        if (m_threads[i].state != SLOT_EMPTY)
+            continue;
+
+        if (pthread_create(&m_threads[i].tid, nullptr, worker, m_threads + i) != 0)
+            return false;
+        m_threads[i].state = SLOT_RUNNING;
+        ++m_thread_number;
+        ++m_idle_number;
+        return true;
+    }
+    return false;
+}
+
+template<typename T>
+void threadpool<T>::set_schedule(const long *weights, long age_us) {
+    for (int c = 0; c < CLASSES; ++c)
+        m_weights[c] = weights[c];
+    m_age_ns = age_us * 1000;
+}
+
+template<typename T>
+void threadpool<T>::set_spin(long spin_us) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    m_spin_limit = cpus > 1 ? cpus - 1 : 0;
+    m_spin_ns = m_spin_limit > 0 ? spin_us * 1000 : 0;
+}
+
+template<typename T>
+bool threadpool<T>::spin_wait() {
+    if (m_spin_ns == 0)
+        return false;
+    if (m_spinners.fetch_add(1, std::memory_order_relaxed) >= m_spin_limit) {
+        m_spinners.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    bool got = false;
+    long end = now_ns() + m_spin_ns;
+    do {
+        if (m_queuesem.trywait()) {
+            got = true;
+            break;
+        }
+        cpu_relax();
+    } while (!m_stop && now_ns() < end);
+    m_spinners.fetch_sub(1, std::memory_order_relaxed);
+    (got ? m_spin_hits : m_parks).fetch_add(1, std::memory_order_relaxed);
+    return got;
+}
+
+template<typename T>
+bool threadpool<T>::append(T *request, int cls) {
+    if (cls < 0 || cls >= CLASSES)
+        cls = CLASSES - 1;
+    if (m_queued.fetch_add(1, std::memory_order_relaxed) >= m_max_requests) {      // 如果请求队列已满
+        m_queued.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // 只对这一类的队列上锁
+    queue &q = m_queues[cls];
+    long now = now_ns();
+    q.lock.lock();
+    q.items.push_back(item{request, now});      // 添加请求到请求队列中
+    if (q.items.size() == 1)
+        q.head_ns.store(now, std::memory_order_release);
+    q.lock.unlock();
+
+    // 没有空闲线程，并且任务的排队时间已经超过目标值，说明线程不够用了
+    if (m_idle_number == 0 && m_avg_wait_ns.load(std::memory_order_relaxed) > m_target_wait_ns) {
+        m_queuelocker.lock();
+        spawn();
+        m_queuelocker.unlock();
+    }
     m_queuesem.post();                         // 信号量增 1
     return true;
 }
 
+// 比较各类队首任务的得分，取得分最小的一类的队首。选中之后其他线程可能先取走了这个任务，这时重新选择
+template<typename T>
+bool threadpool<T>::take(item *task, int *cls) {
+    while (true) {
+        long now = now_ns();
+        int best = -1;
+        long best_score = 0;
+        for (int c = 0; c < CLASSES; ++c) {
+            long head = m_queues[c].head_ns.load(std::memory_order_acquire);
+            if (head == 0)
+                continue;
+            long score = m_weights[c] * m_age_ns - (now - head);
+            if (best == -1 || score < best_score) {
+                best = c;
+                best_score = score;
+            }
+        }
+        if (best == -1)
+            return false;
+
+        queue &q = m_queues[best];
+        q.lock.lock();
+        if (q.items.empty()) {
+            q.lock.unlock();
+            continue;
+        }
+        *task = q.items.front();
+        q.items.pop_front();
+        q.head_ns.store(q.items.empty() ? 0 : q.items.front().enqueue_ns, std::memory_order_release);
+        q.lock.unlock();
+        m_queued.fetch_sub(1, std::memory_order_relaxed);
+        *cls = best;
+        return true;
+    }
+}
+
 template<typename T>
 void *threadpool<T>::worker(void *arg) {
-    threadpool *pool = (threadpool *)arg;
-    pool->run();
-    return pool;
+    slot *self = (slot *)arg;
+    self->pool->run(self);
+    return self->pool;
+}
+
+// 指数加权平均，新样本的权重为 1/8
+template<typename T>
+void threadpool<T>::record_wait(long wait_ns, int cls) {
+    long avg = m_avg_wait_ns.load(std::memory_order_relaxed);
+    m_avg_wait_ns.store(avg + (wait_ns - avg) / 8, std::memory_order_relaxed);
+    avg = m_queues[cls].avg_wait_ns.load(std::memory_order_relaxed);
+    m_queues[cls].avg_wait_ns.store(avg + (wait_ns - avg) / 8, std::memory_order_relaxed);
+
+    long max = m_max_wait_ns.load(std::memory_order_relaxed);
+    while (wait_ns > max && !m_max_wait_ns.compare_exchange_weak(max, wait_ns, std::memory_order_relaxed))
+        ;
 }
 
 template<typename T>
-void threadpool<T>::run() {
+void threadpool<T>::run(slot *self) {
     while (!m_stop) {
-        m_queuesem.wait();             // 等待信号量，也即等待请求队列中存在请求
-        m_queuelocker.lock();           // 如果请求到来，则获取请求队列的一个请求
-        
-        if(m_workqueue.empty()) {
+        // 等待信号量，也即等待请求队列中存在请求。空闲超过冷却时间且线程数多于下限时，线程退出
+        if (!spin_wait() && !m_queuesem.timedwait(m_idle_timeout)) {
+            m_queuelocker.lock();
+            if (m_thread_number > m_min_threads && m_queued.load() == 0) {
+                --m_thread_number;
+                --m_idle_number;
+                self->state = SLOT_EXITED;
+                m_queuelocker.unlock();
+                return;
+            }
             m_queuelocker.unlock();
             continue;
         }
 
-        T *request = m_workqueue.front();       // 从请求队列中取出一个请求
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
-
-        if (!request)
+        // 如果请求到来，则获取请求队列的一个请求
+        item task;
+        int cls;
+        if (!take(&task, &cls))
             continue;
-        
-        request->process();           // 调用请求中的处理函数，处理请求
+        --m_idle_number;
+
+        record_wait(now_ns() - task.enqueue_ns, cls);
+        if (task.request)
+            task.request->process();            // 调用请求中的处理函数，处理请求
+
+        ++m_idle_number;
+    }
+}
+
+template<typename T>
+typename threadpool<T>::stats threadpool<T>::get_stats() {
+    stats st;
+    m_queuelocker.lock();
+    st.threads = m_thread_number;
+    st.idle_threads = m_idle_number;
+    m_queuelocker.unlock();
+    st.queued = m_queued.load(std::memory_order_relaxed);
+    for (int c = 0; c < CLASSES; ++c) {
+        m_queues[c].lock.lock();
+        st.class_queued[c] = m_queues[c].items.size();
+        m_queues[c].lock.unlock();
+        st.class_wait_us[c] = m_queues[c].avg_wait_ns.load(std::memory_order_relaxed) / 1000;
     }
+    st.avg_wait_us = m_avg_wait_ns.load(std::memory_order_relaxed) / 1000;
+    st.max_wait_us = m_max_wait_ns.exchange(0, std::memory_order_relaxed) / 1000;
+    st.spin_hits = m_spin_hits.load(std::memory_order_relaxed);
+    st.parks = m_parks.load(std::memory_order_relaxed);
+    return st;
 }
 
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,82 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// 时间轮：每个槽 1 秒，结点按到期时间放入 expire % SLOTS 号槽，插入和删除都是 O(1)。
+// 到期时间超过一圈的结点也放在同一个槽中，时间轮转到这个槽时发现还没有到期，留给下一圈。
+// 结点嵌在被定时的对象中，不分配内存。时间轮不加锁，只由一个线程使用
+struct wheel_node {
+    wheel_node *prev;
+    wheel_node *next;
+    long expire;                // 到期时间（秒）
+    void *data;                 // 被定时的对象
+
+    wheel_node() : prev(nullptr), next(nullptr), expire(0), data(nullptr) {}
+    bool linked() const { return prev != nullptr; }
+};
+
+class timer_wheel {
+public:
+    static const int SLOTS = 512;
+
+    timer_wheel() : m_current(-1) {
+        for (int i = 0; i < SLOTS; ++i)
+            m_slots[i].prev = m_slots[i].next = &m_slots[i];
+    }
+
+    long current() const { return m_current; }
+
+    // 加入时间轮。已经转过的时间不会再被处理，这样的结点放到下一秒
+    void add(wheel_node *node, long expire) {
+        if (m_current >= 0 && expire <= m_current)
+            expire = m_current + 1;
+        node->expire = expire;
+        wheel_node *head = &m_slots[expire % SLOTS];
+        node->prev = head->prev;
+        node->next = head;
+        head->prev->next = node;
+        head->prev = node;
+    }
+
+    void remove(wheel_node *node) {
+        if (!node->linked())
+            return;
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+    }
+
+    // 把时间推进到 now，依次处理经过的每个槽：到期的结点从时间轮中取下，交给 on_expire(node)，
+    // on_expire 可以把结点重新加入时间轮
+    template<typename F>
+    void advance(long now, F on_expire) {
+        if (m_current < 0)
+            m_current = now;
+        while (m_current < now) {
+            ++m_current;
+
+            // 先把整个槽摘下来，处理过程中重新加入的结点不会在这一轮被再次访问
+            wheel_node *head = &m_slots[m_current % SLOTS];
+            if (head->next == head)
+                continue;
+            wheel_node *node = head->next;
+            head->prev->next = nullptr;
+            head->prev = head->next = head;
+
+            while (node) {
+                wheel_node *next = node->next;
+                node->prev = node->next = nullptr;
+                if (node->expire > m_current)
+                    add(node, node->expire);
+                else
+                    on_expire(node);
+                node = next;
+            }
+        }
+    }
+
+private:
+    wheel_node m_slots[SLOTS];      // 每个槽是带哨兵的双向循环链表
+    long m_current;                 // 已经处理到的时间，-1 表示还没有开始
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <atomic>
+#include <openssl/ssl.h>
+
+// 一个连接上的 TLS 会话。握手由 OpenSSL 在非阻塞 socket 上完成，握手之后尝试把会话交给内核（kTLS），
+// 此后记录的加密由内核完成，连接可以继续使用 writev/sendfile，文件内容不经过用户空间。
+// 内核不支持 kTLS 时退回到用户空间的 SSL_read/SSL_write
+//
+// 下面的 IO 函数的返回值与系统调用相同：-1 表示出错，errno 为 EAGAIN 时表示需要等待 socket 就绪
+class tls_conn {
+public:
+    static const int RECORD_SIZE = 16384;       // 用户空间 TLS 发送文件时每次读取的字节数，等于一个记录的最大长度
+
+    tls_conn() : m_ssl(nullptr), m_handshaking(false), m_ktls_send(false), m_ktls_recv(false), m_want(0) {}
+    ~tls_conn() {}
+
+    // 加载证书和私钥，创建所有连接共用的 SSL_CTX
+    static bool init_context(const char *cert, const char *key);
+    static bool enabled() { return m_ctx != nullptr; }
+
+    bool start(int fd);                         // 新连接开始握手
+    int handshake();                            // 推进握手：1 完成，0 需要等待 want_events() 中的事件，-1 失败
+    void close();                               // 发送 close_notify 并释放会话
+
+    bool active() const { return m_ssl != nullptr; }
+    bool handshaking() const { return m_handshaking; }
+    bool ktls_send() const { return m_ktls_send; }
+    bool ktls_recv() const { return m_ktls_recv; }
+    bool user_space_send() const { return m_ssl && !m_ktls_send; }     // 发送是否必须经过 SSL_write
+    uint32_t want_events() const { return m_want; }
+    bool pending() const { return m_ssl && SSL_pending(m_ssl) > 0; }  // OpenSSL 中是否还有已经解密但没有读走的数据
+    bool alpn_h2() const;                       // 握手时 ALPN 是否选择了 h2
+
+    ssize_t read(void *buf, size_t len);                       // 同 recv
+    ssize_t write(const struct iovec *iv, int count);          // 同 writev，用户空间加密，小块数据合并成一个记录
+    ssize_t send_file(int fd, int file, off_t *offset, size_t len);    // 同 sendfile，kTLS 时直接调用 sendfile
+
+public:
+    static bool m_alpn_h2;                      // ALPN 是否提供 h2。HTTP/2 连接不能访问代理路由，配置了代理路由时不提供
+
+    // 监控数据
+    static std::atomic<long> m_handshakes;      // 完成的握手次数
+    static std::atomic<long> m_resumed;         // 其中恢复会话的次数
+    static std::atomic<long> m_ktls;            // 其中发送方向启用了 kTLS 的次数
+
+private:
+    ssize_t result(int ret);                    // 把 SSL_read/SSL_write 的结果转换成系统调用的形式
+
+private:
+    SSL *m_ssl;
+    bool m_handshaking;
+    bool m_ktls_send;           // 发送方向由内核加密
+    bool m_ktls_recv;           // 接收方向由内核解密
+    uint32_t m_want;            // 握手等待的 epoll 事件
+
+    static SSL_CTX *m_ctx;
+};
+
+#endif
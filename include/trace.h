@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <atomic>
+
+// 请求生命周期的采样跟踪。每 N 个请求跟踪一个，被采样的请求在各个阶段记录一个时间点：
+// accept、每次读到数据、放入线程池队列、被工作线程取出、解析完毕、打开文件、每次可写事件、
+// 发出第一个字节和最后一个字节。
+//
+// 时间点写入当前线程的环形缓冲区，只有本线程写，不加锁，写满后覆盖最旧的记录。
+// 收到 SIGUSR1 时主线程启动一个导出线程，把所有缓冲区导出为 Chrome trace JSON（chrome://tracing 或 Perfetto 可以打开）：
+// 每个线程一条轨道显示时间点，每个请求一条轨道显示相邻时间点之间的各个阶段。复制、排序和写文件都在导出线程中进行，
+// 主线程不等待。
+// 没有开启采样时，请求的跟踪号为 0，每个时间点只有一次判断
+class tracer {
+public:
+    static const int RING_SIZE = 1 << 14;       // 每个线程保留的时间点个数，必须是 2 的幂
+    static const int MAX_RINGS = 256;           // 环形缓冲区的个数上限，退出的线程的缓冲区由新线程复用
+
+    // 请求的各个时间点
+    enum POINT {ACCEPT = 0, READ, ENQUEUE, DEQUEUE, PARSED, FILE_OPEN, WRITE, FIRST_BYTE, LAST_BYTE, POINT_COUNT};
+
+    // 解析 "every[:file]"：每 every 个请求跟踪一个，导出到 file
+    static bool parse(const char *spec);
+    static bool enabled() { return m_every > 0; }
+
+    static uint32_t begin();                    // 一个新请求开始，返回跟踪号，0 表示不跟踪
+    static void record(uint32_t id, POINT point);       // 记录被跟踪的请求的一个时间点
+    static bool dump();                         // 启动导出线程，上一次导出还没有结束时返回 false
+    static void stop();                         // 等待正在进行的导出结束
+    static const char *path() { return m_path; }
+
+private:
+    struct event {
+        uint64_t ts;                // CLOCK_MONOTONIC，纳秒
+        uint32_t id;
+        uint16_t point;
+        pid_t tid;
+    };
+
+    struct ring {
+        std::atomic<uint64_t> head;     // 写入的总个数，下一个位置为 head % RING_SIZE
+        std::atomic<bool> in_use;       // 是否属于一个正在运行的线程
+        pid_t tid;
+        event events[RING_SIZE];
+    };
+
+    // 线程退出时把缓冲区交还，记录保留到被新线程复用为止
+    struct ring_holder {
+        ring *r = nullptr;
+        ~ring_holder() { if (r) r->in_use.store(false, std::memory_order_release); }
+    };
+
+    static ring *local_ring();
+    static void *dump_thread(void *arg);
+    static bool write_file();                   // 导出所有线程记录的时间点
+
+    static int m_every;
+    static const char *m_path;
+    static std::atomic<uint32_t> m_counter;
+    static std::atomic<ring *> m_rings[MAX_RINGS];
+    static thread_local ring_holder m_local;
+
+    // 导出线程。m_dump_started 和 m_dump_tid 只由主线程访问
+    static std::atomic<bool> m_dumping;
+    static bool m_dump_started;
+    static pthread_t m_dump_tid;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+#include "locker.h"
+
+// 平滑升级：新旧进程通过一个 Unix 域 socket 交接监听 socket
+//
+// 1. 旧进程在升级 socket 上监听
+// 2. 新进程启动时连接升级 socket，旧进程用 SCM_RIGHTS 把监听 socket 发给新进程，同时附带热点文件清单
+// 3. 旧进程停止 accept，关闭空闲的长连接，正在处理的请求回复 Connection: close 后关闭，超过期限则直接退出
+// 4. 新进程在后台预读热点文件，并接替旧进程在升级 socket 上监听，等待下一次升级
+//
+// 监听 socket 在交接过程中始终处于打开状态，因此升级期间不会有连接被拒绝
+class upgrader {
+public:
+    static const int MAX_FDS = 16;              // 一次交接的监听 socket 的最大数量
+    static const int HOT_FILES = 256;           // 热点文件清单的大小
+    static const int PATH_LEN = 200;
+
+    upgrader() : m_listenfd(-1) { m_path[0] = m_exe[0] = '\0'; }
+    ~upgrader();
+
+    bool init(const char *path);                // 设置升级 socket 的路径
+    bool enabled() const { return m_path[0] != '\0'; }
+
+    // 新进程调用：从旧进程继承监听 socket，返回继承的个数，0 表示没有正在运行的旧进程，-1 表示出错
+    int inherit(int *fds, int max_fds);
+
+    // 在升级 socket 上监听，返回其文件描述符
+    int listen_upgrade();
+
+    // 旧进程调用：接受新进程的连接，把监听 socket 和热点文件清单交给它
+    bool handoff(const int *fds, int nfds);
+
+    // 启动新版本的程序（与当前进程相同路径的可执行文件和参数），新进程会通过升级 socket 接管监听 socket
+    bool spawn(char *argv[]);
+
+    // 记录一个被访问的文件，用于生成热点文件清单
+    static void record_file(const char *path);
+
+private:
+    int build_manifest(char *buf, int len);     // 生成热点文件清单，每行一个路径
+    static void *warm(void *arg);               // 预读清单中的文件，使其进入页缓存
+
+private:
+    char m_path[PATH_LEN];                      // 升级 socket 的路径
+    char m_exe[PATH_LEN];                       // 可执行文件的路径，部署时新版本会被放到这个路径上
+    int m_listenfd;                             // 升级 socket
+
+    static char m_hot_files[HOT_FILES][PATH_LEN];   // 热点文件，以路径的哈希值为下标
+    static locker m_hot_lock;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "body_handler.h"
+#include <stdlib.h>
+#include <sys/stat.h>
+
+// 创建临时文件 dir/.name.XXXXXX
+bool file_sink::open(const char *dir, const char *name) {
+    on_abort();
+
+    if (snprintf(m_path, PATH_LEN, "%s/%s", dir, name) >= PATH_LEN)
+        return false;
+    if (snprintf(m_tmp_path, PATH_LEN, "%s/.%s.XXXXXX", dir, name) >= PATH_LEN)
+        return false;
+
+    m_fd = mkstemp(m_tmp_path);
+    if (m_fd == -1) {
+        m_tmp_path[0] = '\0';
+        return false;
+    }
+    fchmod(m_fd, 0644);
+    return true;
+}
+
+// 把一块数据完整地写入文件
+bool file_sink::on_data(const char *data, long len) {
+    while (len > 0) {
+        ssize_t n = ::write(m_fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 接收完毕，把临时文件重命名为目标文件
+bool file_sink::on_complete() {
+    if (m_fd == -1)
+        return false;
+
+    close(m_fd);
+    m_fd = -1;
+    if (rename(m_tmp_path, m_path) == -1) {
+        unlink(m_tmp_path);
+        m_tmp_path[0] = '\0';
+        return false;
+    }
+    m_tmp_path[0] = '\0';
+    return true;
+}
+
+// 接收中断，删除临时文件
+void file_sink::on_abort() {
+    if (m_fd != -1) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    if (m_tmp_path[0] != '\0') {
+        unlink(m_tmp_path);
+        m_tmp_path[0] = '\0';
+    }
+}
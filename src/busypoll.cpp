@@ -0,0 +1,83 @@
+#include "busypoll.h"
+#include <sys/ioctl.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+// 旧的内核头文件中没有 epoll 的忙等参数，按 Linux 6.9 的定义补上
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPOLL_IOC_TYPE 0x8A
+#define EPIOCSPARAMS _IOW(EPOLL_IOC_TYPE, 0x01, struct epoll_params)
+#endif
+
+std::atomic<long> busy_poll::m_spins(0);
+std::atomic<long> busy_poll::m_hits(0);
+std::atomic<long> busy_poll::m_blocks(0);
+long busy_poll::m_poll_us = 0;
+long busy_poll::m_worker_us = 0;
+bool busy_poll::m_hot = false;
+
+bool busy_poll::parse(const char *spec) {
+    char *end;
+    m_poll_us = strtol(spec, &end, 10);
+    if (end == spec || m_poll_us <= 0)
+        return false;
+    m_worker_us = m_poll_us;
+    if (*end == ':') {
+        const char *p = end + 1;
+        m_worker_us = strtol(p, &end, 10);
+        if (end == p || m_worker_us < 0)
+            return false;
+    }
+    return *end == '\0';
+}
+
+bool busy_poll::setup(int epfd) {
+    epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = m_poll_us;
+    params.busy_poll_budget = 8;            // 内核默认的每次轮询的包数，超过 64 需要 CAP_NET_ADMIN
+    params.prefer_busy_poll = 1;
+    if (ioctl(epfd, EPIOCSPARAMS, &params) == -1) {
+        std::cout << "epoll busy poll not supported (" << strerror(errno) << "), spinning in user space only" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+long busy_poll::now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int busy_poll::wait(int epfd, epoll_event *events, int max, int timeout) {
+    if (m_hot && timeout != 0) {
+        m_spins.fetch_add(1, std::memory_order_relaxed);
+        long end = now_ns() + m_poll_us * 1000;
+        do {
+            int num = epoll_wait(epfd, events, max, 0);
+            if (num != 0) {
+                if (num > 0)
+                    m_hits.fetch_add(1, std::memory_order_relaxed);
+                return num;
+            }
+            sched_yield();
+        } while (now_ns() < end);
+        m_blocks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    int num = epoll_wait(epfd, events, max, timeout);
+    m_hot = num > 0;
+    return num;
+}
@@ -0,0 +1,217 @@
+#include "capture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <iostream>
+
+bool capture::m_enabled = false;
+const char *capture::m_path = nullptr;
+long capture::m_max_bytes = 1024L << 20;
+FILE *capture::m_file = nullptr;
+long capture::m_written = 0;
+uint64_t capture::m_start_ns = 0;
+std::atomic<bool> capture::m_running(false);
+pthread_t capture::m_thread;
+std::atomic<uint32_t> capture::m_counter(0);
+std::atomic<long> capture::m_records(0);
+std::atomic<long> capture::m_dropped(0);
+std::atomic<capture::ring *> capture::m_rings[MAX_RINGS];
+thread_local capture::ring_holder capture::m_local;
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool capture::parse(const char *spec) {
+    static char path[256];
+    if (strlen(spec) >= sizeof(path))
+        return false;
+    strcpy(path, spec);
+    char *colon = strchr(path, ':');
+    if (colon) {
+        *colon = '\0';
+        long mb = atol(colon + 1);
+        if (mb <= 0)
+            return false;
+        m_max_bytes = mb << 20;
+    }
+    if (path[0] == '\0')
+        return false;
+    m_path = path;
+    m_enabled = true;
+    return true;
+}
+
+bool capture::start() {
+    m_file = fopen(m_path, "wb");
+    if (!m_file) {
+        std::cout << "capture: cannot open " << m_path << std::endl;
+        m_enabled = false;
+        return false;
+    }
+    fwrite(CAPTURE_MAGIC, 1, 8, m_file);
+    m_written = 8;
+    m_start_ns = now_ns();
+    m_running = true;
+    if (pthread_create(&m_thread, nullptr, flusher, nullptr) != 0) {
+        fclose(m_file);
+        m_file = nullptr;
+        m_running = false;
+        m_enabled = false;
+        return false;
+    }
+    return true;
+}
+
+void capture::stop() {
+    if (!m_file)
+        return;
+    m_running = false;
+    pthread_join(m_thread, nullptr);
+    drain();
+    fclose(m_file);
+    m_file = nullptr;
+}
+
+// 取得当前线程的缓冲区：优先复用已经退出的线程留下的缓冲区，否则占用一个空位
+capture::ring *capture::local_ring() {
+    if (m_local.r)
+        return m_local.r;
+
+    for (int i = 0; i < MAX_RINGS; ++i) {
+        ring *r = m_rings[i].load(std::memory_order_acquire);
+        if (r) {
+            bool free = false;
+            if (r->in_use.compare_exchange_strong(free, true, std::memory_order_acq_rel)) {
+                m_local.r = r;
+                return r;
+            }
+            continue;
+        }
+
+        ring *created = new ring;
+        created->head.store(0, std::memory_order_relaxed);
+        created->tail.store(0, std::memory_order_relaxed);
+        created->in_use.store(true, std::memory_order_relaxed);
+        if (m_rings[i].compare_exchange_strong(r, created, std::memory_order_acq_rel)) {
+            m_local.r = created;
+            return created;
+        }
+        delete created;             // 这个空位被别的线程抢先占用了
+        --i;
+    }
+    return nullptr;
+}
+
+// 写入一条完整的记录后才移动 head，后台线程不会读到写了一半的记录。
+// 除 LOST 之外的记录都要在缓冲区中留出 reserve 字节，保证 LOST 记录总能写入
+bool capture::put(uint32_t conn, TYPE type, const char *buf, size_t len, size_t reserve) {
+    if (!m_running.load(std::memory_order_relaxed))
+        return true;
+    ring *r = local_ring();
+    if (!r) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    capture_record rec;
+    rec.ts_ns = now_ns() - m_start_ns;
+    rec.conn = conn;
+    rec.type = type;
+    rec.len = len;
+
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    uint64_t tail = r->tail.load(std::memory_order_acquire);
+    if (RING_SIZE - (head - tail) < sizeof(rec) + len + reserve) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    const char *parts[2] = {(const char *)&rec, buf};
+    size_t lens[2] = {sizeof(rec), len};
+    uint64_t pos = head;
+    for (int i = 0; i < 2 && lens[i] > 0; ++i) {
+        size_t off = pos % RING_SIZE;
+        size_t first = lens[i] < RING_SIZE - off ? lens[i] : RING_SIZE - off;
+        memcpy(r->buf + off, parts[i], first);
+        memcpy(r->buf, parts[i] + first, lens[i] - first);
+        pos += lens[i];
+    }
+    r->head.store(pos, std::memory_order_release);
+    m_records.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void capture::lost(uint32_t &conn) {
+    put(conn, LOST, nullptr, 0, 0);
+    conn = 0;
+}
+
+uint32_t capture::open() {
+    if (!m_running.load(std::memory_order_relaxed))
+        return 0;
+    uint32_t conn = m_counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    put(conn, OPEN, nullptr, 0);
+    return conn;
+}
+
+void capture::data(uint32_t &conn, const char *buf, size_t len) {
+    while (conn && len > 0) {
+        size_t n = len < 65535 ? len : 65535;
+        if (!put(conn, DATA, buf, n))
+            lost(conn);
+        buf += n;
+        len -= n;
+    }
+}
+
+void capture::response(uint32_t &conn, uint64_t bytes) {
+    if (conn && !put(conn, RESP, (const char *)&bytes, sizeof(bytes)))
+        lost(conn);
+}
+
+void capture::close(uint32_t &conn) {
+    if (conn && !put(conn, CLOSE, nullptr, 0))
+        lost(conn);
+    conn = 0;
+}
+
+bool capture::drain() {
+    for (int i = 0; i < MAX_RINGS; ++i) {
+        ring *r = m_rings[i].load(std::memory_order_acquire);
+        if (!r)
+            break;
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        if (head == tail)
+            continue;
+
+        // 数据可能绕过缓冲区的结尾，分两段写出
+        size_t off = tail % RING_SIZE;
+        size_t len = head - tail;
+        size_t first = len < RING_SIZE - off ? len : RING_SIZE - off;
+        fwrite(r->buf + off, 1, first, m_file);
+        fwrite(r->buf, 1, len - first, m_file);
+        m_written += len;
+
+        r->tail.store(head, std::memory_order_release);
+    }
+    fflush(m_file);
+    return m_written < m_max_bytes;
+}
+
+// 每 10 毫秒写出一次。文件达到上限时停止录制，之后的记录直接丢弃
+void *capture::flusher(void *arg) {
+    while (m_running.load(std::memory_order_relaxed)) {
+        usleep(10000);
+        if (!drain()) {
+            std::cout << "capture: " << m_path << " reached the size limit, capture stopped" << std::endl;
+            m_running = false;
+            m_enabled = false;
+        }
+    }
+    return nullptr;
+}
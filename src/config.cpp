@@ -0,0 +1,272 @@
+#include "config.h"
+#include "http_conn.h"
+#include "busypoll.h"
+#include "prefork.h"
+
+// 网站的根目录，定义在 http_conn.cpp
+extern const char* doc_root;
+
+config::config() {
+    m_listener_count = 0;
+    m_doc_root = doc_root;
+    m_max_body = http_conn::m_max_body;
+    m_upgrade_path = nullptr;
+    m_drain_timeout = 30;
+    m_min_threads = 0;
+    m_max_threads = 0;
+    m_target_wait = 1000;
+    m_idle_timeout = 30;
+    for (int c = 0; c < 4; ++c)
+        m_class_weights[c] = 1L << (2 * c);
+    m_age_us = 1000;
+}
+
+void config::usage(const char *prog) {
+    std::cout << "按照如下格式运行：" << prog << " [-r doc_root] [-b max_body] [-U prefix=dir[:max_body]] [-P prefix=upstream[,upstream...]] [-S prefix=dir] [-L req=rate[:burst],net=rate[:burst],conn=rate[:burst]] [-T listen[@sock_options]=cert,key] [-u upgrade_socket] [-D drain_timeout] [-O sock_options]"
+              << " [-t min[:max]] [-w target_wait_us] [-i idle_timeout] [-Q w0,w1,w2,w3[:age_us]] [-m thread|coro] [-X every[:file]] [-E header=s,body=s,idle=s,write=s[:rate]] [-C file[:max_mb]] [-R budget_mb[:max_entry_kb]] [-B poll_us[:worker_us]] [-K requests[:capacity]] [-F ttl_ms[:negative_ttl_ms]] [-I bytes_kb[:calls[:accepts]]] [-W workers] [-H budget_mb[:max_entry_kb]] listen[@sock_options] [listen...]" << std::endl;
+}
+
+// 解析线程池的调度参数 w0,w1,w2,w3[:age_us]
+bool config::parse_schedule(const char *arg) {
+    const char *p = arg;
+    for (int c = 0; c < 4; ++c) {
+        char *end;
+        m_class_weights[c] = strtol(p, &end, 10);
+        if (end == p || m_class_weights[c] < 0)
+            return false;
+        p = end;
+        if (c < 3) {
+            if (*p != ',')
+                return false;
+            ++p;
+        }
+    }
+    if (*p == ':') {
+        char *end;
+        m_age_us = strtol(p + 1, &end, 10);
+        if (end == p + 1 || m_age_us <= 0)
+            return false;
+        p = end;
+    }
+    return *p == '\0';
+}
+
+// 解析上传路由 prefix=dir[:max_body]
+static bool parse_upload_route(char *arg) {
+    char *dir = strchr(arg, '=');
+    if (!dir)
+        return false;
+    *dir++ = '\0';
+
+    long max_body = 0;
+    char *limit = strrchr(dir, ':');
+    if (limit) {
+        *limit++ = '\0';
+        max_body = atol(limit);
+    }
+    return router::add_upload(arg, dir, max_body);
+}
+
+// 解析代理路由 prefix=upstream[,upstream...]
+static bool parse_proxy_route(char *arg) {
+    char *upstreams = strchr(arg, '=');
+    if (!upstreams)
+        return false;
+    *upstreams++ = '\0';
+    return router::add_proxy(arg, upstreams);
+}
+
+// 解析静态文件路由 prefix=dir
+static bool parse_static_route(char *arg) {
+    char *dir = strchr(arg, '=');
+    if (!dir)
+        return false;
+    *dir++ = '\0';
+    return router::add_static(arg, dir);
+}
+
+bool config::add_listener(const char *spec, bool tls) {
+    if (m_listener_count >= listener::MAX || !m_listeners[m_listener_count].parse(spec, tls)) {
+        std::cout << "invalid listen address: " << spec << std::endl;
+        return false;
+    }
+    ++m_listener_count;
+    return true;
+}
+
+// 解析 HTTPS 监听地址 listen=cert,key，并加载证书。监听地址中的 @sock_options 也含有等号，证书从最后一个等号开始
+bool config::parse_tls(char *arg) {
+    char *cert = strrchr(arg, '=');
+    if (!cert)
+        return false;
+    *cert++ = '\0';
+    char *key = strchr(cert, ',');
+    if (!key)
+        return false;
+    *key++ = '\0';
+
+    return add_listener(arg, true) && tls_conn::init_context(cert, key);
+}
+
+bool config::parse_arg(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:U:P:S:L:T:u:D:O:t:w:i:Q:m:X:E:C:R:B:K:F:I:W:H:")) != -1) {
+        switch (opt) {
+            case 'r':
+                m_doc_root = optarg;
+                break;
+            case 'b':
+                m_max_body = atol(optarg);
+                if (m_max_body <= 0)
+                    return false;
+                break;
+            case 'U':
+                if (!parse_upload_route(optarg)) {
+                    std::cout << "invalid upload route: " << optarg << std::endl;
+                    return false;
+                }
+                break;
+            case 'P':
+                if (!parse_proxy_route(optarg)) {
+                    std::cout << "invalid proxy route: " << optarg << std::endl;
+                    return false;
+                }
+                break;
+            case 'S':
+                if (!parse_static_route(optarg)) {
+                    std::cout << "invalid static route: " << optarg << std::endl;
+                    return false;
+                }
+                break;
+            case 'L':
+                if (!rate_limiter::parse(optarg)) {
+                    std::cout << "invalid rate limit: " << optarg << std::endl;
+                    return false;
+                }
+                break;
+            case 'T':
+                if (!parse_tls(optarg)) {
+                    std::cout << "invalid tls listener: " << optarg << std::endl;
+                    return false;
+                }
+                break;
+            case 'u':
+                m_upgrade_path = optarg;
+                break;
+            case 'D':
+                m_drain_timeout = atoi(optarg);
+                if (m_drain_timeout < 0)
+                    return false;
+                break;
+            case 'O':
+                if (!m_sockopt.parse(optarg))
+                    return false;
+                break;
+            case 't': {
+                m_min_threads = atoi(optarg);
+                const char *max = strchr(optarg, ':');
+                m_max_threads = max ? atoi(max + 1) : 0;
+                if (m_min_threads <= 0 || m_max_threads < 0)
+                    return false;
+                break;
+            }
+            case 'w':
+                m_target_wait = atol(optarg);
+                if (m_target_wait <= 0)
+                    return false;
+                break;
+            case 'i':
+                m_idle_timeout = atoi(optarg);
+                if (m_idle_timeout <= 0)
+                    return false;
+                break;
+            case 'Q':
+                if (!parse_schedule(optarg))
+                    return false;
+                break;
+            case 'm':
+                if (strcmp(optarg, "coro") == 0)
+                    http_conn::m_coro_mode = true;
+                else if (strcmp(optarg, "thread") != 0)
+                    return false;
+                break;
+            case 'X':
+                if (!tracer::parse(optarg))
+                    return false;
+                break;
+            case 'E':
+                if (!http_conn::parse_deadlines(optarg))
+                    return false;
+                break;
+            case 'C':
+                if (!capture::parse(optarg))
+                    return false;
+                break;
+            case 'R':
+                if (!resp_cache::parse(optarg))
+                    return false;
+                break;
+            case 'B':
+                if (!busy_poll::parse(optarg))
+                    return false;
+                break;
+            case 'K':
+                if (!http_conn::parse_keepalive(optarg))
+                    return false;
+                break;
+            case 'F':
+                if (!file_table::parse(optarg))
+                    return false;
+                break;
+            case 'I':
+                if (!http_conn::parse_budget(optarg))
+                    return false;
+                break;
+            case 'W':
+                if (!prefork::parse(optarg))
+                    return false;
+                break;
+            case 'H':
+                if (!shm_cache::parse(optarg))
+                    return false;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    if (optind >= argc)             // 参数不足，未传入监听地址
+        return false;
+    // 代理在工作线程中阻塞地等待上游，协程模式的主线程不能这样做
+    if (proxy::enabled() && http_conn::m_coro_mode) {
+        std::cout << "proxy routes are not supported in coro mode" << std::endl;
+        return false;
+    }
+    for (int i = optind; i < argc; ++i) {
+        if (!add_listener(argv[i], false))
+            return false;
+    }
+
+    // 工作进程各自打开监听 socket，与主进程交接监听 socket 的升级方式不适用；录制文件不能由多个进程同时写
+    if (prefork::enabled() && (m_upgrade_path || capture::enabled())) {
+        std::cout << "upgrade socket and capture are not supported in prefork mode" << std::endl;
+        return false;
+    }
+    // 没有单独给出参数的 TCP 监听地址使用 -O 的参数，忙等模式和预派生模式需要的参数对每个地址都补上
+    for (int i = 0; i < m_listener_count; ++i) {
+        listener &lst = m_listeners[i];
+        if (lst.is_unix())
+            continue;
+        if (!lst.own_opts)
+            lst.opts = m_sockopt;
+        if (busy_poll::enabled() && lst.opts.busy_poll == 0)
+            lst.opts.busy_poll = busy_poll::poll_us();
+        if (prefork::enabled())
+            lst.opts.reuseport = true;
+    }
+
+    doc_root = m_doc_root;
+    router::add_static("/", doc_root);        // 其余的请求都是网站根目录下的静态文件，-S / 可以替换它
+    http_conn::m_max_body = m_max_body;
+    return true;
+}
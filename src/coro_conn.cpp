@@ -0,0 +1,239 @@
+#include "http_conn.h"
+#include "http2.h"
+#include "probes.h"
+
+thread_local frame_pool::node *frame_pool::m_free[frame_pool::CLASSES];
+
+// 主线程收到连接上的事件，恢复等待该事件的协程。连接出错或对端关闭时也恢复协程，
+// 协程重试 IO 操作时会发现错误并结束
+void http_conn::resume(uint32_t events) {
+    if (!m_waiter || m_fetching)                // 预读文件期间协程只能由完成队列恢复
+        return;
+    if (events & (m_wait_events | EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        begin_turn();
+        m_waiter.resume();
+    }
+}
+
+// 读取一些数据到读缓冲区，返回读到的字节数，0 表示对方关闭了连接，-1 表示出错
+task<ssize_t> http_conn::read_some() {
+    while (true) {
+        if (m_read_idx >= READ_BUFFER_SIZE)         // 读缓冲区已满
+            co_return -1;
+
+        ssize_t n;
+        if (m_tls.active())
+            n = m_tls.read(m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx);
+        else
+            n = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        charge(n);
+        if (n >= 0)
+            co_return n;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            co_return -1;
+        co_await wait_event(EPOLLIN);               // 等待 socket 可读
+    }
+}
+
+// 集中写出 iv 中的所有数据，iv 会被修改。flags 为 MSG_MORE 时表示后面还有数据，内核会等待后续数据组成完整的报文段
+task<bool> http_conn::write_all(struct iovec *iv, int count, int flags) {
+    bool first = true;                              // 每个响应由一次 write_all 开始
+    while (count > 0) {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iv;
+        msg.msg_iovlen = count;
+        ssize_t n;
+        if (m_tls.user_space_send())                 // 用户空间 TLS 由 SSL_write 加密后发送
+            n = m_tls.write(iv, count);
+        else
+            n = sendmsg(m_sockfd, &msg, flags | MSG_NOSIGNAL);
+        charge(n);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                co_return false;
+            co_await wait_event(EPOLLOUT);          // 等待 socket 可写
+            trace(tracer::WRITE);
+            continue;
+        }
+        if (first && n > 0) {
+            trace(tracer::FIRST_BYTE);
+            first = false;
+        }
+
+        // 跳过已经写完的缓冲区
+        while (count > 0 && (size_t)n >= iv->iov_len) {
+            n -= iv->iov_len;
+            ++iv;
+            --count;
+        }
+        if (count > 0) {
+            iv->iov_base = (char *)iv->iov_base + n;
+            iv->iov_len -= n;
+            if (over_budget())                      // 这一轮的预算用完，让其他连接先发送
+                co_await next_turn();
+        }
+    }
+    co_return true;
+}
+
+// 用 sendfile 把文件从 offset 开始的 len 字节发送出去，数据不经过用户空间。
+// 每次最多发送 COLD_WINDOW 字节，不在页缓存中的部分先由 I/O 线程池预读，主线程不会因为缺页而阻塞
+task<bool> http_conn::send_file(int fd, off_t offset, size_t len) {
+    while (len > 0) {
+        size_t window = len < (size_t)COLD_WINDOW ? len : COLD_WINDOW;
+        if (!file_resident(offset, window)) {
+            start_fetch();
+            co_await wait_event(EPOLLOUT);
+            continue;
+        }
+
+        ssize_t n;
+        if (m_tls.active())                         // kTLS 时仍然是 sendfile，否则读出文件后用 SSL_write 发送
+            n = m_tls.send_file(m_sockfd, fd, &offset, window);
+        else
+            n = sendfile(m_sockfd, fd, &offset, window);
+        charge(n);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                co_return false;
+            co_await wait_event(EPOLLOUT);
+            trace(tracer::WRITE);
+            continue;
+        }
+        if (n == 0)                                 // 文件被截短了
+            co_return false;
+        len -= n;
+        if (len > 0 && over_budget())
+            co_await next_turn();
+    }
+    co_return true;
+}
+
+// HTTP/2 连接：先写出所有能发送的数据，再读取下一批帧。
+// 流量控制的窗口用完时 pending 返回 0，协程转去等待对方的 WINDOW_UPDATE
+task<bool> http_conn::serve_h2() {
+    while (true) {
+        if (m_draining)
+            m_h2->shutdown();
+
+        int ret;
+        while ((ret = flush_h2()) == 0)
+            co_await wait_event(EPOLLOUT);
+        if (ret < 0)
+            co_return false;
+        if (m_h2->finished())
+            co_return true;
+        set_phase(PHASE_IDLE);                      // 每次读写之后重新计算空闲的期限
+
+        m_idle = m_h2->idle();
+        ssize_t n;
+        if (m_tls.active())
+            n = m_tls.read(m_h2->input(), m_h2->input_space());
+        else
+            n = recv(m_sockfd, m_h2->input(), m_h2->input_space(), 0);
+        if (n == 0)
+            co_return false;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                co_return false;
+            co_await wait_event(EPOLLIN);
+            continue;
+        }
+        m_idle = false;
+        capture::data(m_capture_id, m_h2->input(), n);
+        m_h2->on_input(n);
+    }
+}
+
+// 连接协程：读取请求、解析、发送响应，长连接上循环处理下一个请求
+conn_task http_conn::serve() {
+    // HTTPS 连接先完成 TLS 握手
+    while (m_tls.handshaking()) {
+        int ret = m_tls.handshake();
+        if (ret < 0) {
+            m_coro_active = false;
+            close_conn();
+            co_return;
+        }
+        if (ret == 0)
+            co_await wait_event(m_tls.want_events());
+    }
+    if (m_tls.active() && m_tls.alpn_h2()) {            // ALPN 选择了 h2
+        start_h2(H2_PREFACE);
+        co_await serve_h2();
+        m_coro_active = false;
+        close_conn();
+        co_return;
+    }
+
+    while (true) {
+        // 请求体正在被 splice 写入文件，数据要留在 socket 中，只等待可读
+        if (m_body_splice) {
+            co_await wait_event(EPOLLIN);
+        }
+        else if (m_pipelined) {                 // 读缓冲区中已经有下一个请求，先处理它
+            if (over_budget())                  // 流水线上的请求不需要等待事件，预算用完时同样让出
+                co_await next_turn();
+            m_pipelined = false;
+        }
+        else {
+            ssize_t n = co_await read_some();
+            if (n <= 0)
+                break;
+            capture::data(m_capture_id, m_read_buf + m_read_idx, n);
+            m_read_idx += n;
+            m_idle = false;
+            trace(tracer::READ);
+            PROBE2(read, m_sockfd, n);
+        }
+
+        HTTP_CODE ret = process_read();
+        if (ret == NO_REQUEST)                  // 请求不完整，继续读取
+            continue;
+        trace(tracer::PARSED);
+        PROBE3(parse_done, m_sockfd, (int)ret, m_url);
+        if (ret == H2_PREFACE || ret == H2_UPGRADE) {
+            start_h2(ret);
+            co_await serve_h2();
+            break;
+        }
+        if (!process_write(ret))
+            break;
+
+        bool ok;
+        if (m_file_fd != -1) {                  // 先发送首部，再用 sendfile 发送文件，两者合并成尽量少的报文段
+            if (m_sockopt->cork)
+                set_cork(m_sockfd, true);
+            ok = co_await write_all(m_iv, 1, MSG_MORE);
+            if (ok)
+                ok = co_await send_file(m_file_fd, 0, m_file_stat.st_size);
+            if (m_sockopt->cork)
+                set_cork(m_sockfd, false);
+        }
+        else {
+            ok = co_await write_all(m_iv, m_iv_count);
+        }
+        unmap();
+        if (ok) {
+            trace(tracer::LAST_BYTE);
+            PROBE3(response_done, m_sockfd, m_status, bytes_to_send);
+            capture::response(m_capture_id, bytes_to_send);
+        }
+
+        if (!ok || !m_linger)
+            break;
+        next_request();
+    }
+
+    m_coro_active = false;
+    close_conn();
+}
@@ -0,0 +1,50 @@
+#include "cost.h"
+#include <string.h>
+
+std::atomic<uint32_t> cost_table::m_table[SIZE];
+
+// 各类别的上限：响应不超过 16KB、1MB、64MB，处理时间不超过 100us、1ms、10ms，再大的属于最后一类
+static const long size_limits[] = {16L << 10, 1L << 20, 64L << 20};
+static const long time_limits[] = {100000, 1000000, 10000000};
+
+uint32_t cost_table::key(const char *buf, int len) {
+    const char *end = buf + len;
+    const char *url = (const char *)memchr(buf, ' ', len);
+    if (!url)
+        return 0;
+    ++url;
+    const char *stop = (const char *)memchr(url, ' ', end - url);
+    if (!stop)
+        return 0;
+
+    // FNV-1a，查询参数不参与计算。结果为 0 时改为 1，0 留给"没有键"
+    uint32_t h = 2166136261u;
+    for (const char *p = url; p < stop && *p != '?'; ++p)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h ? h : 1;
+}
+
+int cost_table::lookup(uint32_t key) {
+    if (!key)
+        return UNKNOWN_CLASS;
+    uint32_t entry = m_table[key & (SIZE - 1)].load(std::memory_order_relaxed);
+    if (entry == 0 || (entry >> 2) != (key >> 2))
+        return UNKNOWN_CLASS;
+    return entry & 3;
+}
+
+void cost_table::learn(uint32_t key, long bytes, long service_ns) {
+    if (!key)
+        return;
+    uint32_t entry = (key & ~3u) | classify(bytes, service_ns);
+    m_table[key & (SIZE - 1)].store(entry, std::memory_order_relaxed);
+}
+
+int cost_table::classify(long bytes, long service_ns) {
+    int by_size = 0, by_time = 0;
+    while (by_size < 3 && bytes > size_limits[by_size])
+        ++by_size;
+    while (by_time < 3 && service_ns > time_limits[by_time])
+        ++by_time;
+    return by_size > by_time ? by_size : by_time;
+}
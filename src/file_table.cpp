@@ -0,0 +1,167 @@
+#include "file_table.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+
+file_table::shard *file_table::m_shards = nullptr;
+long file_table::m_ttl_ms = 1000;
+long file_table::m_negative_ttl_ms = 1000;
+void (*file_table::m_wake)(waiter *w) = nullptr;
+
+std::atomic<long> file_table::m_hits(0);
+std::atomic<long> file_table::m_loads(0);
+std::atomic<long> file_table::m_coalesced(0);
+std::atomic<long> file_table::m_entries(0);
+
+static long now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = path; *p; ++p)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    return h ^ (h >> 29);
+}
+
+bool file_table::parse(const char *spec) {
+    char *end;
+    m_ttl_ms = strtol(spec, &end, 10);
+    if (end == spec || m_ttl_ms <= 0)
+        return false;
+    m_negative_ttl_ms = m_ttl_ms;
+    if (*end == ':') {
+        const char *p = end + 1;
+        m_negative_ttl_ms = strtol(p, &end, 10);
+        if (end == p || m_negative_ttl_ms < 0)
+            return false;
+    }
+    if (*end != '\0')
+        return false;
+
+    m_shards = new shard[SHARDS];
+    for (int i = 0; i < SHARDS; ++i) {
+        shard &s = m_shards[i];
+        memset(s.buckets, 0, sizeof(s.buckets));
+        s.list.prev = s.list.next = &s.list;
+        s.count = 0;
+    }
+    return true;
+}
+
+void file_table::unlink(shard &s, entry *e) {
+    entry **pp = &s.buckets[e->hash & (BUCKETS - 1)];
+    while (*pp != e)
+        pp = &(*pp)->next_hash;
+    *pp = e->next_hash;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    --s.count;
+    m_entries.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void file_table::destroy(entry *e) {
+    if (e->addr)
+        munmap(e->addr, e->st.st_size);
+    if (e->fd != -1)
+        close(e->fd);
+    e->~entry();
+    free(e);
+}
+
+file_table::entry *file_table::acquire(const char *path, waiter *w, STATUS *status) {
+    uint64_t hash = hash_path(path);
+    shard &s = shard_of(hash);
+    long now = now_ms();
+    entry *dropped[2];
+    int ndropped = 0;
+    entry *e;
+
+    s.lock.lock();
+    for (e = s.buckets[hash & (BUCKETS - 1)]; e; e = e->next_hash) {
+        if (e->hash == hash && strcmp(e->path, path) == 0)
+            break;
+    }
+
+    if (e && e->loading) {                      // 另一个请求正在查找，挂在条目上等待
+        w->next = e->waiters;
+        e->waiters = w;
+        s.lock.unlock();
+        m_coalesced.fetch_add(1, std::memory_order_relaxed);
+        *status = WAIT;
+        return nullptr;
+    }
+    if (e && e->expire_ms > now) {
+        e->refs.fetch_add(1, std::memory_order_relaxed);
+        s.lock.unlock();
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        *status = FOUND;
+        return e;
+    }
+    if (e) {                                    // 已经过期，换成新的条目
+        unlink(s, e);
+        dropped[ndropped++] = e;
+    }
+    if (s.count >= MAX_ENTRIES) {               // 淘汰最早加入的条目，正在使用它的连接仍然持有引用
+        entry *old = (entry *)s.list.next;
+        unlink(s, old);
+        dropped[ndropped++] = old;
+    }
+
+    size_t len = strlen(path);
+    e = new (malloc(sizeof(entry) + len + 1)) entry;
+    memcpy(e->path, path, len + 1);
+    e->hash = hash;
+    e->refs.store(2, std::memory_order_relaxed);    // 表和负责查找的请求各一个
+    e->loading = true;
+    e->expire_ms = 0;
+    e->waiters = nullptr;
+    e->code = 0;
+    e->addr = nullptr;
+    e->fd = -1;
+    e->next_hash = s.buckets[hash & (BUCKETS - 1)];
+    s.buckets[hash & (BUCKETS - 1)] = e;
+    e->prev = s.list.prev;
+    e->next = &s.list;
+    s.list.prev->next = e;
+    s.list.prev = e;
+    ++s.count;
+    s.lock.unlock();
+
+    m_entries.fetch_add(1, std::memory_order_relaxed);
+    m_loads.fetch_add(1, std::memory_order_relaxed);
+    for (int i = 0; i < ndropped; ++i)
+        release(dropped[i]);
+    *status = LOAD;
+    return e;
+}
+
+// 等待的连接直接得到这个结果，不再查找一次，即使它已经过期（否定结果的有效期可以是 0）
+void file_table::publish(entry *e, bool negative) {
+    shard &s = shard_of(e->hash);
+    s.lock.lock();
+    e->expire_ms = now_ms() + (negative ? m_negative_ttl_ms : m_ttl_ms);
+    e->loading = false;
+    waiter *waiters = e->waiters;
+    e->waiters = nullptr;
+    s.lock.unlock();
+
+    while (waiters) {
+        waiter *next = waiters->next;           // 唤醒之后 waiters 可能立即被连接重用
+        e->refs.fetch_add(1, std::memory_order_relaxed);
+        waiters->result = e;
+        m_wake(waiters);
+        waiters = next;
+    }
+}
+
+void file_table::release(entry *e) {
+    if (e->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        destroy(e);
+}
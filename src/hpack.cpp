@@ -0,0 +1,286 @@
+#include "hpack.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+// 静态表（RFC 7541 附录 A），下标从 1 开始
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[] = {
+    {"", ""},
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+    {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+static const int STATIC_COUNT = sizeof(static_table) / sizeof(static_table[0]) - 1;
+
+// Huffman 编码（RFC 7541 附录 B）是规范的（canonical）前缀码：同样长度的码字按符号顺序连续分配，
+// 短码字排在长码字之前。因此只需要每个符号的码长就能还原整张码表，256 是 EOS
+static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// 由码长生成的解码表：长度为 len 的码字从 first[len] 开始，共 count[len] 个，对应 symbols[offset[len]] 起的符号
+struct huffman_table {
+    static const int MAX_LEN = 30;
+    uint32_t first[MAX_LEN + 1];
+    int count[MAX_LEN + 1];
+    int offset[MAX_LEN + 1];
+    uint16_t symbols[257];
+
+    huffman_table() {
+        memset(count, 0, sizeof(count));
+        for (int s = 0; s < 257; ++s)
+            ++count[huffman_lengths[s]];
+
+        uint32_t code = 0;
+        int next = 0;
+        for (int len = 1; len <= MAX_LEN; ++len) {
+            code = (code + count[len - 1]) << 1;
+            first[len] = code;
+            offset[len] = next;
+            for (int s = 0; s < 257; ++s) {
+                if (huffman_lengths[s] == len)
+                    symbols[next++] = s;
+            }
+        }
+        first[0] = 0;
+        offset[0] = 0;
+    }
+};
+
+static const huffman_table huffman;
+
+hpack_decoder::~hpack_decoder() {
+    evict(0);
+}
+
+// 逐位解码：累积的码字落在某个长度的码字区间内时就得到一个符号。首部的字符串都很短，不需要查表加速
+bool hpack_decoder::huffman_decode(const uint8_t *data, int len, char *out, int *out_len) {
+    uint32_t code = 0;
+    int bits = 0;
+    int n = 0;
+    for (int i = 0; i < len; ++i) {
+        for (int shift = 7; shift >= 0; --shift) {
+            code = (code << 1) | ((data[i] >> shift) & 1);
+            if (++bits > huffman_table::MAX_LEN)
+                return false;
+            if (code >= huffman.first[bits] && code - huffman.first[bits] < (uint32_t)huffman.count[bits]) {
+                int sym = huffman.symbols[huffman.offset[bits] + code - huffman.first[bits]];
+                if (sym == 256 || n >= STRING_LEN)          // 字符串中不能出现 EOS
+                    return false;
+                out[n++] = sym;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+    // 末尾的填充是 EOS 码字的前缀（全 1），且不超过 7 位
+    if (bits > 7 || code != (1u << bits) - 1)
+        return false;
+    *out_len = n;
+    return true;
+}
+
+bool hpack_decoder::decode_int(const uint8_t **p, const uint8_t *end, int prefix_bits, uint32_t *value) {
+    if (*p >= end)
+        return false;
+    uint32_t mask = (1u << prefix_bits) - 1;
+    uint32_t v = *(*p)++ & mask;
+    if (v < mask) {
+        *value = v;
+        return true;
+    }
+    for (int shift = 0; *p < end && shift <= 21; shift += 7) {
+        uint8_t b = *(*p)++;
+        v += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool hpack_decoder::decode_string(const uint8_t **p, const uint8_t *end, char *out, int *len) {
+    if (*p >= end)
+        return false;
+    bool huff = **p & 0x80;
+    uint32_t n;
+    if (!decode_int(p, end, 7, &n) || n > (uint32_t)(end - *p))
+        return false;
+    const uint8_t *s = *p;
+    *p += n;
+    if (huff)
+        return huffman_decode(s, n, out, len);
+    if (n > (uint32_t)STRING_LEN)
+        return false;
+    memcpy(out, s, n);
+    *len = n;
+    return true;
+}
+
+bool hpack_decoder::lookup(uint32_t index, const char **name, int *name_len, const char **value, int *value_len) {
+    if (index == 0)
+        return false;
+    if (index <= (uint32_t)STATIC_COUNT) {
+        *name = static_table[index].name;
+        *name_len = strlen(*name);
+        *value = static_table[index].value;
+        *value_len = strlen(*value);
+        return true;
+    }
+    index -= STATIC_COUNT + 1;
+    if (index >= (uint32_t)m_count)
+        return false;
+    const entry &e = m_entries[(m_first + index) % MAX_ENTRIES];
+    *name = e.data;
+    *name_len = e.name_len;
+    *value = e.data + e.name_len;
+    *value_len = e.value_len;
+    return true;
+}
+
+// 淘汰最旧的条目，直到动态表不超过 max_size
+void hpack_decoder::evict(int max_size) {
+    while (m_count > 0 && m_size > max_size) {
+        entry &e = m_entries[(m_first + m_count - 1) % MAX_ENTRIES];
+        m_size -= e.name_len + e.value_len + 32;
+        free(e.data);
+        e.data = nullptr;
+        --m_count;
+    }
+}
+
+// 新条目放在最前面。比整个表还大的条目不插入，但会清空动态表
+bool hpack_decoder::insert(const char *name, int name_len, const char *value, int value_len) {
+    int size = name_len + value_len + 32;
+    if (size > m_max_size) {
+        evict(0);
+        return true;
+    }
+    evict(m_max_size - size);
+
+    char *data = (char *)malloc(name_len + value_len + 1);
+    if (!data)
+        return false;
+    memcpy(data, name, name_len);
+    memcpy(data + name_len, value, value_len);
+    m_first = (m_first + MAX_ENTRIES - 1) % MAX_ENTRIES;
+    entry &e = m_entries[m_first];
+    e.data = data;
+    e.name_len = name_len;
+    e.value_len = value_len;
+    ++m_count;
+    m_size += size;
+    return true;
+}
+
+bool hpack_decoder::decode(const uint8_t *data, int len, header_cb cb, void *arg) {
+    // 解码 Huffman 字符串的缓冲区。解码在工作线程中进行，每个线程一份
+    static thread_local char name_buf[STRING_LEN];
+    static thread_local char value_buf[STRING_LEN];
+
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    while (p < end) {
+        uint8_t b = *p;
+        const char *name, *value;
+        int name_len, value_len;
+        uint32_t index;
+
+        if (b & 0x80) {                     // 1xxxxxxx：索引
+            if (!decode_int(&p, end, 7, &index) || !lookup(index, &name, &name_len, &value, &value_len))
+                return false;
+            if (!cb(arg, name, name_len, value, value_len))
+                return false;
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) {           // 001xxxxx：动态表大小更新
+            if (!decode_int(&p, end, 5, &index) || index > (uint32_t)TABLE_SIZE)
+                return false;
+            m_max_size = index;
+            evict(m_max_size);
+            continue;
+        }
+
+        // 01xxxxxx：字面量并加入动态表；0000xxxx、0001xxxx：字面量，不加入动态表
+        bool indexing = (b & 0xc0) == 0x40;
+        if (!decode_int(&p, end, indexing ? 6 : 4, &index))
+            return false;
+        if (index == 0) {
+            if (!decode_string(&p, end, name_buf, &name_len))
+                return false;
+        }
+        else {
+            // 名字复制出来，插入新条目时引用的旧条目可能正好被淘汰
+            const char *v;
+            int v_len;
+            if (!lookup(index, &name, &name_len, &v, &v_len))
+                return false;
+            memcpy(name_buf, name, name_len);
+        }
+        if (!decode_string(&p, end, value_buf, &value_len))
+            return false;
+        if (indexing && !insert(name_buf, name_len, value_buf, value_len))
+            return false;
+        if (!cb(arg, name_buf, name_len, value_buf, value_len))
+            return false;
+    }
+    return true;
+}
+
+int hpack_decoder::encode_int(uint8_t *out, uint32_t value, int prefix_bits, uint8_t first) {
+    uint32_t max = (1u << prefix_bits) - 1;
+    if (value < max) {
+        out[0] = first | value;
+        return 1;
+    }
+    out[0] = first | max;
+    value -= max;
+    int n = 1;
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+// 静态表中有的状态码用一个字节的索引表示，其余的用名字索引加上字面量的值
+int hpack_decoder::encode_status(uint8_t *out, int status) {
+    static const int indexed[] = {200, 204, 206, 304, 400, 404, 500};
+    for (int i = 0; i < (int)(sizeof(indexed) / sizeof(indexed[0])); ++i) {
+        if (indexed[i] == status)
+            return encode_int(out, STATUS_200 + i, 7, 0x80);
+    }
+    char digits[4];
+    snprintf(digits, sizeof(digits), "%03d", status);
+    return encode_header(out, STATUS_200, digits, 3);
+}
+
+// 不加入动态表的字面量：0000 + 4 位前缀的名字下标，值不做 Huffman 编码
+int hpack_decoder::encode_header(uint8_t *out, int name_index, const char *value, int len) {
+    int n = encode_int(out, name_index, 4, 0x00);
+    n += encode_int(out + n, len, 7, 0x00);
+    memcpy(out + n, value, len);
+    return n + len;
+}
@@ -0,0 +1,995 @@
+#include "http2.h"
+#include <stdlib.h>
+#include <algorithm>
+
+// 响应体，定义在 http_conn.cpp
+extern const char* ok_201_form;
+extern const char* error_400_form;
+extern const char* error_403_form;
+extern const char* error_404_form;
+extern const char* error_413_form;
+extern const char* error_500_form;
+extern const char* error_502_form;
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const char switching_protocols[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+// 帧的标志
+static const int FLAG_ACK = 0x1;
+static const int FLAG_END_STREAM = 0x1;
+static const int FLAG_END_HEADERS = 0x4;
+static const int FLAG_PADDED = 0x8;
+static const int FLAG_PRIORITY = 0x20;
+
+// SETTINGS 的参数
+enum {SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH, SETTINGS_MAX_CONCURRENT_STREAMS, SETTINGS_INITIAL_WINDOW_SIZE,
+      SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE};
+
+static const long MAX_WINDOW = 0x7fffffff;
+static const int DEFAULT_WINDOW = 65535;
+static const int GOAWAY_RESERVE = h2_session::FRAME_HEADER + 8;     // 控制帧缓冲区中为 GOAWAY 保留的空间
+
+std::atomic<long> h2_session::m_connections(0);
+std::atomic<long> h2_session::m_total_streams(0);
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+h2_session::h2_session(const sockaddr_storage &addr)
+    : m_address(addr), m_in_len(0), m_preface_ok(false), m_stream_count(0), m_last_id(0),
+      m_hblock(nullptr), m_hblock_len(0), m_hblock_stream(0), m_hblock_flags(0),
+      m_send_window(DEFAULT_WINDOW), m_recv_window(DEFAULT_WINDOW), m_recv_pending(0),
+      m_peer_window(DEFAULT_WINDOW), m_peer_max_frame(MAX_FRAME_SIZE),
+      m_goaway_sent(false), m_peer_goaway(false), m_failed(false), m_ctrl_len(0),
+      m_out_len(0), m_iov_count(0), m_iov_idx(0), m_round_bytes(0) {
+    memset(m_streams, 0, sizeof(m_streams));
+    ++m_connections;
+}
+
+h2_session::~h2_session() {
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        if (m_streams[i])
+            m_streams[i]->closed = true;
+    }
+    release_streams();
+    free(m_hblock);
+}
+
+int h2_session::match_preface(const char *data, int len) {
+    int n = len < PREFACE_LEN ? len : PREFACE_LEN;
+    if (memcmp(data, preface, n) != 0)
+        return -1;
+    return n == PREFACE_LEN ? 1 : 0;
+}
+
+void h2_session::start() {
+    // 服务器不能发送 SETTINGS_ENABLE_PUSH，一些客户端会把它当成协议错误
+    uint8_t settings[12];
+    put32(settings, SETTINGS_MAX_CONCURRENT_STREAMS << 16);
+    put32(settings + 2, MAX_STREAMS);
+    put32(settings + 6, SETTINGS_INITIAL_WINDOW_SIZE << 16);
+    put32(settings + 8, RECV_WINDOW);
+    queue_frame(SETTINGS_FRAME, 0, 0, settings, sizeof(settings));
+
+    // 连接的接收窗口只能通过 WINDOW_UPDATE 扩大
+    queue_window_update(0, RECV_WINDOW - DEFAULT_WINDOW);
+    m_recv_window = RECV_WINDOW;
+}
+
+// HTTP2-Settings 首部是 SETTINGS 帧的负载，用不带填充的 base64url 编码
+static int base64url_decode(const char *in, uint8_t *out, int size) {
+    int bits = 0, n = 0;
+    uint32_t acc = 0;
+    for (; *in && *in != ' ' && *in != '\t'; ++in) {
+        int v;
+        char c = *in;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-' || c == '+') v = 62;
+        else if (c == '_' || c == '/') v = 63;
+        else if (c == '=') break;
+        else return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n >= size)
+                return -1;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+void h2_session::upgrade(const char *settings, http_conn::METHOD method, const char *path) {
+    memcpy(m_ctrl, switching_protocols, sizeof(switching_protocols) - 1);
+    m_ctrl_len = sizeof(switching_protocols) - 1;
+    start();
+
+    // 101 响应就是对这些参数的确认，不需要再发送 SETTINGS ACK
+    uint8_t payload[64];
+    int len = settings ? base64url_decode(settings, payload, sizeof(payload)) : 0;
+    if (len < 0 || len % 6 != 0) {
+        fail(PROTOCOL_ERROR);
+        return;
+    }
+    if (!on_settings(payload, len))
+        return;
+
+    // 升级前的请求是流 1，请求方向已经结束
+    stream *s = open_stream(1);
+    m_last_id = 1;
+    s->method = method;
+    s->has_method = s->has_path = true;
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    s->remote_closed = true;
+    on_request(s);
+}
+
+void h2_session::on_input(int len) {
+    m_in_len += len;
+    if (m_failed) {
+        m_in_len = 0;
+        return;
+    }
+
+    int pos = 0;
+    if (!m_preface_ok) {
+        int ret = match_preface(m_in, m_in_len);
+        if (ret < 0) {
+            fail(PROTOCOL_ERROR);
+            return;
+        }
+        if (ret == 0)
+            return;
+        m_preface_ok = true;
+        pos = PREFACE_LEN;
+    }
+
+    // 处理所有完整的帧，剩下不完整的帧移到缓冲区开头
+    while (!m_failed && m_in_len - pos >= FRAME_HEADER) {
+        const uint8_t *p = (const uint8_t *)m_in + pos;
+        int frame_len = (p[0] << 16) | (p[1] << 8) | p[2];
+        if (frame_len > MAX_FRAME_SIZE) {
+            fail(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (m_in_len - pos < FRAME_HEADER + frame_len)
+            break;
+        on_frame(p[3], p[4], get32(p + 5) & 0x7fffffff, p + FRAME_HEADER, frame_len);
+        pos += FRAME_HEADER + frame_len;
+    }
+
+    if (m_failed) {
+        m_in_len = 0;
+        return;
+    }
+    memmove(m_in, m_in + pos, m_in_len - pos);
+    m_in_len -= pos;
+}
+
+void h2_session::on_frame(int type, int flags, uint32_t id, const uint8_t *payload, int len) {
+    // 首部块没有结束时，只能收到同一个流的 CONTINUATION
+    if (m_hblock_stream && (type != CONTINUATION_FRAME || id != m_hblock_stream)) {
+        fail(PROTOCOL_ERROR);
+        return;
+    }
+
+    switch (type) {
+        case DATA_FRAME:
+            on_data(flags, id, payload, len);
+            break;
+        case HEADERS_FRAME:
+            on_headers(flags, id, payload, len);
+            break;
+        case CONTINUATION_FRAME:
+            on_continuation(flags, id, payload, len);
+            break;
+        case PRIORITY_FRAME:                // RFC 9113 废弃了依赖树，只检查格式
+            if (id == 0)
+                fail(PROTOCOL_ERROR);
+            else if (len != 5)
+                reset_stream(find_stream(id), FRAME_SIZE_ERROR);
+            break;
+        case RST_STREAM_FRAME: {
+            if (id == 0 || id > m_last_id) {
+                fail(PROTOCOL_ERROR);
+                break;
+            }
+            if (len != 4) {
+                fail(FRAME_SIZE_ERROR);
+                break;
+            }
+            stream *s = find_stream(id);
+            if (s)
+                s->closed = true;           // 对方取消了请求，不再回复 RST_STREAM
+            break;
+        }
+        case SETTINGS_FRAME:
+            if (id != 0) {
+                fail(PROTOCOL_ERROR);
+                break;
+            }
+            if (flags & FLAG_ACK) {
+                if (len != 0)
+                    fail(FRAME_SIZE_ERROR);
+                break;
+            }
+            if (len % 6 != 0) {
+                fail(FRAME_SIZE_ERROR);
+                break;
+            }
+            if (on_settings(payload, len))
+                queue_frame(SETTINGS_FRAME, FLAG_ACK, 0, nullptr, 0);
+            break;
+        case PUSH_PROMISE_FRAME:            // 客户端不能推送
+            fail(PROTOCOL_ERROR);
+            break;
+        case PING_FRAME:
+            if (id != 0)
+                fail(PROTOCOL_ERROR);
+            else if (len != 8)
+                fail(FRAME_SIZE_ERROR);
+            else if (!(flags & FLAG_ACK))
+                queue_frame(PING_FRAME, FLAG_ACK, 0, payload, 8);
+            break;
+        case GOAWAY_FRAME:
+            if (id != 0)
+                fail(PROTOCOL_ERROR);
+            else
+                m_peer_goaway = true;       // 已有的流照常完成
+            break;
+        case WINDOW_UPDATE_FRAME:
+            on_window_update(id, payload, len);
+            break;
+        case PRIORITY_UPDATE_FRAME:
+            if (id != 0 || len < 4) {
+                fail(PROTOCOL_ERROR);
+                break;
+            }
+            if (stream *s = find_stream(get32(payload) & 0x7fffffff))
+                parse_priority(s, (const char *)payload + 4, len - 4);
+            break;
+        default:                            // 未知类型的帧必须忽略
+            break;
+    }
+}
+
+void h2_session::on_data(int flags, uint32_t id, const uint8_t *payload, int len) {
+    if (id == 0 || id > m_last_id) {
+        fail(PROTOCOL_ERROR);
+        return;
+    }
+
+    // 填充也计入流量控制。连接的窗口先归还，请求体交给处理器之后就不再占用内存
+    if (len > m_recv_window) {
+        fail(FLOW_CONTROL_ERROR);
+        return;
+    }
+    m_recv_window -= len;
+    m_recv_pending += len;
+    if (m_recv_pending >= RECV_WINDOW / 2) {
+        queue_window_update(0, m_recv_pending);
+        m_recv_window += m_recv_pending;
+        m_recv_pending = 0;
+    }
+
+    stream *s = find_stream(id);
+    if (!s || s->closed)                    // 我们已经结束或者重置的流，对方可能还有在途的数据
+        return;
+    if (s->remote_closed) {
+        reset_stream(s, STREAM_CLOSED);
+        return;
+    }
+    if (len > s->recv_window) {
+        reset_stream(s, FLOW_CONTROL_ERROR);
+        return;
+    }
+    s->recv_window -= len;
+
+    int data_len = len;
+    if (flags & FLAG_PADDED) {
+        if (len < 1 || payload[0] >= len) {
+            fail(PROTOCOL_ERROR);
+            return;
+        }
+        data_len = len - 1 - payload[0];
+        ++payload;
+    }
+
+    // 上传路由写入文件，其余的请求体直接丢弃
+    if (s->sink && !s->ready) {
+        s->body_received += data_len;
+        if (s->body_received > s->body_limit)
+            respond(s, 413, error_413_form, strlen(error_413_form));
+        else if (!s->sink->on_data((const char *)payload, data_len))
+            respond(s, 500, error_500_form, strlen(error_500_form));
+    }
+
+    if (flags & FLAG_END_STREAM) {
+        s->remote_closed = true;
+        on_body_end(s);
+        return;
+    }
+    s->recv_pending += len;
+    if (s->recv_pending >= RECV_WINDOW / 2) {
+        queue_window_update(id, s->recv_pending);
+        s->recv_window += s->recv_pending;
+        s->recv_pending = 0;
+    }
+}
+
+void h2_session::on_headers(int flags, uint32_t id, const uint8_t *payload, int len) {
+    if (id == 0 || !(id & 1)) {
+        fail(PROTOCOL_ERROR);
+        return;
+    }
+
+    if (flags & FLAG_PADDED) {
+        if (len < 1 || payload[0] >= len) {
+            fail(PROTOCOL_ERROR);
+            return;
+        }
+        len -= 1 + payload[0];
+        ++payload;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5) {
+            fail(FRAME_SIZE_ERROR);
+            return;
+        }
+        payload += 5;
+        len -= 5;
+    }
+
+    // 新的流 ID 必须递增；已有的流上只能是结束请求的尾部首部
+    stream *s = find_stream(id);
+    if (!s && id <= m_last_id) {
+        fail(STREAM_CLOSED);
+        return;
+    }
+    if (s && (s->remote_closed || !(flags & FLAG_END_STREAM))) {
+        fail(PROTOCOL_ERROR);
+        return;
+    }
+
+    m_hblock_stream = id;
+    m_hblock_flags = flags;
+    if (flags & FLAG_END_HEADERS) {
+        on_header_block(payload, len);
+        return;
+    }
+    m_hblock = (uint8_t *)malloc(HEADER_BLOCK_SIZE);
+    if (!m_hblock) {
+        fail(INTERNAL_ERROR);
+        return;
+    }
+    memcpy(m_hblock, payload, len);
+    m_hblock_len = len;
+}
+
+void h2_session::on_continuation(int flags, uint32_t id, const uint8_t *payload, int len) {
+    if (!m_hblock_stream) {
+        fail(PROTOCOL_ERROR);
+        return;
+    }
+    if (m_hblock_len + len > HEADER_BLOCK_SIZE) {
+        fail(ENHANCE_YOUR_CALM);
+        return;
+    }
+    memcpy(m_hblock + m_hblock_len, payload, len);
+    m_hblock_len += len;
+    if (flags & FLAG_END_HEADERS) {
+        on_header_block(m_hblock, m_hblock_len);
+        free(m_hblock);
+        m_hblock = nullptr;
+        m_hblock_len = 0;
+    }
+}
+
+// 首部块接收完整。无论是否接受这个流，都必须解码，否则动态表就和对方不一致了
+void h2_session::on_header_block(const uint8_t *block, int len) {
+    uint32_t id = m_hblock_stream;
+    m_hblock_stream = 0;
+
+    stream *s = find_stream(id);
+    if (s) {                                // 尾部首部：内容不需要，请求体到此结束
+        stream trailer;
+        memset(&trailer, 0, sizeof(trailer));
+        if (!m_decoder.decode(block, len, on_header, &trailer)) {
+            fail(COMPRESSION_ERROR);
+            return;
+        }
+        s->remote_closed = true;
+        if (!s->closed)
+            on_body_end(s);
+        return;
+    }
+
+    m_last_id = id;
+    bool refused = m_goaway_sent || m_stream_count >= MAX_STREAMS;
+    stream refused_stream;
+    if (refused)
+        memset(&refused_stream, 0, sizeof(refused_stream));
+    else
+        s = open_stream(id);
+    if (!m_decoder.decode(block, len, on_header, refused ? &refused_stream : s)) {
+        fail(COMPRESSION_ERROR);
+        return;
+    }
+
+    if (refused) {                          // 客户端收到 REFUSED_STREAM 后可以安全地重试
+        if (!m_goaway_sent) {
+            uint8_t code[4];
+            put32(code, REFUSED_STREAM);
+            queue_frame(RST_STREAM_FRAME, 0, id, code, 4);
+        }
+        return;
+    }
+    if (m_hblock_flags & FLAG_END_STREAM)
+        s->remote_closed = true;
+    on_request(s);
+}
+
+// 解码出一个首部字段。这里只记录请求处理用到的字段，总是返回 true，保证整个首部块都被解码
+bool h2_session::on_header(void *arg, const char *name, int name_len, const char *value, int value_len) {
+    stream *s = (stream *)arg;
+
+#define NAME_IS(str) (name_len == (int)sizeof(str) - 1 && memcmp(name, str, name_len) == 0)
+    if (name_len > 0 && name[0] == ':') {
+        if (s->regular_seen)
+            s->malformed = true;
+        if (NAME_IS(":method")) {
+            s->has_method = true;
+            if (value_len == 3 && memcmp(value, "GET", 3) == 0)
+                s->method = http_conn::GET;
+            else if (value_len == 4 && memcmp(value, "POST", 4) == 0)
+                s->method = http_conn::POST;
+            else if (value_len == 3 && memcmp(value, "PUT", 3) == 0)
+                s->method = http_conn::PUT;
+            else
+                s->bad_request = true;
+        }
+        else if (NAME_IS(":path")) {
+            if (value_len == 0 || value_len >= (int)sizeof(s->path) || value[0] != '/') {
+                s->bad_request = true;       // 同样回复 400
+                value_len = 0;
+            }
+            memcpy(s->path, value, value_len);
+            s->path[value_len] = '\0';
+            s->has_path = true;
+        }
+        else if (!NAME_IS(":scheme") && !NAME_IS(":authority")) {
+            s->malformed = true;
+        }
+        return true;
+    }
+
+    s->regular_seen = true;
+    for (int i = 0; i < name_len; ++i) {    // 首部字段名必须是小写
+        if (name[i] >= 'A' && name[i] <= 'Z')
+            s->malformed = true;
+    }
+    if (NAME_IS("content-length")) {
+        s->content_length = 0;
+        for (int i = 0; i < value_len; ++i) {
+            if (value[i] < '0' || value[i] > '9' || s->content_length > (1L << 50)) {
+                s->malformed = true;
+                break;
+            }
+            s->content_length = s->content_length * 10 + value[i] - '0';
+        }
+    }
+    else if (NAME_IS("priority")) {
+        parse_priority(s, value, value_len);
+    }
+    else if (NAME_IS("connection") || NAME_IS("transfer-encoding") || NAME_IS("keep-alive") || NAME_IS("upgrade")) {
+        s->malformed = true;                // HTTP/2 中没有连接级别的首部
+    }
+#undef NAME_IS
+    return true;
+}
+
+// RFC 9218 的优先级字段，例如 "u=1, i"。不认识的参数忽略
+void h2_session::parse_priority(stream *s, const char *value, int len) {
+    for (int i = 0; i < len; ) {
+        while (i < len && (value[i] == ' ' || value[i] == ','))
+            ++i;
+        const char *item = value + i;
+        while (i < len && value[i] != ',')
+            ++i;
+        int n = value + i - item;
+        if (n >= 3 && item[0] == 'u' && item[1] == '=' && item[2] >= '0' && item[2] <= '7')
+            s->urgency = item[2] - '0';
+        else if (n >= 1 && item[0] == 'i')
+            s->incremental = !(n >= 4 && memcmp(item, "i=?0", 4) == 0);
+    }
+}
+
+bool h2_session::on_settings(const uint8_t *payload, int len) {
+    for (int i = 0; i + 6 <= len; i += 6) {
+        int id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get32(payload + i + 2);
+        switch (id) {
+            case SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    fail(PROTOCOL_ERROR);
+                    return false;
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > MAX_WINDOW) {
+                    fail(FLOW_CONTROL_ERROR);
+                    return false;
+                }
+                // 新的初始窗口对所有已经打开的流生效
+                long delta = (long)value - m_peer_window;
+                m_peer_window = value;
+                for (int j = 0; j < MAX_STREAMS; ++j) {
+                    if (m_streams[j])
+                        m_streams[j]->send_window += delta;
+                }
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < (uint32_t)MAX_FRAME_SIZE || value > 0xffffff) {
+                    fail(PROTOCOL_ERROR);
+                    return false;
+                }
+                m_peer_max_frame = value;
+                break;
+            default:                        // 我们不使用动态表编码，也不推送，其余参数都不需要
+                break;
+        }
+    }
+    return true;
+}
+
+void h2_session::on_window_update(uint32_t id, const uint8_t *payload, int len) {
+    if (len != 4) {
+        fail(FRAME_SIZE_ERROR);
+        return;
+    }
+    uint32_t increment = get32(payload) & 0x7fffffff;
+    if (id == 0) {
+        if (increment == 0) {
+            fail(PROTOCOL_ERROR);
+            return;
+        }
+        m_send_window += increment;
+        if (m_send_window > MAX_WINDOW)
+            fail(FLOW_CONTROL_ERROR);
+        return;
+    }
+
+    if (id > m_last_id) {
+        fail(PROTOCOL_ERROR);
+        return;
+    }
+    stream *s = find_stream(id);
+    if (!s || s->closed)
+        return;
+    if (increment == 0)
+        reset_stream(s, PROTOCOL_ERROR);
+    else if ((s->send_window += increment) > MAX_WINDOW)
+        reset_stream(s, FLOW_CONTROL_ERROR);
+}
+
+// 与 HTTP/1.1 的 dispatch 相同的路由：限流、查找路由、按处理器类型生成响应
+void h2_session::on_request(stream *s) {
+    ++m_total_streams;
+    if (s->malformed || !s->has_method || !s->has_path) {
+        reset_stream(s, PROTOCOL_ERROR);
+        return;
+    }
+    if (s->bad_request) {
+        respond(s, 400, error_400_form, strlen(error_400_form));
+        return;
+    }
+    if (!rate_limiter::allow_request((const sockaddr *)&m_address)) {
+        respond(s, 429, nullptr, 0);
+        return;
+    }
+
+    route_match m;
+    if (!router::match(s->path, &m)) {
+        respond(s, 404, error_404_form, strlen(error_404_form));
+        return;
+    }
+
+    const route_target *target = m.target;
+    switch (target->type) {
+        case PROXY_HANDLER:                 // 代理只能在 HTTP/1.1 连接上 splice
+            respond(s, 502, error_502_form, strlen(error_502_form));
+            break;
+        case FUNC_HANDLER: {
+            s->buf = (char *)malloc(http_conn::WRITE_BUFFER_SIZE - http_conn::HANDLER_HEADROOM);
+            if (!s->buf) {
+                respond(s, 500, error_500_form, strlen(error_500_form));
+                break;
+            }
+            response resp;
+            resp.init(s->buf, http_conn::WRITE_BUFFER_SIZE - http_conn::HANDLER_HEADROOM);
+            target->fn(m, &resp);
+            respond(s, resp.m_status, s->buf, resp.m_len, resp.m_content_type);
+            break;
+        }
+        default:
+            if (s->method == http_conn::GET)
+                serve_file(s, m);
+            else if (target->type == UPLOAD_HANDLER)
+                begin_upload(s, m);
+            else
+                respond(s, 400, error_400_form, strlen(error_400_form));
+            break;
+    }
+}
+
+// 静态文件：与 HTTP/1.1 共用路径的生成和文件的检查，文件映射到内存后由 DATA 帧直接引用
+void h2_session::serve_file(stream *s, const route_match &m) {
+    char path[http_conn::FILENAME_LEN];
+    if (!http_conn::build_path(m, s->path, path)) {
+        respond(s, 404, error_404_form, strlen(error_404_form));
+        return;
+    }
+
+    struct stat st;
+    int fd;
+    switch (http_conn::open_file(path, &st, &fd)) {
+        case http_conn::FILE_REQUEST:
+            break;
+        case http_conn::FORBIDDEN_REQUEST:
+            respond(s, 403, error_403_form, strlen(error_403_form));
+            return;
+        case http_conn::BAD_REQUEST:
+            respond(s, 400, error_400_form, strlen(error_400_form));
+            return;
+        default:
+            respond(s, 404, error_404_form, strlen(error_404_form));
+            return;
+    }
+
+    if (st.st_size > 0) {
+        void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            respond(s, 500, error_500_form, strlen(error_500_form));
+            return;
+        }
+        s->map = (char *)map;
+        s->map_len = st.st_size;
+    }
+    close(fd);
+    respond(s, 200, s->map, st.st_size);
+}
+
+// 上传路由：请求体随 DATA 帧写入文件，请求结束时回复 201
+void h2_session::begin_upload(stream *s, const route_match &m) {
+    char name[http_conn::FILENAME_LEN];
+    if (!http_conn::upload_name(m, s->path, name)) {
+        respond(s, 400, error_400_form, strlen(error_400_form));
+        return;
+    }
+    s->body_limit = m.target->max_body > 0 ? m.target->max_body : http_conn::m_max_body;
+    if (s->content_length > s->body_limit) {
+        respond(s, 413, error_413_form, strlen(error_413_form));
+        return;
+    }
+    s->sink = new file_sink;
+    if (!s->sink->open(m.target->dir, name)) {
+        respond(s, 500, error_500_form, strlen(error_500_form));
+        return;
+    }
+    if (s->remote_closed)                   // 空的请求体
+        on_body_end(s);
+}
+
+void h2_session::on_body_end(stream *s) {
+    if (!s->sink || s->ready)
+        return;
+    if (s->content_length >= 0 && s->body_received != s->content_length)
+        respond(s, 400, error_400_form, strlen(error_400_form));
+    else if (s->sink->on_complete())
+        respond(s, 201, ok_201_form, strlen(ok_201_form));
+    else
+        respond(s, 500, error_500_form, strlen(error_500_form));
+}
+
+// 响应在组织下一轮写出时才编码成帧
+void h2_session::respond(stream *s, int status, const char *body, long len, const char *content_type) {
+    if (s->sink && status != 201)
+        s->sink->on_abort();
+    s->status = status;
+    s->body = body;
+    s->body_len = len;
+    s->body_sent = 0;
+    s->content_type = content_type;
+    s->ready = true;
+}
+
+h2_session::stream *h2_session::find_stream(uint32_t id) {
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        if (m_streams[i] && m_streams[i]->id == id)
+            return m_streams[i];
+    }
+    return nullptr;
+}
+
+h2_session::stream *h2_session::open_stream(uint32_t id) {
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        if (m_streams[i])
+            continue;
+        stream *s = new stream;
+        memset(s, 0, sizeof(*s));
+        s->id = id;
+        s->content_length = -1;
+        s->urgency = 3;
+        s->send_window = m_peer_window;
+        s->recv_window = RECV_WINDOW;
+        m_streams[i] = s;
+        ++m_stream_count;
+        return s;
+    }
+    return nullptr;
+}
+
+// 释放已经结束的流。只在一轮写完之后调用，这时没有 iovec 再引用流的响应体
+void h2_session::release_streams() {
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        stream *s = m_streams[i];
+        if (!s || !s->closed)
+            continue;
+        delete s->sink;                     // 没有完成的上传在析构时删除临时文件
+        free(s->buf);
+        if (s->map)
+            munmap(s->map, s->map_len);
+        delete s;
+        m_streams[i] = nullptr;
+        --m_stream_count;
+    }
+}
+
+void h2_session::reset_stream(stream *s, ERROR_CODE code) {
+    if (!s || s->closed)
+        return;
+    uint8_t payload[4];
+    put32(payload, code);
+    queue_frame(RST_STREAM_FRAME, 0, s->id, payload, 4);
+    if (s->sink && !s->ready)
+        s->sink->on_abort();
+    s->closed = true;
+}
+
+// 响应的最后一帧已经放入本轮。对方还在发送请求体时用 RST_STREAM(NO_ERROR) 让它停下
+void h2_session::finish_stream(stream *s) {
+    s->closed = true;
+    if (!s->remote_closed) {
+        uint8_t payload[4];
+        put32(payload, NO_ERROR);
+        queue_frame(RST_STREAM_FRAME, 0, s->id, payload, 4);
+    }
+}
+
+void h2_session::put_frame_header(uint8_t *out, int len, int type, int flags, uint32_t id) {
+    out[0] = len >> 16;
+    out[1] = len >> 8;
+    out[2] = len;
+    out[3] = type;
+    out[4] = flags;
+    put32(out + 5, id);
+}
+
+bool h2_session::queue_frame(int type, int flags, uint32_t id, const void *payload, int len) {
+    int limit = type == GOAWAY_FRAME ? CTRL_SIZE : CTRL_SIZE - GOAWAY_RESERVE;
+    if (m_ctrl_len + FRAME_HEADER + len > limit) {
+        fail(ENHANCE_YOUR_CALM);            // 对方只发送不读取
+        return false;
+    }
+    put_frame_header(m_ctrl + m_ctrl_len, len, type, flags, id);
+    if (len > 0)
+        memcpy(m_ctrl + m_ctrl_len + FRAME_HEADER, payload, len);
+    m_ctrl_len += FRAME_HEADER + len;
+    return true;
+}
+
+void h2_session::queue_window_update(uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    queue_frame(WINDOW_UPDATE_FRAME, 0, id, payload, 4);
+}
+
+void h2_session::fail(ERROR_CODE code) {
+    if (m_failed)
+        return;
+    m_failed = true;
+    if (!m_goaway_sent) {
+        m_goaway_sent = true;
+        uint8_t payload[8];
+        put32(payload, m_last_id);
+        put32(payload + 4, code);
+        queue_frame(GOAWAY_FRAME, 0, 0, payload, 8);
+    }
+}
+
+void h2_session::shutdown() {
+    if (m_goaway_sent)
+        return;
+    m_goaway_sent = true;
+    uint8_t payload[8];
+    put32(payload, m_last_id);
+    put32(payload + 4, NO_ERROR);
+    queue_frame(GOAWAY_FRAME, 0, 0, payload, 8);
+}
+
+bool h2_session::finished() const {
+    if (m_ctrl_len > 0 || m_iov_idx < m_iov_count)
+        return false;
+    if (m_failed)
+        return true;
+    return (m_goaway_sent || m_peer_goaway) && m_stream_count == 0;
+}
+
+int h2_session::pending(struct iovec **iv) {
+    if (m_iov_idx == m_iov_count)
+        build_round();
+    *iv = m_iov + m_iov_idx;
+    return m_iov_count - m_iov_idx;
+}
+
+void h2_session::sent(size_t len) {
+    while (len > 0 && m_iov_idx < m_iov_count) {
+        struct iovec &v = m_iov[m_iov_idx];
+        if (len >= v.iov_len) {
+            len -= v.iov_len;
+            ++m_iov_idx;
+        }
+        else {
+            v.iov_base = (char *)v.iov_base + len;
+            v.iov_len -= len;
+            len = 0;
+        }
+    }
+}
+
+void h2_session::add_iov(const void *data, long len) {
+    if (m_iov_count > 0) {
+        struct iovec &last = m_iov[m_iov_count - 1];
+        if ((const char *)last.iov_base + last.iov_len == data) {
+            last.iov_len += len;            // 与上一块相邻，合并
+            return;
+        }
+    }
+    m_iov[m_iov_count].iov_base = (void *)data;
+    m_iov[m_iov_count].iov_len = len;
+    ++m_iov_count;
+}
+
+void h2_session::add_output(const void *data, int len) {
+    memcpy(m_out + m_out_len, data, len);
+    add_iov(m_out + m_out_len, len);
+    m_out_len += len;
+}
+
+bool h2_session::round_full() const {
+    return m_iov_count + 2 > ROUND_IOVS || m_out_len + FRAME_HEADER > OUTPUT_SIZE || m_round_bytes >= ROUND_BYTES;
+}
+
+// HEADERS 帧：:status、content-type、content-length。没有响应体时同时结束流
+void h2_session::add_headers(stream *s) {
+    uint8_t *frame = m_out + m_out_len;
+    uint8_t *p = frame + FRAME_HEADER;
+    p += hpack_decoder::encode_status(p, s->status);
+    if (s->body_len > 0) {
+        int type_len = strnlen(s->content_type, 100);
+        p += hpack_decoder::encode_header(p, hpack_decoder::CONTENT_TYPE, s->content_type, type_len);
+    }
+    char digits[24];
+    int n = snprintf(digits, sizeof(digits), "%ld", s->body_len);
+    p += hpack_decoder::encode_header(p, hpack_decoder::CONTENT_LENGTH, digits, n);
+    if (s->status == 429)
+        p += hpack_decoder::encode_header(p, hpack_decoder::RETRY_AFTER, "1", 1);
+
+    int len = p - frame - FRAME_HEADER;
+    put_frame_header(frame, len, HEADERS_FRAME, FLAG_END_HEADERS | (s->body_len == 0 ? FLAG_END_STREAM : 0), s->id);
+    add_iov(frame, FRAME_HEADER + len);
+    m_out_len += FRAME_HEADER + len;
+    s->headers_sent = true;
+    if (s->body_len == 0)
+        finish_stream(s);
+}
+
+// 在窗口允许的范围内为流放入一个 DATA 帧，帧的负载直接引用响应体
+bool h2_session::add_data(stream *s) {
+    if (round_full() || s->closed || !s->headers_sent)
+        return false;
+    long n = s->body_len - s->body_sent;
+    n = std::min(n, (long)m_peer_max_frame);
+    n = std::min(n, std::min(s->send_window, m_send_window));
+    n = std::min(n, ROUND_BYTES - m_round_bytes);
+    if (n <= 0)
+        return false;
+
+    bool last = s->body_sent + n == s->body_len;
+    uint8_t *frame = m_out + m_out_len;
+    put_frame_header(frame, n, DATA_FRAME, last ? FLAG_END_STREAM : 0, s->id);
+    add_iov(frame, FRAME_HEADER);
+    m_out_len += FRAME_HEADER;
+    add_iov(s->body + s->body_sent, n);
+
+    s->body_sent += n;
+    s->send_window -= n;
+    m_send_window -= n;
+    m_round_bytes += n;
+    if (last)
+        finish_stream(s);
+    return true;
+}
+
+// 组织一轮写出：控制帧，所有新生成的响应的 HEADERS 帧，然后按优先级分配 DATA 帧。
+// 优先级数字小的先发送；同一优先级中，非增量的流按 ID 顺序逐个发完，增量的流轮流每次发一帧
+void h2_session::build_round() {
+    m_iov_count = m_iov_idx = 0;
+    m_out_len = 0;
+    m_round_bytes = 0;
+    release_streams();
+
+    // 控制帧，以及 h2c 升级的 101 响应
+    if (m_ctrl_len > 0) {
+        add_output(m_ctrl, m_ctrl_len);
+        m_ctrl_len = 0;
+    }
+    if (m_failed)
+        return;
+
+    stream *order[MAX_STREAMS];
+    int count = 0;
+    for (int i = 0; i < MAX_STREAMS; ++i) {
+        stream *s = m_streams[i];
+        if (!s || s->closed || !s->ready)
+            continue;
+        if (!s->headers_sent) {
+            if (m_out_len + FRAME_HEADER + 160 > OUTPUT_SIZE || m_iov_count + 1 > ROUND_IOVS)
+                continue;
+            add_headers(s);
+            if (s->closed)
+                continue;
+        }
+        order[count++] = s;
+    }
+    std::sort(order, order + count, [](const stream *a, const stream *b) {
+        if (a->urgency != b->urgency)
+            return a->urgency < b->urgency;
+        if (a->incremental != b->incremental)
+            return !a->incremental;
+        return a->id < b->id;
+    });
+
+    for (int i = 0; i < count && m_send_window > 0 && !round_full(); ) {
+        int j = i;
+        while (j < count && order[j]->urgency == order[i]->urgency && !order[j]->incremental) {
+            while (add_data(order[j]))
+                ;
+            ++j;
+        }
+        int k = j;
+        while (k < count && order[k]->urgency == order[i]->urgency)
+            ++k;
+        for (bool progress = true; progress; ) {
+            progress = false;
+            for (int x = j; x < k; ++x)
+                progress |= add_data(order[x]);
+        }
+        i = k;
+    }
+
+    // 本轮放入的 RST_STREAM(NO_ERROR) 等控制帧留到下一轮，保证在流的最后一帧之后发出
+}
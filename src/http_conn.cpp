@@ -1,15 +1,29 @@
 #include "http_conn.h"
+#include "upgrade.h"
+#include "http2.h"
+#include "threadpool.h"
+#include "probes.h"
+#include <time.h>
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
+const char* ok_201_title = "Created";
+const char* ok_201_form = "The uploaded file has been stored.\n";
+const char* continue_100 = "HTTP/1.1 100 Continue\r\n\r\n";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_411_title = "Length Required";
+const char* error_411_form = "This server requires a Content-Length for proxied request bodies.\n";
+const char* error_413_title = "Payload Too Large";
+const char* error_413_form = "The request body is larger than this server allows.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server is unavailable or sent an invalid response.\n";
 
 // 网站的根目录
 const char* doc_root = "/home/pawcook/webserver/resources";
@@ -42,80 +56,655 @@ void removefd(int epollfd, int fd) {
     close(fd);
 }
 
-// 修改文件描述符，重置socket上的EPOLLONESHOT事件，以确保下一次连接 socket 可读时，EPOLLIN 事件能被触发
-void modfd(int epollfd, int fd, int ev) {
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;            // ET 边缘触发；    EPOLLRDHUP：对端套接字关闭
-    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
-}
-
 // 所有的客户数
 int http_conn::m_user_count = 0;
+// 请求体的默认上限
+long http_conn::m_max_body = 1024 * 1024;
+std::atomic<bool> http_conn::m_draining(false);
+bool http_conn::m_coro_mode = false;
 // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
 int http_conn::m_epollfd = -1;
+threadpool<http_conn> *http_conn::m_pool = nullptr;
+int http_conn::m_done_fd = -1;
+std::atomic<long> http_conn::m_epoll_ctls(0);
+static std::atomic<http_conn *> done_head(nullptr);        // 完成队列，工作线程压入，主线程一次全部取出
+// 各阶段的期限：首部 20 秒，请求体两次数据之间 30 秒，长连接空闲 60 秒，发送响应 30 秒加上按 1KB/s 计算的时间
+int http_conn::m_phase_timeout[PHASE_COUNT] = {20, 30, 60, 30};
+long http_conn::m_min_send_rate = 1024;
+int http_conn::m_recheck = 5;
+std::atomic<long> http_conn::m_timeouts[PHASE_COUNT];
+threadpool<http_conn::fetch_job> *http_conn::m_io_pool = nullptr;
+std::atomic<long> http_conn::m_cold_fetches(0);
+// 长连接：每个连接最多 1000 个请求，容量在启动时按文件描述符的上限设置
+int http_conn::m_keepalive_requests = 1000;
+int http_conn::m_capacity = 65535;
+std::atomic<long> http_conn::m_keepalive_reuses(0);
+std::atomic<long> http_conn::m_requests_total(0);
+std::atomic<long> http_conn::m_keepalive_declined(0);
+// 每轮的预算：每个连接 256KB、32 次收发，每轮 accept 64 个连接
+long http_conn::m_turn_bytes = 256 * 1024;
+int http_conn::m_turn_calls = 32;
+int http_conn::m_accept_budget = 64;
+std::atomic<long> http_conn::m_budget_yields(0);
+std::atomic<long> http_conn::m_accept_deferred(0);
+http_conn *http_conn::m_ready_head = nullptr;
+http_conn *http_conn::m_ready_tail = nullptr;
+http_conn::fetch_job *http_conn::m_fetch_retry_head = nullptr;
+http_conn::fetch_job *http_conn::m_fetch_retry_tail = nullptr;
+static thread_local bool on_worker = false;         // 当前线程是线程池的工作线程
+static timer_wheel deadline_wheel;          // 所有连接的期限，只由主线程访问
+
+static long now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static long now_sec() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
 
 // 关闭连接
 void http_conn::close_conn() {
+    deadline_wheel.remove(&m_timer);
+    abort_body();
+    unmap();
+    delete m_h2;
+    m_h2 = nullptr;
+    m_tls.close();
     if(m_sockfd != -1) {
+        PROBE2(close, m_sockfd, m_requests);
+        capture::close(m_capture_id);
         removefd(m_epollfd, m_sockfd);
+        ++m_epoll_ctls;
         m_sockfd = -1;
         m_user_count--; // 关闭一个连接，将客户总数量-1
     }
 }
 
+// 关闭空闲的长连接。协程模式下连接由协程持有，只关闭 socket 的读写，协程被唤醒后会自行清理
+void http_conn::close_idle() {
+    if (m_coro_active)
+        shutdown(m_sockfd, SHUT_RDWR);
+    else
+        close_conn();
+}
+
+// 主线程收到线程池模式的连接上的事件。连接由工作线程持有时只把事件记在状态字中，
+// 工作线程交还连接时会看到它们；否则由主线程直接处理
+void http_conn::on_events(uint32_t events) {
+    uint32_t bits = 0;
+    if (events & EPOLLIN)
+        bits |= EV_IN;
+    if (events & EPOLLOUT)
+        bits |= EV_OUT;
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        bits |= EV_HUP;
+    if (m_state.fetch_or(bits, std::memory_order_acq_rel) & EV_OWNED)
+        return;
+    run_events();
+}
+
+// 主线程持有连接。边缘触发的事件只通知一次，没有处理的事件一直留在状态字中：
+// 等待可写时到达的下一个请求，在响应写完之后接着读取
+void http_conn::run_events() {
+    if (m_sockfd == -1)
+        return;
+    begin_turn();
+    uint32_t pending = m_state.load(std::memory_order_relaxed);
+    if (pending & (EV_HUP | EV_CLOSE)) {        // 异常断开、出错，或者工作线程要求关闭
+        m_state.store(0, std::memory_order_relaxed);
+        close_conn();
+        return;
+    }
+
+    // TLS 握手和 HTTP/2 的读写都由工作线程完成
+    if (io_in_worker()) {
+        if ((pending & EV_IN) || (m_want_write && (pending & EV_OUT)))
+            hand_off();
+        else
+            m_state.store(0, std::memory_order_relaxed);
+        return;
+    }
+
+    // 继续发送没有写完的响应
+    if (m_want_write) {
+        if (!(pending & EV_OUT))
+            return;
+        m_state.store(pending & EV_IN, std::memory_order_relaxed);
+        if (!write()) {
+            close_conn();
+            return;
+        }
+        if (m_fetching) {
+            start_fetch();
+            return;
+        }
+        if (m_budget_out) {                     // socket 仍然可写，排到就绪链表中继续
+            m_budget_out = false;
+            make_ready(EV_OUT);
+            return;
+        }
+        if (m_want_write)
+            return;
+        pending = m_state.load(std::memory_order_relaxed);
+    }
+
+    m_state.store(0, std::memory_order_relaxed);
+    if (!(pending & EV_IN) && !m_pipelined)
+        return;
+    int read_start = m_read_idx;
+    if (!read()) {                              // 将所有数据读出
+        close_conn();
+        return;
+    }
+    if (m_read_idx > read_start || m_body_splice || m_pipelined)
+        hand_off();
+}
+
+// 把连接交给线程池，之后主线程收到的事件都记在状态字中
+void http_conn::hand_off() {
+    m_state.store(EV_OWNED, std::memory_order_release);
+    trace(tracer::ENQUEUE);
+    int cls = cost_class();
+    PROBE2(enqueue, m_sockfd, cls);
+    if (!m_pool->append(this, cls)) {           // 队列已满
+        m_state.store(0, std::memory_order_relaxed);
+        close_conn();
+    }
+}
+
+// 新请求按请求行中的 URL 查询以前处理同一个 URL 的开销。TLS 握手的开销按第 2 类计算，
+// HTTP/2 连接上同时有多个流，按默认类别计算
+int http_conn::cost_class() {
+    if (m_tls.handshaking())
+        return 2;
+    if (m_h2)
+        return cost_table::UNKNOWN_CLASS;
+    if (!m_cost_key && m_check_state == CHECK_STATE_REQUESTLINE)
+        m_cost_key = cost_table::key(m_read_buf, m_read_idx);
+    return cost_table::lookup(m_cost_key);
+}
+
+// 工作线程处理完毕，交还连接。持有期间记录下来的事件已经被边缘触发消耗掉了，
+// 其中有需要处理的事件时，连接经过完成队列交给主线程，由主线程处理这些事件；否则直接清空状态字
+void http_conn::release() {
+    uint32_t interest = EV_IN | EV_HUP | (m_want_write ? EV_OUT : 0);
+    // 读缓冲区满时停止了读取，socket 中的数据不会再触发可读事件；OpenSSL 中已经解密的数据也一样
+    // 流水线发来的下一个请求已经在读缓冲区中，也不会再触发可读事件
+    bool more = !m_h2 && !m_body_splice && (!m_read_drained || m_tls.pending() || m_pipelined);
+
+    // 因为预算用完而停止发送时 socket 仍然可写，同样不会再触发可写事件
+    if (m_budget_out) {
+        m_budget_out = false;
+        m_budget_yields.fetch_add(1, std::memory_order_relaxed);
+        m_state.fetch_or(EV_OUT, std::memory_order_relaxed);
+    }
+
+    uint32_t state = m_state.load(std::memory_order_relaxed);
+    while (!more && !(state & interest)) {
+        if (m_state.compare_exchange_weak(state, 0, std::memory_order_acq_rel, std::memory_order_relaxed))
+            return;
+    }
+    if (more)
+        m_state.fetch_or(EV_IN, std::memory_order_relaxed);
+    post_completion();
+}
+
+void http_conn::close_from_worker() {
+    m_state.fetch_or(EV_CLOSE, std::memory_order_relaxed);
+    post_completion();
+}
+
+// 压入完成队列（无锁栈）。连接仍然标记为 EV_OWNED，主线程取出之前不会把它交给别的工作线程，
+// 因此一个连接同时只会在队列中出现一次。压入空队列的线程负责唤醒主线程
+void http_conn::post_completion() {
+    http_conn *head = done_head.load(std::memory_order_relaxed);
+    do {
+        m_done_next = head;
+    } while (!done_head.compare_exchange_weak(head, this, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    if (!head) {
+        uint64_t one = 1;
+        ::write(m_done_fd, &one, sizeof(one));
+    }
+}
+
+void http_conn::drain_completions() {
+    uint64_t count;
+    ::read(m_done_fd, &count, sizeof(count));
+
+    // 一次取出整个栈，反转成压入的顺序
+    http_conn *list = done_head.exchange(nullptr, std::memory_order_acq_rel);
+    http_conn *ordered = nullptr;
+    while (list) {
+        http_conn *next = list->m_done_next;
+        list->m_done_next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while (ordered) {
+        http_conn *conn = ordered;
+        ordered = conn->m_done_next;            // 处理过程中连接可能被再次交给线程池，先取出下一个
+        conn->m_fetching = false;
+        if (m_coro_mode) {                      // 协程模式只有预读完成的连接，恢复等待发送文件的协程
+            conn->resume(EPOLLOUT);
+            continue;
+        }
+        conn->m_state.fetch_and(~EV_OWNED, std::memory_order_acq_rel);
+        conn->run_events();
+    }
+}
+
+// 解析 "header=s,body=s,idle=s,write=s[:rate]"，没有给出的阶段保持默认值，0 表示该阶段不限时。
+// write 的 rate 是发送响应的最低速率（字节/秒），期限按响应的大小延长
+bool http_conn::parse_deadlines(const char *spec) {
+    static const char *names[PHASE_COUNT] = {"header", "body", "idle", "write"};
+    char buf[256];
+    if (strlen(spec) >= sizeof(buf))
+        return false;
+    strcpy(buf, spec);
+
+    char *save = nullptr;
+    for (char *item = strtok_r(buf, ",", &save); item; item = strtok_r(nullptr, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq)
+            return false;
+        *eq = '\0';
+        int phase = 0;
+        while (phase < PHASE_COUNT && strcmp(item, names[phase]) != 0)
+            ++phase;
+        if (phase == PHASE_COUNT)
+            return false;
+
+        char *end;
+        long seconds = strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || seconds < 0)
+            return false;
+        if (phase == PHASE_WRITE && *end == ':') {
+            char *rate = end + 1;
+            m_min_send_rate = strtol(rate, &end, 10);
+            if (end == rate || m_min_send_rate < 0)
+                return false;
+        }
+        if (*end != '\0')
+            return false;
+        m_phase_timeout[phase] = seconds;
+    }
+
+    // 期限提前时（例如空闲的长连接收到新请求）要靠复查发现，复查间隔取最短期限的四分之一
+    m_recheck = 0;
+    for (int i = 0; i < PHASE_COUNT; ++i) {
+        int check = m_phase_timeout[i] / 4 > 0 ? m_phase_timeout[i] / 4 : 1;
+        if (m_phase_timeout[i] > 0 && (m_recheck == 0 || check < m_recheck))
+            m_recheck = check;
+    }
+    return true;
+}
+
+// 解析 "requests[:capacity]"：每个连接的请求数上限（0 表示不限）和计算负载时使用的连接数容量
+bool http_conn::parse_keepalive(const char *spec) {
+    char *end;
+    long requests = strtol(spec, &end, 10);
+    if (end == spec || requests < 0 || requests > INT32_MAX)
+        return false;
+    m_keepalive_requests = requests;
+    if (*end == ':') {
+        const char *p = end + 1;
+        long capacity = strtol(p, &end, 10);
+        if (end == p || capacity <= 0 || capacity > INT32_MAX)
+            return false;
+        m_capacity = capacity;
+    }
+    return *end == '\0';
+}
+
+// 连接数由主线程修改，工作线程读到的值可能稍旧，对于选择等级没有影响
+int http_conn::keepalive_level() {
+    long percent = (long)m_user_count * 100 / m_capacity;
+    if (percent < 50)
+        return 0;
+    if (percent < 75)
+        return 1;
+    if (percent < 90)
+        return 2;
+    return 3;
+}
+
+// 解析 "bytes_kb[:calls[:accepts]]"，0 表示不限，没有给出的项保持默认值
+bool http_conn::parse_budget(const char *spec) {
+    long values[3] = {m_turn_bytes / 1024, m_turn_calls, m_accept_budget};
+    const char *p = spec;
+    for (int i = 0; i < 3; ++i) {
+        char *end;
+        values[i] = strtol(p, &end, 10);
+        if (end == p || values[i] < 0 || values[i] > INT32_MAX)
+            return false;
+        if (*end == '\0')
+            break;
+        if (*end != ':' || i == 2)
+            return false;
+        p = end + 1;
+    }
+    m_turn_bytes = values[0] * 1024;
+    m_turn_calls = values[1];
+    m_accept_budget = values[2];
+    return true;
+}
+
+bool http_conn::over_budget() const {
+    return (m_turn_bytes > 0 && m_turn_used_bytes >= m_turn_bytes) || (m_turn_calls > 0 && m_turn_used_calls >= m_turn_calls);
+}
+
+// 线程池模式下 bits 记入状态字，连接被工作线程持有时由它交还后处理；协程模式下 bits 为 0，由 run_ready 恢复协程
+void http_conn::make_ready(uint32_t bits) {
+    m_budget_yields.fetch_add(1, std::memory_order_relaxed);
+    if (bits)
+        m_state.fetch_or(bits, std::memory_order_relaxed);
+    if (m_ready)
+        return;
+    m_ready = true;
+    m_ready_next = nullptr;
+    if (m_ready_tail)
+        m_ready_tail->m_ready_next = this;
+    else
+        m_ready_head = this;
+    m_ready_tail = this;
+}
+
+// 处理当前链表中的连接，处理期间再次用完预算的连接排在新的链表中，下一轮再处理。
+// 连接在链表中时可能已经关闭甚至被新的连接重用，run_events 和 m_yielded 会过滤掉这种情况
+void http_conn::run_ready() {
+    http_conn *conn = m_ready_head;
+    m_ready_head = m_ready_tail = nullptr;
+    while (conn) {
+        http_conn *next = conn->m_ready_next;
+        conn->m_ready = false;
+        if (!m_coro_mode) {
+            conn->on_events(0);
+        }
+        else if (conn->m_yielded) {
+            conn->begin_turn();
+            conn->m_waiter.resume();
+        }
+        conn = next;
+    }
+}
+
+int http_conn::keepalive_timeout() const {
+    int timeout = m_phase_timeout[PHASE_IDLE] >> m_keepalive_level;
+    return timeout > 0 ? timeout : 1;
+}
+
+// 期限只是写入 m_deadline，不访问时间轮，因此工作线程也可以调用
+void http_conn::set_phase(PHASE phase, long extra) {
+    if (m_recheck == 0)
+        return;
+    if (m_phase_timeout[phase] <= 0) {
+        m_deadline.store(PHASE_NONE, std::memory_order_release);
+        return;
+    }
+    uint64_t expire = now_sec() + m_phase_timeout[phase] + extra;
+    m_deadline.store(expire << 3 | phase, std::memory_order_release);
+}
+
+// 连接在时间轮中的位置不随期限移动：期限推迟时，时间轮转到旧的位置再把连接放到新的位置；
+// 期限提前时不会被立即发现，所以连接最晚每 m_recheck 秒被检查一次
+void http_conn::arm_timer(long now) {
+    uint64_t deadline = m_deadline.load(std::memory_order_acquire);
+    long at = now + m_recheck;
+    if ((deadline & 7) != PHASE_NONE && (long)(deadline >> 3) < at)
+        at = deadline >> 3;
+    deadline_wheel.add(&m_timer, at);
+}
+
+void http_conn::check_deadlines() {
+    if (m_recheck == 0)
+        return;
+    long now = now_sec();
+    if (now == deadline_wheel.current())
+        return;
+    deadline_wheel.advance(now, [now](wheel_node *node) {
+        ((http_conn *)node->data)->on_deadline(now);
+    });
+}
+
+void http_conn::on_deadline(long now) {
+    uint64_t deadline = m_deadline.load(std::memory_order_acquire);
+    PHASE phase = (PHASE)(deadline & 7);
+    if (phase == PHASE_NONE || (long)(deadline >> 3) > now) {
+        arm_timer(now);
+        return;
+    }
+
+    // 工作线程正在处理连接，下一秒再检查
+    if (!m_coro_mode && (m_state.load(std::memory_order_acquire) & EV_OWNED)) {
+        deadline_wheel.add(&m_timer, now + 1);
+        return;
+    }
+
+    m_timeouts[phase].fetch_add(1, std::memory_order_relaxed);
+    PROBE2(timeout, m_sockfd, (int)phase);
+    if (m_coro_mode) {              // 连接由协程持有，关闭 socket 的读写后协程被唤醒，自行清理
+        m_deadline.store(PHASE_NONE, std::memory_order_relaxed);
+        shutdown(m_sockfd, SHUT_RDWR);
+        return;
+    }
+    m_state.store(0, std::memory_order_relaxed);
+    close_conn();
+}
+
+// mincore 检查映射区中对应的页。检查过的范围记在 m_resident_end 中，同一个响应之后的发送不再重复检查
+bool http_conn::file_resident(off_t offset, size_t len) {
+    if (!m_file_address || len == 0 || offset + (off_t)len <= m_resident_end)
+        return true;
+
+    static const long page = sysconf(_SC_PAGESIZE);
+    off_t start = offset & ~(page - 1);
+    size_t span = offset + len - start;
+    unsigned char vec[COLD_WINDOW / 4096 + 2];
+    if ((span + page - 1) / page > sizeof(vec) || mincore(m_file_address + start, span, vec) == -1)
+        return true;                            // 无法判断时按在页缓存中处理
+    for (size_t i = 0; i < (span + page - 1) / page; ++i) {
+        if (!(vec[i] & 1)) {
+            size_t fetch = m_file_stat.st_size - start;
+            m_fetch.conn = this;
+            m_fetch.addr = m_file_address + start;
+            m_fetch.len = fetch < (size_t)FETCH_SIZE ? fetch : FETCH_SIZE;
+            return false;
+        }
+    }
+    m_resident_end = offset + len;
+    return true;
+}
+
+// 调用者持有连接。线程池模式下连接标记为 EV_OWNED，预读期间主线程收到的事件只记在状态字中
+void http_conn::start_fetch() {
+    m_fetching = true;
+    ++m_cold_fetches;
+    if (!m_coro_mode)
+        m_state.fetch_or(EV_OWNED, std::memory_order_acq_rel);
+    if (m_io_pool->append(&m_fetch))
+        return;
+
+    // 队列已满。工作线程本来就可能阻塞，直接在当前线程中预读；主线程不能等待磁盘，
+    // 任务排入重试链表，由主循环稍后再交给 I/O 线程池
+    if (on_worker) {
+        m_fetch.process();
+        return;
+    }
+    m_fetch.next = nullptr;
+    if (m_fetch_retry_tail)
+        m_fetch_retry_tail->next = &m_fetch;
+    else
+        m_fetch_retry_head = &m_fetch;
+    m_fetch_retry_tail = &m_fetch;
+}
+
+// 按顺序重新提交，队列仍然满时停下，剩下的下一轮再试
+void http_conn::retry_fetches() {
+    while (m_fetch_retry_head) {
+        fetch_job *job = m_fetch_retry_head;
+        fetch_job *next = job->next;            // 提交之后任务随时可能完成，不再访问它
+        if (!m_io_pool->append(job))
+            return;
+        m_fetch_retry_head = next;
+        if (!next)
+            m_fetch_retry_tail = nullptr;
+    }
+}
+
+// 先用 MADV_WILLNEED 让内核一次发起整个范围的预读，再逐页访问，等待这些页都读入页缓存
+void http_conn::fetch_job::process() {
+    madvise(addr, len, MADV_WILLNEED);
+    static const long page = sysconf(_SC_PAGESIZE);
+    long sum = 0;
+    for (size_t i = 0; i < len; i += page)
+        sum += ((volatile char *)addr)[i];
+    (void)sum;
+
+    // 交还连接：线程池模式由主线程在可写时继续发送，协程模式恢复协程
+    conn->m_state.fetch_or(EV_OUT, std::memory_order_relaxed);
+    conn->post_completion();
+}
+
 // 初始化连接,外部调用初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in& addr){
+void http_conn::init(int sockfd, const sockaddr_storage& addr, const sock_options *opts, bool tls){
     m_sockfd = sockfd;
     m_address = addr;
-    
-    // 端口复用
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    addfd(m_epollfd, sockfd, true);
+    m_sockopt = opts;
+
+    opts->apply_conn(m_sockfd);
+    if (tls)
+        m_tls.start(sockfd);
     m_user_count++;
+    m_idle = true;
+    m_capture_id = capture::open();
+    m_requests = 0;
+    m_keepalive_level = 0;
+    m_file_waiting = false;
+    m_budget_out = false;               // 连接可能还在就绪链表中（旧连接关闭前排入的），m_ready 保持不变
+    m_yielded = false;
+    begin_turn();
     init();
+    trace(tracer::ACCEPT);
+    PROBE2(accept, sockfd, tls);
+    m_state.store(0);
+    m_want_write = false;
+    m_read_drained = true;
+
+    // 在首部的期限内必须完成 TLS 握手并发来完整的首部
+    set_phase(PHASE_HEADER);
+    if (m_recheck > 0) {
+        m_timer.data = this;
+        arm_timer(now_sec());
+    }
+
+    // 注册一次读写事件后不再修改：协程模式只有主线程访问连接，线程池模式由状态字决定谁处理事件
+    epoll_event event;
+    event.data.fd = sockfd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, sockfd, &event);
+    ++m_epoll_ctls;
+    setnonblocking(sockfd);
+    if (m_coro_mode) {
+        m_coro_active = true;
+        serve();
+    }
 }
 
-void http_conn::init()
+void http_conn::init(int pipelined)
 {
 
     bytes_to_send = 0;
     bytes_have_send = 0;
+    m_trace_id = tracer::begin();
+    m_cost_key = 0;
+    // 空闲期限随长连接策略的等级缩短，与响应中 Keep-Alive 首部的 timeout 一致
+    set_phase(PHASE_IDLE, m_phase_timeout[PHASE_IDLE] > 0 ? keepalive_timeout() - m_phase_timeout[PHASE_IDLE] : 0);
 
     m_check_state = CHECK_STATE_REQUESTLINE;    // 初始状态为检查请求行
-    m_linger = false;       // 默认不保持链接  Connection : keep-alive保持连接
+    m_linger = false;       // 解析请求行之后按 HTTP 版本设置默认值
 
     m_method = GET;         // 默认请求方式为GET
     m_url = 0;              
     m_version = 0;
+    m_status = 0;
     m_content_length = 0;
+    m_chunked = false;
+    m_expect_continue = false;
+    m_upgrade_h2 = false;
+    m_h2_settings = 0;
+    m_body_handler = nullptr;
+    m_upload = nullptr;
+    m_body_limit = 0;
+    m_body_received = 0;
+    m_body_remaining = 0;
+    m_chunk_state = CHUNK_SIZE;
+    m_chunk_left = 0;
+    m_body_splice = false;
     m_host = 0;
+    m_headers_idx = 0;
+    m_route.target = nullptr;
     m_start_line = 0;       
     m_checked_idx = 0;
-    m_read_idx = 0;
+    m_read_idx = pipelined;
+    m_pipelined = pipelined > 0;
     m_write_idx = 0;
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);
+    bzero(m_read_buf + pipelined, READ_BUFFER_SIZE - pipelined);
     bzero(m_write_buf, READ_BUFFER_SIZE);
     bzero(m_request_path, FILENAME_LEN);
 }
 
+// 请求和请求体都已经处理完，m_checked_idx 之后的数据属于下一个请求。
+// 线程池模式下交还连接时，release 和 run_events 看到 m_pipelined 会立即再次交给线程池，不等待可读事件
+void http_conn::next_request() {
+    int left = m_read_idx - m_checked_idx;
+    if (left < 0)
+        left = 0;
+    if (left > 0)
+        memmove(m_read_buf, m_read_buf + m_checked_idx, left);
+    init(left);
+    m_idle = !m_pipelined;
+}
+
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read() {
     if(m_read_idx >= READ_BUFFER_SIZE) {        // 如果读缓冲区已满
         return false;
     }
 
+    // 请求体正在被 splice 直接写入文件，数据留在 socket 中由工作线程处理
+    if (m_body_splice) {
+        return true;
+    }
+
+    // TLS 握手和 HTTP/2 连接的读写由工作线程完成
+    if (m_tls.handshaking() || m_h2) {
+        m_idle = false;
+        return true;
+    }
+
     int bytes_read = 0;
+    int read_start = m_read_idx;
+    m_read_drained = false;
 
-    while(true) {
+    // 读到缓冲区满为止。接收请求体时，工作线程会腾出缓冲区，然后重新注册读事件
+    while(m_read_idx < READ_BUFFER_SIZE) {
         // 从 m_read_buf + m_read_idx 索引处开始保存数据，大小是 READ_BUFFER_SIZE - m_read_idx
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        if (m_tls.active())
+            bytes_read = m_tls.read(m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx);
+        else
+            bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
         
         if (bytes_read == -1) {         // 读取数据失败，可能的原因是被中断或者连接 socket 收到了 RST 
             if(errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 套接字的读缓冲区中的数据读完
+                m_read_drained = true;
                 break;
             }
             return false;   
@@ -123,9 +712,18 @@ bool http_conn::read() {
         else if (bytes_read == 0) {    // 对方关闭了写端，服务端收到 FIN，读到了文件结尾
             return false;
         }
+        capture::data(m_capture_id, m_read_buf + m_read_idx, bytes_read);
         m_read_idx += bytes_read;
+        m_idle = false;
+        charge(bytes_read);
+        if (over_budget())              // 这一轮的预算用完，m_read_drained 为 false，交还连接时会再次读取
+            break;
     }
 
+    if (m_read_idx > read_start) {
+        trace(tracer::READ);
+        PROBE2(read, m_sockfd, m_read_idx - read_start);
+    }
     return true;
 }
 
@@ -171,6 +769,10 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     char* method = text;
     if (strcasecmp(method, "GET") == 0)     // 忽略大小写比较
         m_method = GET;
+    else if (strcasecmp(method, "POST") == 0)
+        m_method = POST;
+    else if (strcasecmp(method, "PUT") == 0)
+        m_method = PUT;
     else
         return BAD_REQUEST;
 
@@ -181,7 +783,11 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
         return BAD_REQUEST;
 
     *m_version++ = '\0';
-    if (strcasecmp(m_version, "HTTP/1.1") != 0) 
+    if (strcasecmp(m_version, "HTTP/1.1") == 0)
+        m_linger = true;                        // HTTP/1.1 默认保持连接
+    else if (strcasecmp(m_version, "HTTP/1.0") == 0)
+        m_linger = false;                       // HTTP/1.0 只有带 Connection: keep-alive 时才保持连接
+    else
         return BAD_REQUEST;
     
     // 有的请求可能是这种样子：http://192.168.110.129:10000/index.html
@@ -192,6 +798,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
     if (!m_url || m_url[0] != '/') 
         return BAD_REQUEST;
 
+    m_headers_idx = m_checked_idx;             // 请求行之后就是首部字段
     m_check_state = CHECK_STATE_HEADER;        // 检查状态变成检查首部字段
     return NO_REQUEST;
 }
@@ -200,21 +807,19 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
 http_conn::HTTP_CODE http_conn::parse_headers(char* text) {   
     // 遇到空行，表示首部字段解析完毕
     if(text[0] == '\0') {
-        // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
-        // 状态机转移到CHECK_STATE_CONTENT状态
-        if (m_content_length != 0) {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
-        }
-        // 否则说明我们已经得到了一个完整的HTTP请求
-        return GET_REQUEST;
+        return dispatch();
     } 
-    // 处理Connection 头部字段  Connection: keep-alive
+    // 处理Connection 头部字段，值是逗号分隔的列表，例如 Connection: keep-alive 或 Connection: Upgrade, HTTP2-Settings
     else if (strncasecmp(text, "Connection:", 11) == 0) {
         text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0) {
-            m_linger = true;
+        char *save = nullptr;
+        for (char *token = strtok_r(text, ", \t", &save); token; token = strtok_r(nullptr, ", \t", &save)) {
+            if (strcasecmp(token, "close") == 0) {
+                m_linger = false;
+                break;
+            }
+            if (strcasecmp(token, "keep-alive") == 0)
+                m_linger = true;
         }
     }
     // 处理Content-Length头部字段
@@ -222,41 +827,497 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
         text += 15;
         text += strspn(text, " \t");
         m_content_length = atol(text);
+        if (m_content_length < 0)
+            return BAD_REQUEST;
+    }
+    // 处理Transfer-Encoding头部字段  Transfer-Encoding: chunked
+    else if (strncasecmp(text, "Transfer-Encoding:", 18) == 0) {
+        text += 18;
+        text += strspn(text, " \t");
+        if (strcasecmp(text, "chunked") != 0)
+            return BAD_REQUEST;
+        m_chunked = true;
+    }
+    // 处理Expect头部字段  Expect: 100-continue
+    else if (strncasecmp(text, "Expect:", 7) == 0) {
+        text += 7;
+        text += strspn(text, " \t");
+        if (strcasecmp(text, "100-continue") == 0)
+            m_expect_continue = true;
     } 
+    // 处理Upgrade头部字段  Upgrade: h2c
+    else if (strncasecmp(text, "Upgrade:", 8) == 0) {
+        text += 8;
+        text += strspn(text, " \t");
+        if (strcasecmp(text, "h2c") == 0)
+            m_upgrade_h2 = true;
+    }
+    // 处理HTTP2-Settings头部字段，升级到 h2c 时使用
+    else if (strncasecmp(text, "HTTP2-Settings:", 15) == 0) {
+        text += 15;
+        text += strspn(text, " \t");
+        m_h2_settings = text;
+    }
     else if (strncasecmp(text, "Host:", 5) == 0) {
         // 处理Host头部字段
         text += 5;
         text += strspn(text, " \t");
         m_host = text;
-    } 
-    else
-        std::cout << "oop! unknow header " << text << std::endl;
+    }
 
     return NO_REQUEST;
 }
 
-// 我们没有真正解析 HTTP 请求的消息体，只是判断它是否被完整的读入到读缓冲区中
-http_conn::HTTP_CODE http_conn::parse_content(char* text) {
-    if (m_read_idx >= (m_content_length + m_checked_idx))
-    {
-        text[m_content_length] = '\0';
-        return GET_REQUEST;
+// 首部解析完毕，在路由表中查找处理器。接收请求体时首部会被覆盖，用到 URL 的工作都在这里完成
+http_conn::HTTP_CODE http_conn::dispatch() {
+    // 按请求数上限和当前的负载决定这个响应之后是否还保持连接
+    m_requests_total.fetch_add(1, std::memory_order_relaxed);
+    if (++m_requests > 1)
+        m_keepalive_reuses.fetch_add(1, std::memory_order_relaxed);
+    if (m_linger) {
+        m_keepalive_level = keepalive_level();
+        int limit = m_keepalive_requests >> m_keepalive_level;
+        if (m_keepalive_level == KEEPALIVE_LEVELS - 1 || (m_keepalive_requests > 0 && m_requests >= (limit > 0 ? limit : 1))) {
+            m_linger = false;
+            m_keepalive_declined.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    bool has_body = m_content_length != 0 || m_chunked;
+    // 没有请求体的明文请求可以升级到 h2c，路由在 HTTP/2 的流上重新进行
+    if (m_upgrade_h2 && m_h2_settings && !has_body && !m_tls.active())
+        return H2_UPGRADE;
+    if (!rate_limiter::allow_request((const sockaddr *)&m_address))
+        return TOO_MANY_REQUESTS;
+    if (!router::match(m_url, &m_route)) {
+        if (has_body)
+            m_linger = false;
+        return NO_RESOURCE;
+    }
+
+    const route_target *target = m_route.target;
+    switch (target->type) {
+        case PROXY_HANDLER:                 // 代理路由的请求体由代理直接转发给上游
+            // 代理直接在 socket 上 splice，TLS 连接必须两个方向都由内核加解密
+            if (m_tls.active() && !(m_tls.ktls_send() && m_tls.ktls_recv())) {
+                if (has_body)
+                    m_linger = false;
+                return BAD_GATEWAY;
+            }
+            if (m_chunked) {
+                m_linger = false;
+                return LENGTH_REQUIRED;
+            }
+            return PROXY_REQUEST;
+        case FUNC_HANDLER:                  // 进程内处理器在接收请求体之前运行，响应体直接写入写缓冲区
+            m_response.init(m_write_buf + HANDLER_HEADROOM, WRITE_BUFFER_SIZE - HANDLER_HEADROOM);
+            target->fn(m_route, &m_response);
+            break;
+        default:
+            if (m_method == GET && !build_path(m_route, m_url, m_request_path)) {
+                if (has_body)
+                    m_linger = false;
+                return NO_RESOURCE;
+            }
+            break;
+    }
+
+    // 如果HTTP请求有消息体，则还需要读取消息体，状态机转移到CHECK_STATE_CONTENT状态
+    if (has_body) {
+        HTTP_CODE ret = begin_body();
+        if (ret != NO_REQUEST)
+            m_linger = false;           // 请求体还留在 socket 中，无法继续复用连接
+        return ret;
+    }
+    // 只有上传路由和进程内处理器接受 POST 和 PUT
+    if (m_method != GET && target->type != FUNC_HANDLER)
+        return BAD_REQUEST;
+    // 否则说明我们已经得到了一个完整的HTTP请求
+    return GET_REQUEST;
+}
+
+// 静态文件路由的路径为根目录加上 URL 去掉路由前缀后的部分；上传路由上的 GET 请求仍然访问网站根目录
+bool http_conn::build_path(const route_match &route, const char *url, char *path) {
+    const char *root = doc_root;
+    const char *rest = url;
+    if (route.target->type == STATIC_HANDLER) {
+        root = route.target->dir;
+        rest = url + route.prefix_len;
+    }
+    int len = snprintf(path, FILENAME_LEN, "%s%s%s", root, rest[0] == '/' ? "" : "/", rest);
+    return len < FILENAME_LEN;
+}
+
+// 上传的目标文件名为 URL 去掉路由前缀和查询串后的部分，与 build_path 相同，前缀可以带也可以不带结尾的 '/'。
+// 文件名不能为空、不能以 '.' 开头，也不能包含目录
+bool http_conn::upload_name(const route_match &route, const char *url, char *name) {
+    const char *rest = url + route.prefix_len;
+    if (rest[0] == '/')
+        ++rest;
+    int len = strcspn(rest, "?");
+    if (len == 0 || len >= FILENAME_LEN || rest[0] == '.' || memchr(rest, '/', len))
+        return false;
+    memcpy(name, rest, len);
+    name[len] = '\0';
+    return true;
+}
+
+// 首部解析完毕且请求带有请求体。选择请求体处理器，在接收任何数据之前检查大小限制，
+// 需要时回复 100 Continue，然后状态机转移到 CHECK_STATE_CONTENT 状态
+http_conn::HTTP_CODE http_conn::begin_body() {
+    m_upload = (m_method != GET && m_route.target->type == UPLOAD_HANDLER) ? m_route.target : nullptr;
+    if (m_method != GET && !m_upload && m_route.target->type != FUNC_HANDLER)
+        return BAD_REQUEST;
+
+    m_body_limit = (m_upload && m_upload->max_body > 0) ? m_upload->max_body : m_max_body;
+    if (!m_chunked && m_content_length > m_body_limit)
+        return BODY_TOO_LARGE;
+
+    if (m_upload) {
+        char name[FILENAME_LEN];
+        if (!upload_name(m_route, m_url, name))
+            return BAD_REQUEST;
+        if (!m_file_sink.open(m_upload->dir, name))
+            return INTERNAL_ERROR;
+        m_body_handler = &m_file_sink;
     }
+    else {
+        m_body_handler = &m_discard_sink;
+    }
+
+    // 首部之后的数据不再需要保留首部，此后 m_url 等指针不再有效
+    m_url = m_version = m_host = 0;
+    m_body_received = 0;
+    m_body_remaining = m_content_length;
+    m_chunk_state = CHUNK_SIZE;
+    m_check_state = CHECK_STATE_CONTENT;
+    set_phase(PHASE_BODY);
+
+    // 客户端在等待我们确认之后才会发送请求体
+    if (m_expect_continue && m_read_idx == m_checked_idx)
+        send_continue();
+
+    return NO_REQUEST;
+}
+
+// 回复 100 Continue。响应很短，socket 发送缓冲区一定放得下，不处理部分写
+void http_conn::send_continue() {
+    capture::response(m_capture_id, strlen(continue_100));
+    if (m_tls.user_space_send()) {
+        struct iovec iv = { (void *)continue_100, strlen(continue_100) };
+        m_tls.write(&iv, 1);
+    }
+    else {
+        send(m_sockfd, continue_100, strlen(continue_100), MSG_NOSIGNAL);
+    }
+}
+
+// 把一块请求体交给处理器
+bool http_conn::deliver_body(const char *data, long len) {
+    m_body_received += len;
+    set_phase(PHASE_BODY);
+    return m_body_handler->on_data(data, len);
+}
+
+// 丢弃读缓冲区中已经处理过的数据，把未处理的数据移动到缓冲区的开头，
+// 这样请求体无论多大，都只占用一个读缓冲区
+void http_conn::compact_read_buf() {
+    if (m_start_line == 0)
+        return;
+    memmove(m_read_buf, m_read_buf + m_start_line, m_read_idx - m_start_line);
+    m_read_idx -= m_start_line;
+    m_checked_idx -= m_start_line;
+    m_start_line = 0;
+}
+
+// 解析 http 请求体：请求体不会被完整地保存在读缓冲区中，而是分块交给请求体处理器
+http_conn::HTTP_CODE http_conn::parse_content() {
+    HTTP_CODE ret = m_chunked ? parse_chunked_body() : parse_fixed_body();
+    if (ret != NO_REQUEST && ret != GET_REQUEST && ret != UPLOAD_REQUEST) {
+        abort_body();
+        m_linger = false;
+    }
+    return ret;
+}
+
+// 按 Content-Length 接收请求体
+http_conn::HTTP_CODE http_conn::parse_fixed_body() {
+    long len = m_read_idx - m_checked_idx;
+    if (len > m_body_remaining)
+        len = m_body_remaining;
+
+    if (len > 0) {
+        if (!deliver_body(m_read_buf + m_checked_idx, len))
+            return INTERNAL_ERROR;
+        m_checked_idx += len;
+        m_body_remaining -= len;
+    }
+    m_start_line = m_checked_idx;
+    compact_read_buf();
+
+    if (m_body_remaining == 0)
+        return finish_body();
+
+    // 读缓冲区中的数据已经交付，剩下的请求体如果要写入文件，直接从 socket 搬运到文件
+    // 用户空间解密的 TLS 连接上，请求体只能经过 SSL_read；录制流量时请求体也要经过用户空间
+    if (m_body_handler->splice_fd() != -1 && (!m_tls.active() || m_tls.ktls_recv()) && !capture::enabled())
+        return splice_body();
+
     return NO_REQUEST;
 }
 
+// socket -> 管道 -> 文件，数据不经过用户空间
+http_conn::HTTP_CODE http_conn::splice_body() {
+    if (m_pipefd[0] == -1 && pipe2(m_pipefd, O_CLOEXEC) == -1)
+        return INTERNAL_ERROR;
+    m_body_splice = true;
+
+    int fd = m_body_handler->splice_fd();
+    while (m_body_remaining > 0) {
+        long len = m_body_remaining < SPLICE_CHUNK ? m_body_remaining : SPLICE_CHUNK;
+        ssize_t n = splice(m_sockfd, NULL, m_pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+            return CLOSED_CONNECTION;
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return NO_REQUEST;          // socket 中暂时没有数据，等待下一次读事件
+            if (errno == EINTR)
+                continue;
+            return INTERNAL_ERROR;
+        }
+
+        m_body_received += n;
+        m_body_remaining -= n;
+        set_phase(PHASE_BODY);
+        while (n > 0) {                     // 把管道中的数据全部写入文件
+            ssize_t m = splice(m_pipefd[0], NULL, fd, NULL, n, SPLICE_F_MOVE);
+            if (m <= 0) {
+                if (m == -1 && errno == EINTR)
+                    continue;
+                return INTERNAL_ERROR;
+            }
+            n -= m;
+        }
+    }
+
+    m_body_splice = false;
+    return finish_body();
+}
+
+// 按分块传输编码接收请求体
+http_conn::HTTP_CODE http_conn::parse_chunked_body() {
+    while (true) {
+        switch (m_chunk_state) {
+            case CHUNK_SIZE: {                  // 块大小行：十六进制的大小，可能带有 ;扩展
+                LINE_STATUS status = parse_line();
+                if (status == LINE_BAD)
+                    return BAD_REQUEST;
+                if (status == LINE_OPEN) {
+                    compact_read_buf();
+                    return NO_REQUEST;
+                }
+                char *text = get_line();
+                m_start_line = m_checked_idx;
+
+                char *end = nullptr;
+                long size = strtol(text, &end, 16);
+                if (end == text || size < 0 || (*end != '\0' && *end != ';' && *end != ' ' && *end != '\t'))
+                    return BAD_REQUEST;
+                if (m_body_received + size > m_body_limit)
+                    return BODY_TOO_LARGE;
+
+                if (size == 0) {
+                    m_chunk_state = CHUNK_TRAILER;
+                }
+                else {
+                    m_chunk_left = size;
+                    m_chunk_state = CHUNK_DATA;
+                }
+                break;
+            }
+            case CHUNK_DATA: {                  // 块数据
+                long len = m_read_idx - m_checked_idx;
+                if (len > m_chunk_left)
+                    len = m_chunk_left;
+                if (len > 0) {
+                    if (!deliver_body(m_read_buf + m_checked_idx, len))
+                        return INTERNAL_ERROR;
+                    m_checked_idx += len;
+                    m_chunk_left -= len;
+                }
+                m_start_line = m_checked_idx;
+
+                if (m_chunk_left > 0) {
+                    compact_read_buf();
+                    return NO_REQUEST;
+                }
+                m_chunk_state = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:                // 块数据之后必须紧跟一个空行
+            case CHUNK_TRAILER: {               // 尾部字段，忽略其内容，遇到空行结束
+                LINE_STATUS status = parse_line();
+                if (status == LINE_BAD)
+                    return BAD_REQUEST;
+                if (status == LINE_OPEN) {
+                    compact_read_buf();
+                    return NO_REQUEST;
+                }
+                char *text = get_line();
+                m_start_line = m_checked_idx;
+
+                if (m_chunk_state == CHUNK_DATA_END) {
+                    if (text[0] != '\0')
+                        return BAD_REQUEST;
+                    m_chunk_state = CHUNK_SIZE;
+                }
+                else if (text[0] == '\0') {
+                    compact_read_buf();
+                    return finish_body();
+                }
+                break;
+            }
+            default:
+                return INTERNAL_ERROR;
+        }
+    }
+}
+
+// 请求体接收完毕：上传请求落盘，其他请求继续按普通请求处理
+http_conn::HTTP_CODE http_conn::finish_body() {
+    body_handler *handler = m_body_handler;
+    m_body_handler = nullptr;
+    if (m_pipefd[0] != -1) {
+        close(m_pipefd[0]);
+        close(m_pipefd[1]);
+        m_pipefd[0] = m_pipefd[1] = -1;
+    }
+
+    if (!handler->on_complete())
+        return INTERNAL_ERROR;
+    if (m_upload)
+        return UPLOAD_REQUEST;
+    return GET_REQUEST;
+}
+
+// 中断请求体的接收，清理临时文件和管道
+void http_conn::abort_body() {
+    if (m_body_handler) {
+        m_body_handler->on_abort();
+        m_body_handler = nullptr;
+    }
+    if (m_pipefd[0] != -1) {
+        close(m_pipefd[0]);
+        close(m_pipefd[1]);
+        m_pipefd[0] = m_pipefd[1] = -1;
+    }
+    m_body_splice = false;
+}
+
+// 逐跳首部只对当前连接有效，不转发给上游
+static bool is_hop_header(const char *line) {
+    static const char *hop_headers[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:", "Upgrade:", "Expect:"};
+    for (const char *name : hop_headers) {
+        if (strncasecmp(line, name, strlen(name)) == 0)
+            return true;
+    }
+    return false;
+}
+
+// 重新组装发给上游的请求首部。解析时请求行和首部字段中的 \r\n 已经被替换成 \0\0，
+// 按 \0 分隔的行依次取出首部字段，去掉逐跳首部，加上到上游的长连接和客户端地址
+int http_conn::build_proxy_head(char *buf, int size) {
+    static const char *method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT"};
+    int len = snprintf(buf, size, "%s %s HTTP/1.1\r\n", method_names[m_method], m_url);
+
+    for (char *line = m_read_buf + m_headers_idx; line < m_read_buf + m_checked_idx && len < size; ) {
+        int line_len = strlen(line);
+        if (line_len == 0) {
+            ++line;
+            continue;
+        }
+        if (!is_hop_header(line))
+            len += snprintf(buf + len, size - len, "%s\r\n", line);
+        line += line_len;
+    }
+    if (len >= size)
+        return -1;
+
+    // Unix 域 socket 上的客户端没有 IP 地址，与 nginx 一样记为 unix:
+    char ip[INET6_ADDRSTRLEN] = "unix:";
+    if (m_address.ss_family == AF_INET)
+        inet_ntop(AF_INET, &((sockaddr_in *)&m_address)->sin_addr, ip, sizeof(ip));
+    else if (m_address.ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &((sockaddr_in6 *)&m_address)->sin6_addr, ip, sizeof(ip));
+    len += snprintf(buf + len, size - len, "X-Forwarded-For: %s\r\nConnection: keep-alive\r\n\r\n", ip);
+    return len < size ? len : -1;
+}
+
+// 把请求转发给匹配的上游。请求体的剩余部分由 proxy 从 socket 中直接 splice 到上游，
+// 成功时返回 PROXY_REQUEST，响应已经写给客户端
+http_conn::HTTP_CODE http_conn::forward_request() {
+    char head[proxy::HEAD_BUFFER_SIZE];
+    int head_len = build_proxy_head(head, sizeof(head));
+    if (head_len == -1)
+        return BAD_REQUEST;
+
+    // 读缓冲区中首部之后的数据是请求体的开头
+    long body_len = m_read_idx - m_checked_idx;
+    if (body_len > m_content_length)
+        body_len = m_content_length;
+    long body_remaining = m_content_length - body_len;
+
+    // Expect 首部不转发，由我们替上游回复 100 Continue
+    if (m_expect_continue && body_remaining > 0)
+        send_continue();
+
+    bool keep_alive = m_linger && !m_draining;
+    bool http10 = strcasecmp(m_version, "HTTP/1.0") == 0;
+    proxy::RESULT ret = proxy::forward(m_route.target->upstreams, m_sockfd, m_method == HEAD, http10, head, head_len,
+                                       m_read_buf + m_checked_idx, body_len, body_remaining, &keep_alive);
+    if (ret == proxy::PROXY_BAD_GATEWAY) {
+        proxy::m_bad_gateway.fetch_add(1, std::memory_order_relaxed);
+        return BAD_GATEWAY;
+    }
+    if (ret == proxy::PROXY_ABORT)
+        return CLOSED_CONNECTION;
+    m_linger = keep_alive;
+    m_checked_idx += body_len;                  // 读缓冲区中请求体之后的数据属于下一个请求
+    return PROXY_REQUEST;
+}
+
 // 主状态机，解析请求
 http_conn::HTTP_CODE http_conn::process_read() {
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
     char* text = nullptr;
 
-    while (((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK))
-                || ((line_status = parse_line()) == LINE_OK)) {
+    // 空闲的长连接上收到了新请求的数据，开始计算首部的期限
+    if (m_check_state == CHECK_STATE_REQUESTLINE && m_read_idx > 0
+        && (m_deadline.load(std::memory_order_relaxed) & 7) == PHASE_IDLE)
+        set_phase(PHASE_HEADER);
+
+    // 新请求以 HTTP/2 的连接序言开头，说明客户端直接使用 h2c
+    if (m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == 0 && m_read_idx > 0) {
+        int preface = h2_session::match_preface(m_read_buf, m_read_idx);
+        if (preface == 0)
+            return NO_REQUEST;
+        if (preface == 1)
+            return H2_PREFACE;
+    }
+
+    // 请求体不是按行组织的，进入 CHECK_STATE_CONTENT 状态后直接交给 parse_content
+    while ((m_check_state == CHECK_STATE_CONTENT) || ((line_status = parse_line()) == LINE_OK)) {
+        if (m_check_state == CHECK_STATE_CONTENT) {     // 如果当前正在解析报文主体
+            ret = parse_content();
+            if (ret == GET_REQUEST)
+                return do_request();
+            return ret;
+        }
+
         // 获取一行数据
         text = get_line();
         m_start_line = m_checked_idx;           // 设置下一行的起始位置
-        std::cout<<"got 1 http line: "<< text << std::endl;
 
         switch (m_check_state) {
             case CHECK_STATE_REQUESTLINE: {             // 如果当前正在解析请求行
@@ -268,18 +1329,10 @@ http_conn::HTTP_CODE http_conn::process_read() {
             }
             case CHECK_STATE_HEADER: {                  // 如果当前正在解析首部字段
                 ret = parse_headers(text);
-                if (ret == BAD_REQUEST)
-                    return BAD_REQUEST;
-                else if (ret == GET_REQUEST)
-                    return do_request();
-                break;
-            }
-            case CHECK_STATE_CONTENT: {                 // 如果当前正在解析报文主体
-                ret = parse_content(text);
                 if (ret == GET_REQUEST)
                     return do_request();
-                else
-                    line_status = LINE_OPEN;
+                else if (ret != NO_REQUEST)
+                    return ret;
                 break;
             }
             default: {
@@ -294,33 +1347,164 @@ http_conn::HTTP_CODE http_conn::process_read() {
 // 则使用 mmap 将其映射到内存地址 m_file_address 处，并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    // "/home/nowcoder/webserver/resources"
-    strcpy(m_request_path, doc_root);
-    int len = strlen(doc_root);
-    strncpy(m_request_path + len, m_url, FILENAME_LEN - len - 1);
+    // 进程内处理器的响应已经生成，不访问文件系统
+    if (m_route.target->type == FUNC_HANDLER)
+        return HANDLER_REQUEST;
+
+    // 完整的响应在缓存中时直接发送缓存中的副本，不访问文件系统。
+    // 响应因 Connection 和 Keep-Alive 首部而不同：关闭连接是变体 0，保持连接时变体是 1 加上长连接策略的等级。
+    // 等到了共享的查找结果时直接使用它。进程内的缓存和共享内存中的缓存同时开启时只用进程内的缓存
+    if ((resp_cache::enabled() || shm_cache::enabled()) && m_method == GET && !m_file_waiting) {
+        m_cache_key = resp_cache::key(m_request_path, (m_linger && !m_draining) ? 1 + m_keepalive_level : 0);
+        if (resp_cache::enabled())
+            m_cache_entry = resp_cache::lookup(m_cache_key, m_request_path);
+        else
+            m_shm_slot = shm_cache::lookup(m_cache_key, m_request_path);
+        if (m_cache_entry || m_shm_slot)
+            return CACHED_REQUEST;
+    }
+
+    // 文件路径在 dispatch 中已经生成，因为首部随后可能被请求体覆盖
+    if (file_table::enabled())
+        return open_shared();
+    int fd;
+    HTTP_CODE ret = open_file(m_request_path, &m_file_stat, &fd);
+    if (ret != FILE_REQUEST)
+        return ret;
+    m_resident_end = 0;
+    if (m_coro_mode) {                              // 协程模式用 sendfile 发送，保留文件描述符
+        m_file_fd = fd;
+        // 映射只用来检查文件是否在页缓存中，不从中读取数据
+        if (m_file_stat.st_size > 0) {
+            void *addr = mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            m_file_address = addr == MAP_FAILED ? nullptr : (char *)addr;
+        }
+        trace(tracer::FILE_OPEN);
+        return FILE_REQUEST;
+    }
+    // 创建私有文件映射
+    m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    trace(tracer::FILE_OPEN);
+    return FILE_REQUEST;
+}
+
+// 检查文件的属性：文件存在、对所有用户可读，且不是目录时以只读方式打开，返回 FILE_REQUEST
+// 第一个访问这个路径的连接负责查找，结果连同否定结果一起发布；查找期间到达的连接挂在条目上，
+// 工作线程直接返回，结果发布时连接重新进入线程池。协程模式下查找在主线程中同步完成，不会出现等待
+http_conn::HTTP_CODE http_conn::open_shared() {
+    file_table::entry *e = m_file_waiter.result;
+    m_file_waiter.result = nullptr;
+    m_file_waiting = false;
+    if (!e) {
+        file_table::STATUS status;
+        e = file_table::acquire(m_request_path, &m_file_waiter, &status);
+        if (status == file_table::WAIT) {
+            m_file_waiting = true;
+            return FILE_PENDING;
+        }
+        if (status == file_table::LOAD) {
+            int fd;
+            e->code = open_file(m_request_path, &e->st, &fd);
+            if (e->code == FILE_REQUEST) {
+                if (e->st.st_size > 0) {
+                    void *addr = mmap(0, e->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    e->addr = addr == MAP_FAILED ? nullptr : (char *)addr;
+                }
+                // 协程模式用 sendfile 发送，映射只用来检查页缓存；线程池模式从映射区发送，必须映射成功
+                if (m_coro_mode)
+                    e->fd = fd;
+                else
+                    close(fd);
+                if (!e->addr && e->st.st_size > 0 && !m_coro_mode)
+                    e->code = INTERNAL_ERROR;
+            }
+            file_table::publish(e, e->code != FILE_REQUEST);
+        }
+    }
+
+    HTTP_CODE ret = (HTTP_CODE)e->code;
+    if (ret != FILE_REQUEST) {
+        file_table::release(e);
+        return ret;
+    }
+    m_file_entry = e;
+    m_file_stat = e->st;
+    m_file_address = e->addr;
+    m_file_fd = e->fd;
+    m_resident_end = 0;
+    trace(tracer::FILE_OPEN);
+    return FILE_REQUEST;
+}
+
+// 在发布结果的工作线程中调用，当前线程可能正在处理另一个连接，不能在这里嵌套处理。
+// 队列已满时与 hand_off 一样关闭连接：放掉结果的引用，由主线程关闭
+void http_conn::file_ready(file_table::waiter *w) {
+    http_conn *conn = (http_conn *)w->owner;
+    if (m_pool->append(conn, conn->cost_class()))
+        return;
+    file_table::release(w->result);
+    w->result = nullptr;
+    conn->m_file_waiting = false;
+    conn->close_from_worker();
+}
 
-    // 获取m_request_path文件的相关的状态信息，-1 失败，0 成功
-    if (stat(m_request_path, &m_file_stat) == -1)
+http_conn::HTTP_CODE http_conn::open_file(const char *path, struct stat *st, int *fd) {
+    // 获取文件的相关的状态信息，-1 失败，0 成功
+    if (stat(path, st) == -1)
         return NO_RESOURCE;
 
     // 判断访问权限
-    if (!(m_file_stat.st_mode & S_IROTH))
+    if (!(st->st_mode & S_IROTH))
         return FORBIDDEN_REQUEST;
 
     // 判断是否是目录
-    if (S_ISDIR(m_file_stat.st_mode)) 
+    if (S_ISDIR(st->st_mode)) 
         return BAD_REQUEST;
 
     // 以只读方式打开文件
-    int fd = open(m_request_path, O_RDONLY);
-    // 创建私有文件映射
-    m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
+    *fd = open(path, O_RDONLY);
+    if (*fd == -1)
+        return NO_RESOURCE;
+    upgrader::record_file(path);            // 记入热点文件清单，升级时交给新进程预读
     return FILE_REQUEST;
 }
 
-// 解除内存映射
+// 被访问过的小文件的响应复制进缓存。只复制已经在页缓存中的文件，复制时不会因为缺页而阻塞
+void http_conn::cache_response() {
+    if (m_method != GET || (m_file_stat.st_size > 0 && !m_file_address))
+        return;
+    long len = m_write_idx + m_file_stat.st_size;
+    if (resp_cache::enabled()) {
+        if (resp_cache::wants(m_cache_key, len) && file_resident(0, m_file_stat.st_size))
+            resp_cache::insert(m_cache_key, m_request_path, m_file_stat, m_write_buf, m_write_idx, m_file_address, m_file_stat.st_size);
+    }
+    else if (shm_cache::enabled()) {
+        if (shm_cache::wants(len) && file_resident(0, m_file_stat.st_size))
+            shm_cache::insert(m_cache_key, m_request_path, m_file_stat, m_write_buf, m_write_idx, m_file_address, m_file_stat.st_size);
+    }
+}
+
+// 解除内存映射，释放缓存中的响应
 void http_conn::unmap() {
+    if (m_cache_entry) {
+        resp_cache::release(m_cache_entry);
+        m_cache_entry = nullptr;
+    }
+    if (m_shm_slot) {
+        shm_cache::release(m_shm_slot);
+        m_shm_slot = nullptr;
+    }
+    if (m_file_entry) {                 // 共享的映射区和文件描述符由 file_table 在最后一个引用释放时关闭
+        file_table::release(m_file_entry);
+        m_file_entry = nullptr;
+        m_file_address = 0;
+        m_file_fd = -1;
+    }
+    if (m_file_fd != -1) {
+        close(m_file_fd);
+        m_file_fd = -1;
+    }
     if(m_file_address)
     {
         munmap(m_file_address, m_file_stat.st_size);
@@ -334,18 +1518,56 @@ bool http_conn::write() {
     
     // 如果要发送的字节为 0，则本次响应结束，重置读写缓冲区。
     if (bytes_to_send == 0) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN); 
+        m_want_write = false;
         init();
         return true;
     }
 
+    // 新响应的第一次发送：塞住连接，让首部和文件内容合并成尽量少的报文段
+    bool first = bytes_have_send == 0;
+    if (first && m_sockopt->cork)
+        set_cork(m_sockfd, true);
+    if (!first)                                             // 上一次写满了 socket，这是又一次可写事件
+        trace(tracer::WRITE);
+
     while(1) {
-        // 集中写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        // 这一轮的预算用完时停下，socket 仍然可写，连接排到其他连接之后再继续发送
+        if (over_budget()) {
+            m_want_write = true;
+            m_budget_out = true;
+            return true;
+        }
+
+        // 文件内容每次最多发送 COLD_WINDOW 字节，发送之前确认它们都在页缓存中，缺页不会阻塞当前线程。
+        // 不在页缓存中时，连接等待 I/O 线程池预读完成，之后由主线程继续发送
+        size_t file_len = m_iv_count == 2 ? m_iv[1].iov_len : 0;
+        if (file_len > 0) {
+            off_t file_pos = bytes_have_send > m_write_idx ? bytes_have_send - m_write_idx : 0;
+            if (file_len > (size_t)COLD_WINDOW)
+                m_iv[1].iov_len = COLD_WINDOW;
+            if (!file_resident(file_pos, m_iv[1].iov_len)) {
+                m_iv[1].iov_len = file_len;
+                m_want_write = true;
+                m_fetching = true;
+                return true;
+            }
+        }
+
+        // 首部还没发完时，可以用 MSG_MORE 单独发送首部，内核会等文件内容到来后再组成报文段
+        if (m_tls.user_space_send())                     // 用户空间 TLS 由 SSL_write 加密后发送
+            temp = m_tls.write(m_iv, m_iv_count);
+        else if (m_sockopt->msg_more && m_iv_count == 2 && m_iv[0].iov_len > 0)
+            temp = send(m_sockfd, m_iv[0].iov_base, m_iv[0].iov_len, MSG_MORE | MSG_NOSIGNAL);
+        else
+            temp = writev(m_sockfd, m_iv, m_iv_count);      // 集中写
+        if (file_len > 0)
+            m_iv[1].iov_len = file_len;
+        charge(temp);
+
         if (temp <= -1) {
             // 如果 TCP 写缓冲没有空间获取被中断，则等待下一轮 EPOLLOUT 事件，虽然在此期间，服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if(errno == EAGAIN) {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                m_want_write = true;
                 return true;
             }
             else {
@@ -354,26 +1576,35 @@ bool http_conn::write() {
             }
         }
 
+        if (first && temp > 0) {
+            trace(tracer::FIRST_BYTE);
+            first = false;
+        }
         bytes_have_send += temp;
         bytes_to_send -= temp;
 
-        if (bytes_have_send >= m_iv[0].iov_len) {           // 部分写的情况1，如果集中写的第一个缓冲区已经发送完毕，第二个缓冲区发送了一部分
+        if (m_iv_count == 2 && bytes_have_send >= m_write_idx) {    // 部分写的情况1，如果集中写的第一个缓冲区已经发送完毕，第二个缓冲区发送了一部分
             m_iv[0].iov_len = 0;
             m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
             m_iv[1].iov_len = bytes_to_send;
         }
-        else {                                              // 部分写的情况2，集中写的第一个缓冲区发送了一部分数据。
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
+        else {                                              // 部分写的情况2，集中写的第一个缓冲区发送了一部分数据（它可能是缓存中的响应）
+            m_iv[0].iov_base = (char *)m_iv[0].iov_base + temp;
             m_iv[0].iov_len = m_iv[0].iov_len - temp;
         }
 
         // 如果集中写的数据发送完毕
         if (bytes_to_send <= 0) {
+            trace(tracer::LAST_BYTE);
+            PROBE3(response_done, m_sockfd, m_status, bytes_have_send);
+            capture::response(m_capture_id, bytes_have_send);
             unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);            // 重新向 epoll 注册连接 socket 上的可读事件
+            if (m_sockopt->cork)                            // 拔掉塞子，立即发出最后一个不满的报文段
+                set_cork(m_sockfd, false);
+            m_want_write = false;
 
             if (m_linger) {                                 // 如果设置了保持连接，则重置读写缓冲区等
-                init();
+                next_request();
                 return true;
             }
             else 
@@ -398,6 +1629,7 @@ bool http_conn::add_response(const char* format, ...) {
 
 // 为 HTTP 响应报文添加状态行
 bool http_conn::add_status_line(int status, const char* title) {
+    m_status = status;
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
@@ -417,7 +1649,18 @@ bool http_conn::add_content_length(int content_len) {
 
 // 为 HTTP 响应报文添加首部字段 Connection
 bool http_conn::add_linger() {
-    return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
+    if (!m_linger)
+        return add_response("Connection: close\r\n");
+    int limit = m_keepalive_requests >> m_keepalive_level;
+    if (m_keepalive_requests > 0 && limit == 0)
+        limit = 1;
+    if (m_phase_timeout[PHASE_IDLE] > 0 && limit > 0)
+        return add_response("Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n", keepalive_timeout(), limit);
+    if (m_phase_timeout[PHASE_IDLE] > 0)
+        return add_response("Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n", keepalive_timeout());
+    if (limit > 0)
+        return add_response("Connection: keep-alive\r\nKeep-Alive: max=%d\r\n", limit);
+    return add_response("Connection: keep-alive\r\n");
 }
 
 // 为 HTTP 响应报文添加空行
@@ -437,6 +1680,9 @@ bool http_conn::add_content(const char* content) {
 
 // 根据服务器处理 HTTP 请求的结果，决定返回给客户端的内容
 bool http_conn::process_write(HTTP_CODE ret) {
+    if (m_draining)                 // 进程正在退出，发送完这个响应就关闭连接
+        m_linger = false;
+
     switch (ret) {
         case INTERNAL_ERROR:
             add_status_line(500, error_500_title);
@@ -453,6 +1699,48 @@ bool http_conn::process_write(HTTP_CODE ret) {
             add_headers(strlen(error_404_form));
             add_content(error_404_form);
             break;
+        case BODY_TOO_LARGE:
+            m_linger = false;               // 剩余的请求体还留在 socket 中，无法继续复用连接
+            add_status_line(413, error_413_title);
+            add_headers(strlen(error_413_form));
+            add_content(error_413_form);
+            break;
+        case LENGTH_REQUIRED:
+            add_status_line(411, error_411_title);
+            add_headers(strlen(error_411_form));
+            add_content(error_411_form);
+            break;
+        case BAD_GATEWAY:
+            m_linger = false;               // 请求体可能还留在 socket 中
+            add_status_line(502, error_502_title);
+            add_headers(strlen(error_502_form));
+            add_content(error_502_form);
+            break;
+        case TOO_MANY_REQUESTS:             // 预先生成的响应，发送后关闭连接
+            m_linger = false;
+            memcpy(m_write_buf, rate_limiter::m_response, rate_limiter::m_response_len);
+            m_write_idx = rate_limiter::m_response_len;
+            m_status = 429;
+            break;
+        case HANDLER_REQUEST: {
+            // 处理器已经把响应体写在 HANDLER_HEADROOM 处，补上首部后把响应体移到首部之后
+            int body_len = m_response.m_len;
+            add_status_line(m_response.m_status, m_response.m_title);
+            add_content_length(body_len);
+            add_response("Content-Type:%s\r\n", m_response.m_content_type);
+            add_linger();
+            add_blank_line();
+            if (m_write_idx >= HANDLER_HEADROOM)
+                return false;
+            memmove(m_write_buf + m_write_idx, m_response.m_body, body_len);
+            m_write_idx += body_len;
+            break;
+        }
+        case UPLOAD_REQUEST:
+            add_status_line(201, ok_201_title);
+            add_headers(strlen(ok_201_form));
+            add_content(ok_201_form);
+            break;
         case FORBIDDEN_REQUEST:
             add_status_line(403, error_403_title);
             add_headers(strlen(error_403_form));
@@ -468,33 +1756,201 @@ bool http_conn::process_write(HTTP_CODE ret) {
             m_iv_count = 2;
 
             bytes_to_send = m_write_idx + m_file_stat.st_size;
-            return true;
-            
+            cache_response();
+            break;
+        case CACHED_REQUEST:                // 缓存中的响应已经包含首部，一次发送
+            m_status = 200;
+            m_iv[0].iov_base = m_cache_entry ? m_cache_entry->data : m_shm_slot->data;
+            m_iv[0].iov_len = m_cache_entry ? m_cache_entry->len : m_shm_slot->len;
+            m_iv_count = 1;
+            bytes_to_send = m_iv[0].iov_len;
+            break;
+
         default:
             return false;
     }
 
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
+    if (ret != FILE_REQUEST && ret != CACHED_REQUEST) {
+        m_iv[0].iov_base = m_write_buf;
+        m_iv[0].iov_len = m_write_idx;
+        m_iv_count = 1;
+        bytes_to_send = m_write_idx;
+    }
+
+    PROBE3(response_start, m_sockfd, m_status, bytes_to_send);
+    // 发送响应的期限随响应的大小延长，太慢地读取响应的客户端会被断开
+    set_phase(PHASE_WRITE, m_min_send_rate > 0 ? bytes_to_send / m_min_send_rate : 0);
     return true;
 }
 
 // 由线程池中的工作线程调用，这是处理 HTTP 请求的入口函数
 void http_conn::process() {
-    // 解析 HTTP 请求
-    HTTP_CODE read_ret = process_read();
+    on_worker = true;
+    if (m_h2) {
+        process_h2();
+        return;
+    }
+
+    trace(tracer::DEQUEUE);
+    PROBE1(dequeue, m_sockfd);
+    long start = now_ns();
+    begin_turn();
+    m_pipelined = false;                                // 读缓冲区中的下一个请求由这一次处理
+
+    // TLS 握手比较耗时，在工作线程中进行。握手完成时客户端可能已经发来了请求
+    if (m_tls.handshaking()) {
+        int ret = m_tls.handshake();
+        if (ret == 0) {
+            m_want_write = m_tls.want_events() & EPOLLOUT;
+            release();
+            return;
+        }
+        if (ret < 0) {
+            close_from_worker();
+            return;
+        }
+        if (m_tls.alpn_h2()) {                          // ALPN 选择了 h2，客户端接下来发送连接序言
+            start_h2(H2_PREFACE);
+            process_h2();
+            return;
+        }
+        if (!read()) {
+            close_from_worker();
+            return;
+        }
+    }
 
-    if (read_ret == NO_REQUEST) {                       // 如果本次请求无效，则重新把连接 socket 上的读事件加入到 epoll 中
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    // 解析 HTTP 请求。等待共享的查找结果的请求已经解析完毕，从 do_request 继续
+    HTTP_CODE read_ret = m_file_waiting ? do_request() : process_read();
+    if (read_ret == FILE_PENDING)                       // 另一个连接正在查找这个文件，连接挂在 file_table 上，不交还
+        return;
+
+    // OpenSSL 中已经解密的数据不会再触发 epoll 事件，读缓冲区腾出空间后直接在这里读取
+    while (read_ret == NO_REQUEST && m_tls.pending() && m_read_idx < READ_BUFFER_SIZE) {
+        if (!read()) {
+            close_from_worker();
+            return;
+        }
+        read_ret = process_read();
+    }
+    if (read_ret != NO_REQUEST) {
+        trace(tracer::PARSED);
+        PROBE3(parse_done, m_sockfd, (int)read_ret, m_url);
+    }
+
+    if (read_ret == H2_PREFACE || read_ret == H2_UPGRADE) {
+        start_h2(read_ret);
+        process_h2();
+        return;
+    }
+
+    if (read_ret == PROXY_REQUEST) {
+        read_ret = forward_request();
+        cost_table::learn(m_cost_key, 0, now_ns() - start);
+        if (read_ret == PROXY_REQUEST) {                // 响应已经由代理写给客户端
+            if (!m_linger) {
+                close_from_worker();
+                return;
+            }
+            next_request();
+            release();
+            return;
+        }
+        if (read_ret == CLOSED_CONNECTION) {
+            close_from_worker();
+            return;
+        }
+    }
+
+    if (read_ret == NO_REQUEST) {                       // 请求不完整，交还连接，等待更多的数据
+        release();
         return;
     }
     
-    // 生成响应
-    bool write_ret = process_write(read_ret);           // 当请求解析成功后，则把连接 socket 上的写事件加入到 epoll 中
-    if (!write_ret) {
-        close_conn();
+    // 生成响应，并在工作线程中直接开始发送。socket 写满时交还连接，由主线程在可写时继续发送；
+    // 文件不在页缓存中时交给 I/O 线程池，工作线程不等待磁盘
+    if (!process_write(read_ret)) {
+        close_from_worker();
+        return;
+    }
+    // 预估开销按完整的响应大小计算，write 会修改 bytes_to_send；init 会清除 m_cost_key
+    cost_table::learn(m_cost_key, bytes_to_send, now_ns() - start);
+    if (!write()) {
+        close_from_worker();
+        return;
+    }
+    if (m_fetching) {
+        start_fetch();
+        return;
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
-}
\ No newline at end of file
+    release();
+}
+
+// 切换到 HTTP/2。读缓冲区中已经读到的数据是客户端的连接序言和之后的帧；
+// h2c 升级时首部之前的部分是升级请求，它成为会话的流 1
+void http_conn::start_h2(HTTP_CODE how) {
+    m_h2 = new h2_session(m_address);
+    int start = how == H2_UPGRADE ? m_checked_idx : 0;
+    int len = m_read_idx - start;
+    memcpy(m_h2->input(), m_read_buf + start, len);
+    if (how == H2_UPGRADE)
+        m_h2->upgrade(m_h2_settings, m_method, m_url);
+    else
+        m_h2->start();
+    init();
+    m_h2->on_input(len);
+}
+
+// 线程池模式下 HTTP/2 连接的读写都在工作线程中完成：每读一次就处理其中完整的帧，并尽量写出响应，
+// 直到 socket 上暂时没有数据可读。socket 写满时同时等待可写事件
+void http_conn::process_h2() {
+    if (m_draining)
+        m_h2->shutdown();
+
+    int flushed = 1;
+    while (true) {
+        ssize_t n;
+        if (m_tls.active())
+            n = m_tls.read(m_h2->input(), m_h2->input_space());
+        else
+            n = recv(m_sockfd, m_h2->input(), m_h2->input_space(), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            close_from_worker();
+            return;
+        }
+        if (n > 0) {
+            capture::data(m_capture_id, m_h2->input(), n);
+            m_h2->on_input(n);
+        }
+
+        flushed = flush_h2();
+        if (flushed < 0 || m_h2->finished()) {
+            close_from_worker();
+            return;
+        }
+        if (n < 0)
+            break;
+    }
+
+    // 空闲的 HTTP/2 连接在退出时可以直接关闭。m_idle 必须在交还连接之前写入，此后主线程随时可能处理新的事件
+    m_idle = m_h2->idle();
+    m_want_write = flushed == 0;
+    set_phase(PHASE_IDLE);
+    release();
+}
+
+int http_conn::flush_h2() {
+    struct iovec *iv;
+    int count;
+    while ((count = m_h2->pending(&iv)) > 0) {
+        ssize_t n;
+        if (m_tls.user_space_send())
+            n = m_tls.write(iv, count);
+        else
+            n = writev(m_sockfd, iv, count);
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        m_h2->sent(n);
+    }
+    return 1;
+}
@@ -0,0 +1,172 @@
+#include "listener.h"
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <iostream>
+
+bool listener::parse(const char *spec, bool is_tls) {
+    memset(&addr, 0, sizeof(addr));
+    tls = is_tls;
+
+    // unix:/path[:mode]
+    if (strncmp(spec, "unix:", 5) == 0) {
+        char path[sizeof(((sockaddr_un *)0)->sun_path)];
+        const char *p = spec + 5;
+        const char *colon = strrchr(p, ':');
+        size_t len = strlen(p);
+        if (colon) {                            // 冒号后面不是八进制数时是路径的一部分
+            char *end;
+            long m = strtol(colon + 1, &end, 8);
+            if (end != colon + 1 && *end == '\0') {
+                if (m < 0 || m > 0777)
+                    return false;
+                mode = m;
+                len = colon - p;
+            }
+        }
+        if (len == 0 || len >= sizeof(path) || p[0] != '/')
+            return false;
+        memcpy(path, p, len);
+        path[len] = '\0';
+
+        sockaddr_un *un = (sockaddr_un *)&addr;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        addr_len = sizeof(sockaddr_un);
+        return true;
+    }
+
+    // port，或者 host:port，后面可以跟 @sock_options
+    char addr_spec[256];
+    const char *at = strchr(spec, '@');
+    if (at) {
+        if ((size_t)(at - spec) >= sizeof(addr_spec) || !opts.parse(at + 1))
+            return false;
+        memcpy(addr_spec, spec, at - spec);
+        addr_spec[at - spec] = '\0';
+        spec = addr_spec;
+        own_opts = true;
+    }
+
+    char host[256];
+    const char *port = strrchr(spec, ':');
+    if (!port) {
+        strcpy(host, "0.0.0.0");
+        port = spec;
+    }
+    else {
+        size_t len = port - spec;
+        if (len >= sizeof(host))
+            return false;
+        if (len >= 2 && spec[0] == '[' && spec[len - 1] == ']') {      // [IPv6]:port
+            ++spec;
+            len -= 2;
+        }
+        memcpy(host, spec, len);
+        host[len] = '\0';
+        ++port;
+    }
+    if (atoi(port) <= 0 || atoi(port) > 65535)
+        return false;
+
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    if (getaddrinfo(host, port, &hints, &res) != 0 || !res)
+        return false;
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+bool listener::matches(int sock) const {
+    sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    if (getsockname(sock, (sockaddr *)&local, &len) == -1 || local.ss_family != addr.ss_family)
+        return false;
+
+    switch (addr.ss_family) {
+        case AF_INET: {
+            const sockaddr_in *a = (const sockaddr_in *)&addr, *b = (const sockaddr_in *)&local;
+            return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+        }
+        case AF_INET6: {
+            const sockaddr_in6 *a = (const sockaddr_in6 *)&addr, *b = (const sockaddr_in6 *)&local;
+            return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(in6_addr)) == 0;
+        }
+        case AF_UNIX:
+            return strcmp(((const sockaddr_un *)&addr)->sun_path, ((const sockaddr_un *)&local)->sun_path) == 0;
+    }
+    return false;
+}
+
+int listener::open() {
+    int sock = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (sock == -1)
+        return -1;
+
+    if (is_unix()) {
+        // 路径上的 socket 文件还能连上，说明有别的进程在监听
+        const char *path = ((const sockaddr_un *)&addr)->sun_path;
+        if (connect(sock, (const sockaddr *)&addr, addr_len) == 0) {
+            ::close(sock);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        ::close(sock);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == -1)
+            return -1;
+        unlink(path);
+
+        // 在 listen 之前修改权限，没有权限的进程在任何时刻都连不上
+        if (bind(sock, (const sockaddr *)&addr, addr_len) == -1 || chmod(path, mode) == -1) {
+            ::close(sock);
+            return -1;
+        }
+    }
+    else {
+        // 设置端口复用，必须在绑定之前（作用，允许多个套接字绑定在同一个端口上）
+        int reuse = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (opts.reuseport)
+            setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+        if (bind(sock, (const sockaddr *)&addr, addr_len) == -1) {
+            ::close(sock);
+            return -1;
+        }
+        opts.apply_listener(sock);
+    }
+
+    // 监听。未决连接队列要足够长，否则进程繁忙或启动时会直接拒绝连接
+    if (listen(sock, SOMAXCONN) == -1) {
+        ::close(sock);
+        return -1;
+    }
+    fd = sock;
+    return fd;
+}
+
+const char *listener::describe(char *buf, size_t size) const {
+    char ip[INET6_ADDRSTRLEN];
+    switch (addr.ss_family) {
+        case AF_INET:
+            inet_ntop(AF_INET, &((const sockaddr_in *)&addr)->sin_addr, ip, sizeof(ip));
+            snprintf(buf, size, "%s:%d", ip, ntohs(((const sockaddr_in *)&addr)->sin_port));
+            break;
+        case AF_INET6:
+            inet_ntop(AF_INET6, &((const sockaddr_in6 *)&addr)->sin6_addr, ip, sizeof(ip));
+            snprintf(buf, size, "[%s]:%d", ip, ntohs(((const sockaddr_in6 *)&addr)->sin6_port));
+            break;
+        default:
+            snprintf(buf, size, "unix:%s", ((const sockaddr_un *)&addr)->sun_path);
+            break;
+    }
+    return buf;
+}
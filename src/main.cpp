@@ -10,9 +10,20 @@
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "config.h"
+#include "upgrade.h"
+#include "proxy.h"
+#include "router.h"
+#include "ratelimit.h"
+#include "http2.h"
+#include "busypoll.h"
+#include "prefork.h"
+#include <time.h>
 
 #define MAX_FD 65535                // webserve 能接受的最大连接个数
 #define MAX_EVENT_NUMBER 10000      // epoll 能监听的最大文件描述符的数目
@@ -21,8 +32,89 @@
 extern void addfd(int epollfd, int fd, bool one_shot);
 // 从 epoll 中删除描述符
 extern void removefd(int epollfd, int fd);
-// 修改文件描述符
-extern void modfd(int epollfd, int fd, int ev);
+
+// 信号管道。信号处理函数只把信号值写入管道，由主循环统一处理
+static int sig_pipefd[2];
+
+void sig_handler(int sig) {
+    int save_errno = errno;
+    char msg = sig;
+    send(sig_pipefd[1], &msg, 1, MSG_DONTWAIT);
+    errno = save_errno;
+}
+
+// 线程池，供监控接口读取状态
+static threadpool<http_conn> *stats_pool = nullptr;
+
+// 健康检查接口：负载均衡器会频繁访问，只写一个固定的响应体
+static void health_handler(const route_match &match, response *resp) {
+    resp->append("ok\n");
+}
+
+// 监控接口：线程池和连接的状态
+static void metrics_handler(const route_match &match, response *resp) {
+    threadpool<http_conn>::stats st = stats_pool->get_stats();
+    resp->append("threads %d\nidle_threads %d\nqueued %d\navg_wait_us %ld\nmax_wait_us %ld\nconnections %d\nrate_limited %ld\n",
+                 st.threads, st.idle_threads, st.queued, st.avg_wait_us, st.max_wait_us, http_conn::m_user_count,
+                 rate_limiter::m_rejected.load(std::memory_order_relaxed));
+    for (int c = 0; c < threadpool<http_conn>::CLASSES; ++c)
+        resp->append("queued_class%d %d\nwait_us_class%d %ld\n", c, st.class_queued[c], c, st.class_wait_us[c]);
+    resp->append("h2_connections %ld\nh2_streams %ld\nepoll_ctl %ld\n", h2_session::m_connections.load(),
+                 h2_session::m_total_streams.load(), http_conn::m_epoll_ctls.load(std::memory_order_relaxed));
+    resp->append("cold_fetches %ld\n", http_conn::m_cold_fetches.load(std::memory_order_relaxed));
+    resp->append("keepalive_level %d\nkeepalive_reuses %ld\nkeepalive_declined %ld\n", http_conn::keepalive_level(),
+                 http_conn::m_keepalive_reuses.load(), http_conn::m_keepalive_declined.load());
+    resp->append("budget_yields %ld\naccept_deferred %ld\n", http_conn::m_budget_yields.load(), http_conn::m_accept_deferred.load());
+    resp->append("timeout_header %ld\ntimeout_body %ld\ntimeout_idle %ld\ntimeout_write %ld\n",
+                 http_conn::m_timeouts[http_conn::PHASE_HEADER].load(), http_conn::m_timeouts[http_conn::PHASE_BODY].load(),
+                 http_conn::m_timeouts[http_conn::PHASE_IDLE].load(), http_conn::m_timeouts[http_conn::PHASE_WRITE].load());
+    if (resp_cache::enabled())
+        resp->append("cache_hits %ld\ncache_misses %ld\ncache_entries %ld\ncache_bytes %ld\ncache_evictions %ld\ncache_rejected %ld\n",
+                     resp_cache::m_hits.load(), resp_cache::m_misses.load(), resp_cache::m_entries.load(),
+                     resp_cache::m_bytes.load(), resp_cache::m_evictions.load(), resp_cache::m_rejected.load());
+    if (busy_poll::enabled())
+        resp->append("busy_poll_spins %ld\nbusy_poll_hits %ld\nbusy_poll_blocks %ld\nworker_spin_hits %ld\nworker_parks %ld\n",
+                     busy_poll::m_spins.load(), busy_poll::m_hits.load(), busy_poll::m_blocks.load(), st.spin_hits, st.parks);
+    if (shm_cache::enabled()) {
+        shm_cache::stats cs = shm_cache::get_stats();
+        resp->append("shm_cache_hits %ld\nshm_cache_misses %ld\nshm_cache_entries %ld\nshm_cache_bytes %ld\nshm_cache_evictions %ld\nshm_cache_slots %ld\n",
+                     cs.hits, cs.misses, cs.entries, cs.bytes, cs.evictions, cs.slots);
+    }
+    // 预派生模式：所有工作进程的合计，每个进程一行的明细放在最后输出
+    if (prefork::enabled()) {
+        long connections = 0, requests = 0, restarts = 0;
+        int alive = 0;
+        for (int i = 0; i < prefork::workers(); ++i) {
+            const prefork::worker_stats &w = prefork::stats(i);
+            alive += w.pid.load() != 0;
+            connections += w.connections.load();
+            requests += w.requests.load();
+            restarts += w.restarts.load();
+        }
+        resp->append("workers %d\nworkers_alive %d\nworkers_connections %ld\nworkers_requests %ld\nworkers_restarts %ld\n",
+                     prefork::workers(), alive, connections, requests, restarts);
+    }
+    if (file_table::enabled())
+        resp->append("file_hits %ld\nfile_loads %ld\nfile_coalesced %ld\nfile_entries %ld\n", file_table::m_hits.load(),
+                     file_table::m_loads.load(), file_table::m_coalesced.load(), file_table::m_entries.load());
+    if (capture::enabled())
+        resp->append("capture_records %ld\ncapture_dropped %ld\n", capture::m_records.load(std::memory_order_relaxed),
+                     capture::m_dropped.load(std::memory_order_relaxed));
+    if (proxy::enabled())
+        resp->append("proxy_bad_gateway %ld\n", proxy::m_bad_gateway.load(std::memory_order_relaxed));
+    if (tls_conn::enabled())
+        resp->append("tls_handshakes %ld\ntls_resumed %ld\ntls_ktls %ld\n", tls_conn::m_handshakes.load(),
+                     tls_conn::m_resumed.load(), tls_conn::m_ktls.load());
+    // 每个工作进程一行 "worker<i> pid connections requests restarts"。工作进程很多时写缓冲区可能放不下，
+    // 放在最后只会截掉后面的进程，不影响前面的各项；截断时尽量再输出一行 workers_truncated，说明从哪个进程开始省略
+    for (int i = 0; prefork::enabled() && i < prefork::workers(); ++i) {
+        const prefork::worker_stats &w = prefork::stats(i);
+        if (!resp->append("worker%d %d %ld %ld %ld\n", i, (int)w.pid.load(), w.connections.load(), w.requests.load(), w.restarts.load())) {
+            resp->append("workers_truncated %d\n", i);
+            break;
+        }
+    }
+}
 
 // 注册信号处理函数
 void addsig(int sig, void (handler) (int)) {
@@ -35,17 +127,60 @@ void addsig(int sig, void (handler) (int)) {
 }
 
 
+// 在监听 socket 上 accept 一个连接，没有新连接时返回 false
+static bool accept_one(listener &lst, http_conn *users) {
+    struct sockaddr_storage client_address;
+    socklen_t client_addrlen = sizeof(client_address);
+    int connfd = accept(lst.fd, (struct sockaddr*)&client_address, &client_addrlen);              // 接受来自客户端的连接请求
+    if (connfd < 0)
+        return false;
+
+    // 目前连接数已达到最大，则关闭连接请求，表示服务器正忙
+    if (http_conn::m_user_count >= MAX_FD) {
+        close(connfd);
+        return true;
+    }
+
+    // 新建连接过于频繁的客户端，直接回复预先生成的 429 并关闭
+    if (!rate_limiter::allow_conn((struct sockaddr*)&client_address)) {
+        send(connfd, rate_limiter::m_response, rate_limiter::m_response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(connfd);
+        return true;
+    }
+
+    // 将新的客户的数据初始化，放入 users 数组中。连接使用所属监听地址的 TCP 参数，Unix 域 socket 的参数为空
+    users[connfd].init(connfd, client_address, &lst.opts, lst.tls);
+    return true;
+}
+
 // 参数用于指定端口号
 int main(int argc, char *argv[]) {
 
-    // 判断参数
-    if(argc <= 1) {     // 参数不足，未传入端口号
-        std::cout << "按照如下格式运行：" << basename(argv[0]) << " port_number" << std::endl;
+    // 解析参数
+    config conf;
+    if (!conf.parse_arg(argc, argv)) {
+        conf.usage(basename(argv[0]));
         exit(-1);
     }
 
-    // 获取端口号
-    int port = std::stoi(argv[1], nullptr, 10);
+    // 长连接策略按连接数占容量的比例收紧，能同时打开的连接数受文件描述符的上限限制
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < (rlim_t)http_conn::m_capacity)
+        http_conn::m_capacity = nofile.rlim_cur;
+
+    // 预派生模式：主进程在这里看管工作进程，不再返回；工作进程从这里继续，各自创建线程池、连接数组和 TCP 监听 socket。
+    // Unix 域 socket 不能用 SO_REUSEPORT 分配连接，由主进程打开，工作进程继承同一个
+    if (prefork::enabled()) {
+        for (int i = 0; i < conf.m_listener_count; ++i) {
+            char name[128];
+            if (conf.m_listeners[i].is_unix() && conf.m_listeners[i].open() == -1) {
+                std::cout << "cannot listen on " << conf.m_listeners[i].describe(name, sizeof(name)) << ": " << strerror(errno) << std::endl;
+                exit(-1);
+            }
+        }
+        if (prefork::run() == -1)
+            exit(-1);
+    }
 
     // 对 SIGPIE 信号进行处理
     addsig(SIGPIPE, SIG_IGN);               // 向一个没有读端的管道写数据时会产生该信号
@@ -53,41 +188,121 @@ int main(int argc, char *argv[]) {
     // 创建线程池
     threadpool<http_conn> *pool = nullptr;          // 任务对象是一个 http 连接
     try {
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(conf.m_min_threads, conf.m_max_threads, 10000,
+                                         conf.m_target_wait, conf.m_idle_timeout);
+        pool->set_schedule(conf.m_class_weights, conf.m_age_us);
+        file_table::m_wake = http_conn::file_ready;
+        if (busy_poll::enabled())
+            pool->set_spin(busy_poll::worker_us());
+        // 预读冷文件的 I/O 线程池，等待的是磁盘，线程数不多
+        http_conn::m_io_pool = new threadpool<http_conn::fetch_job>(1, 4, 10000, conf.m_target_wait, conf.m_idle_timeout);
     }catch(...) {
         exit(-1);
     }
 
+    // 进程内处理器，不经过文件系统
+    stats_pool = pool;
+    router::add_func("/healthz", true, health_handler);
+    router::add_func("/metrics", true, metrics_handler);
+
     // 创建一个数组保存所有的客户端信息
     http_conn *users = new http_conn[MAX_FD];
 
-    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-
-    // 设置端口复用，必须在绑定之前（作用，允许多个套接字绑定在同一个端口上）
-    int reuse = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    
-    // 绑定 socket 地址
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;           // 地址族
-    address.sin_addr.s_addr = INADDR_ANY;   // IP 地址
-    address.sin_port = htons(port);         // 将主机字节序转换为网络字节序
-    bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+    // 平滑升级：如果有旧进程在运行，直接继承它的监听 socket，不重新绑定端口
+    upgrader upg;
+    int inherited[upgrader::MAX_FDS];
+    int ninherited = 0;
+    if (conf.m_upgrade_path) {
+        if (!upg.init(conf.m_upgrade_path)) {
+            std::cout << "invalid upgrade socket path" << std::endl;
+            exit(-1);
+        }
+        ninherited = upg.inherit(inherited, upgrader::MAX_FDS);
+    }
 
-    // 监听
-    listen(listenfd, 5);            // 设置未决连接的个数为 5
+    // 继承的 socket 按绑定的地址认领，配置中新增的地址重新打开，不再使用的关闭
+    listener *listeners = conf.m_listeners;
+    int nlisteners = conf.m_listener_count;
+    for (int i = 0; i < nlisteners; ++i) {
+        for (int j = 0; j < ninherited && listeners[i].fd == -1; ++j) {
+            if (inherited[j] != -1 && listeners[i].matches(inherited[j])) {
+                listeners[i].fd = inherited[j];
+                inherited[j] = -1;
+            }
+        }
+        char name[128];
+        if (listeners[i].fd == -1 && listeners[i].open() == -1) {
+            std::cout << "cannot listen on " << listeners[i].describe(name, sizeof(name)) << ": " << strerror(errno) << std::endl;
+            exit(-1);
+        }
+    }
+    for (int j = 0; j < ninherited; ++j) {
+        if (inherited[j] != -1)
+            close(inherited[j]);
+    }
 
     // 创建 epoll 事件数组和 epoll 实例
     epoll_event events[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(5);
 
     // 将监听的文件描述符添加到 epoll 实例中
-    addfd(epollfd, listenfd, false);
+    for (int i = 0; i < nlisteners; ++i)
+        addfd(epollfd, listeners[i].fd, false);
     http_conn::m_epollfd = epollfd;
+    if (busy_poll::enabled())
+        busy_poll::setup(epollfd);
+
+    // 完成队列：工作线程交还连接时，有需要主线程处理的事件就放入队列，并通过 eventfd 唤醒主线程
+    http_conn::m_pool = pool;
+    http_conn::m_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    addfd(epollfd, http_conn::m_done_fd, false);
+
+    // 在升级 socket 上等待下一个版本的进程
+    int upgradefd = -1;
+    if (upg.enabled()) {
+        upgradefd = upg.listen_upgrade();
+        if (upgradefd == -1) {
+            std::cout << "listen on upgrade socket failed" << std::endl;
+            exit(-1);
+        }
+        addfd(epollfd, upgradefd, false);
+    }
+
+    // 开启流量录制
+    if (capture::enabled() && !capture::start())
+        exit(-1);
+
+    // 定期检查代理路由的上游是否可用
+    proxy::start_health_check();
+    // HTTP/2 连接不能访问代理路由，配置了代理路由时 TLS 不通过 ALPN 提供 h2
+    tls_conn::m_alpn_h2 = !proxy::enabled();
+
+    // 信号管道：SIGUSR2 启动新版本进程并交出监听 socket，SIGQUIT 处理完已有请求后退出，
+    // SIGUSR1 打印线程池的状态，开启了请求跟踪时同时导出跟踪记录
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sig_pipefd);
+    addfd(epollfd, sig_pipefd[0], false);
+    addsig(SIGUSR1, sig_handler);
+    addsig(SIGUSR2, sig_handler);
+    addsig(SIGQUIT, sig_handler);
+    prefork::unblock_signals();             // 预派生的工作进程从这里开始处理主进程转发的信号
+
+    bool draining = false;          // 是否已经停止 accept，正在等待已有连接结束
+    time_t drain_deadline = 0;
+    // 监听 socket 是边缘触发的，必须一直 accept 到没有新连接为止，否则剩下的连接会滞留在队列中。
+    // 每轮最多 accept http_conn::m_accept_budget 个，没有 accept 完的监听 socket 记在这里，下一轮继续
+    bool accept_pending[listener::MAX] = {};
+    bool accept_backlog = false;
 
     // web 服务器一直循环
     while (true){              
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);            // 检测 epoll 实例中是否有就绪事件
+        // 退出过程中需要定期检查连接是否都已结束，各阶段的期限也需要每秒检查一次
+        int timeout = (draining || http_conn::m_recheck > 0) ? 1000 : -1;
+        if (accept_backlog || http_conn::has_ready())     // 还有没处理完的连接，不阻塞等待
+            timeout = 0;
+        else if (http_conn::has_fetch_retry())          // I/O 线程池的队列满了，稍后重新提交预读任务
+            timeout = 1;
+        int num = busy_poll::enabled() ? busy_poll::wait(epollfd, events, MAX_EVENT_NUMBER, timeout)
+                                       : epoll_wait(epollfd, events, MAX_EVENT_NUMBER, timeout);            // 检测 epoll 实例中是否有就绪事件
         if (num<0 && errno != EINTR) {
             std::cout << "epoll failure" << std::endl;
             break;
@@ -97,41 +312,128 @@ int main(int argc, char *argv[]) {
         for (int i=0; i<num; i++) {
             int sockfd = events[i].data.fd;
 
-            if (sockfd == listenfd) {           // 说明有客户端连接进来
-                struct sockaddr_in client_address;
-                socklen_t client_addrlen = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addrlen);              // 接受来自客户端的连接请求
+            listener *lst = nullptr;
+            for (int j = 0; j < nlisteners && !lst; ++j) {
+                if (sockfd == listeners[j].fd)
+                    lst = &listeners[j];
+            }
 
-                // 目前连接数已达到最大，则关闭连接请求，表示服务器正忙
-                if (http_conn::m_user_count >= MAX_FD) {
-                    close(connfd);
-                    continue;
+            if (lst) {     // 说明有客户端连接进来，处理完这一批事件之后再 accept
+                accept_pending[lst - listeners] = true;
+            }
+            else if (sockfd == upgradefd || sockfd == sig_pipefd[0]) {
+                bool stop = false;
+                if (sockfd == upgradefd) {          // 新版本的进程来接管监听 socket
+                    int fds[listener::MAX];
+                    for (int j = 0; j < nlisteners; ++j)
+                        fds[j] = listeners[j].fd;
+                    if (upg.handoff(fds, nlisteners)) {
+                        std::cout << "listening socket handed off, draining connections" << std::endl;
+                        upgradefd = -1;
+                        stop = true;
+                    }
+                }
+                else {
+                    char signals[64];
+                    int n = recv(sig_pipefd[0], signals, sizeof(signals), MSG_DONTWAIT);
+                    for (int j = 0; j < n; ++j) {
+                        if (signals[j] == SIGUSR2 && !draining) {
+                            if (!upg.enabled())
+                                std::cout << "upgrade failed: no upgrade socket configured" << std::endl;
+                            else if (!upg.spawn(argv))
+                                std::cout << "upgrade failed: fork error" << std::endl;
+                        }
+                        else if (signals[j] == SIGQUIT) {
+                            stop = true;
+                        }
+                        else if (signals[j] == SIGUSR1) {
+                            threadpool<http_conn>::stats st = pool->get_stats();
+                            std::cout << "threadpool: threads=" << st.threads << " idle=" << st.idle_threads
+                                      << " queued=" << st.queued << " avg_wait_us=" << st.avg_wait_us
+                                      << " max_wait_us=" << st.max_wait_us << std::endl;
+                            if (tracer::enabled() && !tracer::dump())
+                                std::cout << "trace dump already in progress" << std::endl;
+                        }
+                    }
                 }
 
-                // 将新的客户的数据初始化，放入 users 数组中
-                users[connfd].init(connfd, client_address);
+                // 停止 accept，之后的响应都带上 Connection: close
+                if (stop && !draining) {
+                    draining = true;
+                    drain_deadline = time(nullptr) + conf.m_drain_timeout;
+                    http_conn::m_draining = true;
+                    for (int j = 0; j < nlisteners; ++j) {
+                        removefd(epollfd, listeners[j].fd);
+                        listeners[j].fd = -1;
+                    }
+                }
             }
-            else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {        // EPOLLHUP：挂断       EPOLLRDHUP：对端套接字关闭      EPOLLERR：有错误发生
-                // 异常断开或错误，则断开连接
-                users[sockfd].close_conn();
+            else if (sockfd == http_conn::m_done_fd) {     // 工作线程交还的连接
+                http_conn::drain_completions();
             }
-            else if (events[i].events & EPOLLIN) {  // 读事件
-                if (users[sockfd].read())                   // 将所有数据读出      
-                    pool->append(users + sockfd);           // 把任务（即 http 请求）追加到线程池中
-                else 
-                    users[sockfd].close_conn();
+            else if (http_conn::m_coro_mode) {     // 协程模式：恢复连接协程，由它完成读写
+                users[sockfd].resume(events[i].events);
             }
-            else if (events[i].events & EPOLLOUT) {  // 写事件
-                if(!users[sockfd].write())                 // 一次性写，但是失败（成功但并未请求保持连接）
-                    users[sockfd].close_conn();
+            else {      // 线程池模式：连接由主线程持有时在这里读写，交给线程池处理请求；由工作线程持有时只记录事件
+                users[sockfd].on_events(events[i].events);
+            }
+        }
+
+        // 在有新连接的监听 socket 之间轮流，每次各 accept 一个，直到都 accept 完或者达到这一轮的上限
+        int accepted = 0;
+        bool progress = true;
+        while (progress && (http_conn::m_accept_budget == 0 || accepted < http_conn::m_accept_budget)) {
+            progress = false;
+            for (int j = 0; j < nlisteners && (http_conn::m_accept_budget == 0 || accepted < http_conn::m_accept_budget); ++j) {
+                if (!accept_pending[j])
+                    continue;
+                if (listeners[j].fd == -1 || !accept_one(listeners[j], users)) {
+                    accept_pending[j] = false;
+                    continue;
+                }
+                ++accepted;
+                progress = true;
             }
         }
+        accept_backlog = false;
+        for (int j = 0; j < nlisteners; ++j)
+            accept_backlog |= accept_pending[j];
+        if (accept_backlog)
+            http_conn::m_accept_deferred.fetch_add(1, std::memory_order_relaxed);
+
+        // 用完了预算的连接按顺序各处理一轮
+        http_conn::run_ready();
+        http_conn::retry_fetches();
+
+        // 超过期限的连接直接在主线程中关闭
+        http_conn::check_deadlines();
+
+        if (prefork::enabled())
+            prefork::publish(http_conn::m_user_count, http_conn::m_requests_total.load(std::memory_order_relaxed));
+
+        if (draining) {
+            // 空闲的长连接上没有正在处理的请求，可以直接关闭；其余连接在发送完响应后关闭
+            for (int fd = 0; fd < MAX_FD; ++fd) {
+                if (users[fd].is_idle())
+                    users[fd].close_idle();
+            }
+            if (http_conn::m_user_count <= 0 || time(nullptr) >= drain_deadline)
+                break;
+        }
     }
     
     close(epollfd);
-    close(listenfd);
+    // Unix 域 socket 的文件不删除：交接之后新进程还在这个路径上监听
+    for (int i = 0; i < nlisteners; ++i) {
+        if (listeners[i].fd != -1)
+            close(listeners[i].fd);
+    }
+    proxy::stop_health_check();
+    delete pool;                // 先等待工作线程结束，它们可能还在访问 users
+    delete http_conn::m_io_pool;
+    capture::stop();
+    tracer::stop();
     delete []users;
-    delete pool;
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "prefork.h"
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <iostream>
+#include <new>
+
+int prefork::m_workers = 0;
+int prefork::m_index = -1;
+pid_t prefork::m_master = 0;
+prefork::worker_stats *prefork::m_stats = nullptr;
+sigset_t prefork::m_old_mask;
+
+static long now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool prefork::parse(const char *spec) {
+    char *end;
+    long workers = strtol(spec, &end, 10);
+    if (end == spec || *end != '\0' || workers <= 0 || workers > MAX_WORKERS)
+        return false;
+    m_workers = workers;
+    return true;
+}
+
+int prefork::run() {
+    void *mem = mmap(nullptr, sizeof(worker_stats) * m_workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        std::cout << "cannot map worker statistics: " << strerror(errno) << std::endl;
+        return -1;
+    }
+    m_stats = (worker_stats *)mem;
+    for (int i = 0; i < m_workers; ++i)
+        new (&m_stats[i]) worker_stats();
+    m_master = getpid();
+
+    // 主进程同步地等待这些信号。派生的进程继续阻塞它们，直到装好自己的信号处理函数再恢复原来的信号掩码，
+    // 否则在这之前收到的 SIGQUIT（主进程退出或停止）、SIGUSR1 会按默认动作直接终止工作进程
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &set, &m_old_mask);
+
+    pid_t pids[MAX_WORKERS] = {};
+    long spawned_ms[MAX_WORKERS] = {};
+    bool pending[MAX_WORKERS];                  // 这个位置需要派生一个进程
+    for (int i = 0; i < m_workers; ++i)
+        pending[i] = true;
+    int alive = 0;
+    bool stopping = false;
+
+    while (true) {
+        long now = now_ms();
+        bool delayed = false;                   // 有位置因为刚刚派生过而推迟
+        for (int i = 0; i < m_workers && !stopping; ++i) {
+            if (!pending[i])
+                continue;
+            if (spawned_ms[i] && now - spawned_ms[i] < 1000) {
+                delayed = true;
+                continue;
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                prctl(PR_SET_PDEATHSIG, SIGQUIT);
+                if (getppid() != m_master)      // 主进程在 prctl 之前已经退出
+                    exit(0);
+                m_index = i;
+                return i;
+            }
+            if (pid == -1) {
+                std::cout << "fork worker " << i << " failed: " << strerror(errno) << std::endl;
+                spawned_ms[i] = now;
+                delayed = true;
+                continue;
+            }
+            if (spawned_ms[i])
+                m_stats[i].restarts.fetch_add(1, std::memory_order_relaxed);
+            m_stats[i].pid.store(pid, std::memory_order_relaxed);
+            pids[i] = pid;
+            spawned_ms[i] = now;
+            pending[i] = false;
+            ++alive;
+        }
+        if (alive == 0 && (stopping || !delayed))
+            break;
+
+        timespec timeout = {delayed ? 0 : 1, delayed ? 100000000 : 0};
+        siginfo_t info;
+        int sig = sigtimedwait(&set, &info, &timeout);
+        if (sig == SIGQUIT || sig == SIGTERM || sig == SIGINT || sig == SIGUSR1) {
+            if (sig != SIGUSR1 && !stopping) {
+                std::cout << "stopping " << alive << " workers" << std::endl;
+                stopping = true;
+            }
+            for (int i = 0; i < m_workers; ++i) {
+                if (pids[i])
+                    kill(pids[i], sig == SIGUSR1 ? SIGUSR1 : SIGQUIT);
+            }
+        }
+
+        // 回收退出的工作进程，没有在停止时重新派生
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < m_workers; ++i) {
+                if (pids[i] != pid)
+                    continue;
+                pids[i] = 0;
+                m_stats[i].pid.store(0, std::memory_order_relaxed);
+                --alive;
+                pending[i] = !stopping;
+                if (!stopping) {
+                    if (WIFSIGNALED(status))
+                        std::cout << "worker " << i << " (pid " << pid << ") killed by signal " << WTERMSIG(status) << ", restarting" << std::endl;
+                    else
+                        std::cout << "worker " << i << " (pid " << pid << ") exited with status " << WEXITSTATUS(status) << ", restarting" << std::endl;
+                }
+            }
+        }
+    }
+    exit(0);
+}
+
+void prefork::unblock_signals() {
+    if (m_index >= 0)
+        sigprocmask(SIG_SETMASK, &m_old_mask, nullptr);
+}
+
+void prefork::publish(long connections, long requests) {
+    worker_stats &w = m_stats[m_index];
+    w.connections.store(connections, std::memory_order_relaxed);
+    w.requests.store(requests, std::memory_order_relaxed);
+}
@@ -0,0 +1,604 @@
+#include "proxy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <iostream>
+
+proxy::route proxy::m_routes[MAX_ROUTES];
+int proxy::m_route_count = 0;
+std::atomic<long> proxy::m_bad_gateway(0);
+pthread_t proxy::m_health_tid;
+bool proxy::m_health_running = false;
+bool proxy::m_health_stop = false;
+locker proxy::m_health_lock;
+cond proxy::m_health_cond;
+
+// 每个工作线程一个 splice 使用的管道
+static thread_local int relay_pipe[2] = {-1, -1};
+
+////////////////////////////////upstream////////////////////////////////
+
+upstream::~upstream() {
+    for (int i = 0; i < m_idle_count; ++i)
+        close(m_idle[i]);
+}
+
+// 解析上游地址：unix:/path 或 host:port
+bool upstream::init(const char *addr) {
+    if (strlen(addr) >= NAME_LEN)
+        return false;
+    strcpy(m_name, addr);
+    memset(&m_addr, 0, sizeof(m_addr));
+
+    if (strncmp(addr, "unix:", 5) == 0) {
+        sockaddr_un *un = (sockaddr_un *)&m_addr;
+        if (strlen(addr + 5) >= sizeof(un->sun_path))
+            return false;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, addr + 5);
+        m_addrlen = sizeof(sockaddr_un);
+        return true;
+    }
+
+    char host[NAME_LEN];
+    strcpy(host, addr);
+    char *port = strrchr(host, ':');
+    if (!port)
+        return false;
+    *port++ = '\0';
+
+    addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0 || !res)
+        return false;
+    memcpy(&m_addr, res->ai_addr, res->ai_addrlen);
+    m_addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+// 非阻塞地建立连接，最多等待 timeout_ms 毫秒
+int upstream::connect_upstream(int timeout_ms) {
+    int fd = socket(m_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    if (connect(fd, (sockaddr *)&m_addr, m_addrlen) == -1) {
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        pollfd pfd = { fd, POLLOUT, 0 };
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (poll(&pfd, 1, timeout_ms) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (m_addr.ss_family != AF_UNIX) {          // 请求首部和请求体分开发送，不能等待 Nagle 算法
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    return fd;
+}
+
+// 优先复用空闲连接。空闲期间上游可能已经关闭了连接，此时 socket 可读（读到 EOF），直接丢弃
+int upstream::acquire() {
+    m_lock.lock();
+    while (m_idle_count > 0) {
+        int fd = m_idle[--m_idle_count];
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) == 0) {
+            m_lock.unlock();
+            return fd;
+        }
+        close(fd);
+    }
+    m_lock.unlock();
+
+    int fd = connect_upstream(1000);
+    if (fd == -1)
+        m_healthy = false;                      // 连接失败，在下一次健康检查通过之前不再选择它
+    return fd;
+}
+
+void upstream::release(int fd, bool reusable) {
+    if (reusable) {
+        m_lock.lock();
+        if (m_idle_count < MAX_IDLE) {
+            m_idle[m_idle_count++] = fd;
+            m_lock.unlock();
+            return;
+        }
+        m_lock.unlock();
+    }
+    close(fd);
+}
+
+bool upstream::check() {
+    int fd = connect_upstream(1000);
+    if (fd == -1)
+        return false;
+    close(fd);
+    return true;
+}
+
+////////////////////////////////转发的辅助函数////////////////////////////////
+
+// 等待 fd 上的事件
+static bool wait_fd(int fd, short events) {
+    pollfd pfd = { fd, events, 0 };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, proxy::IO_TIMEOUT);
+    } while (ret == -1 && errno == EINTR);
+    return ret == 1;
+}
+
+// 向非阻塞的 socket 写出全部数据
+static bool send_all(int fd, const char *buf, long len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN || !wait_fd(fd, POLLOUT))
+                return false;
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 关闭本线程的管道。出错时管道中可能残留数据，必须重建
+static void reset_pipe() {
+    if (relay_pipe[0] != -1) {
+        close(relay_pipe[0]);
+        close(relay_pipe[1]);
+        relay_pipe[0] = relay_pipe[1] = -1;
+    }
+}
+
+// socket -> 管道 -> socket，数据不经过用户空间。len 为 LONG_MAX 表示一直转发到对端关闭
+static bool splice_relay(int from, int to, long len) {
+    if (relay_pipe[0] == -1 && pipe2(relay_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+        return false;
+
+    while (len > 0) {
+        ssize_t n = splice(from, NULL, relay_pipe[1], NULL, len < 65536 ? len : 65536, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)                             // 对端关闭
+            return len == LONG_MAX;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && wait_fd(from, POLLIN))
+                continue;
+            reset_pipe();
+            return false;
+        }
+
+        if (len != LONG_MAX)
+            len -= n;
+        while (n > 0) {
+            ssize_t m = splice(relay_pipe[0], NULL, to, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (len > 0 ? SPLICE_F_MORE : 0));
+            if (m == -1 && (errno == EINTR || (errno == EAGAIN && wait_fd(to, POLLOUT))))
+                continue;
+            if (m <= 0) {
+                reset_pipe();
+                return false;
+            }
+            n -= m;
+        }
+    }
+    return true;
+}
+
+// 分块传输编码的边界扫描器。只识别报文在哪里结束，不解码数据，数据原样转发
+struct chunk_scanner {
+    enum STATE {SIZE = 0, EXT, DATA, DATA_CR, DATA_LF, TRAILER, TRAILER_LINE, FINAL_LF, DONE};
+    STATE state;
+    long size;
+
+    chunk_scanner() : state(SIZE), size(0) {}
+
+    // 扫描 len 字节，返回属于当前报文的字节数。返回值小于 len 或 state == DONE 时报文已经结束，-1 表示格式错误。
+    // out 不为空时同时解码：块中的数据依次移到 out 中，字节数累加到 *out_len。out 可以与 p 相同
+    long feed(const char *p, long len, char *out = nullptr, long *out_len = nullptr) {
+        long i = 0;
+        while (i < len && state != DONE) {
+            char c = p[i];
+            switch (state) {
+                case SIZE:
+                    if (isxdigit((unsigned char)c)) {
+                        size = size * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+                        ++i;
+                        break;
+                    }
+                    state = EXT;
+                    break;
+                case EXT:                       // 块扩展，直到行尾
+                    ++i;
+                    if (c == '\n') {
+                        state = size == 0 ? TRAILER : DATA;
+                    }
+                    break;
+                case DATA: {
+                    long n = len - i < size ? len - i : size;
+                    if (out) {
+                        memmove(out + *out_len, p + i, n);
+                        *out_len += n;
+                    }
+                    i += n;
+                    size -= n;
+                    if (size == 0)
+                        state = DATA_CR;
+                    break;
+                }
+                case DATA_CR:
+                    if (c != '\r')
+                        return -1;
+                    ++i;
+                    state = DATA_LF;
+                    break;
+                case DATA_LF:
+                    if (c != '\n')
+                        return -1;
+                    ++i;
+                    state = SIZE;
+                    break;
+                case TRAILER:                   // 尾部字段的行首，空行表示报文结束
+                    ++i;
+                    state = (c == '\r') ? FINAL_LF : (c == '\n' ? DONE : TRAILER_LINE);
+                    break;
+                case TRAILER_LINE:
+                    ++i;
+                    if (c == '\n')
+                        state = TRAILER;
+                    break;
+                case FINAL_LF:
+                    if (c != '\n')
+                        return -1;
+                    ++i;
+                    state = DONE;
+                    break;
+                default:
+                    return -1;
+            }
+        }
+        return i;
+    }
+};
+
+// 上游响应首部中决定如何转发响应体的信息
+struct response_head {
+    int status;
+    long content_length;        // -1 表示没有 Content-Length
+    bool chunked;
+    bool close;                 // 上游在响应之后会关闭连接
+};
+
+// 解析响应首部，buf 中的首部以 \r\n\r\n 结尾
+static bool parse_response_head(const char *buf, int len, response_head *head) {
+    head->status = 0;
+    head->content_length = -1;
+    head->chunked = false;
+    head->close = false;
+
+    if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0)
+        return false;
+    head->close = (buf[7] == '0');          // HTTP/1.0 默认不保持连接
+    head->status = atoi(buf + 9);
+
+    const char *end = buf + len;
+    for (const char *line = (const char *)memchr(buf, '\n', len) + 1; line < end; ) {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (!eol)
+            break;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            head->content_length = atol(line + 15);
+        }
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            head->chunked = memmem(line, eol - line, "chunked", 7) != nullptr;
+        }
+        else if (strncasecmp(line, "Connection:", 11) == 0) {
+            if (memmem(line, eol - line, "close", 5))
+                head->close = true;
+            else if (memmem(line, eol - line, "keep-alive", 10))
+                head->close = false;
+        }
+        line = eol + 1;
+    }
+    return head->status >= 100;
+}
+
+// 读取上游的响应首部，跳过 1xx 临时响应。返回首部长度，buf 中首部之后可能还有部分响应体，总长度通过 len 返回
+static int read_response_head(int fd, bool tcp, char *buf, int *len, response_head *head) {
+    // 上游分两次写出首部和响应体时，延迟确认会和上游的 Nagle 算法互相等待，读取首部之前先要求立即确认
+    if (tcp) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+    *len = 0;
+    while (true) {
+        char *end = (char *)memmem(buf, *len, "\r\n\r\n", 4);
+        if (end) {
+            int head_len = end + 4 - buf;
+            if (!parse_response_head(buf, head_len, head))
+                return -1;
+            if (head->status >= 200 || head->status == 101)
+                return head_len;
+            memmove(buf, buf + head_len, *len - head_len);      // 丢弃 1xx 响应
+            *len -= head_len;
+            continue;
+        }
+
+        if (*len >= proxy::HEAD_BUFFER_SIZE)
+            return -1;
+        ssize_t n = recv(fd, buf + *len, proxy::HEAD_BUFFER_SIZE - *len, 0);
+        if (n == 0)
+            return -1;
+        if (n == -1) {
+            if (errno == EINTR || (errno == EAGAIN && wait_fd(fd, POLLIN)))
+                continue;
+            return -1;
+        }
+        *len += n;
+    }
+}
+
+// 在用户空间转发分块编码的响应体，同时扫描报文边界，因为只有解析块大小才能知道响应在哪里结束。
+// data 为与首部一起读到的响应体开头，之后的数据读入自己的缓冲区。decode 时只转发解码后的数据
+static bool relay_chunked(int from, int to, char *data, long len, bool decode, bool *reusable) {
+    chunk_scanner scanner;
+    char buf[proxy::HEAD_BUFFER_SIZE];
+    while (true) {
+        long out_len = 0;
+        long used = decode ? scanner.feed(data, len, data, &out_len) : scanner.feed(data, len);
+        if (used == -1)
+            return false;
+        if (!send_all(to, data, decode ? out_len : used))
+            return false;
+        if (scanner.state == chunk_scanner::DONE) {
+            if (used < len)                     // 响应之后还有多余的数据，上游连接的状态不可信
+                *reusable = false;
+            return true;
+        }
+
+        ssize_t n = recv(from, buf, sizeof(buf), 0);
+        if (n == 0)
+            return false;
+        if (n == -1) {
+            if (errno == EINTR || (errno == EAGAIN && wait_fd(from, POLLIN))) {
+                len = 0;
+                continue;
+            }
+            return false;
+        }
+        data = buf;
+        len = n;
+    }
+}
+
+// 改写上游响应的首部：去掉逐跳首部，按客户端连接能否复用加上我们自己的 Connection 首部。
+// dechunk 时同时去掉 Transfer-Encoding，响应体解码后以连接关闭为结束。首部放不下时返回 -1
+static int rewrite_response_head(const char *head, int len, bool keep_alive, bool dechunk, char *out, int size) {
+    static const char *hop_headers[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:", "Trailer:", "Upgrade:"};
+    const char *end = head + len - 2;           // 结尾的空行
+    const char *line = (const char *)memchr(head, '\n', len) + 1;
+    int out_len = line - head;
+    if (out_len > size)
+        return -1;
+    memcpy(out, head, out_len);                 // 状态行
+
+    while (line < end) {
+        const char *next = (const char *)memchr(line, '\n', end - line) + 1;
+        bool skip = dechunk && strncasecmp(line, "Transfer-Encoding:", 18) == 0;
+        for (const char *name : hop_headers)
+            skip = skip || strncasecmp(line, name, strlen(name)) == 0;
+        if (!skip) {
+            if (out_len + (next - line) > size)
+                return -1;
+            memcpy(out + out_len, line, next - line);
+            out_len += next - line;
+        }
+        line = next;
+    }
+    out_len += snprintf(out + out_len, size - out_len, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+    return out_len < size ? out_len : -1;
+}
+
+////////////////////////////////proxy////////////////////////////////
+
+const proxy::route *proxy::add_route(const char *upstreams) {
+    if (m_route_count >= MAX_ROUTES)
+        return nullptr;
+
+    route &r = m_routes[m_route_count];
+    r.count = 0;
+    r.next = 0;
+
+    char buf[upstream::NAME_LEN * MAX_UPSTREAMS];
+    if (strlen(upstreams) >= sizeof(buf))
+        return nullptr;
+    strcpy(buf, upstreams);
+
+    char *save = nullptr;
+    for (char *addr = strtok_r(buf, ",", &save); addr; addr = strtok_r(nullptr, ",", &save)) {
+        if (r.count >= MAX_UPSTREAMS)
+            return nullptr;
+        upstream *up = new upstream;
+        if (!up->init(addr)) {
+            delete up;
+            return nullptr;
+        }
+        r.upstreams[r.count++] = up;
+    }
+    if (r.count == 0)
+        return nullptr;
+
+    ++m_route_count;
+    return &r;
+}
+
+// 最少请求数优先。从轮转起点开始比较，请求数相同时各个上游被依次选中
+upstream *proxy::pick(const route *r) {
+    unsigned start = r->next.fetch_add(1, std::memory_order_relaxed);
+    upstream *best = nullptr;
+    int best_outstanding = INT_MAX;
+    for (int i = 0; i < r->count; ++i) {
+        upstream *up = r->upstreams[(start + i) % r->count];
+        if (!up->m_healthy)
+            continue;
+        int outstanding = up->m_outstanding.load(std::memory_order_relaxed);
+        if (outstanding < best_outstanding) {
+            best = up;
+            best_outstanding = outstanding;
+        }
+    }
+    return best;
+}
+
+void proxy::start_health_check() {
+    if (m_route_count == 0)
+        return;
+    m_health_running = pthread_create(&m_health_tid, nullptr, health_check, nullptr) == 0;
+}
+
+void proxy::stop_health_check() {
+    if (!m_health_running)
+        return;
+    m_health_lock.lock();
+    m_health_stop = true;
+    m_health_cond.signal();
+    m_health_lock.unlock();
+    pthread_join(m_health_tid, nullptr);
+    m_health_running = false;
+}
+
+// 健康检查线程：定期尝试连接每个上游，两次检查之间在条件变量上等待，停止时立即被唤醒
+void *proxy::health_check(void *arg) {
+    while (true) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += HEALTH_INTERVAL;
+        m_health_lock.lock();
+        while (!m_health_stop && m_health_cond.timedwait(m_health_lock.get(), deadline))
+            ;
+        bool stop = m_health_stop;
+        m_health_lock.unlock();
+        if (stop)
+            break;
+
+        for (int i = 0; i < m_route_count; ++i) {
+            for (int j = 0; j < m_routes[i].count; ++j) {
+                upstream *up = m_routes[i].upstreams[j];
+                bool healthy = up->check();
+                if (healthy != up->m_healthy)
+                    std::cout << "upstream " << up->name() << (healthy ? " is up" : " is down") << std::endl;
+                up->m_healthy = healthy;
+            }
+        }
+    }
+    return nullptr;
+}
+
+proxy::RESULT proxy::forward(const route *r, int client_fd, bool head_only, bool http10, const char *head, int head_len,
+                             const char *body, long body_len, long body_remaining, bool *keep_alive) {
+    // 连接失败的上游被标记为不可用，换一个上游重试
+    upstream *up = nullptr;
+    int fd = -1;
+    for (int i = 0; i < r->count && fd == -1; ++i) {
+        up = pick(r);
+        if (!up)
+            return PROXY_BAD_GATEWAY;
+        fd = up->acquire();
+    }
+    if (fd == -1)
+        return PROXY_BAD_GATEWAY;
+
+    ++up->m_outstanding;
+    RESULT result = PROXY_ABORT;
+    bool reusable = false;
+    char buf[HEAD_BUFFER_SIZE];
+    int len = 0, resp_head_len = 0;
+    response_head resp;
+
+    do {
+        // 转发请求：首部、已经读到的请求体、socket 中剩余的请求体
+        if (!send_all(fd, head, head_len) || !send_all(fd, body, body_len))
+            break;
+        if (body_remaining > 0 && !splice_relay(client_fd, fd, body_remaining))
+            break;
+
+        // 读取响应首部，在此之前出错的话客户端还没有收到任何数据
+        resp_head_len = read_response_head(fd, !up->is_unix(), buf, &len, &resp);
+        if (resp_head_len == -1) {
+            result = PROXY_BAD_GATEWAY;
+            break;
+        }
+        // 响应体以连接关闭为结束，或者要为 HTTP/1.0 的客户端解码分块编码时，客户端连接也只能关闭
+        bool no_body = head_only || resp.status == 204 || resp.status == 304;
+        bool dechunk = !no_body && resp.chunked && http10;
+        if (dechunk || (!no_body && !resp.chunked && resp.content_length < 0))
+            *keep_alive = false;
+        // 改写后的首部最多多出一行 Connection，与首部一起读到的响应体也放得下，可以一次发出
+        char out[HEAD_BUFFER_SIZE + 64];
+        int out_len = rewrite_response_head(buf, resp_head_len, *keep_alive, dechunk, out, sizeof(out));
+        if (out_len == -1) {
+            result = PROXY_BAD_GATEWAY;
+            break;
+        }
+
+        // 转发响应体。与首部一起读到的数据只把属于这个响应的部分发给客户端，
+        // 多出的数据说明上游连接的状态不可信，不再复用
+        reusable = !resp.close;
+        long extra = len - resp_head_len;
+        if (no_body) {
+            if (!send_all(client_fd, out, out_len))
+                break;
+            reusable = reusable && extra == 0;
+        }
+        else if (resp.chunked) {
+            if (!send_all(client_fd, out, out_len)
+                || !relay_chunked(fd, client_fd, buf + resp_head_len, extra, dechunk, &reusable))
+                break;
+        }
+        else if (resp.content_length >= 0) {
+            if (extra > resp.content_length) {
+                extra = resp.content_length;
+                reusable = false;
+            }
+            memcpy(out + out_len, buf + resp_head_len, extra);
+            if (!send_all(client_fd, out, out_len + extra))
+                break;
+            long remaining = resp.content_length - extra;
+            if (remaining > 0 && !splice_relay(fd, client_fd, remaining))
+                break;
+        }
+        else {
+            reusable = false;
+            memcpy(out + out_len, buf + resp_head_len, extra);
+            if (!send_all(client_fd, out, out_len + extra) || !splice_relay(fd, client_fd, LONG_MAX))
+                break;
+        }
+        result = PROXY_OK;
+    } while (false);
+
+    --up->m_outstanding;
+    up->release(fd, result == PROXY_OK && reusable);
+    return result;
+}
@@ -0,0 +1,169 @@
+#include "ratelimit.h"
+#include <stdlib.h>
+#include <time.h>
+#include <iostream>
+
+const char rate_limiter::m_response[] =
+    "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+const int rate_limiter::m_response_len = sizeof(m_response) - 1;
+std::atomic<long> rate_limiter::m_rejected(0);
+
+rate_limiter::limit rate_limiter::m_conn = {0, 0};
+rate_limiter::limit rate_limiter::m_req = {0, 0};
+rate_limiter::limit rate_limiter::m_net = {0, 0};
+rate_limiter::slot rate_limiter::m_table[TABLE_SIZE];
+
+// 单调时钟的毫秒数，只保留低 32 位，比较时使用差值。粗粒度时钟不需要陷入内核
+static uint32_t now_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint32_t ms = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    return ms ? ms : 1;                         // 状态 0 表示满的桶，时间不能为 0
+}
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// 解析一项 name=rate[:burst]
+static bool parse_limit(const char *item, const char *name, rate_limiter::limit *l) {
+    size_t len = strlen(name);
+    if (strncmp(item, name, len) != 0 || item[len] != '=')
+        return false;
+    l->rate = atoi(item + len + 1);
+    const char *burst = strchr(item + len + 1, ':');
+    l->burst = burst ? atoi(burst + 1) : l->rate;
+    return true;
+}
+
+bool rate_limiter::parse(const char *spec) {
+    char buf[256];
+    if (strlen(spec) >= sizeof(buf))
+        return false;
+    strcpy(buf, spec);
+
+    char *save = nullptr;
+    for (char *item = strtok_r(buf, ",", &save); item; item = strtok_r(nullptr, ",", &save)) {
+        if (!parse_limit(item, "conn", &m_conn) && !parse_limit(item, "req", &m_req) && !parse_limit(item, "net", &m_net)) {
+            std::cout << "unknown rate limit: " << item << std::endl;
+            return false;
+        }
+    }
+
+    // 令牌数以千分之一为单位存放在 32 位中
+    for (const limit *l : {&m_conn, &m_req, &m_net}) {
+        if (l->rate < 0 || l->burst < 0 || l->burst > 4000000 || (l->rate > 0 && l->burst == 0))
+            return false;
+    }
+    return true;
+}
+
+// IPv4 的网段为 /24，IPv6 为 /64。映射到 IPv6 的 IPv4 地址按 IPv4 处理
+uint64_t rate_limiter::make_key(KEY_KIND kind, const sockaddr *addr, bool network) {
+    uint64_t id;
+    if (addr->sa_family == AF_INET6) {
+        const uint8_t *a = ((const sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED((const in6_addr *)a)) {
+            id = ((uint32_t)a[12] << 24) | (a[13] << 16) | (a[14] << 8) | a[15];
+            if (network)
+                id &= 0xffffff00;
+        }
+        else {
+            uint64_t hi, lo;
+            memcpy(&hi, a, 8);
+            memcpy(&lo, a + 8, 8);
+            id = mix(network ? hi : hi ^ mix(lo));
+            id = (id & 0xffffffffffffULL) | (1ULL << 48);       // 与 IPv4 地址区分开
+        }
+    }
+    else {
+        id = ntohl(((const sockaddr_in *)addr)->sin_addr.s_addr);
+        if (network)
+            id &= 0xffffff00;
+    }
+    return ((uint64_t)kind << 56) | id;
+}
+
+// 找到键所在的槽，没有时占用一个空槽或者淘汰一个最久没有访问的槽。
+// 淘汰和更新之间存在竞争，最坏的情况是两个地址短暂地共用一个桶，不影响正确性
+rate_limiter::slot *rate_limiter::find(uint64_t key, uint32_t now) {
+    size_t h = mix(key) & (TABLE_SIZE - 1);
+    slot *victim = nullptr;
+    uint32_t victim_age = 0;
+
+    for (int i = 0; i < PROBE; ++i) {
+        slot *s = &m_table[(h + i) & (TABLE_SIZE - 1)];
+        uint64_t k = s->key.load(std::memory_order_acquire);
+        if (k == key)
+            return s;
+        if (k == 0) {
+            if (s->key.compare_exchange_strong(k, key, std::memory_order_acq_rel)) {
+                s->state.store(0, std::memory_order_release);
+                return s;
+            }
+            if (k == key)                       // 另一个线程刚刚为同一个键占用了这个槽
+                return s;
+        }
+
+        uint64_t state = s->state.load(std::memory_order_relaxed);
+        uint32_t age = state ? now - (uint32_t)(state >> 32) : UINT32_MAX;
+        if (!victim || age > victim_age) {
+            victim = s;
+            victim_age = age;
+        }
+    }
+
+    uint64_t old = victim->key.load(std::memory_order_relaxed);
+    if (victim->key.compare_exchange_strong(old, key, std::memory_order_acq_rel))
+        victim->state.store(0, std::memory_order_release);
+    return victim;
+}
+
+// 从桶中取一个令牌。先按经过的时间补充令牌，再用 CAS 写回
+bool rate_limiter::take(uint64_t key, const limit &l) {
+    uint32_t now = now_ms();
+    slot *s = find(key, now);
+    uint64_t cap = (uint64_t)l.burst * 1000;
+
+    uint64_t old = s->state.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t tokens = cap;
+        if (old != 0) {
+            tokens = (uint32_t)old + (uint64_t)(uint32_t)(now - (uint32_t)(old >> 32)) * l.rate;
+            if (tokens > cap)
+                tokens = cap;
+        }
+        bool ok = tokens >= 1000;
+        if (ok)
+            tokens -= 1000;
+        uint64_t state = ((uint64_t)now << 32) | tokens;
+        if (s->state.compare_exchange_weak(old, state, std::memory_order_relaxed))
+            return ok;
+    }
+}
+
+bool rate_limiter::allow_conn(const sockaddr *addr) {
+    if (addr->sa_family == AF_UNIX)
+        return true;
+    if (m_conn.rate > 0 && !take(make_key(CONN_KEY, addr, false), m_conn)) {
+        ++m_rejected;
+        return false;
+    }
+    return true;
+}
+
+bool rate_limiter::allow_request(const sockaddr *addr) {
+    if (addr->sa_family == AF_UNIX)
+        return true;
+    if ((m_req.rate > 0 && !take(make_key(REQ_KEY, addr, false), m_req))
+            || (m_net.rate > 0 && !take(make_key(NET_KEY, addr, true), m_net))) {
+        ++m_rejected;
+        return false;
+    }
+    return true;
+}
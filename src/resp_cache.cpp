@@ -0,0 +1,426 @@
+#include "resp_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <new>
+
+resp_cache::shard *resp_cache::m_shards = nullptr;
+long resp_cache::m_budget = 0;
+long resp_cache::m_window_cap = 0;
+long resp_cache::m_main_cap = 0;
+long resp_cache::m_protected_cap = 0;
+long resp_cache::m_max_entry = 1024L << 10;
+std::atomic<uint8_t> *resp_cache::m_sketch = nullptr;
+long resp_cache::m_sketch_width = 0;
+std::atomic<long> resp_cache::m_samples(0);
+long resp_cache::m_reset_at = 0;
+std::atomic<uint64_t> resp_cache::m_epoch(1);
+std::atomic<resp_cache::reader_slot *> resp_cache::m_readers[MAX_READERS];
+thread_local resp_cache::slot_holder resp_cache::m_local;
+
+std::atomic<long> resp_cache::m_hits(0);
+std::atomic<long> resp_cache::m_misses(0);
+std::atomic<long> resp_cache::m_entries(0);
+std::atomic<long> resp_cache::m_bytes(0);
+std::atomic<long> resp_cache::m_evictions(0);
+std::atomic<long> resp_cache::m_rejected(0);
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static long now_sec() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+bool resp_cache::parse(const char *spec) {
+    char *end;
+    long budget_mb = strtol(spec, &end, 10);
+    if (end == spec || budget_mb <= 0)
+        return false;
+    if (*end == ':') {
+        const char *p = end + 1;
+        long kb = strtol(p, &end, 10);
+        if (end == p || kb <= 0)
+            return false;
+        m_max_entry = kb << 10;
+    }
+    if (*end != '\0')
+        return false;
+
+    m_budget = (budget_mb << 20) / SHARDS;
+    m_window_cap = m_budget / 100;
+    m_main_cap = m_budget - m_window_cap;
+    m_protected_cap = m_main_cap * 8 / 10;
+    if (m_max_entry > m_main_cap)
+        m_max_entry = m_main_cap;
+
+    // 每个计数器大约对应 4KB 的预算，即按预算能容纳的条目数估计宽度；采样数达到宽度的 10 倍时减半
+    m_sketch_width = 1024;
+    while (m_sketch_width < (budget_mb << 20) / 4096 && m_sketch_width < (1 << 22))
+        m_sketch_width <<= 1;
+    m_reset_at = m_sketch_width * 10;
+    m_sketch = new std::atomic<uint8_t>[4 * m_sketch_width];
+    for (long i = 0; i < 4 * m_sketch_width; ++i)
+        m_sketch[i].store(0, std::memory_order_relaxed);
+
+    m_shards = new shard[SHARDS];
+    for (int i = 0; i < SHARDS; ++i) {
+        shard &s = m_shards[i];
+        for (int b = 0; b < BUCKETS; ++b)
+            s.buckets[b].store(nullptr, std::memory_order_relaxed);
+        for (int seg = 0; seg < 3; ++seg) {
+            s.lists[seg].prev = s.lists[seg].next = &s.lists[seg];
+            s.bytes[seg] = 0;
+        }
+        s.retired.prev = s.retired.next = &s.retired;
+        s.used = 0;
+    }
+    return true;
+}
+
+// FNV-1a，低位是变体
+uint64_t resp_cache::key(const char *path, int variant) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = path; *p; ++p)
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    return (mix(h) & ~(uint64_t)(VARIANTS - 1)) | variant;
+}
+
+/////////////////////////////////////读者的纪元
+
+// 取得当前线程的纪元槽：优先复用已经退出的线程留下的槽，否则占用一个空位
+resp_cache::reader_slot *resp_cache::local_slot() {
+    if (m_local.s)
+        return m_local.s;
+
+    for (int i = 0; i < MAX_READERS; ++i) {
+        reader_slot *s = m_readers[i].load(std::memory_order_acquire);
+        if (s) {
+            bool free = false;
+            if (s->in_use.compare_exchange_strong(free, true, std::memory_order_acq_rel)) {
+                m_local.s = s;
+                return s;
+            }
+            continue;
+        }
+
+        reader_slot *created = new reader_slot;
+        created->epoch.store(0, std::memory_order_relaxed);
+        created->in_use.store(true, std::memory_order_relaxed);
+        if (m_readers[i].compare_exchange_strong(s, created, std::memory_order_acq_rel)) {
+            m_local.s = created;
+            return created;
+        }
+        delete created;             // 这个空位被别的线程抢先占用了
+        --i;
+    }
+    return nullptr;
+}
+
+// 正在临界区中的读者所处的最小纪元，没有读者时返回 UINT64_MAX
+uint64_t resp_cache::min_active_epoch() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t min = UINT64_MAX;
+    for (int i = 0; i < MAX_READERS; ++i) {
+        reader_slot *s = m_readers[i].load(std::memory_order_acquire);
+        if (!s)
+            break;
+        uint64_t e = s->epoch.load(std::memory_order_acquire);
+        if (e != 0 && e < min)
+            min = e;
+    }
+    return min;
+}
+
+// 读者的临界区只是一次哈希链的遍历，等待的时间很短
+void resp_cache::synchronize(uint64_t epoch) {
+    while (min_active_epoch() < epoch)
+        sched_yield();
+}
+
+/////////////////////////////////////访问频率
+
+// 计数器到 15 为止。并发的更新可能丢失，频率只是估计值
+void resp_cache::touch(uint64_t key) {
+    uint64_t h = key;
+    for (int row = 0; row < 4; ++row) {
+        h = mix(h + row);
+        std::atomic<uint8_t> &c = m_sketch[row * m_sketch_width + (h & (m_sketch_width - 1))];
+        uint8_t v = c.load(std::memory_order_relaxed);
+        if (v < 15)
+            c.store(v + 1, std::memory_order_relaxed);
+    }
+
+    // 每个线程攒够 64 次再累加到全局的采样数，避免所有线程争用同一个缓存行
+    static thread_local long local = 0;
+    if (++local < 64)
+        return;
+    local = 0;
+    long samples = m_samples.fetch_add(64, std::memory_order_relaxed) + 64;
+    if (samples >= m_reset_at && samples - 64 < m_reset_at) {    // 只有越过上限的线程负责减半
+        for (long i = 0; i < 4 * m_sketch_width; ++i)
+            m_sketch[i].store(m_sketch[i].load(std::memory_order_relaxed) >> 1, std::memory_order_relaxed);
+        m_samples.fetch_sub(m_reset_at, std::memory_order_relaxed);
+    }
+}
+
+int resp_cache::frequency(uint64_t key) {
+    uint64_t h = key;
+    int min = 15;
+    for (int row = 0; row < 4; ++row) {
+        h = mix(h + row);
+        int v = m_sketch[row * m_sketch_width + (h & (m_sketch_width - 1))].load(std::memory_order_relaxed);
+        if (v < min)
+            min = v;
+    }
+    return min;
+}
+
+/////////////////////////////////////读者
+
+resp_cache::entry *resp_cache::lookup(uint64_t key, const char *path) {
+    touch(key);
+    shard &s = shard_of(key);
+    reader_slot *slot = local_slot();
+    if (!slot) {
+        ++m_misses;
+        return nullptr;
+    }
+
+    // 先公布纪元再读哈希链，与写者“摘下条目之后再检查纪元槽”配对
+    slot->epoch.store(m_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    entry *e = find(s, key, path);
+    if (e)
+        e->refs.fetch_add(1, std::memory_order_relaxed);
+    slot->epoch.store(0, std::memory_order_release);
+
+    if (e && !fresh(e)) {
+        release(e);
+        e = nullptr;
+    }
+    if (!e) {
+        ++m_misses;
+        return nullptr;
+    }
+    if (!e->referenced.load(std::memory_order_relaxed))     // 已经置位时不写，热点条目的缓存行不在线程之间来回传递
+        e->referenced.store(true, std::memory_order_relaxed);
+    ++m_hits;
+    return e;
+}
+
+void resp_cache::release(entry *e) {
+    e->refs.fetch_sub(1, std::memory_order_release);
+}
+
+resp_cache::entry *resp_cache::find(shard &s, uint64_t key, const char *path) {
+    entry *e = s.buckets[key & (BUCKETS - 1)].load(std::memory_order_acquire);
+    while (e && (e->key != key || strcmp(e->path, path) != 0))
+        e = e->next_hash.load(std::memory_order_acquire);
+    return e;
+}
+
+// 每个条目每秒最多由一个线程 stat 一次，其余线程直接使用
+bool resp_cache::fresh(entry *e) {
+    long now = now_sec();
+    long checked = e->checked.load(std::memory_order_relaxed);
+    if (checked == now || !e->checked.compare_exchange_strong(checked, now, std::memory_order_relaxed))
+        return true;
+
+    struct stat st;
+    if (stat(e->path, &st) == 0 && (st.st_mode & S_IROTH) && st.st_dev == e->dev && st.st_ino == e->ino
+            && st.st_size == e->size && st.st_mtim.tv_sec == e->mtime.tv_sec && st.st_mtim.tv_nsec == e->mtime.tv_nsec)
+        return true;
+    remove(e);
+    return false;
+}
+
+/////////////////////////////////////写者，持有分片的锁
+
+void resp_cache::push(shard &s, int segment, entry *e) {
+    lru_node *head = &s.lists[segment];
+    e->next = head->next;
+    e->prev = head;
+    head->next->prev = e;
+    head->next = e;
+    e->segment = segment;
+    s.bytes[segment] += e->charge;
+}
+
+void resp_cache::unlink(shard &s, entry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    s.bytes[e->segment] -= e->charge;
+}
+
+// 从哈希链中摘下，放入待释放的链表。此后新的读者找不到它，已经找到它的读者还可能在访问
+void resp_cache::retire(shard &s, entry *e) {
+    std::atomic<entry *> *link = &s.buckets[e->key & (BUCKETS - 1)];
+    entry *cur;
+    while ((cur = link->load(std::memory_order_relaxed)) && cur != e)
+        link = &cur->next_hash;
+    if (cur)
+        link->store(e->next_hash.load(std::memory_order_relaxed), std::memory_order_release);
+
+    e->segment = RETIRED;
+    e->retire_epoch = m_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+    e->next = s.retired.next;
+    e->prev = &s.retired;
+    s.retired.next->prev = e;
+    s.retired.next = e;
+    --m_entries;
+}
+
+// 释放所有读者都已经看不到、也没有连接在发送的条目
+void resp_cache::reclaim(shard &s) {
+    uint64_t min = min_active_epoch();
+    lru_node *node = s.retired.next;
+    while (node != &s.retired) {
+        entry *e = (entry *)node;
+        node = node->next;
+        if (e->retire_epoch > min || e->refs.load(std::memory_order_acquire) != 0)
+            continue;
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        s.used -= e->charge;
+        m_bytes -= e->charge;
+        e->~entry();
+        free(e);
+    }
+}
+
+// 窗口淘汰出的候选进入主区。主区放不下时与试用区最旧的条目比较访问频率，频率低的被淘汰；
+// 被命中过的条目获得第二次机会，移入保护区，保护区超出上限时最旧的条目降回试用区
+void resp_cache::admit(shard &s, entry *cand) {
+    int chances = 64;                   // 条目不断被命中时，第二次机会的次数也是有限的
+    while (s.bytes[PROBATION] + s.bytes[PROTECTED] + cand->charge > m_main_cap) {
+        lru_node *tail = s.lists[PROBATION].prev != &s.lists[PROBATION] ? s.lists[PROBATION].prev : s.lists[PROTECTED].prev;
+        if (tail == &s.lists[PROTECTED]) {
+            retire(s, cand);
+            ++m_rejected;
+            return;
+        }
+        entry *victim = (entry *)tail;
+
+        if (chances > 0 && victim->referenced.load(std::memory_order_relaxed)) {
+            --chances;
+            victim->referenced.store(false, std::memory_order_relaxed);
+            unlink(s, victim);
+            push(s, PROTECTED, victim);
+            while (s.bytes[PROTECTED] > m_protected_cap) {
+                entry *old = (entry *)s.lists[PROTECTED].prev;
+                unlink(s, old);
+                push(s, PROBATION, old);
+            }
+            continue;
+        }
+
+        if (frequency(cand->key) > frequency(victim->key)) {
+            unlink(s, victim);
+            retire(s, victim);
+            ++m_evictions;
+        }
+        else {
+            retire(s, cand);
+            ++m_rejected;
+            return;
+        }
+    }
+    push(s, PROBATION, cand);
+}
+
+void resp_cache::remove(entry *e) {
+    shard &s = shard_of(e->key);
+    s.lock.lock();
+    if (e->segment != RETIRED) {
+        unlink(s, e);
+        retire(s, e);
+    }
+    reclaim(s);
+    s.lock.unlock();
+}
+
+bool resp_cache::wants(uint64_t key, long len) {
+    return enabled() && (long)sizeof(entry) + len < m_max_entry && frequency(key) >= 2;
+}
+
+void resp_cache::insert(uint64_t key, const char *path, const struct stat &st,
+                        const char *head, long head_len, const char *body, long body_len) {
+    // 在锁外复制数据
+    size_t path_len = strlen(path) + 1;
+    long len = head_len + body_len;
+    long charge = sizeof(entry) + path_len + len;
+    if (charge > m_max_entry)
+        return;
+    entry *e = (entry *)malloc(charge);
+    if (!e)
+        return;
+    new (e) entry();
+    e->next_hash.store(nullptr, std::memory_order_relaxed);
+    e->key = key;
+    e->len = len;
+    e->charge = charge;
+    e->referenced.store(false, std::memory_order_relaxed);
+    e->refs.store(0, std::memory_order_relaxed);
+    e->checked.store(now_sec(), std::memory_order_relaxed);
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    e->path = (char *)(e + 1);
+    e->data = e->path + path_len;
+    memcpy(e->path, path, path_len);
+    memcpy(e->data, head, head_len);
+    memcpy(e->data + head_len, body, body_len);
+
+    shard &s = shard_of(key);
+    s.lock.lock();
+    if (find(s, key, path)) {                   // 别的线程已经放入了同一个响应
+        s.lock.unlock();
+        e->~entry();
+        free(e);
+        return;
+    }
+    reclaim(s);
+    s.used += charge;
+    m_bytes += charge;
+    ++m_entries;
+
+    // 新条目进入窗口，窗口超出上限时最旧的条目（可能就是新条目）去争取主区的位置
+    uint64_t before = m_epoch.load(std::memory_order_relaxed);
+    push(s, WINDOW, e);
+    while (s.bytes[WINDOW] > m_window_cap) {
+        entry *cand = (entry *)s.lists[WINDOW].prev;
+        unlink(s, cand);
+        admit(s, cand);
+    }
+
+    // 被淘汰的条目要等读者离开才能释放。连接正在发送的条目仍然占着预算，超出预算时放弃新条目
+    if (s.used > m_budget && m_epoch.load(std::memory_order_relaxed) != before) {
+        synchronize(m_epoch.load(std::memory_order_relaxed));
+        reclaim(s);
+    }
+    if (s.used > m_budget && e->segment != RETIRED) {
+        unlink(s, e);
+        retire(s, e);
+        ++m_rejected;
+    }
+
+    // 最后才放入哈希链，读者看到的是已经完整的条目
+    if (e->segment != RETIRED) {
+        std::atomic<entry *> &bucket = s.buckets[key & (BUCKETS - 1)];
+        e->next_hash.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        bucket.store(e, std::memory_order_release);
+    }
+    reclaim(s);
+    s.lock.unlock();
+}
@@ -0,0 +1,183 @@
+#include "router.h"
+#include <stdlib.h>
+
+// 压缩前缀树的节点。静态的边以 label 标记，同一节点的子节点的 label 首字符互不相同；
+// 参数边 :name 单独挂在 param 上。路由的终点一定是一个节点，插入时在需要的位置拆分边
+struct router::node {
+    const char *label;          // 边上的字符串，参数节点为空
+    int len;
+    const char *name;           // 参数节点的参数名
+    node *child;                // 第一个静态子节点
+    node *next;                 // 下一个兄弟节点
+    node *param;                // 参数子节点
+    const route_target *exact;  // 在此结束的精确路由
+    const route_target *prefix; // 在此结束的前缀路由
+
+    node(const char *l, int n) : label(l), len(n), name(nullptr), child(nullptr), next(nullptr), param(nullptr),
+                                 exact(nullptr), prefix(nullptr) {}
+};
+
+router::node *router::m_root = new router::node("", 0);
+
+// 从 parent 开始插入静态字符串 s，返回 s 结束处的节点
+router::node *router::insert_static(node *parent, const char *s, int len) {
+    while (len > 0) {
+        node **link = &parent->child;
+        while (*link && (*link)->label[0] != s[0])
+            link = &(*link)->next;
+
+        node *c = *link;
+        if (!c) {                               // 没有首字符相同的边，新建一条
+            *link = new node(strndup(s, len), len);
+            return *link;
+        }
+
+        int common = 0;
+        while (common < c->len && common < len && c->label[common] == s[common])
+            ++common;
+        if (common < c->len) {                  // 只有一部分相同，把原来的边拆成两段
+            node *mid = new node(c->label, common);
+            mid->next = c->next;
+            c->label += common;
+            c->len -= common;
+            c->next = nullptr;
+            mid->child = c;
+            *link = mid;
+            c = mid;
+        }
+        parent = c;
+        s += common;
+        len -= common;
+    }
+    return parent;
+}
+
+bool router::add(const char *pattern, bool exact, const route_target &target) {
+    if (pattern[0] != '/' || strlen(pattern) >= PATTERN_LEN)
+        return false;
+
+    node *n = m_root;
+    for (const char *p = pattern; *p; ) {
+        if (*p == ':') {
+            const char *end = p + 1 + strcspn(p + 1, "/");
+            if (end == p + 1)
+                return false;
+            char *name = strndup(p + 1, end - p - 1);
+            if (!n->param) {
+                n->param = new node("", 0);
+                n->param->name = name;
+            }
+            else if (strcmp(n->param->name, name) != 0) {      // 同一位置只能有一个参数名
+                free(name);
+                return false;
+            }
+            n = n->param;
+            p = end;
+        }
+        else {
+            int len = strcspn(p, ":");
+            n = insert_static(n, p, len);
+            p += len;
+        }
+    }
+
+    const route_target **slot = exact ? &n->exact : &n->prefix;
+    if (*slot)                                  // 重复的路由
+        return false;
+    *slot = new route_target(target);
+    return true;
+}
+
+bool router::add_static(const char *prefix, const char *dir) {
+    route_target target = {};
+    target.type = STATIC_HANDLER;
+    if (strlen(dir) >= sizeof(target.dir))
+        return false;
+    strcpy(target.dir, dir);
+    return add(prefix, false, target);
+}
+
+bool router::add_upload(const char *prefix, const char *dir, long max_body) {
+    route_target target = {};
+    target.type = UPLOAD_HANDLER;
+    if (strlen(dir) >= sizeof(target.dir))
+        return false;
+    strcpy(target.dir, dir);
+    target.max_body = max_body;
+    return add(prefix, false, target);
+}
+
+bool router::add_proxy(const char *prefix, const char *upstreams) {
+    route_target target = {};
+    target.type = PROXY_HANDLER;
+    target.upstreams = proxy::add_route(upstreams);
+    if (!target.upstreams)
+        return false;
+    return add(prefix, false, target);
+}
+
+bool router::add_func(const char *pattern, bool exact, route_fn fn) {
+    route_target target = {};
+    target.type = FUNC_HANDLER;
+    target.fn = fn;
+    return add(pattern, exact, target);
+}
+
+// 从节点 n 继续匹配 url[pos...]。找到精确路由时返回 true；沿途经过的前缀路由中最长的一个记录在 m 中。
+// 前缀路由只在路径段的边界上匹配：/static 匹配 /static 和 /static/a，不匹配 /staticfoo。
+// 参数值先记录在调用者栈上的 params 中，命中时才复制到 m，回溯时不需要撤销
+bool router::walk(const node *n, const char *url, int pos, route_param *params, int param_count, route_match *m) {
+    char c = url[pos];
+    bool boundary = pos == 0 || c == '\0' || c == '/' || c == '?' || url[pos - 1] == '/';
+    if (n->prefix && boundary && (!m->target || pos > m->prefix_len)) {
+        m->target = n->prefix;
+        m->prefix_len = pos;
+        m->param_count = param_count;
+        memcpy(m->params, params, param_count * sizeof(route_param));
+    }
+
+    if (c == '\0' || c == '?') {                // 路径结束，查询串不参与匹配
+        if (!n->exact)
+            return false;
+        m->target = n->exact;
+        m->prefix_len = pos;
+        m->param_count = param_count;
+        memcpy(m->params, params, param_count * sizeof(route_param));
+        return true;
+    }
+
+    // 静态的边优先，首字符相同的边最多只有一条
+    for (const node *child = n->child; child; child = child->next) {
+        if (child->label[0] != c)
+            continue;
+        if (strncmp(url + pos, child->label, child->len) == 0
+                && walk(child, url, pos + child->len, params, param_count, m))
+            return true;
+        break;
+    }
+
+    // 参数匹配到下一个 / 为止
+    if (n->param && param_count < route_match::MAX_PARAMS) {
+        int end = pos;
+        while (url[end] != '\0' && url[end] != '/' && url[end] != '?')
+            ++end;
+        if (end > pos) {
+            params[param_count].name = n->param->name;
+            params[param_count].value = url + pos;
+            params[param_count].len = end - pos;
+            if (walk(n->param, url, end, params, param_count + 1, m))
+                return true;
+        }
+    }
+    return false;
+}
+
+bool router::match(const char *url, route_match *m) {
+    route_param params[route_match::MAX_PARAMS];
+    m->target = nullptr;
+    m->url = url;
+    m->prefix_len = 0;
+    m->param_count = 0;
+    walk(m_root, url, 0, params, 0, m);
+    return m->target != nullptr;
+}
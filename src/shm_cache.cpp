@@ -0,0 +1,182 @@
+#include "shm_cache.h"
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <new>
+
+shm_cache::header *shm_cache::m_header = nullptr;
+
+static long now_sec() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+bool shm_cache::parse(const char *spec) {
+    char *end;
+    long budget_mb = strtol(spec, &end, 10);
+    if (end == spec || budget_mb <= 0)
+        return false;
+    long max_entry_kb = 64;
+    if (*end == ':') {
+        const char *p = end + 1;
+        max_entry_kb = strtol(p, &end, 10);
+        if (end == p || max_entry_kb <= 0)
+            return false;
+    }
+    if (*end != '\0')
+        return false;
+
+    long stride = (sizeof(slot) + max_entry_kb * 1024 + MAX_PATH + 63) & ~63L;
+    long slots = budget_mb * 1024 * 1024 / stride;
+    if (slots < PROBE) {
+        std::cout << "shared cache budget too small for " << max_entry_kb << "KB entries" << std::endl;
+        return false;
+    }
+
+    // 匿名共享映射的内容全部为 0，也就是所有槽都是空的
+    size_t size = sizeof(header) + slots * stride;
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        std::cout << "cannot map " << budget_mb << "MB shared cache" << std::endl;
+        return false;
+    }
+    m_header = new (mem) header;
+    m_header->slots = slots;
+    m_header->stride = stride;
+    m_header->max_entry = max_entry_kb * 1024;
+    return true;
+}
+
+bool shm_cache::claim(slot *s) {
+    uint32_t expected = 0;
+    return s->state.compare_exchange_strong(expected, WRITING, std::memory_order_acquire, std::memory_order_relaxed);
+}
+
+void shm_cache::vacate(slot *s) {
+    if (s->key.load(std::memory_order_relaxed) != 0) {
+        s->key.store(0, std::memory_order_relaxed);
+        m_header->entries.fetch_sub(1, std::memory_order_relaxed);
+        m_header->bytes.fetch_sub(s->len, std::memory_order_relaxed);
+    }
+    s->state.store(0, std::memory_order_release);
+}
+
+bool shm_cache::fresh(slot *s, const char *path) {
+    long now = now_sec();
+    long checked = s->checked.load(std::memory_order_relaxed);
+    if (checked == now || !s->checked.compare_exchange_strong(checked, now, std::memory_order_relaxed))
+        return true;
+
+    struct stat st;
+    return stat(path, &st) == 0 && (st.st_mode & S_IROTH) && st.st_dev == s->dev && st.st_ino == s->ino
+           && st.st_size == s->size && st.st_mtim.tv_sec == s->mtime.tv_sec && st.st_mtim.tv_nsec == s->mtime.tv_nsec;
+}
+
+shm_cache::slot *shm_cache::lookup(uint64_t key, const char *path) {
+    long base = key % m_header->slots;
+    for (int i = 0; i < PROBE; ++i) {
+        slot *s = at((base + i) % m_header->slots);
+        if (s->key.load(std::memory_order_relaxed) != key)
+            continue;
+
+        // 增加读者数，之后写者取不到这个槽。写者正在写入时按未命中处理，不等待
+        uint32_t state = s->state.load(std::memory_order_relaxed);
+        bool pinned = false;
+        while (!(state & WRITING)) {
+            if (s->state.compare_exchange_weak(state, state + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+                pinned = true;
+                break;
+            }
+        }
+        if (!pinned)
+            break;
+
+        // 增加读者数之前槽可能已经被替换，重新确认键和路径
+        if (s->key.load(std::memory_order_relaxed) != key || strcmp(s->data + s->len, path) != 0) {
+            release(s);
+            break;
+        }
+        if (!fresh(s, path)) {                  // 文件已经被修改，没有其他读者时清空这个槽
+            release(s);
+            if (claim(s))
+                vacate(s);
+            break;
+        }
+        s->used.store(now_sec(), std::memory_order_relaxed);
+        m_header->hits.fetch_add(1, std::memory_order_relaxed);
+        return s;
+    }
+    m_header->misses.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+void shm_cache::release(slot *s) {
+    s->state.fetch_sub(1, std::memory_order_release);
+}
+
+void shm_cache::insert(uint64_t key, const char *path, const struct stat &st,
+                       const char *head, long head_len, const char *body, long body_len) {
+    long len = head_len + body_len;
+    size_t path_len = strlen(path);
+    if (key == 0 || len > m_header->max_entry || path_len >= MAX_PATH)
+        return;
+
+    // 优先选空槽，否则选最近最少命中的槽。正在被发送的槽不能替换
+    long base = key % m_header->slots;
+    slot *victim = nullptr;
+    long victim_used = 0;
+    for (int i = 0; i < PROBE; ++i) {
+        slot *s = at((base + i) % m_header->slots);
+        uint64_t k = s->key.load(std::memory_order_relaxed);
+        if (k == key)                           // 其他进程已经缓存了这个响应
+            return;
+        if (s->state.load(std::memory_order_relaxed) != 0)
+            continue;
+        long used = k == 0 ? -1 : s->used.load(std::memory_order_relaxed);
+        if (!victim || used < victim_used) {
+            victim = s;
+            victim_used = used;
+        }
+    }
+    if (!victim || !claim(victim))
+        return;
+
+    if (victim->key.load(std::memory_order_relaxed) != 0) {
+        m_header->evictions.fetch_add(1, std::memory_order_relaxed);
+        m_header->entries.fetch_sub(1, std::memory_order_relaxed);
+        m_header->bytes.fetch_sub(victim->len, std::memory_order_relaxed);
+        victim->key.store(0, std::memory_order_relaxed);
+    }
+    memcpy(victim->data, head, head_len);
+    if (body_len > 0)
+        memcpy(victim->data + head_len, body, body_len);
+    memcpy(victim->data + len, path, path_len + 1);
+    victim->len = len;
+    victim->dev = st.st_dev;
+    victim->ino = st.st_ino;
+    victim->size = st.st_size;
+    victim->mtime = st.st_mtim;
+    long now = now_sec();
+    victim->checked.store(now, std::memory_order_relaxed);
+    victim->used.store(now, std::memory_order_relaxed);
+
+    // 键在内容写完之后发布，读者增加读者数时与状态字的释放同步，看到的是完整的内容
+    victim->key.store(key, std::memory_order_relaxed);
+    m_header->entries.fetch_add(1, std::memory_order_relaxed);
+    m_header->bytes.fetch_add(len, std::memory_order_relaxed);
+    victim->state.store(0, std::memory_order_release);
+}
+
+shm_cache::stats shm_cache::get_stats() {
+    stats st;
+    st.hits = m_header->hits.load(std::memory_order_relaxed);
+    st.misses = m_header->misses.load(std::memory_order_relaxed);
+    st.entries = m_header->entries.load(std::memory_order_relaxed);
+    st.bytes = m_header->bytes.load(std::memory_order_relaxed);
+    st.evictions = m_header->evictions.load(std::memory_order_relaxed);
+    st.slots = m_header->slots;
+    return st;
+}
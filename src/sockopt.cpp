@@ -0,0 +1,65 @@
+#include "sockopt.h"
+#include <iostream>
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// 解析一项 name=value 形式的整数参数
+static bool parse_int(const char *item, const char *name, int *value) {
+    size_t len = strlen(name);
+    if (strncmp(item, name, len) != 0 || item[len] != '=')
+        return false;
+    *value = atoi(item + len + 1);
+    return true;
+}
+
+bool sock_options::parse(const char *spec) {
+    char buf[256];
+    if (strlen(spec) >= sizeof(buf))
+        return false;
+    strcpy(buf, spec);
+
+    char *save = nullptr;
+    for (char *item = strtok_r(buf, ",", &save); item; item = strtok_r(nullptr, ",", &save)) {
+        if (strcmp(item, "nodelay") == 0)
+            nodelay = true;
+        else if (strcmp(item, "cork") == 0)
+            cork = true;
+        else if (strcmp(item, "msgmore") == 0)
+            msg_more = true;
+        else if (strcmp(item, "reuseport") == 0)
+            reuseport = true;
+        else if (!parse_int(item, "fastopen", &fastopen) && !parse_int(item, "sndbuf", &sndbuf)
+                && !parse_int(item, "rcvbuf", &rcvbuf) && !parse_int(item, "lowat", &notsent_lowat)
+                && !parse_int(item, "usertimeout", &user_timeout) && !parse_int(item, "busypoll", &busy_poll)) {
+            std::cout << "unknown socket option: " << item << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// 缓冲区大小会被接受的连接继承，并且 SO_RCVBUF 必须在 listen 之前设置才能影响窗口扩大因子
+void sock_options::apply_listener(int fd) const {
+    if (fastopen > 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen));
+    if (sndbuf > 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    if (rcvbuf > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+void sock_options::apply_conn(int fd) const {
+    int on = 1;
+    if (nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (notsent_lowat > 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsent_lowat, sizeof(notsent_lowat));
+    if (user_timeout > 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+    if (busy_poll > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+    }
+}
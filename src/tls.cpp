@@ -0,0 +1,176 @@
+#include "tls.h"
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <openssl/err.h>
+#include <string.h>
+#include <iostream>
+
+SSL_CTX *tls_conn::m_ctx = nullptr;
+bool tls_conn::m_alpn_h2 = true;
+std::atomic<long> tls_conn::m_handshakes(0);
+std::atomic<long> tls_conn::m_resumed(0);
+std::atomic<long> tls_conn::m_ktls(0);
+
+// ALPN：客户端提供 h2 且允许时选择 HTTP/2，否则选择 http/1.1。都不支持的客户端按 HTTP/1.1 处理
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
+                       unsigned int inlen, void *arg) {
+    static const unsigned char h2[] = "\x02h2";
+    static const unsigned char http11[] = "\x08http/1.1";
+    unsigned char *selected;
+    if ((tls_conn::m_alpn_h2 && SSL_select_next_proto(&selected, outlen, h2, sizeof(h2) - 1, in, inlen) == OPENSSL_NPN_NEGOTIATED)
+            || SSL_select_next_proto(&selected, outlen, http11, sizeof(http11) - 1, in, inlen) == OPENSSL_NPN_NEGOTIATED) {
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+    return SSL_TLSEXT_ERR_NOACK;
+}
+
+bool tls_conn::init_context(const char *cert, const char *key) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+        return false;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // SSL_OP_ENABLE_KTLS：握手完成后 OpenSSL 设置 TCP_ULP "tls"，把密钥交给内核，失败时静默地留在用户空间
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION
+                             | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    // 非阻塞写：允许部分写，重试时缓冲区地址可以变化（内容和长度不变）
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 || SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    // 会话恢复：TLS 1.3 和 TLS 1.2 都发放无状态的会话票据，票据密钥由 OpenSSL 在进程启动时随机生成，
+    // fork 出的进程共用同一组密钥。TLS 1.2 的会话 ID 还可以命中服务器端的会话缓存
+    static const unsigned char sid_ctx[] = "webserver";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, nullptr);
+
+    m_ctx = ctx;
+    return true;
+}
+
+bool tls_conn::start(int fd) {
+    m_ssl = SSL_new(m_ctx);
+    if (!m_ssl)
+        return false;
+    SSL_set_fd(m_ssl, fd);
+    SSL_set_accept_state(m_ssl);
+    m_handshaking = true;
+    m_ktls_send = m_ktls_recv = false;
+    m_want = EPOLLIN;
+    return true;
+}
+
+int tls_conn::handshake() {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(m_ssl);
+    if (ret == 1) {
+        m_handshaking = false;
+        m_ktls_send = BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+        m_ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(m_ssl));
+        ++m_handshakes;
+        if (SSL_session_reused(m_ssl))
+            ++m_resumed;
+        if (m_ktls_send)
+            ++m_ktls;
+        return 1;
+    }
+
+    switch (SSL_get_error(m_ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            m_want = EPOLLIN;
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            m_want = EPOLLOUT;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+void tls_conn::close() {
+    if (!m_ssl)
+        return;
+    if (!m_handshaking) {           // 尽力发送 close_notify，不等待对方的回复
+        ERR_clear_error();
+        SSL_shutdown(m_ssl);
+    }
+    SSL_free(m_ssl);
+    m_ssl = nullptr;
+    m_handshaking = false;
+}
+
+ssize_t tls_conn::result(int ret) {
+    if (ret > 0)
+        return ret;
+    switch (SSL_get_error(m_ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:         // 对方发送了 close_notify，或者没有 close_notify 就关闭了连接
+            return 0;
+        default:
+            errno = ECONNRESET;
+            return -1;
+    }
+}
+
+ssize_t tls_conn::read(void *buf, size_t len) {
+    ERR_clear_error();
+    return result(SSL_read(m_ssl, buf, len));
+}
+
+bool tls_conn::alpn_h2() const {
+    const unsigned char *proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(m_ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+// 第一个非空的缓冲区不小于一个记录时直接加密它；否则把后面的缓冲区拼起来，凑满一个记录再加密，
+// 避免首部、HTTP/2 的帧首部这样的小块数据各自成为一个 TLS 记录。
+// 返回 EAGAIN 时调用者的缓冲区保持不变，下次用同样的参数重试，拼出的数据也相同，满足 OpenSSL 的要求
+ssize_t tls_conn::write(const struct iovec *iv, int count) {
+    int i = 0;
+    while (i < count && iv[i].iov_len == 0)
+        ++i;
+    if (i == count)
+        return 0;
+    ERR_clear_error();
+    if (iv[i].iov_len >= RECORD_SIZE || i + 1 == count)
+        return result(SSL_write(m_ssl, iv[i].iov_base, iv[i].iov_len));
+
+    static thread_local char buf[RECORD_SIZE];
+    size_t len = 0;
+    for (; i < count && len < sizeof(buf); ++i) {
+        size_t n = iv[i].iov_len < sizeof(buf) - len ? iv[i].iov_len : sizeof(buf) - len;
+        memcpy(buf + len, iv[i].iov_base, n);
+        len += n;
+    }
+    return result(SSL_write(m_ssl, buf, len));
+}
+
+// 用户空间加密时，从文件中读取一个记录大小的数据再交给 SSL_write。重试时从同一偏移量读取同样长度的数据
+ssize_t tls_conn::send_file(int fd, int file, off_t *offset, size_t len) {
+    if (m_ktls_send)
+        return sendfile(fd, file, offset, len);
+
+    static thread_local char buf[RECORD_SIZE];
+    ssize_t n = pread(file, buf, len < sizeof(buf) ? len : sizeof(buf), *offset);
+    if (n <= 0)
+        return n;
+    ERR_clear_error();
+    ssize_t ret = result(SSL_write(m_ssl, buf, n));
+    if (ret > 0)
+        *offset += ret;
+    return ret;
+}
@@ -0,0 +1,193 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+int tracer::m_every = 0;
+const char *tracer::m_path = "/tmp/pawcook-trace.json";
+std::atomic<uint32_t> tracer::m_counter(0);
+std::atomic<tracer::ring *> tracer::m_rings[MAX_RINGS];
+thread_local tracer::ring_holder tracer::m_local;
+std::atomic<bool> tracer::m_dumping(false);
+bool tracer::m_dump_started = false;
+pthread_t tracer::m_dump_tid;
+
+static const char *point_names[tracer::POINT_COUNT] = {
+    "accept", "read", "enqueue", "dequeue", "parsed", "file_open", "write", "first_byte", "last_byte"
+};
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool tracer::parse(const char *spec) {
+    static char path[256];
+    const char *colon = strchr(spec, ':');
+    if (colon) {
+        if (colon[1] == '\0' || strlen(colon + 1) >= sizeof(path))
+            return false;
+        strcpy(path, colon + 1);
+        m_path = path;
+    }
+    m_every = atoi(spec);
+    return m_every > 0;
+}
+
+uint32_t tracer::begin() {
+    if (m_every <= 0)
+        return 0;
+    uint32_t n = m_counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (n % m_every != 0)
+        return 0;
+    return n;
+}
+
+// 取得当前线程的缓冲区：优先复用已经退出的线程留下的缓冲区，否则占用一个空位
+tracer::ring *tracer::local_ring() {
+    if (m_local.r)
+        return m_local.r;
+
+    pid_t tid = syscall(SYS_gettid);
+    for (int i = 0; i < MAX_RINGS; ++i) {
+        ring *r = m_rings[i].load(std::memory_order_acquire);
+        if (r) {
+            bool free = false;
+            if (r->in_use.compare_exchange_strong(free, true, std::memory_order_acq_rel)) {
+                r->tid = tid;
+                m_local.r = r;
+                return r;
+            }
+            continue;
+        }
+
+        ring *created = new ring;
+        created->head.store(0, std::memory_order_relaxed);
+        created->in_use.store(true, std::memory_order_relaxed);
+        created->tid = tid;
+        if (m_rings[i].compare_exchange_strong(r, created, std::memory_order_acq_rel)) {
+            m_local.r = created;
+            return created;
+        }
+        delete created;             // 这个空位被别的线程抢先占用了
+        --i;
+    }
+    return nullptr;
+}
+
+void tracer::record(uint32_t id, POINT point) {
+    ring *r = local_ring();
+    if (!r)
+        return;
+    uint64_t head = r->head.load(std::memory_order_relaxed);
+    event &e = r->events[head & (RING_SIZE - 1)];
+    e.ts = now_ns();
+    e.id = id;
+    e.point = point;
+    e.tid = r->tid;
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+bool tracer::dump() {
+    if (m_dumping.load(std::memory_order_acquire))      // 上一次导出还没有结束
+        return false;
+    if (m_dump_started)                                 // 回收已经结束的导出线程
+        pthread_join(m_dump_tid, nullptr);
+    m_dumping.store(true, std::memory_order_relaxed);
+    m_dump_started = pthread_create(&m_dump_tid, nullptr, dump_thread, nullptr) == 0;
+    if (!m_dump_started)
+        m_dumping.store(false, std::memory_order_relaxed);
+    return m_dump_started;
+}
+
+void tracer::stop() {
+    if (m_dump_started)
+        pthread_join(m_dump_tid, nullptr);
+    m_dump_started = false;
+}
+
+void *tracer::dump_thread(void *arg) {
+    if (write_file())
+        std::cout << "trace dumped to " << m_path << std::endl;
+    m_dumping.store(false, std::memory_order_release);
+    return nullptr;
+}
+
+bool tracer::write_file() {
+    // 复制每个缓冲区中的记录。复制过程中写入线程可能覆盖最旧的记录，复制完再读一次 head，丢弃可能被覆盖的部分
+    std::vector<event> events;
+    for (int i = 0; i < MAX_RINGS; ++i) {
+        ring *r = m_rings[i].load(std::memory_order_acquire);
+        if (!r)
+            break;
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t start = head > RING_SIZE ? head - RING_SIZE : 0;
+        size_t base = events.size();
+        for (uint64_t j = start; j < head; ++j)
+            events.push_back(r->events[j & (RING_SIZE - 1)]);
+
+        uint64_t after = r->head.load(std::memory_order_acquire);
+        uint64_t valid = after > RING_SIZE ? after - RING_SIZE : 0;
+        if (valid > start)
+            events.erase(events.begin() + base, events.begin() + base + (std::min(valid, head) - start));
+    }
+
+    // 先写临时文件再改名，读取导出文件的工具不会看到写了一半的内容。
+    // 临时文件名由 mkstemp 随机生成并以 O_EXCL 创建，不会跟随别人预先放在 /tmp 中的符号链接
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", m_path);
+    int fd = mkstemp(tmp);
+    FILE *out = fd == -1 ? nullptr : fdopen(fd, "w");
+    if (!out) {
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp);
+        }
+        std::cout << "trace dump failed: cannot create a temporary file next to " << m_path << std::endl;
+        return false;
+    }
+    fchmod(fd, 0644);
+
+    // 进程 1 是线程的轨道，进程 2 是请求的轨道
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"threads\"}},\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"requests\"}}");
+
+    for (const event &e : events) {
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"point\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,"
+                     "\"args\":{\"req\":%u}}",
+                point_names[e.point], e.ts / 1000.0, (int)e.tid, e.id);
+    }
+
+    // 同一个请求相邻的两个时间点之间是一个阶段，名字为 "起点->终点"
+    std::stable_sort(events.begin(), events.end(), [](const event &a, const event &b) {
+        return a.id != b.id ? a.id < b.id : a.ts < b.ts;
+    });
+    for (size_t i = 1; i < events.size(); ++i) {
+        const event &from = events[i - 1];
+        const event &to = events[i];
+        if (from.id != to.id)
+            continue;
+        fprintf(out, ",\n{\"name\":\"%s->%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":2,\"tid\":%u,"
+                     "\"args\":{\"from_tid\":%d,\"to_tid\":%d}}",
+                point_names[from.point], point_names[to.point], from.ts / 1000.0, (to.ts - from.ts) / 1000.0,
+                to.id, (int)from.tid, (int)to.tid);
+    }
+    fprintf(out, "\n]}\n");
+
+    bool ok = fclose(out) == 0 && rename(tmp, m_path) == 0;
+    if (!ok) {
+        unlink(tmp);
+        std::cout << "trace dump failed: cannot write " << m_path << std::endl;
+    }
+    return ok;
+}
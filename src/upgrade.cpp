@@ -0,0 +1,243 @@
+#include "upgrade.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+char upgrader::m_hot_files[HOT_FILES][PATH_LEN];
+locker upgrader::m_hot_lock;
+
+// 交接消息的头部，随 SCM_RIGHTS 一起发送，后面紧跟 manifest_len 字节的热点文件清单
+struct handoff_header {
+    uint32_t nfds;
+    uint32_t manifest_len;
+};
+
+upgrader::~upgrader() {
+    if (m_listenfd != -1)
+        close(m_listenfd);
+}
+
+bool upgrader::init(const char *path) {
+    if (strlen(path) >= sizeof(((sockaddr_un *)0)->sun_path))
+        return false;
+    strcpy(m_path, path);
+
+    // 启动时就记下可执行文件的路径：之后该路径上的文件被替换，/proc/self/exe 仍然指向旧版本
+    ssize_t len = readlink("/proc/self/exe", m_exe, PATH_LEN - 1);
+    if (len <= 0)
+        return false;
+    m_exe[len] = '\0';
+    return true;
+}
+
+// 连接升级 socket，如果有旧进程在监听，则接收它交出的监听 socket
+int upgrader::inherit(int *fds, int max_fds) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        return -1;
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, m_path);
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return 0;                   // 没有旧进程，正常启动
+    }
+
+    handoff_header header;
+    iovec iov = { &header, sizeof(header) };
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != sizeof(header)) {
+        close(sock);
+        return -1;
+    }
+
+    int nfds = 0;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < n; ++i) {
+            if (nfds < max_fds)
+                fds[nfds++] = received[i];
+            else
+                close(received[i]);
+        }
+    }
+
+    // 接收热点文件清单，交给后台线程预读，不推迟新进程开始 accept 的时间
+    if (header.manifest_len > 0) {
+        char *manifest = (char *)malloc(header.manifest_len + 1);
+        ssize_t len = manifest ? recv(sock, manifest, header.manifest_len, MSG_WAITALL) : -1;
+        pthread_t tid;
+        if (len == (ssize_t)header.manifest_len) {
+            manifest[len] = '\0';
+            if (pthread_create(&tid, nullptr, warm, manifest) == 0)
+                pthread_detach(tid);
+            else
+                free(manifest);
+        }
+        else {
+            free(manifest);
+        }
+    }
+
+    close(sock);
+    std::cout << "inherited " << nfds << " listening socket(s) from the old process" << std::endl;
+    return nfds;
+}
+
+// 在升级 socket 上监听。路径上可能残留着旧进程的 socket 文件，先删除它
+int upgrader::listen_upgrade() {
+    m_listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_listenfd == -1)
+        return -1;
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, m_path);
+    unlink(m_path);
+    if (bind(m_listenfd, (sockaddr *)&addr, sizeof(addr)) == -1 || listen(m_listenfd, 1) == -1) {
+        close(m_listenfd);
+        m_listenfd = -1;
+        return -1;
+    }
+    chmod(m_path, 0600);
+    return m_listenfd;
+}
+
+// 把监听 socket 和热点文件清单交给新进程
+bool upgrader::handoff(const int *fds, int nfds) {
+    int sock = accept4(m_listenfd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock == -1)
+        return false;
+    // 升级 socket 可能是非阻塞的，交接过程使用阻塞 IO
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+
+    static char manifest[HOT_FILES * PATH_LEN];
+    handoff_header header;
+    header.nfds = nfds;
+    header.manifest_len = build_manifest(manifest, sizeof(manifest));
+
+    iovec iov = { &header, sizeof(header) };
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+    bool ok = sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(header);
+    for (uint32_t sent = 0; ok && sent < header.manifest_len; ) {
+        ssize_t n = send(sock, manifest + sent, header.manifest_len - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            ok = false;
+            break;
+        }
+        sent += n;
+    }
+    close(sock);
+
+    if (ok) {
+        // 新进程已经接管，旧进程不再接受新的升级
+        close(m_listenfd);
+        m_listenfd = -1;
+    }
+    return ok;
+}
+
+// fork 出子进程执行当前程序的新版本。子进程只应持有标准输入输出，其余描述符
+// （客户端连接、epoll 实例等）都要关闭，否则旧进程关闭连接时子进程仍然持有它
+bool upgrader::spawn(char *argv[]) {
+    pid_t pid = fork();
+    if (pid == -1)
+        return false;
+    if (pid > 0)
+        return true;
+
+    // 子进程：恢复默认的信号处理和信号掩码
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, nullptr);
+    if (syscall(SYS_close_range, 3, ~0U, 0) == -1) {
+        for (int fd = 3; fd < sysconf(_SC_OPEN_MAX); ++fd)
+            close(fd);
+    }
+
+    execv(m_exe, argv);
+    _exit(1);
+}
+
+// 记录被访问的文件。清单是一个以路径哈希值为下标的表，冲突时新路径覆盖旧路径
+void upgrader::record_file(const char *path) {
+    uint32_t hash = 2166136261u;            // FNV-1a
+    for (const char *p = path; *p; ++p)
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+    char *slot = m_hot_files[hash % HOT_FILES];
+    m_hot_lock.lock();
+    if (strcmp(slot, path) != 0) {
+        strncpy(slot, path, PATH_LEN - 1);
+        slot[PATH_LEN - 1] = '\0';
+    }
+    m_hot_lock.unlock();
+}
+
+int upgrader::build_manifest(char *buf, int len) {
+    int used = 0;
+    m_hot_lock.lock();
+    for (int i = 0; i < HOT_FILES; ++i) {
+        if (m_hot_files[i][0] == '\0')
+            continue;
+        int n = snprintf(buf + used, len - used, "%s\n", m_hot_files[i]);
+        if (n >= len - used)
+            break;
+        used += n;
+    }
+    m_hot_lock.unlock();
+    return used;
+}
+
+// 后台线程：把清单中的文件读入页缓存，同时把它们记录为新进程的热点文件
+void *upgrader::warm(void *arg) {
+    char *manifest = (char *)arg;
+    int count = 0;
+    char *save = nullptr;
+    for (char *path = strtok_r(manifest, "\n", &save); path; path = strtok_r(nullptr, "\n", &save)) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+            readahead(fd, 0, st.st_size);
+            record_file(path);
+            ++count;
+        }
+        close(fd);
+    }
+    free(manifest);
+    std::cout << "warmed " << count << " file(s) from the upgrade manifest" << std::endl;
+    return nullptr;
+}
@@ -0,0 +1,335 @@
+// 反向代理测试：启动一个本地的桩上游，再以 -P /p=桩上游 启动服务器，通过服务器请求桩上游，
+// 检查客户端收到的响应逐字节符合预期（逐跳首部换成代理自己的 Connection 首部，响应体原样转发），
+// 长连接上的下一个响应没有被破坏，要求关闭的连接在响应之后被关闭。
+//
+// 用法：proxy_test.out [server]，server 默认为 ./a.out，需要在仓库根目录下运行
+//
+// 桩上游按路径生成响应：
+//   /p/len/N       Content-Length 响应，N 字节的响应体
+//   /p/chunked/N   分块编码的响应，N 字节的响应体，每块 4000 字节，分几次写出，代理需要多次读取
+//   /p/echo        Content-Length 响应，响应体为请求体
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+static const int CHUNK = 4000;
+static const int IO_TIMEOUT_MS = 5000;
+
+static int failures = 0;
+
+// 请求的方式：普通的长连接、HTTP/1.1 带 Connection: close、不带 keep-alive 的 HTTP/1.0
+enum MODE {KEEP = 0, CLOSE, HTTP10};
+
+// 响应体：/p/len/N 为 N 个 'x'，/p/chunked/N 为 N 个循环的小写字母，其他为请求体
+static std::string response_body(const std::string &path, const std::string &body) {
+    std::string data;
+    if (path.compare(0, 11, "/p/chunked/") == 0) {
+        long n = atol(path.c_str() + 11);
+        for (long i = 0; i < n; ++i)
+            data += (char)('a' + i % 26);
+    }
+    else if (path.compare(0, 7, "/p/len/") == 0) {
+        data.assign(atol(path.c_str() + 7), 'x');
+    }
+    else {
+        data = body;
+    }
+    return data;
+}
+
+// 桩上游对一个请求的完整响应。Content-Length 响应带着上游自己的逐跳首部，代理应该去掉它们。
+// 分块响应在 split 的位置分段写出
+static std::string stub_response(const std::string &path, const std::string &body, std::vector<size_t> *split) {
+    std::string data = response_body(path, body);
+    if (path.compare(0, 11, "/p/chunked/") != 0) {
+        char head[160];
+        snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nKeep-Alive: timeout=5\r\n"
+                 "Content-Length: %zu\r\n\r\n", data.size());
+        return head + data;
+    }
+
+    std::string out = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    for (size_t i = 0; i < data.size(); i += CHUNK) {
+        size_t len = data.size() - i < (size_t)CHUNK ? data.size() - i : CHUNK;
+        char size[32];
+        snprintf(size, sizeof(size), "%zx\r\n", len);
+        out += size;
+        out += data.substr(i, len);
+        out += "\r\n";
+        if (split)
+            split->push_back(out.size());
+    }
+    out += "0\r\n\r\n";
+    return out;
+}
+
+// 客户端应该收到的响应：逐跳首部换成代理自己的 Connection 首部，HTTP/1.0 的客户端收到解码后的分块响应
+static std::string client_response(const std::string &path, const std::string &body, MODE mode) {
+    const char *connection = mode == KEEP ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    std::string data = response_body(path, body);
+    if (path.compare(0, 11, "/p/chunked/") != 0) {
+        char head[128];
+        snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n", data.size());
+        return head + std::string(connection) + data;
+    }
+    if (mode == HTTP10)
+        return "HTTP/1.1 200 OK\r\n" + std::string(connection) + data;
+    std::string out = stub_response(path, body, nullptr);
+    return out.insert(out.find("\r\n\r\n") + 2, connection, strlen(connection) - 2);
+}
+
+static bool send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 桩上游的一个连接：逐个解析请求并回复，分块响应分段写出
+static void *stub_conn(void *arg) {
+    int fd = (int)(long)arg;
+    std::string in;
+    char buf[65536];
+    while (true) {
+        size_t end;
+        while ((end = in.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                close(fd);
+                return nullptr;
+            }
+            in.append(buf, n);
+        }
+        std::string head = in.substr(0, end + 4);
+        in.erase(0, end + 4);
+
+        size_t sp = head.find(' ');
+        std::string path = head.substr(sp + 1, head.find(' ', sp + 1) - sp - 1);
+        long content_length = 0;
+        for (size_t pos = 0; (pos = head.find("\r\n", pos)) != std::string::npos; pos += 2) {
+            if (strncasecmp(head.c_str() + pos + 2, "Content-Length:", 15) == 0)
+                content_length = atol(head.c_str() + pos + 17);
+        }
+        while ((long)in.size() < content_length) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                close(fd);
+                return nullptr;
+            }
+            in.append(buf, n);
+        }
+        std::string body = in.substr(0, content_length);
+        in.erase(0, content_length);
+
+        std::vector<size_t> split;
+        std::string out = stub_response(path, body, &split);
+        size_t sent = 0;
+        for (size_t at : split) {
+            if (!send_all(fd, out.data() + sent, at - sent))
+                break;
+            sent = at;
+            usleep(2000);
+        }
+        if (!send_all(fd, out.data() + sent, out.size() - sent))
+            break;
+    }
+    close(fd);
+    return nullptr;
+}
+
+static void *stub_accept(void *arg) {
+    int listenfd = (int)(long)arg;
+    while (true) {
+        int fd = accept(listenfd, nullptr, nullptr);
+        if (fd == -1)
+            continue;
+        pthread_t tid;
+        if (pthread_create(&tid, nullptr, stub_conn, (void *)(long)fd) == 0)
+            pthread_detach(tid);
+        else
+            close(fd);
+    }
+    return nullptr;
+}
+
+// 在回环地址上监听一个空闲端口
+static int listen_any(int *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 128) == -1
+        || getsockname(fd, (sockaddr *)&addr, &len) == -1) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int connect_port(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 读取恰好 len 字节，之后在 quiet_ms 之内不能再有数据
+static bool recv_exact(int fd, size_t len, std::string *out, int quiet_ms) {
+    char buf[65536];
+    out->clear();
+    while (out->size() < len) {
+        pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, IO_TIMEOUT_MS) <= 0)
+            return false;
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return false;
+        out->append(buf, n);
+    }
+    pollfd pfd = {fd, POLLIN, 0};
+    if (out->size() == len && poll(&pfd, 1, quiet_ms) > 0) {
+        ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0)
+            out->append(buf, n);
+    }
+    return out->size() == len;
+}
+
+struct request {
+    const char *method;
+    const char *path;
+    const char *body;
+    MODE mode;
+};
+
+// 在一个连接上依次发送几组请求，每组一次写出（一组有多个请求时即为流水线），检查每组的响应。
+// 最后一个请求不是 KEEP 时，服务器应该在响应之后关闭连接
+static void check(const char *name, int port, const std::vector<std::vector<request>> &batches) {
+    int fd = connect_port(port);
+    if (fd == -1) {
+        printf("FAIL %s: cannot connect\n", name);
+        ++failures;
+        return;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    for (size_t b = 0; b < batches.size(); ++b) {
+        std::string out, expect;
+        for (const request &r : batches[b]) {
+            char head[256];
+            snprintf(head, sizeof(head), "%s %s HTTP/1.%d\r\nHost: localhost\r\nContent-Length: %zu\r\n%s\r\n",
+                     r.method, r.path, r.mode == HTTP10 ? 0 : 1, strlen(r.body), r.mode == CLOSE ? "Connection: close\r\n" : "");
+            out += head;
+            out += r.body;
+            expect += client_response(r.path, r.body, r.mode);
+        }
+        std::string got;
+        if (!send_all(fd, out.data(), out.size()) || !recv_exact(fd, expect.size(), &got, 200) || got != expect) {
+            printf("FAIL %s: batch %zu expected %zu bytes, got %zu bytes%s\n", name, b, expect.size(), got.size(),
+                   got.size() == expect.size() ? " with different content" : "");
+            ++failures;
+            close(fd);
+            return;
+        }
+    }
+    char c;
+    pollfd pfd = {fd, POLLIN, 0};
+    if (batches.back().back().mode != KEEP && (poll(&pfd, 1, IO_TIMEOUT_MS) != 1 || recv(fd, &c, 1, 0) != 0)) {
+        printf("FAIL %s: connection not closed\n", name);
+        ++failures;
+        close(fd);
+        return;
+    }
+    printf("ok   %s\n", name);
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    const char *server = argc > 1 ? argv[1] : "./a.out";
+    signal(SIGPIPE, SIG_IGN);
+
+    int stub_port, server_port;
+    int stub_fd = listen_any(&stub_port);
+    int probe_fd = listen_any(&server_port);        // 只用来找一个空闲端口
+    if (stub_fd == -1 || probe_fd == -1) {
+        printf("cannot listen on loopback\n");
+        return 1;
+    }
+    close(probe_fd);
+    pthread_t tid;
+    pthread_create(&tid, nullptr, stub_accept, (void *)(long)stub_fd);
+
+    char route[64], listen_arg[16];
+    snprintf(route, sizeof(route), "/p=127.0.0.1:%d", stub_port);
+    snprintf(listen_arg, sizeof(listen_arg), "%d", server_port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(server, server, "-P", route, listen_arg, (char *)nullptr);
+        _exit(127);
+    }
+
+    // 等待服务器开始监听
+    int fd = -1;
+    for (int i = 0; i < 100 && fd == -1; ++i) {
+        usleep(100000);
+        fd = connect_port(server_port);
+    }
+    if (fd == -1) {
+        printf("server %s did not start\n", server);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        return 1;
+    }
+    close(fd);
+
+    check("content-length", server_port, {{{"GET", "/p/len/10", ""}}, {{"GET", "/p/len/100000", ""}}});
+    check("small chunked", server_port, {{{"GET", "/p/chunked/5", ""}}, {{"GET", "/p/len/10", ""}}});
+    check("large chunked", server_port, {{{"GET", "/p/chunked/20000", ""}}, {{"GET", "/p/chunked/20000", ""}}});
+    check("request body", server_port, {{{"POST", "/p/echo", "hello"}}, {{"PUT", "/p/echo", "world"}}});
+    check("client close", server_port, {{{"GET", "/p/len/10", ""}}, {{"GET", "/p/chunked/5", "", CLOSE}}});
+    check("http/1.0 chunked", server_port, {{{"GET", "/p/chunked/20000", "", HTTP10}}});
+    check("http/1.0 content-length", server_port, {{{"GET", "/p/len/10", "", HTTP10}}});
+    check("pipelined", server_port, {{
+        {"GET", "/p/len/10", ""},
+        {"GET", "/p/chunked/5", ""},
+        {"POST", "/p/echo", "hello"},
+        {"GET", "/p/chunked/20000", ""},
+        {"GET", "/p/len/3000", ""},
+    }, {{"GET", "/p/len/1", ""}}});
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    printf(failures ? "%d failed\n" : "all passed\n", failures);
+    return failures ? 1 : 0;
+}
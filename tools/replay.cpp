@@ -0,0 +1,408 @@
+// 流量重放：读取服务器用 -C 录制的日志，对本地实例按原来的连接和时间结构重放。
+// 每个录制的连接对应一个新连接，按原来的顺序发送原始字节（包括首部的大小写、分片和长连接上的多个请求），
+// 响应读出后丢弃，只统计字节数和延迟。
+//
+// 用法：replay.out [-s scale] [-f] [-c concurrency] host:port|unix:/path capture.bin
+//   -s scale         按时间重放，时间间隔除以 scale，2 表示两倍速，默认 1
+//   -f               尽快重放：忽略时间，连接上的下一个请求在上一个响应收完之后立即发送
+//   -c concurrency   尽快重放时同时进行的连接数上限，默认 100
+//
+// 录制中连接上的响应结束之后才发送的数据，重放时也要等响应收完才发送。响应是否收完按录制时的响应字节数判断。重放的实例返回的响应大小不同时（例如文件已经改变），
+// 等待 STALL_MS 后继续，并计入 stalls
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <deque>
+#include <algorithm>
+#include "capture.h"
+
+static const long STALL_MS = 2000;          // 等待响应的最长时间
+
+// 录制的一个事件
+struct event {
+    uint64_t ts_ns;
+    int type;
+    std::string data;           // DATA 的请求数据
+    uint64_t resp;              // RESP 的响应字节数
+};
+
+// 一个重放的连接
+struct conn {
+    uint32_t id;
+    std::vector<event> events;
+    size_t next = 0;            // 下一个要处理的事件
+    int fd = -1;
+    std::string out;            // 还没有发出的请求数据
+    size_t out_off = 0;
+    uint64_t received = 0;      // 收到的响应字节数
+    uint64_t expect = 0;        // 按录制应该收到的响应字节数
+    long req_start = 0;         // 当前请求开始发送的时间
+    long wait_since = 0;        // 开始等待响应或者关闭的时间，0 表示没有在等待
+    bool closing = false;       // 已经处理了 CLOSE，等待发送和接收完毕
+    bool done = false;
+    bool lost = false;          // 录制时丢失了记录
+};
+
+static double scale = 1;
+static bool fast = false;
+static int concurrency = 100;
+static struct sockaddr_storage target;
+static socklen_t target_len;
+static int epfd;
+
+// 统计
+static long requests = 0, bytes_sent = 0, bytes_received = 0, stalls = 0, errors = 0;
+static size_t finished = 0;                 // 已经结束的连接数
+static std::vector<long> latencies;         // 每个响应的延迟，纳秒
+
+static long now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// 读取日志，按连接号分组。同一个连接的记录按时间排序，连接按建立的时间排序
+static bool load(const char *path, std::vector<conn> &conns) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a capture file\n", path);
+        fclose(in);
+        return false;
+    }
+
+    std::vector<conn> by_id;
+    capture_record rec;
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        event ev;
+        ev.ts_ns = rec.ts_ns;
+        ev.type = rec.type;
+        ev.resp = 0;
+        std::string data(rec.len, '\0');
+        if (rec.len > 0 && fread(&data[0], 1, rec.len, in) != rec.len)
+            break;                          // 录制被中断，最后一条记录不完整
+        if (rec.type == capture::DATA)
+            ev.data = data;
+        else if (rec.type == capture::RESP && rec.len == sizeof(uint64_t))
+            memcpy(&ev.resp, data.data(), sizeof(uint64_t));
+        if (rec.conn >= by_id.size())
+            by_id.resize(rec.conn + 1);
+        by_id[rec.conn].id = rec.conn;
+        if (rec.type == capture::LOST)
+            by_id[rec.conn].lost = true;
+        by_id[rec.conn].events.push_back(ev);
+    }
+    fclose(in);
+
+    long skipped = 0;
+    for (conn &c : by_id) {
+        if (c.lost) {
+            ++skipped;
+            continue;
+        }
+        std::stable_sort(c.events.begin(), c.events.end(), [](const event &a, const event &b) {
+            return a.ts_ns < b.ts_ns;
+        });
+        // 日志开始之前建立的连接没有 OPEN，截断的日志中的连接没有 CLOSE，都跳过
+        if (c.events.empty() || c.events.front().type != capture::OPEN)
+            continue;
+        conns.push_back(std::move(c));
+    }
+    std::stable_sort(conns.begin(), conns.end(), [](const conn &a, const conn &b) {
+        return a.events.front().ts_ns < b.events.front().ts_ns;
+    });
+    if (skipped > 0)
+        fprintf(stderr, "skipped %ld connections with lost records\n", skipped);
+    return true;
+}
+
+static bool parse_target(const char *spec) {
+    if (strncmp(spec, "unix:", 5) == 0) {
+        sockaddr_un *un = (sockaddr_un *)&target;
+        if (strlen(spec + 5) >= sizeof(un->sun_path))
+            return false;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec + 5);
+        target_len = sizeof(sockaddr_un);
+        return true;
+    }
+
+    std::string s(spec);
+    size_t colon = s.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+    std::string host = s.substr(0, colon), port = s.substr(colon + 1);
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return false;
+    memcpy(&target, res->ai_addr, res->ai_addrlen);
+    target_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+static void finish(conn &c) {
+    if (c.fd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+    }
+    c.done = true;
+    ++finished;
+}
+
+// 发送缓冲的请求数据，socket 写满时等待可写事件
+static bool flush(conn &c) {
+    while (c.out_off < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN || errno == ENOTCONN || errno == EINPROGRESS;
+        c.out_off += n;
+        bytes_sent += n;
+    }
+    c.out.clear();
+    c.out_off = 0;
+    return true;
+}
+
+// 关闭或者继续下一个请求之前，请求要发完，响应要收完
+static bool settled(const conn &c) {
+    return c.out.empty() && c.received >= c.expect;
+}
+
+// 处理连接的下一个事件，返回 false 表示要等待（响应还没有收完）
+static bool step(conn &c, long now) {
+    event &ev = c.events[c.next];
+    switch (ev.type) {
+        case capture::OPEN: {
+            c.fd = socket(target.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            int one = 1;
+            setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (c.fd == -1 || (connect(c.fd, (sockaddr *)&target, target_len) == -1 && errno != EINPROGRESS)) {
+                ++errors;
+                finish(c);
+                return true;
+            }
+            epoll_event e;
+            e.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+            e.data.ptr = &c;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &e);
+            break;
+        }
+        case capture::DATA:
+            if (c.received >= c.expect && c.out.empty())
+                c.req_start = now;
+            c.out += ev.data;
+            if (!flush(c)) {
+                ++errors;
+                finish(c);
+                return true;
+            }
+            break;
+        case capture::RESP:
+            c.expect += ev.resp;
+            ++requests;
+            // 下一个请求要等这个响应收完再发送，和录制时的客户端一样。按时间重放时，响应慢了之后的请求随之推迟
+            if (!settled(c)) {
+                c.wait_since = now;
+                ++c.next;
+                return false;
+            }
+            break;
+        case capture::CLOSE:
+            c.closing = true;
+            c.wait_since = now;
+            ++c.next;
+            if (settled(c))
+                finish(c);
+            return false;
+    }
+    ++c.next;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:fc:")) != -1) {
+        switch (opt) {
+            case 's':
+                scale = atof(optarg);
+                if (scale <= 0)
+                    scale = 1;
+                break;
+            case 'f':
+                fast = true;
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                if (concurrency <= 0)
+                    concurrency = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s scale] [-f] [-c concurrency] host:port|unix:/path capture.bin\n", argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || !parse_target(argv[optind])) {
+        fprintf(stderr, "usage: %s [-s scale] [-f] [-c concurrency] host:port|unix:/path capture.bin\n", argv[0]);
+        return 1;
+    }
+    std::vector<conn> conns;
+    if (!load(argv[optind + 1], conns))
+        return 1;
+
+    epfd = epoll_create1(0);
+    long start = now_ns();
+
+    // 按时间重放时，连接的下一个事件按时间放入小根堆；尽快重放时，可以继续的连接放入就绪队列
+    typedef std::pair<long, conn *> timed;
+    std::priority_queue<timed, std::vector<timed>, std::greater<timed>> schedule;
+    std::deque<conn *> ready;
+    size_t started = 0;
+    long last_scan = start;
+    auto due = [&](conn &c) {
+        return start + (long)(c.events[c.next].ts_ns / scale);
+    };
+    if (!fast) {
+        for (conn &c : conns)
+            schedule.push(timed(due(c), &c));
+    }
+
+    // 连接可以继续时处理事件，直到需要等待或者轮到下一个事件的时间
+    auto advance = [&](conn &c, long now) {
+        while (!c.done && c.next < c.events.size() && !c.closing) {
+            if (!fast && due(c) > now) {
+                schedule.push(timed(due(c), &c));
+                return;
+            }
+            if (!step(c, now))
+                return;
+        }
+        if (!c.done && !c.closing && c.next >= c.events.size()) {     // 录制中没有 CLOSE
+            c.closing = true;
+            c.wait_since = now;
+            if (settled(c))
+                finish(c);
+        }
+    };
+
+    epoll_event events[256];
+    while (finished < conns.size()) {
+        long now = now_ns();
+
+        if (fast) {
+            while (started - finished < (size_t)concurrency && started < conns.size())
+                ready.push_back(&conns[started++]);
+        }
+        while (!ready.empty()) {
+            conn *c = ready.front();
+            ready.pop_front();
+            advance(*c, now);
+        }
+        while (!schedule.empty() && schedule.top().first <= now) {
+            conn *c = schedule.top().second;
+            schedule.pop();
+            advance(*c, now);
+        }
+
+        int timeout = 10;
+        if (!schedule.empty()) {
+            long wait_ms = (schedule.top().first - now) / 1000000;
+            timeout = wait_ms < timeout ? (wait_ms > 0 ? wait_ms : 0) : timeout;
+        }
+        int n = epoll_wait(epfd, events, 256, timeout);
+        now = now_ns();
+        for (int i = 0; i < n; ++i) {
+            conn &c = *(conn *)events[i].data.ptr;
+            if (c.done)
+                continue;
+            if ((events[i].events & EPOLLOUT) && !flush(c)) {
+                ++errors;
+                finish(c);
+                continue;
+            }
+
+            bool closed = false;
+            char buf[65536];
+            while (true) {
+                ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+                if (r > 0) {
+                    c.received += r;
+                    bytes_received += r;
+                    continue;
+                }
+                closed = r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                break;
+            }
+            if (c.expect > 0 && c.received >= c.expect && c.req_start > 0) {
+                latencies.push_back(now - c.req_start);
+                c.req_start = 0;
+            }
+
+            if (closed) {
+                // 服务器关闭连接之后录制中还有请求数据，说明重放的行为和录制时不同
+                for (size_t j = c.next; j < c.events.size(); ++j) {
+                    if (c.events[j].type == capture::DATA) {
+                        ++errors;
+                        break;
+                    }
+                }
+                finish(c);
+            }
+            else if (c.closing && settled(c)) {
+                finish(c);
+            }
+            else if (c.wait_since && !c.closing && settled(c)) {
+                c.wait_since = 0;
+                ready.push_back(&c);
+            }
+        }
+
+        // 响应大小和录制时不同，等待超时后继续。每 100 毫秒检查一次
+        if (now - last_scan < 100000000)
+            continue;
+        last_scan = now;
+        for (size_t i = 0; i < conns.size(); ++i) {
+            conn &c = conns[i];
+            if (c.done || !c.wait_since || now - c.wait_since < STALL_MS * 1000000)
+                continue;
+            ++stalls;
+            c.wait_since = 0;
+            c.received = c.expect;
+            if (c.closing)
+                finish(c);
+            else
+                ready.push_back(&c);
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    std::sort(latencies.begin(), latencies.end());
+    auto pct = [&](double p) {
+        return latencies.empty() ? 0 : latencies[(size_t)(p * (latencies.size() - 1))] / 1000;
+    };
+    printf("connections=%zu requests=%ld sent=%ld received=%ld elapsed=%.3fs rps=%.0f\n",
+           conns.size(), requests, bytes_sent, bytes_received, elapsed, requests / elapsed);
+    printf("latency_us p50=%ld p90=%ld p99=%ld max=%ld stalls=%ld errors=%ld\n",
+           pct(0.5), pct(0.9), pct(0.99), pct(1.0), stalls, errors);
+    return 0;
+}